@@ -1,140 +1,312 @@
 #ifndef WifiFunctionDeclarations_h
 #define WifiFunctionDeclarations_h
 
+// Uncomment to build with the blocking PubSubClient instead of the asynchronous MQTT link
+// (see mqttlink.h), to compare round trips
+//#define MQTT_BLOCKING
 
 #include <WiFi.h>
-#include <PubSubClient.h>
 #include "esp_secrets.h"
+#include "commands.h"
+#include "mqttqueue.h"
+#include "binlog.h"
+#include "trace.h"
+#include "metrics.h"
+#include "heapaudit.h"
 
-#ifndef DEBUG
-#define DEBUG
-#endif
 // constants for MQTT & WiFi
 char ssid[] = SECRET_SSID;    // your network SSID (name)
 char pass[] = SECRET_PASS;    // your network password (use for WPA, or use as key for WEP)
 int status = WL_IDLE_STATUS;  // the WiFi radio's status
 
 const char* mqtt_server = "10.1.10.10"; // Replace with your MQTT broker IP address
+const char* ntp_server = "10.1.10.10"; // Time server shared by all props (see netclock.h)
 const char* topic = "ToDevice/NameOfMachine"; // Replace with your topic
+const char* roomTopic = "ToDevice/Room"; // Commands for every prop in the room, such as light cues
 const char* hostTopic = "ToHost/NameOfMachine"; // Replace with your topic
+const char* telemetryTopic = "ToHost/NameOfMachine/telemetry"; // Batched state snapshots and events
+const char* eventTopic = "ToHost/NameOfMachine/events"; // Sequenced events, acknowledged with "ack <seq>"
+const char* logTopic = "ToHost/NameOfMachine/log"; // Binary log batches (see binlog.h)
+const char* traceTopic = "ToHost/NameOfMachine/trace"; // Trace dumps (see trace.h)
+const char* metricsTopic = "ToHost/NameOfMachine/metrics"; // Counters, gauges and histograms (see metrics.h)
+const char* profileTopic = "ToHost/NameOfMachine/profile"; // Sampling profiler results (see profiler.h)
+
+// Retained state, a dashboard subscribing to NameOfMachine/# gets the whole picture at once
+const char* statusTopic = "NameOfMachine/status";   // "online", or "offline" from the broker's last will
+const char* stateTopic = "NameOfMachine/state";
+const char* doorsTopic = "NameOfMachine/doors";
+const char* beakersTopic = "NameOfMachine/beakers";
+const char* lightsTopic = "NameOfMachine/lights";
+bool republishState = true;     // send every state topic again, set on each connection
 const char* deviceID = "NameOfMachine"; //NameOfMachine
+const uint16_t mqttBufferSize = 1536; // Large enough for a tag database or the metrics sent in one message
 
 
+#ifdef MQTT_BLOCKING
 WiFiClient espClient;
-PubSubClient client(espClient);
+MqttClient client(espClient);
+#else
+MqttClient client;
+#endif
+
+// Commands accepted on the device and room topics, registered in setup()
+CommandRegistry commands;
+
+// Outbound messages, published from networkUpdate() so loop() never waits on the broker
+MqttQueue outbox(client);
+const unsigned long outboxDrainBudget = 3000;   // microseconds of publishing per loop
+
+// Keys of messages that replace each other while queued
+enum outboxKey {keyNone = noCoalesce, keyState};
+
+// Connection manager timing
+const unsigned long wifiConnectTimeout = 15000;   // milliseconds allowed for WiFi to associate
+const unsigned long backoffBase = 1000;           // milliseconds before the first retry
+const unsigned long backoffMax = 60000;           // longest wait between retries
+const uint16_t mqttSocketTimeout = 2;             // seconds PubSubClient waits on the broker
+const unsigned long mqttConnectTimeout = 10000;   // milliseconds allowed for the broker to accept
+
+// Connection manager states
+enum netState {netWifiConnecting, netMqttConnecting, netBackoff, netConnected};
+netState networkState = netWifiConnecting;
+unsigned long netStateSince = 0;    // when the current WiFi attempt started
+unsigned long netNextAttempt = 0;   // when the backoff ends
+byte netAttempts = 0;               // failed attempts since the last connection
+
+// Connection statistics
+struct NetStats {
+  unsigned long reconnects;             // successful connections to the broker
+  unsigned long failedAttempts;         // attempts that failed, not dropped connections
+  unsigned long connectedMillis;        // time connected, excluding the current session
+  unsigned long connectedSince;         // start of the current session
+  unsigned long downSince;              // when the connection was last lost
+  unsigned long lastReconnectMillis;    // time from losing the connection to getting it back
+  unsigned long maxReconnectMillis;
+};
+NetStats netStats = {0, 0, 0, 0, 0, 0, 0};
+
+// The same for the fleet, published with the other metrics
+const uint32_t netReconnectBounds[] = {1000, 5000, 15000, 60000, 300000};
+MetricCounter netConnects("net.connects");
+MetricCounter netFailures("net.failures");
+MetricCounter netDisconnects("net.disconnects");
+MetricHistogram netReconnectMillis("net.reconnect_ms", netReconnectBounds, 5);
+MetricCounter mqttCommands("mqtt.commands");
+MetricCounter mqttUnknown("mqtt.unknown");
 
 void wifiSetup();
-void reconnectMQTT();
-void handleWifiReconnect();
-void handleMQTTReconnect();
-void onSolve();
-void onReset();
+void networkUpdate();
 
 //************WIFI and MQTT FUNCTIONS************
 
+// Commands that arrived, called from loop()
 void callback(char* thisTopic, byte* message, unsigned int length) {
-  Serial.print("Message arrived [");
-  Serial.print(thisTopic);
-  Serial.print("] ");
-  Serial.println("Message: ");
-  
-  // Convert byte array to C-style string
-  char messageArrived[length + 1];
-  memcpy(messageArrived, message, length);
-  messageArrived[length] = '\0'; // Null-terminate the string
- 
-  for (unsigned int i = 0; i < length; i++) {
-    messageArrived[i] = tolower(messageArrived[i]);
-  }
+  TRACE_SPAN("mqtt.command");
+  HEAP_SCOPE(logNet);
+  // The payload is not terminated, the log takes a terminated copy of its start
+  char text[64];
+  unsigned int shown = min(length, (unsigned int)sizeof(text) - 1);
+  memcpy(text, message, shown);
+  text[shown] = '\0';
+  LOG_INFO(logNet, "Message arrived [%s] %s", thisTopic, text);
 
-  // Use strcmp to look for certain messages
-  if (strcmp(messageArrived, "solve") == 0){
-    Serial.print("Solve Received from MQTT Message!");
-    onSolve();
-  }   else if (strcmp(messageArrived, "reset") == 0){
-    Serial.print("reset received from MQTT Message!");
-    onReset();
-  }  
-    else {
-    Serial.print("Unknown message received from MQTT Message!");
+  // The first word picks the handler, the rest is passed to it as arguments
+  mqttCommands.add();
+  if (!commands.dispatch(message, length, thisTopic)) {
+    mqttUnknown.add();
+    LOG_WARN(logNet, "Unknown message received from MQTT: %s", text);
   }
-  Serial.println(messageArrived);
-  Serial.println();
 }
 
+#ifndef MQTT_BLOCKING
+// Commands registered with addImmediate() are run by the MQTT link as soon as they arrive
+bool immediateCallback(char* thisTopic, byte* message, unsigned int length) {
+  TRACE_SPAN("mqtt.immediate");
+  return commands.dispatchImmediate(message, length, thisTopic);
+}
+#endif
+
+// Send a reply from a command handler at once. Immediate commands run on the network side and
+// must use this rather than the outbox, which belongs to loop().
+void mqttReply(const char* replyTopic, const char* text, uint16_t length) {
+  #ifdef MQTT_BLOCKING
+  client.publish(replyTopic, (const uint8_t *)text, length);
+  #else
+  client.reply(replyTopic, (const uint8_t *)text, length);
+  #endif
+}
+
+// Handle "ping <token>": answer "pong <token>" on the host topic, for round trip measurements
+void onPingCommand(CommandArgs &args) {
+  char reply[64];
+  int len = snprintf(reply, sizeof(reply), "pong %.*s", (int)min(args.restLength(0), (uint16_t)58), args.rest(0));
+  mqttReply(hostTopic, reply, len);
+}
+
+// Start associating with the access point, networkUpdate() takes it from there
 void wifiSetup() {
-  #ifdef DEBUG
-  Serial.println();
-  Serial.println("****************************");
-  Serial.print("Connecting to ");
-  Serial.println(ssid);
-  WiFi.begin(ssid, pass);
+  LOG_INFO(logNet, "Connecting to %s", ssid);
+  WiFi.mode(WIFI_STA);
   WiFi.setAutoReconnect(true);
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-  }
-
-  Serial.println("");
-  Serial.println("WiFi connected");
-  Serial.println("IP Address: ");
-  Serial.print(WiFi.localIP());
- #endif
- }
+  WiFi.begin(ssid, pass);
+  networkState = netWifiConnecting;
+  netStateSince = millis();
+  netStats.downSince = millis();
+}
 
 void MQTTsetup() {
   client.setServer(mqtt_server, 1883);
+  client.setBufferSize(mqttBufferSize);
   client.setCallback(callback);
-  client.subscribe(topic);
-  reconnectMQTT();
+  #ifdef MQTT_BLOCKING
+  client.setSocketTimeout(mqttSocketTimeout);
+  #else
+  client.setImmediate(immediateCallback);
+  #endif
 }
 
-void reconnectMQTT() {
-  while (!client.connected()) {
-
-    // Debug info
-    #ifdef DEBUG
-    Serial.print("Attempting to connect to the MQTT broker at ");
-    Serial.println(mqtt_server);
-    #endif
-    // Attempt to connect
-    if (client.connect(deviceID)) {
-      #ifdef DEBUG
-      Serial.println("Connected to MQTT broker");
-      #endif
-      client.publish(hostTopic, "Alchemy Machine Connected!");
-      client.subscribe(topic);
-      #ifdef DEBUG
-      Serial.println("Subscribed to topic: ");
-      Serial.println(topic);
-      #endif
-    } else {
-      // Debug info
-      #ifdef DEBUG
-      Serial.print("Failed to connect to MQTT broker, rc =");
-      Serial.print(client.state());
-      Serial.println("Retrying in 5 seconds...");
-      #endif
-      delay(5000);
-    }
+// Connected time so far, including the session in progress
+unsigned long networkUptime() {
+  unsigned long uptime = netStats.connectedMillis;
+  if (networkState == netConnected) {
+    uptime += millis() - netStats.connectedSince;
   }
+  return uptime;
 }
 
-void handleWifiReconnect() {
-  if (WiFi.status() != WL_CONNECTED) {
-    #ifdef DEBUG
-    Serial.println("WiFi connection lost. Reconnecting...");
-    #endif
-    wifiSetup();
+void printNetworkStatus() {
+  Serial.print("Network: ");
+  Serial.print(networkState == netConnected ? "connected" : "offline");
+  Serial.print(", up ");
+  Serial.print(networkUptime() / 1000);
+  Serial.print(" of ");
+  Serial.print(millis() / 1000);
+  Serial.print(" s, ");
+  Serial.print(netStats.reconnects);
+  Serial.print(" reconnects (last ");
+  Serial.print(netStats.lastReconnectMillis);
+  Serial.print(" ms, max ");
+  Serial.print(netStats.maxReconnectMillis);
+  Serial.print(" ms), ");
+  Serial.print(netStats.failedAttempts);
+  Serial.println(" failed attempts");
+}
+
+// Wait before the next attempt: exponential backoff with equal jitter, so a room full of
+// props does not hammer the broker in lockstep after an outage
+void scheduleAttempt() {
+  unsigned long backoff = backoffBase << min(netAttempts, (byte)6);
+  backoff = min(backoff, backoffMax);
+  backoff = backoff / 2 + random(backoff / 2 + 1);
+  netAttempts++;
+  netNextAttempt = millis() + backoff;
+  networkState = netBackoff;
+  LOG_DEBUG(logNet, "Retrying in %lu ms", backoff);
+}
+
+// An attempt failed, count it and back off
+void scheduleRetry() {
+  netStats.failedAttempts++;
+  netFailures.add();
+  scheduleAttempt();
+}
+
+// The broker accepted the connection
+void mqttConnected() {
+  LOG_INFO(logNet, "Connected to MQTT broker");
+  outbox.clear();  // queued for the last session or during the outage, the state is republished instead
+  client.publish(statusTopic, "online", true);
+  client.publish(hostTopic, "Alchemy Machine Connected!");
+  republishState = true;  // in case the broker lost its retained messages
+  client.subscribe(topic);
+  client.subscribe(roomTopic);
+  LOG_DEBUG(logNet, "Subscribed to topics: %s %s", topic, roomTopic);
+
+  unsigned long now = millis();
+  netStats.lastReconnectMillis = now - netStats.downSince;
+  netStats.maxReconnectMillis = max(netStats.maxReconnectMillis, netStats.lastReconnectMillis);
+  netStats.reconnects++;
+  netConnects.add();
+  netReconnectMillis.record(netStats.lastReconnectMillis);
+  netStats.connectedSince = now;
+  netAttempts = 0;
+  networkState = netConnected;
+}
+
+// One attempt to reach the broker. The MQTT link only starts connecting and networkUpdate()
+// waits for the broker to accept. PubSubClient (MQTT_BLOCKING) still blocks while it connects,
+// for at most the socket timeout, so this runs once per backoff step rather than in a loop.
+void connectMQTT() {
+  LOG_DEBUG(logNet, "Attempting to connect to the MQTT broker at %s", mqtt_server);
+  // The broker publishes the last will if the connection drops without a clean disconnect
+  if (!client.connect(deviceID, statusTopic, 0, true, "offline")) {
+    LOG_WARN(logNet, "Failed to connect to MQTT broker, rc = %d", client.state());
+    scheduleRetry();
+    return;
+  }
+  if (client.connected()) {
+    mqttConnected();
+    return;
   }
+  networkState = netMqttConnecting;
+  netStateSince = millis();
 }
 
-void handleMQTTReconnect() {
-  if (!client.connected()) {
-    #ifdef DEBUG
-    Serial.println("MQTT connection lost. Reconnecting...");
-    #endif
-    reconnectMQTT();
+// Connection manager, called once per loop(). Never waits for the network, so the puzzle keeps
+// running while WiFi or the broker is down.
+void networkUpdate() {
+  unsigned long now = millis();
+  switch (networkState)
+  {
+  case netWifiConnecting:
+    if (WiFi.status() == WL_CONNECTED) {
+      IPAddress ip = WiFi.localIP();
+      LOG_INFO(logNet, "WiFi connected, IP Address: %u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+      connectMQTT();
+    }
+    else if (now - netStateSince > wifiConnectTimeout) {
+      LOG_WARN(logNet, "WiFi connection timed out");
+      WiFi.disconnect();
+      scheduleRetry();
+    }
+    break;
+  case netMqttConnecting:
+    if (client.connected()) {
+      mqttConnected();
+    }
+    else if (WiFi.status() != WL_CONNECTED || now - netStateSince > mqttConnectTimeout) {
+      LOG_WARN(logNet, "Broker did not accept the connection, rc = %d", client.state());
+      client.disconnect();
+      scheduleRetry();
+    }
+    break;
+  case netBackoff:
+    if ((long)(now - netNextAttempt) >= 0) {
+      if (WiFi.status() == WL_CONNECTED) {
+        connectMQTT();
+      }
+      else {
+        WiFi.begin(ssid, pass);
+        networkState = netWifiConnecting;
+        netStateSince = now;
+      }
+    }
+    break;
+  case netConnected:
+    if (WiFi.status() != WL_CONNECTED || !client.loop()) {
+      LOG_WARN(logNet, "MQTT connection lost. Reconnecting...");
+      netDisconnects.add();
+      netStats.connectedMillis += now - netStats.connectedSince;
+      netStats.downSince = now;
+      netAttempts = 0;  // a dropped connection is not a failed attempt, start from the shortest backoff
+      scheduleAttempt();
+      break;
+    }
+    {
+      TRACE_SPAN("mqtt.drain");
+      outbox.drain(outboxDrainBudget);
+    }
+    break;
   }
 }
 
@@ -0,0 +1,666 @@
+#ifndef Assets_h
+#define Assets_h
+
+#include "native_hal.h"
+#include "commands.h"
+
+// Asset bundle: palettes, lookup tables, timelines, pre-rendered frames and the tag table in a
+// flash partition of their own ("assets" in partitions.csv), built by tools/mkassets.py
+//
+//      uint16_t n;
+//      const uint32_t *embers = assets.palette("embers", n);   // points into flash, no copy
+//
+// The partition is memory mapped through the flash cache, so an asset is used where it lies,
+// like a const array in the firmware's own .rodata: nothing is copied into RAM and nothing is
+// allocated. Pointers stay good until the bundle is unmapped for a reload or a new bundle
+// ("assets load <url>"), which only happens in loop() after the light cues and the timeline
+// using it have been stopped (LightCues::dropAssets(), TimelinePlayer::stop()).
+//
+// Layout, all little endian and every asset starting on a 4 byte boundary:
+//      AssetHeader     magic, format, entry count, bundle version, total size, CRC-32 of the rest
+//      AssetEntry[]    name, type, offset from the start of the bundle, size, type parameter
+//      data
+// A bundle is only used when its CRC matches, so one half written by an interrupted load reads
+// as no bundle at all and the firmware's compiled-in defaults apply.
+
+const uint32_t assetMagic = 0x54455341;        // "ASET"
+const uint16_t assetFormat = 1;
+const byte assetNameSize = 16;                  // with the terminating zero
+const uint16_t assetLutSize = 256;
+
+// Asset types, the names are the ones mkassets.py manifests use
+enum assetType {assetRaw, assetPalette, assetLut, assetTimeline, assetFrames, assetTags, assetTypes};
+const char *const assetTypeNames[assetTypes] = {"raw", "palette", "lut", "timeline", "frames", "tags"};
+
+struct AssetHeader
+{
+    uint32_t magic;
+    uint16_t format;
+    uint16_t count;                 // entries
+    uint32_t version;               // of the bundle, set by whoever builds it
+    uint32_t size;                  // bytes including this header
+    uint32_t crc;                   // CRC-32 of everything after the header
+    uint32_t reserved[3];
+};
+
+struct AssetEntry
+{
+    char name[assetNameSize];
+    uint16_t type;
+    uint16_t flags;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t param;                 // frames: pixels per frame
+};
+
+#ifdef ARDUINO_ARCH_ESP32
+#include "esp32/rom/crc.h"
+#endif
+
+// CRC-32 as zlib computes it, with the ROM's table on the ESP32
+inline uint32_t assetCrc32(const uint8_t *data, uint32_t length)
+{
+#ifdef ARDUINO_ARCH_ESP32
+    return crc32_le(0, data, length);
+#else
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        for (byte bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+#endif
+}
+
+// Class finding assets in a bundle image, wherever the image is (mapped flash, or a file read
+// into memory on the host)
+class AssetBundle
+{
+    public:
+
+    AssetBundle()
+    {
+        Base = nullptr;
+    }
+
+    // Check the image at base and use it, nullptr when it is good, otherwise the reason
+    const char *open(const uint8_t *base, uint32_t size)
+    {
+        Base = nullptr;
+        const AssetHeader *header = (const AssetHeader *)base;
+        if (size < sizeof(AssetHeader) || header->magic != assetMagic)
+        {
+            return "no bundle";
+        }
+        if (header->format != assetFormat)
+        {
+            return "unknown format";
+        }
+        if (header->size < sizeof(AssetHeader) + header->count * sizeof(AssetEntry) || header->size > size)
+        {
+            return "bad size";
+        }
+        if (assetCrc32(base + sizeof(AssetHeader), header->size - sizeof(AssetHeader)) != header->crc)
+        {
+            return "bad crc";
+        }
+        const AssetEntry *entries = (const AssetEntry *)(base + sizeof(AssetHeader));
+        for (uint16_t i = 0; i < header->count; i++)
+        {
+            const AssetEntry &entry = entries[i];
+            if (entry.offset % 4 || entry.offset > header->size || entry.size > header->size - entry.offset ||
+                memchr(entry.name, '\0', assetNameSize) == nullptr)
+            {
+                return "bad entry";
+            }
+        }
+        Base = base;
+        return nullptr;
+    }
+
+    void close()
+    {
+        Base = nullptr;
+    }
+
+    bool valid() const { return Base != nullptr; }
+    uint32_t version() const { return Base ? header()->version : 0; }
+    uint32_t size() const { return Base ? header()->size : 0; }
+    uint16_t count() const { return Base ? header()->count : 0; }
+
+    const AssetEntry *entry(uint16_t i) const
+    {
+        return i < count() ? entries() + i : nullptr;
+    }
+
+    // Asset of a type by name, name need not be terminated
+    const AssetEntry *find(const char *name, uint16_t length, assetType type) const
+    {
+        for (uint16_t i = 0; i < count(); i++)
+        {
+            const AssetEntry *e = entries() + i;
+            if (e->type == type && length < assetNameSize && strncmp(e->name, name, length) == 0 && e->name[length] == '\0')
+            {
+                return e;
+            }
+        }
+        return nullptr;
+    }
+
+    const AssetEntry *find(const char *name, assetType type) const
+    {
+        return find(name, strlen(name), type);
+    }
+
+    const uint8_t *data(const AssetEntry *e) const
+    {
+        return e ? Base + e->offset : nullptr;
+    }
+
+    // 0x00RRGGBB colors, nullptr when there is no such palette
+    const uint32_t *palette(const char *name, uint16_t length, uint16_t &colors) const
+    {
+        const AssetEntry *e = find(name, length, assetPalette);
+        colors = e ? e->size / 4 : 0;
+        return (const uint32_t *)data(e);
+    }
+
+    const uint32_t *palette(const char *name, uint16_t &colors) const
+    {
+        return palette(name, strlen(name), colors);
+    }
+
+    // 256 entry byte table
+    const uint8_t *lut(const char *name) const
+    {
+        const AssetEntry *e = find(name, assetLut);
+        return e && e->size == assetLutSize ? data(e) : nullptr;
+    }
+
+    // Frames of width pixels, 3 bytes (r, g, b) each
+    const uint8_t *frames(const char *name, uint16_t length, uint16_t &width, uint16_t &frameCount) const
+    {
+        const AssetEntry *e = find(name, length, assetFrames);
+        if (e == nullptr || e->param == 0 || e->param > 0xFFFF || e->size / (e->param * 3) == 0)
+        {
+            return nullptr;
+        }
+        width = e->param;
+        frameCount = min(e->size / (e->param * 3), (uint32_t)0xFFFF);
+        return data(e);
+    }
+
+    // Text assets (timelines, tag tables), not terminated
+    const char *text(const char *name, assetType type, uint32_t &length) const
+    {
+        const AssetEntry *e = find(name, type);
+        length = e ? e->size : 0;
+        return (const char *)data(e);
+    }
+
+    // One line per asset
+    void printList() const
+    {
+        char line[96];
+        for (uint16_t i = 0; i < count(); i++)
+        {
+            const AssetEntry *e = entries() + i;
+            snprintf(line, sizeof(line), "  %-8s %-15s %6lu bytes at +%lu",
+                e->type < assetTypes ? assetTypeNames[e->type] : "?", e->name, (unsigned long)e->size, (unsigned long)e->offset);
+            Serial.println(line);
+        }
+    }
+
+    protected:
+
+    const uint8_t *Base;
+
+    const AssetHeader *header() const { return (const AssetHeader *)Base; }
+    const AssetEntry *entries() const { return (const AssetEntry *)(Base + sizeof(AssetHeader)); }
+};
+
+// Class running the commands of a timeline asset at their times
+//
+// A timeline is text, one "<ms from the start> <command>" per line, blank lines and lines
+// starting with # skipped. Each line is dispatched from the bundle in place as if it had come
+// in on topic, so light cues in a timeline share that topic's rate limit (see lightcues.h).
+// Stop the player before the bundle is unmapped.
+class TimelinePlayer
+{
+    public:
+
+    TimelinePlayer(CommandRegistry &registry, const char *topic)
+    : Registry(registry)
+    {
+        Topic = topic;
+        Text = nullptr;
+        End = nullptr;
+        Next = nullptr;
+        Started = 0;
+    }
+
+    void play(const char *text, uint32_t length)
+    {
+        Text = text;
+        End = text + length;
+        Next = text;
+        Started = millis();
+    }
+
+    void stop()
+    {
+        Text = nullptr;
+    }
+
+    bool playing() const { return Text != nullptr; }
+
+    // Run the lines that are due. Called from loop().
+    void update()
+    {
+        while (Text)
+        {
+            if (Next >= End)
+            {
+                Text = nullptr;
+                return;
+            }
+            const char *eol = (const char *)memchr(Next, '\n', End - Next);
+            const char *lineEnd = eol ? eol : End;
+            const char *p = Next;
+            while (p < lineEnd && (*p == ' ' || *p == '\t'))
+            {
+                p++;
+            }
+            unsigned long at = 0;
+            const char *digits = p;
+            while (p < lineEnd && *p >= '0' && *p <= '9')
+            {
+                at = at * 10 + (*p++ - '0');
+            }
+            if (p == digits)
+            {
+                Next = lineEnd + 1;     // blank, comment or not a timed line
+                continue;
+            }
+            if (millis() - Started < at)
+            {
+                return;
+            }
+            uint16_t length = lineEnd - p;
+            if (length && p[length - 1] == '\r')
+            {
+                length--;
+            }
+            Next = lineEnd + 1;
+            Registry.dispatch((const uint8_t *)p, length, Topic);
+        }
+    }
+
+    private:
+
+    CommandRegistry &Registry;
+    const char *Topic;
+    const char *Text;               // nullptr when nothing is playing
+    const char *End;
+    const char *Next;               // start of the next line to run
+    unsigned long Started;
+};
+
+#ifdef ARDUINO_ARCH_ESP32
+
+#include <HTTPClient.h>
+#include <esp_partition.h>
+#include <esp_spi_flash.h>
+#include "mqttqueue.h"
+#include "binlog.h"
+#include "heapaudit.h"
+
+const char *const assetPartitionLabel = "assets";
+const uint8_t assetPartitionSubtype = 0x40;     // first of the subtypes left to applications
+const uint16_t assetReadSize = 1024;            // network bytes read at a time
+const uint16_t assetUrlSize = 160;
+const uint32_t assetSectorSize = 4096;          // flash erase unit
+const unsigned long assetStallTimeout = 10000;
+const uint32_t assetTaskStack = 6144;
+
+enum assetLoadState {assetIdle, assetLoading, assetLoaded, assetLoadFailed};
+
+// Class mapping the asset partition and writing new bundles into it
+//
+// A new bundle is downloaded in a task of its own, like an OTA update (see ota.h), and written
+// a sector at a time straight into the partition, so it is never held in RAM. The old bundle is
+// unmapped first and the new one is only mapped again, by update() in loop(), once it is whole.
+class FlashAssets : public AssetBundle
+{
+    public:
+
+    // Member Variables:
+    volatile assetLoadState state;
+    uint32_t loaded;                // bytes of the last download
+    unsigned long loadMillis;
+    unsigned long mapMicros;        // checking and mapping the bundle
+
+    FlashAssets(MqttQueue &outbox, const char *topic)
+    : Outbox(outbox)
+    {
+        Topic = topic;
+        state = assetIdle;
+        loaded = 0;
+        loadMillis = 0;
+        mapMicros = 0;
+        Partition = nullptr;
+        Mapped = false;
+        Reported = true;
+        error = nullptr;
+    }
+
+    // Map the bundle in the partition, false when there is none that checks out
+    bool begin()
+    {
+        Partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)assetPartitionSubtype,
+            assetPartitionLabel);
+        if (Partition == nullptr)
+        {
+            LOG_WARN(logOta, "No %s partition, flash with partitions.csv", assetPartitionLabel);
+            return false;
+        }
+        return map();
+    }
+
+    // Map the partition again, after it was written from outside (esptool)
+    bool reload()
+    {
+        if (state == assetLoading || Partition == nullptr)
+        {
+            return false;
+        }
+        unmap();
+        return map();
+    }
+
+    // Download a bundle into the partition, false when one is already loading. The current
+    // bundle is gone from here on, stop everything using it first.
+    bool load(const char *url, uint16_t length)
+    {
+        if (state == assetLoading || Partition == nullptr || length == 0 || length >= assetUrlSize)
+        {
+            return false;
+        }
+        unmap();
+        memcpy(Url, url, length);
+        Url[length] = '\0';
+        state = assetLoading;
+        Reported = false;
+        if (xTaskCreate(task, "assets", assetTaskStack, this, 1, nullptr) != pdPASS)
+        {
+            error = "no task";
+            state = assetLoadFailed;
+        }
+        return true;
+    }
+
+    // Map a freshly loaded bundle and report the result. Called from loop().
+    void update()
+    {
+        if (Reported || state == assetLoading)
+        {
+            return;
+        }
+        char message[80];
+        if (state == assetLoaded && map())
+        {
+            snprintf(message, sizeof(message), "assets done %lu %lu %lu",
+                (unsigned long)version(), (unsigned long)loaded, loadMillis);
+        }
+        else
+        {
+            snprintf(message, sizeof(message), "assets failed %s", error ? error : "");
+        }
+        LOG_INFO(logOta, "%s", message);
+        Outbox.publish(Topic, message);
+        Reported = true;
+    }
+
+    void printStatus()
+    {
+        char line[96];
+        if (valid())
+        {
+            snprintf(line, sizeof(line), "Assets: version %lu, %u assets, %lu of %lu bytes mapped at %p in %lu us",
+                (unsigned long)version(), count(), (unsigned long)size(), (unsigned long)Partition->size, (void *)Base, mapMicros);
+        }
+        else
+        {
+            snprintf(line, sizeof(line), "Assets: none (%s)", state == assetLoading ? "loading" : error ? error : "no partition");
+        }
+        Serial.println(line);
+    }
+
+    // Time asset reads from mapped flash against the same reads from RAM
+    //
+    // lut: random lookups in a 256 byte table, the flash one stays in the cache after the
+    // first few. scattered: random words across the whole bundle, a cache miss each when the
+    // bundle is much larger than the 32 KB cache. stream: every word of the largest asset once,
+    // first when it has not been read for a while and then again.
+    void benchmark(uint32_t rounds)
+    {
+        if (!valid())
+        {
+            Serial.println(F("No asset bundle to measure"));
+            return;
+        }
+        const uint8_t *flashLut = nullptr;
+        const AssetEntry *largest = nullptr;
+        for (uint16_t i = 0; i < count(); i++)
+        {
+            const AssetEntry *e = entries() + i;
+            if (!flashLut && e->type == assetLut && e->size == assetLutSize)
+            {
+                flashLut = data(e);
+            }
+            if (!largest || e->size > largest->size)
+            {
+                largest = e;
+            }
+        }
+        static uint8_t ramLut[assetLutSize];
+        static uint32_t ramBlock[1024];
+        uint32_t sum = 0;
+        uint32_t x = 12345;
+        if (flashLut == nullptr)
+        {
+            flashLut = Base;
+        }
+        memcpy(ramLut, flashLut, assetLutSize);
+
+        uint32_t started = ESP.getCycleCount();
+        for (uint32_t i = 0; i < rounds; i++)
+        {
+            x = x * 1103515245 + 12345;
+            sum += ramLut[x >> 24];
+        }
+        uint32_t lutRam = ESP.getCycleCount() - started;
+        x = 12345;
+        started = ESP.getCycleCount();
+        for (uint32_t i = 0; i < rounds; i++)
+        {
+            x = x * 1103515245 + 12345;
+            sum += flashLut[x >> 24];
+        }
+        uint32_t lutFlash = ESP.getCycleCount() - started;
+
+        const uint32_t *words = (const uint32_t *)Base;
+        uint32_t wordCount = size() / 4;
+        started = ESP.getCycleCount();
+        for (uint32_t i = 0; i < rounds; i++)
+        {
+            x = x * 1103515245 + 12345;
+            sum += words[x % wordCount];
+        }
+        uint32_t scattered = ESP.getCycleCount() - started;
+
+        const uint32_t *stream = (const uint32_t *)data(largest);
+        uint32_t streamWords = largest->size / 4;
+        uint32_t streamCold = streamSum(stream, streamWords, sum);
+        uint32_t streamWarm = streamSum(stream, streamWords, sum);
+        uint32_t streamRam = 0;
+        for (uint32_t done = 0; done < streamWords; done += 1024)
+        {
+            streamRam += streamSum(ramBlock, min(streamWords - done, (uint32_t)1024), sum);
+        }
+
+        char line[112];
+        uint32_t kb = max(largest->size / 1024, (uint32_t)1);
+        snprintf(line, sizeof(line), "Assets bench, cycles per read: lut ram %lu flash %lu, scattered over %lu KB %lu",
+            (unsigned long)(lutRam / rounds), (unsigned long)(lutFlash / rounds), (unsigned long)(size() / 1024),
+            (unsigned long)(scattered / rounds));
+        Serial.println(line);
+        snprintf(line, sizeof(line), "  stream %s (%lu bytes), cycles per KB: flash %lu then %lu, ram %lu (%lu)",
+            largest->name, (unsigned long)largest->size, (unsigned long)(streamCold / kb), (unsigned long)(streamWarm / kb),
+            (unsigned long)(streamRam / kb), (unsigned long)(sum & 0xFF));
+        Serial.println(line);
+    }
+
+    private:
+
+    MqttQueue &Outbox;
+    const char *Topic;
+    const esp_partition_t *Partition;
+    spi_flash_mmap_handle_t Handle;
+    bool Mapped;
+    bool Reported;                  // result of the last load sent to the host
+    const char *error;
+    char Url[assetUrlSize];
+    uint8_t In[assetReadSize];
+
+    bool map()
+    {
+        unsigned long started = micros();
+        AssetHeader header;
+        const void *base;
+        if (esp_partition_read(Partition, 0, &header, sizeof(header)) != ESP_OK ||
+            header.magic != assetMagic || header.size > Partition->size || header.size < sizeof(header))
+        {
+            error = "no bundle";
+            return false;
+        }
+        if (esp_partition_mmap(Partition, 0, header.size, SPI_FLASH_MMAP_DATA, &base, &Handle) != ESP_OK)
+        {
+            error = "not mapped";
+            return false;
+        }
+        Mapped = true;
+        error = open((const uint8_t *)base, header.size);
+        mapMicros = micros() - started;
+        if (error)
+        {
+            LOG_WARN(logOta, "Asset bundle not used: %s", error);
+            unmap();
+            return false;
+        }
+        LOG_INFO(logOta, "Asset bundle version %lu, %u assets, %lu bytes", (unsigned long)version(), count(),
+            (unsigned long)size());
+        return true;
+    }
+
+    void unmap()
+    {
+        close();
+        if (Mapped)
+        {
+            spi_flash_munmap(Handle);
+            Mapped = false;
+        }
+    }
+
+    static uint32_t streamSum(const uint32_t *words, uint32_t n, uint32_t &sum)
+    {
+        uint32_t started = ESP.getCycleCount();
+        for (uint32_t i = 0; i < n; i++)
+        {
+            sum += words[i];
+        }
+        return ESP.getCycleCount() - started;
+    }
+
+    static void task(void *assets)
+    {
+        ((FlashAssets *)assets)->run();
+        heapTaskExit();
+    }
+
+    void run()
+    {
+        unsigned long started = millis();
+        error = nullptr;
+        loaded = 0;
+        HTTPClient http;
+        http.begin(Url);
+        bool ok = http.GET() == HTTP_CODE_OK || fail("http error");
+        if (ok)
+        {
+            ok = download(http.getStreamPtr(), http.getSize());
+        }
+        http.end();
+        loadMillis = millis() - started;
+        state = ok ? assetLoaded : assetLoadFailed;
+    }
+
+    // Write the download into the partition, erasing each sector as it is reached
+    bool download(WiFiClient *stream, int contentLength)
+    {
+        if (contentLength < (int)sizeof(AssetHeader) || (uint32_t)contentLength > Partition->size)
+        {
+            return fail(contentLength < 0 ? "no length" : "wrong size");
+        }
+        uint32_t erased = 0;
+        unsigned long lastData = millis();
+        while ((int)loaded < contentLength)
+        {
+            size_t available = stream->available();
+            if (available == 0)
+            {
+                if (!stream->connected() || millis() - lastData > assetStallTimeout)
+                {
+                    return fail("download stalled");
+                }
+                vTaskDelay(1);
+                continue;
+            }
+            size_t n = stream->read(In, min(available, (size_t)assetReadSize));
+            lastData = millis();
+            if (loaded == 0 && (n < 4 || ((AssetHeader *)In)->magic != assetMagic))
+            {
+                return fail("not a bundle");
+            }
+            while (erased < loaded + n)
+            {
+                if (esp_partition_erase_range(Partition, erased, assetSectorSize) != ESP_OK)
+                {
+                    return fail("erase failed");
+                }
+                erased += assetSectorSize;
+            }
+            if (esp_partition_write(Partition, loaded, In, n) != ESP_OK)
+            {
+                return fail("write failed");
+            }
+            loaded += n;
+        }
+        return true;
+    }
+
+    bool fail(const char *reason)
+    {
+        error = reason;
+        return false;
+    }
+};
+
+#endif
+
+#endif
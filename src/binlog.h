@@ -0,0 +1,617 @@
+#ifndef BinLog_h
+#define BinLog_h
+
+#include <Arduino.h>
+#include <atomic>
+#include "mqttqueue.h"
+#include "spscqueue.h"
+
+// Deferred-format, level-gated logging
+//
+// LOG_INFO(logRfid, "Tag removed from reader #%d", i) does not format anything. It stores the
+// address of the format string (which lives in flash and doubles as its id), micros() and the
+// raw arguments in a lock-free ring (spscqueue.h), which costs a few microseconds. A low
+// priority task drains the ring to one of
+//    sinkText      formatted on the device and printed to Serial, as the old Serial.print calls
+//    sinkSerial    binary batches printed as "#BL <base64>" lines between the usual text
+//    sinkMqtt      binary batches published to the log topic (handed back to loop() by update())
+// and only writes what Serial can take without blocking. tools/binlog_decode.py turns the
+// binary batches back into text using the firmware ELF.
+//
+// Levels are gated twice. Calls above LOG_LEVEL (a build flag, debug by default) compile to
+// nothing, format string included. The rest are checked against a level per module, set at run
+// time with "log level <module> <level>" (info by default). Each call site also keeps its own
+// rate limit: after binLogRepeatBurst records inside binLogRepeatMillis the rest are counted,
+// and the next record let through is preceded by how many were suppressed.
+//
+// Record:  uint8 length, uint8 level << 4 | module, uint32 micros, uint32 format address, arguments
+// Batch:   uint8 version, uint8 reserved, uint16 sequence, uint32 records dropped so far, records
+// Arguments are little-endian: integers, bool and char 4 bytes, long long 8 bytes, float and
+// double 4 bytes as float, strings a length byte and the characters (cut to fit the record).
+// The decoder walks the format string to know what comes next, so a format must match its
+// arguments; the LOG macros have the compiler check them as it does for printf.
+//
+// Logging is only for loop() and what it calls, the ring has a single writer.
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+#define LOG_LEVEL_TRACE 5
+
+// Highest level compiled in, for example -DLOG_LEVEL=LOG_LEVEL_WARN in build_flags
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+enum logLevel {logNone, logError, logWarn, logInfo, logDebug, logTrace, numLogLevels};
+enum logModule {logSystem, logPuzzle, logRfid, logNet, logLights, logOta, numLogModules};
+
+const uint16_t binLogSize = 4096;           // ring bytes
+const byte binLogMaxRecord = 160;
+const uint16_t binLogBatchSize = 512;       // bytes per MQTT or serial batch
+const unsigned long binLogFlushMillis = 250;
+const unsigned long binLogRepeatMillis = 1000;  // rate limit window of a call site
+const uint16_t binLogRepeatBurst = 4;       // records a call site may log per window
+const logLevel binLogDefaultLevel = logInfo;
+const uint32_t binLogTaskStack = 3072;
+const int binLogTaskPriority = 1;           // lowest above idle, below the network tasks
+const int binLogTaskCore = 0;               // off the loop() core
+const uint32_t binLogTaskIdleMillis = 10;   // sleep when the ring is empty or Serial is full
+const byte binLogVersion = 2;
+
+enum binLogSink {sinkText, sinkSerial, sinkMqtt, sinkOff, numBinLogSinks};
+
+// Rate limit state of one call site, a static inside each LOG macro
+struct LogSite
+{
+    unsigned long windowStart;
+    uint16_t count;                 // records let through in this window
+    uint16_t suppressed;            // records held back since the last one let through
+
+    bool allow()
+    {
+        unsigned long now = millis();
+        if (now - windowStart >= binLogRepeatMillis)
+        {
+            windowStart = now;
+            count = 0;
+        }
+        if (count < binLogRepeatBurst)
+        {
+            count++;
+            return true;
+        }
+        if (suppressed < 0xFFFF)
+        {
+            suppressed++;
+        }
+        return false;
+    }
+};
+
+#define LOG_AT(level, module, format, ...) do { \
+    if (false) printf(format, ##__VA_ARGS__); \
+    static LogSite logSite; \
+    if (binLog.enabled(module, level) && logSite.allow()) \
+        binLog.record(level, module, logSite, format, ##__VA_ARGS__); \
+} while (0)
+
+// Compiled out, the format is still checked against its arguments
+#define LOG_STRIPPED(format, ...) do { \
+    if (false) printf(format, ##__VA_ARGS__); \
+} while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(module, format, ...) LOG_AT(logError, module, format, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(module, format, ...) LOG_STRIPPED(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(module, format, ...) LOG_AT(logWarn, module, format, ##__VA_ARGS__)
+#else
+#define LOG_WARN(module, format, ...) LOG_STRIPPED(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(module, format, ...) LOG_AT(logInfo, module, format, ##__VA_ARGS__)
+#else
+#define LOG_INFO(module, format, ...) LOG_STRIPPED(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(module, format, ...) LOG_AT(logDebug, module, format, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(module, format, ...) LOG_STRIPPED(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(module, format, ...) LOG_AT(logTrace, module, format, ##__VA_ARGS__)
+#else
+#define LOG_TRACE(module, format, ...) LOG_STRIPPED(format, ##__VA_ARGS__)
+#endif
+
+static const char *const logLevelNames[numLogLevels] = {"none", "error", "warn", "info", "debug", "trace"};
+static const char *const logModuleNames[numLogModules] = {"system", "puzzle", "rfid", "net", "lights", "ota"};
+
+// Stands in front of the next record let through when a call site was rate limited
+static const char binLogSuppressedFormat[] = "(%u like the next suppressed)";
+
+// Class holding the log ring and draining it to the chosen sink
+class BinLog
+{
+    public:
+
+    // Member Variables:
+    unsigned long records;          // records logged
+    unsigned long dropped;          // records lost to a full ring
+    unsigned long suppressed;       // records held back by the per call site rate limit
+    unsigned long bytes;            // record bytes logged
+    unsigned long recordMicros;     // total time spent in record()
+    unsigned long sentBytes;        // batch or text bytes written to the sink
+
+    BinLog()
+    {
+        Outbox = nullptr;
+        Topic = nullptr;
+        Task = nullptr;
+        Requested.store(sinkText);
+        Sink = sinkText;
+        Sequence = 0;
+        LastFlush = 0;
+        Pending = 0;
+        PendingSent = 0;
+        records = 0;
+        dropped = 0;
+        suppressed = 0;
+        bytes = 0;
+        recordMicros = 0;
+        sentBytes = 0;
+        setLevel(numLogModules, binLogDefaultLevel);
+    }
+
+    // Start the drain task. Records logged before this wait in the ring.
+    bool begin(MqttQueue &outbox, const char *topic)
+    {
+        Outbox = &outbox;
+        Topic = topic;
+        if (Task)
+        {
+            return true;
+        }
+        return xTaskCreatePinnedToCore(task, "log", binLogTaskStack, this, binLogTaskPriority, &Task, binLogTaskCore) == pdPASS;
+    }
+
+    // The drain task picks the new sink up on its next pass
+    void setSink(binLogSink sink)
+    {
+        Requested.store(sink, std::memory_order_release);
+    }
+
+    binLogSink sink() { return (binLogSink)Requested.load(std::memory_order_relaxed); }
+
+    // Level of one module, or of all of them with numLogModules
+    void setLevel(byte module, logLevel level)
+    {
+        for (byte m = 0; m < numLogModules; m++)
+        {
+            if (module == m || module == numLogModules)
+            {
+                Levels[m] = level;
+            }
+        }
+    }
+
+    logLevel level(byte module) { return (logLevel)Levels[module]; }
+
+    bool enabled(logModule module, logLevel level)
+    {
+        return level <= Levels[module];
+    }
+
+    template <typename... Args>
+    void record(logLevel level, logModule module, LogSite &site, const char *format, Args... args)
+    {
+        unsigned long started = micros();
+        if (site.suppressed)
+        {
+            suppressed += site.suppressed;
+            uint16_t held = site.suppressed;
+            site.suppressed = 0;
+            record(level, module, binLogSuppressedFormat, (unsigned int)held);
+        }
+        record(level, module, format, args...);
+        recordMicros += micros() - started;
+    }
+
+    // Hand finished MQTT batches to the outbound queue. Called from loop().
+    void update()
+    {
+        uint16_t length;
+        const uint8_t *batch;
+        while ((batch = Batches.peek(length)) != nullptr)
+        {
+            if (!Outbox->publish(Topic, batch, length))
+            {
+                return;
+            }
+            sentBytes += length;
+            Batches.release();
+        }
+    }
+
+    // Format a record on the device, as the host decoder does
+    static uint16_t render(const uint8_t *record, char *out, uint16_t size)
+    {
+        const uint8_t *end = record + record[0];
+        const uint8_t *p = record + 10;
+        const char *format = (const char *)(uintptr_t)get32(record + 6);
+        uint16_t n = snprintf(out, size, "%c %s: ", "-EWIDT"[min(record[1] >> 4, (int)logTrace)],
+            logModuleNames[min(record[1] & 0x0F, numLogModules - 1)]);
+        n = min(n, (uint16_t)(size - 1));
+        while (*format && n + 1 < size)
+        {
+            if (*format != '%')
+            {
+                out[n++] = *format++;
+                continue;
+            }
+            // Copy one conversion, "%-08lx" and the like
+            char spec[16];
+            byte s = 0;
+            byte longs = 0;
+            spec[s++] = *format++;
+            while (*format && !strchr("diouxXcsfeEgGp%", *format) && s < sizeof(spec) - 3)
+            {
+                if (*format == 'l')
+                {
+                    longs++;
+                }
+                else
+                {
+                    spec[s++] = *format;
+                }
+                format++;
+            }
+            char conversion = *format ? *format++ : '%';
+            int written = 0;
+            if (conversion == '%')
+            {
+                out[n++] = '%';
+                continue;
+            }
+            if (conversion == 's')
+            {
+                char text[binLogMaxRecord];
+                byte length = 0;
+                if (p < end)
+                {
+                    length = *p++;
+                    length = min((int)length, (int)(end - p));
+                }
+                memcpy(text, p, length);
+                text[length] = '\0';
+                p += length;
+                spec[s++] = 's';
+                spec[s] = '\0';
+                written = snprintf(out + n, size - n, spec, text);
+            }
+            else if (longs >= 2)
+            {
+                uint64_t value = 0;
+                if (p + 8 <= end)
+                {
+                    value = get32(p) | ((uint64_t)get32(p + 4) << 32);
+                }
+                p += 8;
+                spec[s++] = 'l';
+                spec[s++] = 'l';
+                spec[s++] = conversion;
+                spec[s] = '\0';
+                written = snprintf(out + n, size - n, spec, value);
+            }
+            else
+            {
+                uint32_t value = (p + 4 <= end) ? get32(p) : 0;
+                p += 4;
+                spec[s++] = conversion;
+                spec[s] = '\0';
+                if (strchr("feEgG", conversion))
+                {
+                    float f;
+                    memcpy(&f, &value, sizeof(f));
+                    written = snprintf(out + n, size - n, spec, (double)f);
+                }
+                else if (conversion == 'p')
+                {
+                    written = snprintf(out + n, size - n, spec, (void *)(uintptr_t)value);
+                }
+                else
+                {
+                    written = snprintf(out + n, size - n, spec, value);
+                }
+            }
+            n += max(0, min(written, (int)(size - 1 - n)));
+        }
+        return n;
+    }
+
+    void printStats()
+    {
+        Serial.print(F("Log: "));
+        Serial.print(records);
+        Serial.print(F(" records, "));
+        Serial.print(dropped);
+        Serial.print(F(" dropped, "));
+        Serial.print(suppressed);
+        Serial.print(F(" suppressed, "));
+        Serial.print(records ? recordMicros / records : 0);
+        Serial.print(F(" us per record, "));
+        Serial.print(records ? bytes / records : 0);
+        Serial.print(F(" bytes per record, "));
+        Serial.print(sentBytes);
+        Serial.println(F(" bytes sent"));
+    }
+
+    void printLevels()
+    {
+        Serial.print(F("Log levels (compiled up to "));
+        Serial.print(logLevelNames[LOG_LEVEL]);
+        Serial.print(F("):"));
+        for (byte m = 0; m < numLogModules; m++)
+        {
+            Serial.print(' ');
+            Serial.print(logModuleNames[m]);
+            Serial.print('=');
+            Serial.print(logLevelNames[Levels[m]]);
+        }
+        Serial.println();
+    }
+
+    private:
+
+    MqttQueue *Outbox;
+    const char *Topic;
+    TaskHandle_t Task;
+    std::atomic<uint8_t> Requested;     // sink set from loop()
+    binLogSink Sink;                    // sink the drain task is writing to
+    byte Levels[numLogModules];
+    SpscQueue<binLogSize> Ring;                     // loop() -> drain task
+    SpscQueue<binLogBatchSize * 2 + 8> Batches;     // drain task -> loop(), for the MQTT sink
+    uint16_t Sequence;
+    unsigned long LastFlush;
+    uint8_t Out[binLogBatchSize + 8];   // batch, text line or base64 line on its way out
+    uint16_t Pending;               // bytes of Out still to write to Serial
+    uint16_t PendingSent;
+
+    template <typename... Args>
+    void record(logLevel level, logModule module, const char *format, Args... args)
+    {
+        uint8_t buffer[binLogMaxRecord];
+        byte n = 1;
+        buffer[n++] = (level << 4) | module;
+        put32(buffer, n, (uint32_t)micros());
+        put32(buffer, n, (uint32_t)(uintptr_t)format);
+        pack(buffer, n, args...);
+        buffer[0] = n;
+        if (!Ring.push(buffer, n))
+        {
+            dropped++;
+            return;
+        }
+        records++;
+        bytes += n;
+    }
+
+    static void put32(uint8_t *buffer, byte &n, uint32_t value)
+    {
+        if (n + 4 <= binLogMaxRecord)
+        {
+            buffer[n++] = value;
+            buffer[n++] = value >> 8;
+            buffer[n++] = value >> 16;
+            buffer[n++] = value >> 24;
+        }
+    }
+
+    static uint32_t get32(const uint8_t *p)
+    {
+        return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    static void pack(uint8_t *buffer, byte &n) {}
+
+    template <typename T, typename... Args>
+    static void pack(uint8_t *buffer, byte &n, T value, Args... args)
+    {
+        put(buffer, n, value);
+        pack(buffer, n, args...);
+    }
+
+    static void put(uint8_t *buffer, byte &n, int value) { put32(buffer, n, value); }
+    static void put(uint8_t *buffer, byte &n, unsigned int value) { put32(buffer, n, value); }
+    static void put(uint8_t *buffer, byte &n, long value) { put32(buffer, n, value); }
+    static void put(uint8_t *buffer, byte &n, unsigned long value) { put32(buffer, n, value); }
+    static void put(uint8_t *buffer, byte &n, const void *value) { put32(buffer, n, (uint32_t)(uintptr_t)value); }
+
+    static void put(uint8_t *buffer, byte &n, long long value)
+    {
+        put32(buffer, n, (uint32_t)value);
+        put32(buffer, n, (uint32_t)((unsigned long long)value >> 32));
+    }
+
+    static void put(uint8_t *buffer, byte &n, unsigned long long value) { put(buffer, n, (long long)value); }
+
+    static void put(uint8_t *buffer, byte &n, double value)
+    {
+        float f = value;
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        put32(buffer, n, bits);
+    }
+
+    static void put(uint8_t *buffer, byte &n, const char *value)
+    {
+        if (n >= binLogMaxRecord)
+        {
+            return;
+        }
+        size_t length = min(strlen(value), (size_t)(binLogMaxRecord - n - 1));
+        buffer[n++] = length;
+        memcpy(buffer + n, value, length);
+        n += length;
+    }
+
+    static void put(uint8_t *buffer, byte &n, char *value) { put(buffer, n, (const char *)value); }
+
+    // Move whole records into a batch in Out, at most limit bytes
+    uint16_t batch(uint16_t limit)
+    {
+        Out[0] = binLogVersion;
+        Out[1] = 0;
+        Out[2] = Sequence;
+        Out[3] = Sequence >> 8;
+        byte n = 4;
+        put32(Out, n, dropped);
+        uint16_t length = n;
+        uint16_t size;
+        const uint8_t *record;
+        while ((record = Ring.peek(size)) != nullptr && length + size <= limit)
+        {
+            memcpy(Out + length, record, size);
+            length += size;
+            Ring.release();
+        }
+        Sequence++;
+        return length;
+    }
+
+    // Turn the batch in Out into a "#BL <base64>" line, in place from the back
+    uint16_t encodeLine(uint16_t length)
+    {
+        static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        uint8_t batch[binLogBatchSize];
+        memcpy(batch, Out, length);
+        char *line = (char *)Out;
+        uint16_t n = 0;
+        line[n++] = '#';
+        line[n++] = 'B';
+        line[n++] = 'L';
+        line[n++] = ' ';
+        for (uint16_t i = 0; i < length; i += 3)
+        {
+            uint32_t group = (uint32_t)batch[i] << 16;
+            if (i + 1 < length) group |= (uint32_t)batch[i + 1] << 8;
+            if (i + 2 < length) group |= batch[i + 2];
+            line[n++] = alphabet[(group >> 18) & 0x3F];
+            line[n++] = alphabet[(group >> 12) & 0x3F];
+            line[n++] = (i + 1 < length) ? alphabet[(group >> 6) & 0x3F] : '=';
+            line[n++] = (i + 2 < length) ? alphabet[group & 0x3F] : '=';
+        }
+        line[n++] = '\r';
+        line[n++] = '\n';
+        return n;
+    }
+
+    // Write what Serial takes without blocking, true once the pending line is out
+    bool writePending()
+    {
+        int room = Serial.availableForWrite();
+        uint16_t n = min((int)(Pending - PendingSent), max(room, 0));
+        if (n > 0)
+        {
+            Serial.write(Out + PendingSent, n);
+            PendingSent += n;
+            sentBytes += n;
+        }
+        if (PendingSent < Pending)
+        {
+            return false;
+        }
+        Pending = 0;
+        PendingSent = 0;
+        return true;
+    }
+
+    static void task(void *log)
+    {
+        ((BinLog *)log)->run();
+    }
+
+    // The drain task: one record or batch at a time, sleeping whenever there is nothing to do
+    // or Serial has no room
+    void run()
+    {
+        while (true)
+        {
+            if (!drain())
+            {
+                vTaskDelay(pdMS_TO_TICKS(binLogTaskIdleMillis));
+            }
+        }
+    }
+
+    // Move one step towards the sink, false when there is nothing to do for now
+    bool drain()
+    {
+        binLogSink requested = (binLogSink)Requested.load(std::memory_order_acquire);
+        if (requested != Sink)
+        {
+            Sink = requested;
+            Pending = 0;
+            PendingSent = 0;
+        }
+        if (Pending > 0)
+        {
+            return writePending();
+        }
+        uint16_t size;
+        const uint8_t *record = Ring.peek(size);
+        if (!record)
+        {
+            return false;
+        }
+        if (Sink == sinkOff)
+        {
+            Ring.release();
+            return true;
+        }
+        if (Sink == sinkText)
+        {
+            Pending = render(record, (char *)Out, sizeof(Out) - 2);
+            Out[Pending++] = '\r';
+            Out[Pending++] = '\n';
+            Ring.release();
+            return true;
+        }
+        // Batches go out when they are full or the oldest record has waited long enough
+        if (Ring.used() < binLogBatchSize - 8 && millis() - LastFlush < binLogFlushMillis)
+        {
+            return false;
+        }
+        if (Sink == sinkMqtt)
+        {
+            uint8_t *slot = Batches.reserve(binLogBatchSize);
+            if (!slot || !Outbox)
+            {
+                return false;
+            }
+            uint16_t length = batch(binLogBatchSize);
+            memcpy(slot, Out, length);
+            Batches.commit(length);
+        }
+        else
+        {
+            Pending = encodeLine(batch(binLogBatchSize * 3 / 4));
+        }
+        LastFlush = millis();
+        return true;
+    }
+};
+
+// The firmware's log, started from setup() with begin()
+BinLog binLog;
+
+#endif
@@ -0,0 +1,410 @@
+#ifndef Commands_h
+#define Commands_h
+
+#include "native_hal.h"
+
+const byte maxCommands = 32;            // commands the registry can hold
+const byte commandSlots = 64;           // hash index slots, a power of two above maxCommands
+const byte maxCommandArgs = 12;         // arguments parsed after the command name, enough for a light cue
+const byte noCommand = 0xFF;            // empty hash index slot
+
+// Arguments of one command, parsed in place from the MQTT payload
+//
+// Nothing is copied and the payload is not modified: each argument is a pointer into the payload
+// and a length, so handlers must not expect null-terminated strings. The payload is only valid
+// while the handler runs.
+class CommandArgs
+{
+    public:
+
+    CommandArgs(const char *text, uint16_t length, const char *topic = nullptr)
+    {
+        Topic = topic;
+        End = text + length;
+        Count = 0;
+        const char *p = skipSpaces(text);
+        NameLength = tokenLength(p);
+        Name = p;
+        p = skipSpaces(p + NameLength);
+        while (p < End && Count < maxCommandArgs)
+        {
+            Args[Count] = p;
+            Lengths[Count] = tokenLength(p);
+            p = skipSpaces(p + Lengths[Count]);
+            Count++;
+        }
+    }
+
+    // Topic the message arrived on, nullptr when it did not come from MQTT
+    const char *topic() { return Topic; }
+
+    // Command name (not null-terminated)
+    const char *name() { return Name; }
+    uint16_t nameLength() { return NameLength; }
+
+    // Number of arguments after the command name
+    byte count() { return Count; }
+
+    // Argument i (not null-terminated), an empty string past the last argument
+    const char *arg(byte i)
+    {
+        return i < Count ? Args[i] : End;
+    }
+
+    uint16_t length(byte i)
+    {
+        return i < Count ? Lengths[i] : 0;
+    }
+
+    // Whether argument i is the given word, ignoring case
+    bool is(byte i, const char *word)
+    {
+        uint16_t len = length(i);
+        return len == strlen(word) && strncasecmp(arg(i), word, len) == 0;
+    }
+
+    // Argument i as a decimal number, fallback when it is missing or not a number
+    long toInt(byte i, long fallback = 0)
+    {
+        const char *p = arg(i);
+        uint16_t len = length(i);
+        bool negative = len > 1 && *p == '-';
+        uint16_t start = negative ? 1 : 0;
+        if (len == start)
+        {
+            return fallback;
+        }
+        long value = 0;
+        for (uint16_t j = start; j < len; j++)
+        {
+            if (p[j] < '0' || p[j] > '9')
+            {
+                return fallback;
+            }
+            value = value * 10 + (p[j] - '0');
+        }
+        return negative ? -value : value;
+    }
+
+    // Unsigned 64-bit value of argument i, for times on the shared clock
+    uint64_t toUInt64(byte i, uint64_t fallback = 0)
+    {
+        const char *p = arg(i);
+        uint16_t len = length(i);
+        if (len == 0)
+        {
+            return fallback;
+        }
+        uint64_t value = 0;
+        for (uint16_t j = 0; j < len; j++)
+        {
+            if (p[j] < '0' || p[j] > '9')
+            {
+                return fallback;
+            }
+            value = value * 10 + (p[j] - '0');
+        }
+        return value;
+    }
+
+    // Everything from argument i to the end of the payload, for commands taking free text
+    const char *rest(byte i) { return arg(i); }
+
+    uint16_t restLength(byte i)
+    {
+        return End - arg(i);
+    }
+
+    private:
+
+    const char *Topic;
+    const char *End;
+    const char *Name;
+    uint16_t NameLength;
+    const char *Args[maxCommandArgs];
+    uint16_t Lengths[maxCommandArgs];
+    byte Count;
+
+    const char *skipSpaces(const char *p)
+    {
+        while (p < End && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        {
+            p++;
+        }
+        return p;
+    }
+
+    uint16_t tokenLength(const char *p)
+    {
+        const char *q = p;
+        while (q < End && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n')
+        {
+            q++;
+        }
+        return q - p;
+    }
+};
+
+typedef void (*CommandHandler)(CommandArgs &args);
+
+// One registered command and its timing
+struct Command
+{
+    const char *name;
+    uint32_t hash;              // hash of the name, computed when registered
+    CommandHandler handler;
+    bool immediate;             // may run on the network task as soon as it arrives
+    unsigned long calls;        // runs from loop(), the fields below are only written there
+    unsigned long totalMicros;  // time spent in the handler
+    unsigned long maxMicros;
+    unsigned long netCalls;     // runs on the network task, written only there
+    unsigned long netTotalMicros;
+    unsigned long netMaxMicros;
+};
+
+// Class mapping command names to handlers
+//
+// Names are hashed once when they are registered. A message costs one hash over its first word
+// and a probe of the hash index, so dispatch takes the same time however many commands exist.
+// Names are matched without regard to case.
+class CommandRegistry
+{
+    public:
+
+    // Member Variables:
+    unsigned long dispatched;       // messages that matched a command
+    unsigned long unknown;          // messages that matched nothing
+    unsigned long lookupMicros;     // time spent finding handlers
+
+    CommandRegistry()
+    {
+        Count = 0;
+        dispatched = 0;
+        unknown = 0;
+        lookupMicros = 0;
+        memset(Index, noCommand, sizeof(Index));
+    }
+
+    // Register a handler, false when the registry is full or the name is taken. The name must
+    // stay valid for the life of the registry (normally a string literal).
+    bool add(const char *name, CommandHandler handler)
+    {
+        if (Count >= maxCommands || find(name, strlen(name)) != noCommand)
+        {
+            return false;
+        }
+        Command &command = Commands[Count];
+        command.name = name;
+        command.hash = hash(name, strlen(name));
+        command.handler = handler;
+        command.immediate = false;
+        command.calls = 0;
+        command.totalMicros = 0;
+        command.maxMicros = 0;
+        command.netCalls = 0;
+        command.netTotalMicros = 0;
+        command.netMaxMicros = 0;
+        byte slot = command.hash & (commandSlots - 1);
+        while (Index[slot] != noCommand)
+        {
+            slot = (slot + 1) & (commandSlots - 1);
+        }
+        Index[slot] = Count++;
+        return true;
+    }
+
+    // Register a handler that may run on the network task as soon as its message arrives,
+    // ahead of the puzzle loop (see mqttlink.h). It must only reply and read the clock, never
+    // touch puzzle state.
+    bool addImmediate(const char *name, CommandHandler handler)
+    {
+        if (!add(name, handler))
+        {
+            return false;
+        }
+        Commands[Count - 1].immediate = true;
+        return true;
+    }
+
+    // Run the handler of an immediate command on the network task, false when the payload is
+    // anything else. Only the command's network task statistics are updated, everything else
+    // belongs to the loop.
+    bool dispatchImmediate(const uint8_t *payload, uint16_t length, const char *topic)
+    {
+        CommandArgs args((const char *)payload, length, topic);
+        byte i = find(args.name(), args.nameLength());
+        if (i == noCommand || !Commands[i].immediate)
+        {
+            return false;
+        }
+        Command &command = Commands[i];
+        unsigned long started = micros();
+        command.handler(args);
+        unsigned long elapsed = micros() - started;
+        command.netCalls++;
+        command.netTotalMicros += elapsed;
+        command.netMaxMicros = max(command.netMaxMicros, elapsed);
+        return true;
+    }
+
+    // Parse a payload and run its handler, false when no command matches
+    bool dispatch(const uint8_t *payload, uint16_t length, const char *topic = nullptr)
+    {
+        unsigned long started = micros();
+        CommandArgs args((const char *)payload, length, topic);
+        byte i = find(args.name(), args.nameLength());
+        lookupMicros += micros() - started;
+        if (i == noCommand)
+        {
+            unknown++;
+            return false;
+        }
+
+        Command &command = Commands[i];
+        started = micros();
+        command.handler(args);
+        unsigned long elapsed = micros() - started;
+        command.calls++;
+        command.totalMicros += elapsed;
+        command.maxMicros = max(command.maxMicros, elapsed);
+        dispatched++;
+        return true;
+    }
+
+    byte size() { return Count; }
+
+    // Print calls and handler time per command
+    void printStats()
+    {
+        Serial.print(F("Commands: "));
+        Serial.print(dispatched);
+        Serial.print(F(" dispatched, "));
+        Serial.print(unknown);
+        Serial.print(F(" unknown, lookup "));
+        Serial.print((dispatched + unknown) ? lookupMicros / (dispatched + unknown) : 0);
+        Serial.println(F(" us average"));
+        for (byte i = 0; i < Count; i++)
+        {
+            Command &command = Commands[i];
+            Serial.print(F("  "));
+            Serial.print(command.name);
+            Serial.print(F(": "));
+            Serial.print(command.calls);
+            Serial.print(F(" calls, "));
+            Serial.print(command.calls ? command.totalMicros / command.calls : 0);
+            Serial.print(F(" us average, "));
+            Serial.print(command.maxMicros);
+            Serial.print(F(" us max"));
+            if (command.immediate)
+            {
+                Serial.print(F(", on the network task "));
+                Serial.print(command.netCalls);
+                Serial.print(F(" calls, "));
+                Serial.print(command.netCalls ? command.netTotalMicros / command.netCalls : 0);
+                Serial.print(F(" us average, "));
+                Serial.print(command.netMaxMicros);
+                Serial.print(F(" us max"));
+            }
+            Serial.println();
+        }
+    }
+
+    // Compare lookup time against a strcmp chain for growing numbers of registered commands
+    static void benchmark(unsigned long rounds)
+    {
+        static char names[maxCommands][8];
+        for (byte i = 0; i < maxCommands; i++)
+        {
+            sprintf(names[i], "cmd%02d", i);
+        }
+        const byte sizes[] = {2, 8, maxCommands};
+        for (byte s = 0; s < sizeof(sizes); s++)
+        {
+            CommandRegistry *registry = new CommandRegistry();
+            for (byte i = 0; i < sizes[s]; i++)
+            {
+                registry->add(names[i], nullptr);
+            }
+            // The last command registered is the worst case for the chain
+            const char *target = names[sizes[s] - 1];
+            uint16_t len = strlen(target);
+            unsigned long found = 0;
+            unsigned long started = micros();
+            for (unsigned long r = 0; r < rounds; r++)
+            {
+                found += registry->find(target, len) != noCommand;
+            }
+            unsigned long hashMicros = micros() - started;
+
+            started = micros();
+            for (unsigned long r = 0; r < rounds; r++)
+            {
+                for (byte i = 0; i < sizes[s]; i++)
+                {
+                    if (strncasecmp(names[i], target, len) == 0 && names[i][len] == '\0')
+                    {
+                        found++;
+                        break;
+                    }
+                }
+            }
+            unsigned long chainMicros = micros() - started;
+            delete registry;
+
+            Serial.print(F("Command lookup with "));
+            Serial.print(sizes[s]);
+            Serial.print(F(" commands: hashed "));
+            Serial.print(hashMicros * 1000 / rounds);
+            Serial.print(F(" ns, strcmp chain "));
+            Serial.print(chainMicros * 1000 / rounds);
+            Serial.print(F(" ns ("));
+            Serial.print(found);
+            Serial.println(F(" found)"));
+        }
+    }
+
+    private:
+
+    Command Commands[maxCommands];
+    byte Index[commandSlots];       // command number per slot, noCommand when empty
+    byte Count;
+
+    // FNV-1a over the lowercased name
+    static uint32_t hash(const char *name, uint16_t len)
+    {
+        uint32_t h = 2166136261UL;
+        for (uint16_t i = 0; i < len; i++)
+        {
+            char c = name[i];
+            if (c >= 'A' && c <= 'Z')
+            {
+                c += 'a' - 'A';
+            }
+            h = (h ^ (uint8_t)c) * 16777619UL;
+        }
+        return h;
+    }
+
+    // Command number for a name, noCommand when it is not registered
+    byte find(const char *name, uint16_t len)
+    {
+        if (len == 0)
+        {
+            return noCommand;
+        }
+        uint32_t h = hash(name, len);
+        byte slot = h & (commandSlots - 1);
+        while (Index[slot] != noCommand)
+        {
+            const Command &command = Commands[Index[slot]];
+            if (command.hash == h && strncasecmp(command.name, name, len) == 0 && command.name[len] == '\0')
+            {
+                return Index[slot];
+            }
+            slot = (slot + 1) & (commandSlots - 1);
+        }
+        return noCommand;
+    }
+};
+
+#endif
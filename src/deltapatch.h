@@ -0,0 +1,272 @@
+#ifndef DeltaPatch_h
+#define DeltaPatch_h
+
+#include <Arduino.h>
+
+// Delta image format, written by tools/ota_delta.py:
+//
+//   header   OtaHeader below, not compressed
+//   body     zlib stream of operations, a type byte followed by little-endian uint32 fields
+//              otaOpAdd <source offset> <length> <length bytes>    target = source + bytes (mod 256)
+//              otaOpInsert <length> <length bytes>                 target = bytes
+//              otaOpEnd
+//
+// Code that moved between builds differs from the source mostly in shifted addresses, so the
+// add bytes are nearly all zero and compress to very little. A full image is the same format
+// with insert operations only and the otaFlagFull flag set.
+
+const uint32_t otaMagic = 0x544C4441;   // "ADLT"
+const byte otaVersion = 1;
+const byte otaFlagFull = 0x01;          // no source image needed
+const byte otaOpEnd = 0;
+const byte otaOpAdd = 1;
+const byte otaOpInsert = 2;
+const uint16_t otaPageSize = 4096;      // target bytes collected per flash write
+
+struct OtaHeader
+{
+    uint32_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t sourceSize;        // bytes of the running image the delta was made against
+    uint32_t targetSize;
+    uint8_t sourceSha[32];      // SHA-256 of those bytes
+    uint8_t targetSha[32];      // SHA-256 of the new image
+};
+
+// Class rebuilding a target image from the decompressed operation stream
+//
+// The stream is fed in pieces of any size as it is inflated, operation headers may be split
+// between pieces. Target bytes are collected into pages and handed to writeTarget(), source bytes
+// are fetched with readSource() straight into the page before the add bytes are applied, so
+// patching needs one page of memory. A derived class supplies the two.
+class DeltaPatcher
+{
+    public:
+
+    // Member Variables:
+    uint32_t written;           // target bytes produced
+    const char *error;          // why patching stopped, nullptr while it is going well
+
+    DeltaPatcher()
+    {
+        reset(0, 0);
+    }
+
+    virtual ~DeltaPatcher() {}
+
+    void reset(uint32_t sourceSize, uint32_t targetSize)
+    {
+        SourceSize = sourceSize;
+        TargetSize = targetSize;
+        Op = otaOpEnd;
+        FieldBytes = 0;
+        FieldNeeded = 0;
+        Remaining = 0;
+        SourceOffset = 0;
+        PageFill = 0;
+        Planned = 0;
+        Started = false;
+        Done = false;
+        written = 0;
+        error = nullptr;
+    }
+
+    // Apply the next piece of the operation stream, false once the stream is bad
+    bool feed(const uint8_t *data, size_t length)
+    {
+        while (length > 0 && error == nullptr)
+        {
+            if (Done)
+            {
+                return fail("data after the end");
+            }
+            if (Remaining > 0)
+            {
+                size_t n = min((size_t)Remaining, length);
+                if (!(Op == otaOpAdd ? add(data, n) : emit(data, n)))
+                {
+                    return false;
+                }
+                data += n;
+                length -= n;
+                Remaining -= n;
+                continue;
+            }
+
+            // Between operations: the type byte, then its fields
+            if (!Started)
+            {
+                Op = *data++;
+                length--;
+                Started = true;
+                FieldBytes = 0;
+                FieldNeeded = (Op == otaOpAdd) ? 8 : (Op == otaOpInsert) ? 4 : 0;
+                if (Op == otaOpEnd)
+                {
+                    Done = true;
+                    Started = false;
+                    continue;
+                }
+                if (FieldNeeded == 0)
+                {
+                    return fail("bad operation");
+                }
+            }
+            byte n = min((size_t)(FieldNeeded - FieldBytes), length);
+            memcpy(Field + FieldBytes, data, n);
+            FieldBytes += n;
+            data += n;
+            length -= n;
+            if (FieldBytes == FieldNeeded)
+            {
+                Started = false;
+                if (!beginOperation())
+                {
+                    return false;
+                }
+            }
+        }
+        return error == nullptr;
+    }
+
+    // Write the last partial page, true when the stream ended with exactly the target image
+    bool finish()
+    {
+        if (error)
+        {
+            return false;
+        }
+        if (!Done || Remaining > 0 || written != TargetSize)
+        {
+            return fail("stream ended early");
+        }
+        if (PageFill > 0 && !writeTarget(Page, PageFill))
+        {
+            return fail("target write failed");
+        }
+        PageFill = 0;
+        return true;
+    }
+
+    protected:
+
+    // Read len bytes of the source image at offset into buffer
+    virtual bool readSource(uint32_t offset, uint8_t *buffer, size_t len) = 0;
+    // Append len bytes to the target image
+    virtual bool writeTarget(const uint8_t *buffer, size_t len) = 0;
+
+    bool fail(const char *why)
+    {
+        if (error == nullptr)
+        {
+            error = why;
+        }
+        return false;
+    }
+
+    private:
+
+    uint32_t SourceSize;
+    uint32_t TargetSize;
+    uint8_t Op;
+    uint8_t Field[8];
+    byte FieldBytes;
+    byte FieldNeeded;
+    bool Started;               // type byte read, fields still coming
+    bool Done;                  // end operation seen
+    uint32_t Remaining;         // bytes left in the current operation
+    uint32_t SourceOffset;      // next source byte of an add operation
+    uint32_t Planned;           // target bytes covered by the operations read so far
+    uint16_t PageFill;
+    uint8_t Page[otaPageSize];
+
+    static uint32_t le32(const uint8_t *p)
+    {
+        return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    bool beginOperation()
+    {
+        if (Op == otaOpAdd)
+        {
+            SourceOffset = le32(Field);
+            Remaining = le32(Field + 4);
+            if (SourceOffset > SourceSize || Remaining > SourceSize - SourceOffset)
+            {
+                return fail("add outside the source");
+            }
+        }
+        else
+        {
+            Remaining = le32(Field);
+        }
+        if (Remaining > TargetSize - Planned)
+        {
+            return fail("target too long");
+        }
+        Planned += Remaining;
+        return true;
+    }
+
+    bool flushPage()
+    {
+        if (PageFill == otaPageSize)
+        {
+            if (!writeTarget(Page, PageFill))
+            {
+                return fail("target write failed");
+            }
+            PageFill = 0;
+        }
+        return true;
+    }
+
+    bool emit(const uint8_t *data, size_t n)
+    {
+        while (n > 0)
+        {
+            size_t chunk = min(n, (size_t)(otaPageSize - PageFill));
+            memcpy(Page + PageFill, data, chunk);
+            PageFill += chunk;
+            written += chunk;
+            data += chunk;
+            n -= chunk;
+            if (!flushPage())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool add(const uint8_t *data, size_t n)
+    {
+        while (n > 0)
+        {
+            size_t chunk = min(n, (size_t)(otaPageSize - PageFill));
+            uint8_t *out = Page + PageFill;
+            if (!readSource(SourceOffset, out, chunk))
+            {
+                return fail("source read failed");
+            }
+            for (size_t i = 0; i < chunk; i++)
+            {
+                out[i] += data[i];
+            }
+            SourceOffset += chunk;
+            PageFill += chunk;
+            written += chunk;
+            data += chunk;
+            n -= chunk;
+            if (!flushPage())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif
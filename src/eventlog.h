@@ -0,0 +1,551 @@
+#ifndef EventLog_h
+#define EventLog_h
+
+#include <Arduino.h>
+#include <FS.h>
+#include <LittleFS.h>
+#include "mqttqueue.h"
+
+// Events are kept in two segment files used in turn. When the active segment is full the
+// other one is deleted and reused, so the log holds between one and two segments of history.
+const char *eventLogSegments[2] = {"/events0.bin", "/events1.bin"};
+const char *eventLogAckPath = "/events.ack";
+const uint16_t eventLogSegmentRecords = 128;    // records per segment file
+const byte eventLogStageSize = 8;               // records held in RAM before they are written
+const unsigned long eventLogStageMillis = 2000; // longest a record waits in RAM
+const unsigned long eventLogAckSaveMillis = 2000;   // shortest interval between saves of the ack position
+const byte eventLogWindow = 8;                  // events sent and not yet acknowledged
+const unsigned long eventLogAckTimeout = 5000;  // milliseconds before unacknowledged events are sent again
+const uint8_t eventLogUidFlag = 0x80;           // set in the stored code when data holds a UID
+const uint32_t eventLogSeqReserve = 256;        // sequence numbers reserved in flash at a time
+
+// Acknowledged position and sequence reservation, saved in eventLogAckPath
+struct EventLogState
+{
+    uint32_t ackedThrough;
+    uint32_t seqLimit;      // no sequence number at or above this has been used
+};
+
+// One logged event as stored in flash
+struct EventRecord
+{
+    uint32_t seq;
+    uint32_t millis;
+    uint8_t code;
+    uint8_t index;
+    uint8_t data[8];    // value (little endian) or tag UID
+    uint16_t check;     // Fletcher-16 over the fields above, catches a torn write
+};
+
+// Cost of logging and replay
+struct EventLogStats
+{
+    unsigned long logged;           // events appended
+    unsigned long ackedInRam;       // events acknowledged before they had to be written
+    unsigned long flashRecords;     // records written to flash
+    unsigned long flashBytes;       // bytes handed to the file system (records and ack position)
+    unsigned long syncs;            // file open, write, close cycles
+    unsigned long writeMicros;      // time spent in those cycles
+    unsigned long sent;             // event messages queued for the host
+    unsigned long resent;           // of which were sent again after a timeout or reconnect
+    unsigned long lost;             // unacknowledged events overwritten by a full log
+    unsigned long replayEvents;     // events acknowledged during the last replay
+    unsigned long replayMillis;     // duration of the last replay
+};
+
+// Class keeping every event until the host acknowledges it
+//
+// Messages are only published at QoS0, so delivery is acknowledged by the application: each
+// event carries a sequence number and the host answers "ack <seq>" on the device topic, which
+// acknowledges every event up to seq. A window of events is sent at a time and sent again if the
+// acknowledgement does not arrive, so each event reaches the host at least once.
+//
+// New events wait in RAM first. While the broker is reachable they are normally acknowledged
+// there and never written to flash. Records still unacknowledged after a short while (or when
+// the staging area fills) are appended to the active segment, so events that happen while the
+// broker is unreachable survive a power cut and are replayed when the connection returns.
+class EventLog
+{
+    public:
+
+    // Member Variables:
+    EventLogStats stats;
+
+    EventLog(MqttQueue &outbox, const char *topic)
+    : Outbox(outbox)
+    {
+        Topic = topic;
+        memset(&stats, 0, sizeof(stats));
+        NextSeq = 1;
+        AckedThrough = 0;
+        SavedAck = 0;
+        SendNext = 1;
+        Staged = 0;
+        StagedSince = 0;
+        LastAckSave = 0;
+        LastProgress = 0;
+        Active = 0;
+        First[0] = First[1] = 0;
+        Count[0] = Count[1] = 0;
+        Online = false;
+        Replaying = false;
+        ReplayStart = 0;
+        ReplayBacklog = 0;
+        HighestSent = 0;
+        SeqLimit = 0;
+        GapFrom = 0;
+        GapTo = 0;
+    }
+
+    // Recover the segments and the acknowledged position after a reboot
+    void begin()
+    {
+        EventLogState state = {0, 0};
+        File ack = LittleFS.open(eventLogAckPath, "r");
+        if (ack)
+        {
+            ack.read((uint8_t *)&state, sizeof(state));
+            ack.close();
+        }
+        AckedThrough = state.ackedThrough;
+        SavedAck = AckedThrough;
+        uint32_t last = AckedThrough;
+        for (byte s = 0; s < 2; s++)
+        {
+            scanSegment(s);
+            if (Count[s] > 0)
+            {
+                last = max(last, First[s] + Count[s] - 1);
+                if (First[s] > First[Active] || Count[Active] == 0)
+                {
+                    Active = s;
+                }
+            }
+        }
+
+        // Events acknowledged in RAM before the reboot never reached flash, so carry on after
+        // the reserved numbers rather than reuse theirs. The numbers skipped count as
+        // acknowledged once everything before them is.
+        NextSeq = max(last + 1, state.seqLimit);
+        if (AckedThrough >= last)
+        {
+            AckedThrough = NextSeq - 1;
+        }
+        else if (NextSeq > last + 1)
+        {
+            GapFrom = last + 1;
+            GapTo = NextSeq - 1;
+        }
+        SendNext = AckedThrough + 1;
+        reserve();
+        Serial.print(F("Event log: "));
+        Serial.print(backlog());
+        Serial.println(F(" events waiting for the host"));
+    }
+
+    // Record an event, value is ignored when a UID is given
+    void append(uint8_t code, uint8_t index, uint32_t value, const uint8_t *uid = nullptr)
+    {
+        if (Staged == eventLogStageSize)
+        {
+            sync();
+        }
+        if (NextSeq >= SeqLimit)
+        {
+            reserve();
+        }
+        EventRecord &record = Stage[Staged++];
+        record.seq = NextSeq++;
+        record.millis = millis();
+        record.code = code | (uid ? eventLogUidFlag : 0);
+        record.index = index;
+        if (uid)
+        {
+            memcpy(record.data, uid, 8);
+        }
+        else
+        {
+            memset(record.data, 0, 8);
+            for (byte i = 0; i < 4; i++)
+            {
+                record.data[i] = (value >> (8 * i)) & 0xFF;
+            }
+        }
+        record.check = checksum(record);
+        if (Staged == 1)
+        {
+            StagedSince = millis();
+        }
+        stats.logged++;
+    }
+
+    // Host acknowledged every event up to seq
+    void ack(uint32_t seq)
+    {
+        if (seq <= AckedThrough || seq >= NextSeq)
+        {
+            return;
+        }
+        advance(seq);
+        LastProgress = millis();
+        if (Replaying)
+        {
+            stats.replayEvents = ReplayBacklog - min(backlog(), ReplayBacklog);
+        }
+
+        // Drop staged records that no longer need to reach flash
+        byte done = 0;
+        while (done < Staged && Stage[done].seq <= AckedThrough)
+        {
+            done++;
+        }
+        if (done)
+        {
+            stats.ackedInRam += done;
+            memmove(Stage, &Stage[done], (Staged - done) * sizeof(EventRecord));
+            Staged -= done;
+            StagedSince = millis();
+        }
+    }
+
+    // Called once per loop: writes staged records that waited long enough, sends the next
+    // window of events and resends after a timeout
+    void update(bool online)
+    {
+        unsigned long now = millis();
+        if (Staged && now - StagedSince >= eventLogStageMillis)
+        {
+            sync();
+        }
+        if (ackInFlash() && (backlog() == 0 || now - LastAckSave >= eventLogAckSaveMillis))
+        {
+            saveAck();
+        }
+
+        if (online && !Online)
+        {
+            // Connection is back, start again from the first unacknowledged event
+            SendNext = AckedThrough + 1;
+            LastProgress = now;
+            Replaying = backlog() > 0;
+            ReplayStart = now;
+            ReplayBacklog = backlog();
+            stats.replayEvents = 0;
+        }
+        Online = online;
+        if (!online)
+        {
+            return;
+        }
+        if (Replaying && backlog() == 0)
+        {
+            Replaying = false;
+            stats.replayMillis = now - ReplayStart;
+        }
+
+        if (SendNext > AckedThrough + 1 && now - LastProgress > eventLogAckTimeout)
+        {
+            SendNext = AckedThrough + 1;    // go back and send the window again
+            LastProgress = now;
+        }
+        while (SendNext < NextSeq && SendNext - AckedThrough <= eventLogWindow)
+        {
+            EventRecord record;
+            if (!read(SendNext, record))
+            {
+                SendNext++;     // unreadable, the host acknowledges past it
+                continue;
+            }
+            if (!send(record))
+            {
+                break;          // outbound queue full, try again next loop
+            }
+            if (SendNext == AckedThrough + 1)
+            {
+                LastProgress = now;
+            }
+            SendNext++;
+        }
+    }
+
+    // Events the host has not acknowledged yet
+    uint32_t backlog()
+    {
+        uint32_t waiting = NextSeq - 1 - AckedThrough;
+        return GapFrom ? waiting - (GapTo - GapFrom + 1) : waiting;
+    }
+
+    void printStats()
+    {
+        Serial.print(F("Event log: "));
+        Serial.print(stats.logged);
+        Serial.print(F(" events, "));
+        Serial.print(backlog());
+        Serial.print(F(" waiting, "));
+        Serial.print(stats.ackedInRam);
+        Serial.print(F(" acked in RAM, "));
+        Serial.print(stats.flashRecords);
+        Serial.print(F(" written to flash ("));
+        Serial.print(stats.flashBytes);
+        Serial.print(F(" bytes in "));
+        Serial.print(stats.syncs);
+        Serial.print(F(" writes, "));
+        Serial.print(stats.syncs ? stats.writeMicros / stats.syncs : 0);
+        Serial.print(F(" us each, "));
+        Serial.print(stats.logged ? stats.flashBytes * 100 / (stats.logged * sizeof(EventRecord)) : 0);
+        Serial.println(F("% of event bytes)"));
+        Serial.print(F("Event replay: "));
+        Serial.print(stats.sent);
+        Serial.print(F(" sent, "));
+        Serial.print(stats.resent);
+        Serial.print(F(" resent, "));
+        Serial.print(stats.lost);
+        Serial.print(F(" lost, last replay "));
+        Serial.print(stats.replayEvents);
+        Serial.print(F(" events in "));
+        Serial.print(stats.replayMillis);
+        Serial.print(F(" ms ("));
+        Serial.print(stats.replayMillis ? stats.replayEvents * 1000 / stats.replayMillis : 0);
+        Serial.println(F(" events/s)"));
+    }
+
+    private:
+
+    MqttQueue &Outbox;
+    const char *Topic;
+    EventRecord Stage[eventLogStageSize];
+    byte Staged;
+    unsigned long StagedSince;
+    uint32_t NextSeq;           // sequence number of the next event
+    uint32_t AckedThrough;      // every event up to here is acknowledged
+    uint32_t SavedAck;          // AckedThrough as last written to flash
+    uint32_t SendNext;          // next event to send
+    uint32_t ReplayBacklog;     // events waiting when the connection came back
+    uint32_t First[2];          // sequence number of the first record in each segment
+    uint16_t Count[2];          // records in each segment
+    byte Active;                // segment being appended to
+    unsigned long LastAckSave;
+    unsigned long LastProgress; // millis() of the last acknowledgement or window start
+    unsigned long ReplayStart;
+    uint32_t HighestSent;       // to tell resends from first sends
+    uint32_t SeqLimit;          // end of the sequence numbers reserved in flash
+    uint32_t GapFrom;           // sequence numbers skipped after a reboot, 0 when none
+    uint32_t GapTo;
+    bool Online;
+    bool Replaying;
+
+    static uint16_t checksum(const EventRecord &record)
+    {
+        const uint8_t *p = (const uint8_t *)&record;
+        uint16_t a = 0, b = 0;
+        for (byte i = 0; i < sizeof(EventRecord) - sizeof(record.check); i++)
+        {
+            a = (a + p[i]) % 255;
+            b = (b + a) % 255;
+        }
+        return (b << 8) | a;
+    }
+
+    // Find the sequence range of a segment, ignoring a torn record at the end
+    void scanSegment(byte s)
+    {
+        First[s] = 0;
+        Count[s] = 0;
+        File file = LittleFS.open(eventLogSegments[s], "r");
+        if (!file)
+        {
+            return;
+        }
+        uint16_t records = file.size() / sizeof(EventRecord);
+        EventRecord record;
+        while (records > 0)
+        {
+            file.seek((records - 1) * sizeof(EventRecord));
+            if (file.read((uint8_t *)&record, sizeof(record)) == sizeof(record) && record.check == checksum(record))
+            {
+                break;
+            }
+            records--;
+        }
+        if (records > 0)
+        {
+            file.seek(0);
+            file.read((uint8_t *)&record, sizeof(record));
+            First[s] = record.seq;
+            Count[s] = records;
+        }
+        file.close();
+    }
+
+    // Append the staged records to flash
+    void sync()
+    {
+        unsigned long started = micros();
+        byte written = 0;
+        while (written < Staged)
+        {
+            if (Count[Active] == eventLogSegmentRecords)
+            {
+                rotate();
+            }
+            byte n = min((uint16_t)(Staged - written), (uint16_t)(eventLogSegmentRecords - Count[Active]));
+            File file = LittleFS.open(eventLogSegments[Active], "a");
+            if (!file)
+            {
+                break;
+            }
+            size_t bytes = file.write((const uint8_t *)&Stage[written], n * sizeof(EventRecord));
+            file.close();
+            stats.syncs++;
+            stats.flashBytes += bytes;
+            if (Count[Active] == 0)
+            {
+                First[Active] = Stage[written].seq;
+            }
+            Count[Active] += n;
+            written += n;
+        }
+        stats.flashRecords += written;
+        stats.writeMicros += micros() - started;
+        Staged = 0;
+    }
+
+    // Start over in the other segment, dropping what it held
+    void rotate()
+    {
+        byte other = 1 - Active;
+        if (Count[other] > 0)
+        {
+            uint32_t last = First[other] + Count[other] - 1;
+            if (last > AckedThrough)
+            {
+                // Never delivered and now gone, stop waiting for them
+                stats.lost += last - max(AckedThrough, First[other] - 1);
+                advance(last);
+            }
+        }
+        LittleFS.remove(eventLogSegments[other]);
+        Count[other] = 0;
+        Active = other;
+    }
+
+    // Move the acknowledged position forward, over the numbers skipped after a reboot
+    void advance(uint32_t seq)
+    {
+        AckedThrough = seq;
+        if (GapFrom && AckedThrough + 1 >= GapFrom)
+        {
+            AckedThrough = max(AckedThrough, GapTo);
+            GapFrom = 0;
+        }
+        if (SendNext <= AckedThrough)
+        {
+            SendNext = AckedThrough + 1;
+        }
+    }
+
+    // Whether an acknowledgement covers records in flash that the saved position does not.
+    // Acknowledging events that only ever lived in RAM costs no flash write.
+    bool ackInFlash()
+    {
+        for (byte s = 0; s < 2; s++)
+        {
+            if (Count[s] > 0 && First[s] <= AckedThrough && First[s] + Count[s] - 1 > SavedAck)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Reserve the next block of sequence numbers
+    void reserve()
+    {
+        SeqLimit = NextSeq + eventLogSeqReserve;
+        saveAck();
+    }
+
+    void saveAck()
+    {
+        unsigned long started = micros();
+        EventLogState state = {AckedThrough, SeqLimit};
+        File file = LittleFS.open(eventLogAckPath, "w");
+        if (file)
+        {
+            stats.flashBytes += file.write((const uint8_t *)&state, sizeof(state));
+            file.close();
+            stats.syncs++;
+            SavedAck = AckedThrough;
+        }
+        stats.writeMicros += micros() - started;
+        LastAckSave = millis();
+
+        // A segment holding only acknowledged events is no longer needed
+        for (byte s = 0; s < 2; s++)
+        {
+            if (s != Active && Count[s] > 0 && First[s] + Count[s] - 1 <= AckedThrough)
+            {
+                LittleFS.remove(eventLogSegments[s]);
+                Count[s] = 0;
+            }
+        }
+    }
+
+    // Fetch an event from RAM or flash
+    bool read(uint32_t seq, EventRecord &record)
+    {
+        if (Staged && seq >= Stage[0].seq)
+        {
+            record = Stage[seq - Stage[0].seq];
+            return true;
+        }
+        for (byte s = 0; s < 2; s++)
+        {
+            if (Count[s] > 0 && seq >= First[s] && seq < First[s] + Count[s])
+            {
+                File file = LittleFS.open(eventLogSegments[s], "r");
+                if (!file)
+                {
+                    return false;
+                }
+                file.seek((seq - First[s]) * sizeof(EventRecord));
+                bool ok = file.read((uint8_t *)&record, sizeof(record)) == sizeof(record);
+                file.close();
+                return ok && record.check == checksum(record);
+            }
+        }
+        return false;
+    }
+
+    // Queue one event for the host as "<seq> <millis> <code> <index> <value or uid>"
+    bool send(const EventRecord &record)
+    {
+        char message[64];
+        int len = sprintf(message, "%lu %lu %u %u ", (unsigned long)record.seq, (unsigned long)record.millis, record.code & ~eventLogUidFlag, record.index);
+        if (record.code & eventLogUidFlag)
+        {
+            for (byte i = 0; i < 8; i++)
+            {
+                len += sprintf(&message[len], "%02X", record.data[i]);
+            }
+        }
+        else
+        {
+            uint32_t value = record.data[0] | (record.data[1] << 8) | ((uint32_t)record.data[2] << 16) | ((uint32_t)record.data[3] << 24);
+            len += sprintf(&message[len], "%lu", (unsigned long)value);
+        }
+        if (!Outbox.publish(Topic, (const uint8_t *)message, len))
+        {
+            return false;
+        }
+        stats.sent++;
+        if (record.seq <= HighestSent)
+        {
+            stats.resent++;
+        }
+        HighestSent = max(HighestSent, record.seq);
+        return true;
+    }
+};
+
+#endif
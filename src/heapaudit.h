@@ -0,0 +1,453 @@
+#ifndef HeapAudit_h
+#define HeapAudit_h
+
+#include "native_hal.h"
+
+// Heap allocation audit: who allocates, how much, and does anything allocate once the prop is
+// running?
+//
+//      HEAP_SCOPE(logRfid);        this task's allocations until the scope exits are rfid's
+//
+// The nodemcu-32s-heapaudit build in platformio.ini defines HEAP_AUDIT and links with --wrap for
+// malloc, calloc, realloc and free, so those calls, operator new and String included, go through
+// the hooks at the bottom of this file. Each allocation is counted against a subsystem (the log
+// modules of binlog.h): the innermost HEAP_SCOPE of the calling task, or else the subsystem
+// its task belongs to by name (heapTaskModules). Memory the SDK takes with heap_caps_malloc()
+// directly is not seen.
+//
+// lock() at the end of setup() starts the steady state. From then on an allocation by the task
+// that called it (loop()) is a violation. Each call site is kept once in a small table with
+// its return address, size and count; loop() reports new ones as warnings and eventHeap
+// telemetry events. In strict mode a violation aborts, so the panic backtrace names the caller.
+//
+// heapAuditSample() refreshes the heap.* counters and the stack.* high-water marks (bytes never used)
+// of the tasks in heapStackTasks, which are published with the other metrics.
+
+const byte heapAuditTasks = 16;         // tasks with their own subsystem and scope
+const byte heapAuditSites = 8;          // distinct call sites that allocated after setup
+const uint8_t heapNoScope = 0xFF;
+
+// An allocation site after setup()
+struct HeapSite
+{
+    uint32_t caller;                // return address into the allocating function
+    uint32_t size;                  // bytes asked for the first time
+    uint32_t count;
+    uint8_t module;
+    bool reported;
+};
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(HEAP_AUDIT)
+
+#include <atomic>
+#include "binlog.h"
+#include "metrics.h"
+
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t count, size_t size);
+extern "C" void *__real_realloc(void *ptr, size_t size);
+extern "C" void __real_free(void *ptr);
+
+#define HEAP_CONCAT2(a, b) a##b
+#define HEAP_CONCAT(a, b) HEAP_CONCAT2(a, b)
+#define HEAP_SCOPE(module) HeapScope HEAP_CONCAT(heapScope, __LINE__)(module)
+
+// Subsystem of a task that has no HEAP_SCOPE open, by the start of its name
+struct HeapTaskModule
+{
+    const char *prefix;
+    logModule module;
+};
+
+const HeapTaskModule heapTaskModules[] = {
+    {"loopTask", logPuzzle}, {"mqtt", logNet}, {"async_tcp", logNet}, {"tiT", logNet},
+    {"wifi", logNet}, {"sys_evt", logNet}, {"ota", logOta}, {"assets", logOta},
+};
+
+// A task's subsystem and open scope. Only the task itself reads or writes its entry after
+// claiming it, and gives it back with heapTaskExit() if it deletes itself.
+struct HeapTask
+{
+    std::atomic<TaskHandle_t> task;
+    uint8_t module;
+    uint8_t scope;
+};
+
+// Class holding the allocation counts. It has no constructor: the hooks run before static
+// constructors do, so it must be ready as soon as it is zeroed.
+class HeapAudit
+{
+    public:
+
+    // Member Variables:
+    std::atomic<uint32_t> allocs;
+    std::atomic<uint32_t> bytes;
+    std::atomic<uint32_t> frees;
+    std::atomic<uint32_t> failed;           // the heap had no block that size
+    std::atomic<uint32_t> afterSetup;       // violations, see lock()
+    std::atomic<uint32_t> moduleAllocs[numLogModules];
+    std::atomic<uint32_t> moduleBytes[numLogModules];
+    volatile bool strict;                   // abort on a violation
+
+    // Make every later allocation by the calling task a violation
+    void lock()
+    {
+        Watched = xTaskGetCurrentTaskHandle();
+    }
+
+    void unlock()
+    {
+        Watched = nullptr;
+    }
+
+    bool locked() { return Watched != nullptr; }
+
+    // Count an allocation, from the hooks
+    void allocated(void *ptr, size_t size, void *caller)
+    {
+        if (!ptr)
+        {
+            failed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        TaskHandle_t task = xTaskGetCurrentTaskHandle();
+        uint8_t module = logSystem;
+        if (task)
+        {
+            HeapTask *entry = find(task);
+            if (entry)
+            {
+                module = entry->scope != heapNoScope ? entry->scope : entry->module;
+            }
+        }
+        allocs.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+        moduleAllocs[module].fetch_add(1, std::memory_order_relaxed);
+        moduleBytes[module].fetch_add(size, std::memory_order_relaxed);
+        if (task && task == Watched)
+        {
+            violation((uint32_t)(uintptr_t)caller, size, module);
+        }
+    }
+
+    void freed(void *ptr)
+    {
+        if (ptr)
+        {
+            frees.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Open a scope on the calling task, the previous scope to restore
+    uint8_t enter(uint8_t module)
+    {
+        HeapTask *entry = find(xTaskGetCurrentTaskHandle());
+        if (!entry)
+        {
+            return heapNoScope;
+        }
+        uint8_t previous = entry->scope;
+        entry->scope = module;
+        return previous;
+    }
+
+    void leave(uint8_t previous)
+    {
+        HeapTask *entry = find(xTaskGetCurrentTaskHandle());
+        if (entry)
+        {
+            entry->scope = previous;
+        }
+    }
+
+    // Give the calling task's entry back, so the next task to allocate can claim it
+    void release()
+    {
+        TaskHandle_t task = xTaskGetCurrentTaskHandle();
+        for (byte t = 0; t < heapAuditTasks; t++)
+        {
+            if (Tasks[t].task.load(std::memory_order_acquire) == task)
+            {
+                Tasks[t].task.store(nullptr, std::memory_order_release);
+                return;
+            }
+        }
+    }
+
+    // The next call site that allocated after setup and was not reported yet. Called from loop().
+    HeapSite *unreported()
+    {
+        for (byte s = 0; s < heapAuditSites; s++)
+        {
+            if (Sites[s].count && !Sites[s].reported)
+            {
+                Sites[s].reported = true;
+                return &Sites[s];
+            }
+        }
+        return nullptr;
+    }
+
+    void printStats()
+    {
+        Serial.print(F("Heap: "));
+        Serial.print(allocs.load());
+        Serial.print(F(" allocations, "));
+        Serial.print(bytes.load());
+        Serial.print(F(" bytes, "));
+        Serial.print(frees.load());
+        Serial.print(F(" frees, "));
+        Serial.print(failed.load());
+        Serial.print(F(" failed, "));
+        Serial.print(afterSetup.load());
+        Serial.print(F(" after setup"));
+        Serial.println(strict ? F(" (strict)") : (locked() ? F("") : F(" (not locked)")));
+        for (byte m = 0; m < numLogModules; m++)
+        {
+            Serial.print(F("  "));
+            Serial.print(logModuleNames[m]);
+            Serial.print(F(": "));
+            Serial.print(moduleAllocs[m].load());
+            Serial.print(F(" allocations, "));
+            Serial.print(moduleBytes[m].load());
+            Serial.println(F(" bytes"));
+        }
+        for (byte s = 0; s < heapAuditSites; s++)
+        {
+            if (Sites[s].count)
+            {
+                char line[80];
+                snprintf(line, sizeof(line), "  after setup: %lu x %lu bytes from 0x%08lx (%s)", (unsigned long)Sites[s].count,
+                    (unsigned long)Sites[s].size, (unsigned long)Sites[s].caller, logModuleNames[Sites[s].module]);
+                Serial.println(line);
+            }
+        }
+    }
+
+    private:
+
+    HeapTask Tasks[heapAuditTasks];
+    HeapSite Sites[heapAuditSites];
+    TaskHandle_t volatile Watched;
+
+    // The calling task's entry, claimed on first use. A task that is created again for each
+    // job (ota, assets) releases its entry when it ends, or the table would fill up.
+    HeapTask *find(TaskHandle_t task)
+    {
+        for (byte t = 0; t < heapAuditTasks; t++)
+        {
+            TaskHandle_t owner = Tasks[t].task.load(std::memory_order_acquire);
+            if (owner == task)
+            {
+                return &Tasks[t];
+            }
+            if (owner == nullptr && Tasks[t].task.compare_exchange_strong(owner, task))
+            {
+                Tasks[t].module = moduleOf(pcTaskGetName(task));
+                Tasks[t].scope = heapNoScope;
+                return &Tasks[t];
+            }
+        }
+        return nullptr;
+    }
+
+    static uint8_t moduleOf(const char *name)
+    {
+        for (const HeapTaskModule &m : heapTaskModules)
+        {
+            if (strncmp(name, m.prefix, strlen(m.prefix)) == 0)
+            {
+                return m.module;
+            }
+        }
+        return logSystem;
+    }
+
+    // Only the watched task gets here, so the site table has a single writer
+    void violation(uint32_t caller, uint32_t size, uint8_t module)
+    {
+        afterSetup.fetch_add(1, std::memory_order_relaxed);
+        if (strict)
+        {
+            abort();
+        }
+        for (byte s = 0; s < heapAuditSites; s++)
+        {
+            HeapSite &site = Sites[s];
+            if (site.count == 0 || site.caller == caller)
+            {
+                if (site.count == 0)
+                {
+                    site.caller = caller;
+                    site.size = size;
+                    site.module = module;
+                }
+                site.count++;
+                return;
+            }
+        }
+    }
+};
+
+HeapAudit heapAudit;
+
+// End the calling task, instead of vTaskDelete(nullptr), so its entry can be reused
+void heapTaskExit()
+{
+    heapAudit.release();
+    vTaskDelete(nullptr);
+}
+
+// Heap scope for the enclosing block, see HEAP_SCOPE
+class HeapScope
+{
+    public:
+
+    HeapScope(uint8_t module)
+    {
+        Previous = heapAudit.enter(module);
+    }
+
+    ~HeapScope()
+    {
+        heapAudit.leave(Previous);
+    }
+
+    private:
+
+    uint8_t Previous;
+};
+
+// Published with the other metrics, brought up to date by heapAuditSample()
+MetricCounter heapAllocs("heap.allocs");
+MetricCounter heapBytes("heap.alloc_bytes");
+MetricCounter heapFrees("heap.frees");
+MetricCounter heapFailed("heap.failed");
+MetricCounter heapAfterSetup("heap.after_setup");
+MetricCounter heapModuleAllocs[numLogModules] = {
+    {"heap.allocs.system"}, {"heap.allocs.puzzle"}, {"heap.allocs.rfid"},
+    {"heap.allocs.net"}, {"heap.allocs.lights"}, {"heap.allocs.ota"},
+};
+
+// Stack high-water marks, by task name
+struct HeapStackTask
+{
+    const char *task;
+    MetricGauge gauge;
+};
+
+HeapStackTask heapStackTasks[] = {
+    {"loopTask", {"stack.loop"}}, {"log", {"stack.log"}}, {"mqtt", {"stack.mqtt"}},
+    {"async_tcp", {"stack.async_tcp"}}, {"tiT", {"stack.tcpip"}},
+};
+
+// Bring a counter up to a running total kept elsewhere
+void heapSync(MetricCounter &counter, uint32_t total)
+{
+    counter.add(total - counter.value());
+}
+
+// Update the heap and stack metrics. Looking tasks up by name is slow, call it at the metrics rate.
+void heapAuditSample()
+{
+    heapSync(heapAllocs, heapAudit.allocs.load());
+    heapSync(heapBytes, heapAudit.bytes.load());
+    heapSync(heapFrees, heapAudit.frees.load());
+    heapSync(heapFailed, heapAudit.failed.load());
+    heapSync(heapAfterSetup, heapAudit.afterSetup.load());
+    for (byte m = 0; m < numLogModules; m++)
+    {
+        heapSync(heapModuleAllocs[m], heapAudit.moduleAllocs[m].load());
+    }
+    for (HeapStackTask &t : heapStackTasks)
+    {
+        TaskHandle_t task = xTaskGetHandle(t.task);
+        t.gauge.set(task ? uxTaskGetStackHighWaterMark(task) : 0);
+    }
+}
+
+void printStacks()
+{
+    Serial.print(F("Stack never used:"));
+    for (HeapStackTask &t : heapStackTasks)
+    {
+        Serial.print(' ');
+        Serial.print(t.task);
+        Serial.print('=');
+        Serial.print(t.gauge.value());
+    }
+    Serial.println();
+}
+
+// The hooks --wrap sends the C heap calls to
+extern "C" void *__wrap_malloc(size_t size)
+{
+    void *ptr = __real_malloc(size);
+    heapAudit.allocated(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
+
+extern "C" void *__wrap_calloc(size_t count, size_t size)
+{
+    void *ptr = __real_calloc(count, size);
+    heapAudit.allocated(ptr, count * size, __builtin_return_address(0));
+    return ptr;
+}
+
+extern "C" void *__wrap_realloc(void *ptr, size_t size)
+{
+    void *moved = __real_realloc(ptr, size);
+    if (size == 0)
+    {
+        heapAudit.freed(ptr);
+    }
+    else
+    {
+        heapAudit.allocated(moved, size, __builtin_return_address(0));
+    }
+    return moved;
+}
+
+extern "C" void __wrap_free(void *ptr)
+{
+    heapAudit.freed(ptr);
+    __real_free(ptr);
+}
+
+#else
+
+#define HEAP_SCOPE(module) do {} while (0)
+
+// Stands in for the audit when the firmware is built without the heap hooks
+class HeapAudit
+{
+    public:
+
+    bool strict = false;
+
+    void lock() {}
+    void unlock() {}
+    bool locked() { return false; }
+    HeapSite *unreported() { return nullptr; }
+
+    void printStats()
+    {
+        Serial.println(F("Heap: audit not built in (HEAP_AUDIT)"));
+    }
+};
+
+HeapAudit heapAudit;
+
+#ifdef ARDUINO_ARCH_ESP32
+void heapTaskExit()
+{
+    vTaskDelete(nullptr);
+}
+#endif
+
+void heapAuditSample() {}
+void printStacks() {}
+
+#endif
+
+#endif
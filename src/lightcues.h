@@ -0,0 +1,752 @@
+#ifndef LightCues_h
+#define LightCues_h
+
+#include <Arduino.h>
+#include "lights.h"
+#include "commands.h"
+#include "mqttqueue.h"
+#include "netclock.h"
+#include "assets.h"
+
+// Light cues from the game master
+//
+// "light <strip> <pattern> key=value ..." starts any NeoPatterns pattern on a segment of a strip
+// without a reflash. A command is checked completely before anything changes, so a bad parameter
+// leaves every strip as it was and is answered with "light error <reason>" on the host topic.
+//
+// Checked cues wait in one slot per strip, a newer cue replacing one that has not started yet.
+// update() runs just before the strips draw their frames in loop(), so cues start between
+// frames, and a burst of commands costs at most one pattern change per strip per loop however
+// many arrive. Each topic the commands come in on has its own token bucket: once a topic has
+// used its burst, further commands on it are dropped until it refills, and the other topic keeps
+// working.
+//
+// A started cue holds its strip (NeoPatterns::Held): the puzzle's own light changes for that
+// strip are ignored until the cue is released, its "for" time runs out, or the puzzle is reset.
+// A strip that is a view over others (see pixelview.h) also holds the strips under it and stops
+// their patterns while its cue runs, so nothing else draws over it. The other way round, a cue
+// starting on a strip under a view stops the view's cue: the newest cue owns the pixels. "all"
+// means the strips that are not views.
+//
+// With an asset bundle (see assets.h), "frames asset=<name>" plays pre-rendered frames from it
+// and a color may be a palette entry, "color=<palette>:<index>".
+
+const byte maxCueStrips = 6;
+const byte cueTopics = 4;                   // topics rate limited separately
+const uint32_t cueRate = 4;                 // commands per second each topic may send
+const uint32_t cueBurst = 8;                // commands a topic may send at once
+const int cueIntervalMin = 5;               // ms between frames
+const int cueIntervalMax = 255;             // most patterns keep the interval in a byte
+const uint16_t cueRepsMax = 100;
+const unsigned long cueHoldMax = 3600000;   // longest "for", ms
+const unsigned long cueLead = 50;           // set an animation up this early for a timed start, ms
+
+enum cuePattern {cueOff, cueSolid, cueFlash, cueWipe, cueChase, cueRunning, cueWave, cueCylon, cueScanner, cueFade, cueAccel, cueFrames, cueRelease, cuePatterns};
+const char *const cueNames[cuePatterns] = {"off", "solid", "flash", "wipe", "chase", "running", "wave", "cylon", "scanner", "fade", "accel", "frames", "release"};
+
+// One checked cue for one strip
+struct LightCue
+{
+    cuePattern pattern;
+    uint32_t color1, color2;
+    int start, len;             // len 0 runs to the end of the strip
+    int interval;
+    int eye, reps, tail;
+    direction dir;
+    bool timed;                 // start at startAt rather than on the next loop
+    unsigned long startAt;      // millis()
+    unsigned long holdFor;      // ms, 0 to hold until released
+    const uint8_t *frames;      // frames of a frame sequence, in the asset bundle
+    uint16_t frameCount, frameWidth;
+};
+
+// Rate limit of one topic, tokens in thousandths of a command
+struct CueBucket
+{
+    uint32_t topicHash;
+    uint32_t tokens;
+    unsigned long refilled;
+    unsigned long lastUsed;
+    bool inUse;
+    bool warned;                // "light limited" sent since the bucket ran dry
+};
+
+// Class turning "light" commands into patterns on the strips
+class LightCues
+{
+    public:
+
+    // Member Variables:
+    unsigned long received;         // light commands seen
+    unsigned long applied;          // cues started on a strip
+    unsigned long replaced;         // cues replaced by a newer one before they started
+    unsigned long limited;          // commands dropped by the rate limit
+    unsigned long rejected;         // commands with bad parameters
+    unsigned long maxApplyMicros;   // longest update() that started cues
+
+    LightCues(NeoPatterns *const *strips, byte count, MqttQueue &queue, const char *replyTopic,
+        const AssetBundle *assets = nullptr)
+    : Queue(queue)
+    {
+        Strips = strips;
+        Assets = assets;
+        Count = min(count, maxCueStrips);
+        ReplyTopic = replyTopic;
+        received = 0;
+        applied = 0;
+        replaced = 0;
+        limited = 0;
+        rejected = 0;
+        maxApplyMicros = 0;
+        memset(Waiting, 0, sizeof(Waiting));
+        memset(Buckets, 0, sizeof(Buckets));
+    }
+
+    // Handle "light ..." (see the README for the parameters)
+    void command(CommandArgs &args)
+    {
+        received++;
+        if (args.is(0, "stats"))
+        {
+            printStats();
+            return;
+        }
+        if (!allow(args.topic()))
+        {
+            limited++;
+            return;
+        }
+
+        LightCue cue;
+        byte mask = 0;
+        const char *error = parse(args, cue, mask);
+        for (byte s = 0; s < Count && !error; s++)
+        {
+            if (mask & (1 << s))
+            {
+                LightCue check = cue;
+                error = fit(check, *Strips[s]);
+            }
+        }
+        if (error)
+        {
+            rejected++;
+            char reply[64];
+            snprintf(reply, sizeof(reply), "light error %s", error);
+            Queue.publish(ReplyTopic, reply);
+            return;
+        }
+
+        for (byte s = 0; s < Count; s++)
+        {
+            if (mask & (1 << s))
+            {
+                if (Waiting[s])
+                {
+                    replaced++;
+                }
+                Pending[s] = cue;
+                fit(Pending[s], *Strips[s]);
+                Waiting[s] = true;
+            }
+        }
+    }
+
+    // Start waiting cues and keep held strips on their cue, call once per loop just before the
+    // strips update
+    void update()
+    {
+        unsigned long started = micros();
+        bool changed = false;
+        for (byte s = 0; s < Count; s++)
+        {
+            NeoPatterns &strip = *Strips[s];
+            if (Waiting[s] && due(Pending[s]))
+            {
+                begin(s);
+                changed = true;
+            }
+            else if (strip.Held)
+            {
+                if (HoldFor[s] && (long)(millis() - HoldUntil[s]) >= 0)
+                {
+                    release(s);
+                    changed = true;
+                }
+                else if (strip.ActivePattern != HeldPattern[s])
+                {
+                    // The puzzle cleared the pattern directly, put the cue back
+                    strip.ActivePattern = HeldPattern[s];
+                }
+            }
+        }
+        if (changed)
+        {
+            maxApplyMicros = max(maxApplyMicros, micros() - started);
+        }
+    }
+
+    // Drop waiting cues and hand every strip back to the puzzle, on a reset
+    void releaseAll()
+    {
+        for (byte s = 0; s < Count; s++)
+        {
+            Waiting[s] = false;
+            if (Strips[s]->Held)
+            {
+                release(s);
+            }
+        }
+    }
+
+    // Stop the cues that read the asset bundle, before it is unmapped
+    void dropAssets()
+    {
+        for (byte s = 0; s < Count; s++)
+        {
+            if (Waiting[s] && Pending[s].pattern == cueFrames)
+            {
+                Waiting[s] = false;
+            }
+            if (Strips[s]->ActivePattern == frameSequence)
+            {
+                release(s);
+            }
+        }
+    }
+
+    void printStats()
+    {
+        Serial.print(F("Light cues: "));
+        Serial.print(received);
+        Serial.print(F(" received, "));
+        Serial.print(applied);
+        Serial.print(F(" applied, "));
+        Serial.print(replaced);
+        Serial.print(F(" replaced, "));
+        Serial.print(limited);
+        Serial.print(F(" rate limited, "));
+        Serial.print(rejected);
+        Serial.print(F(" rejected, apply max "));
+        Serial.print(maxApplyMicros);
+        Serial.print(F(" us, held"));
+        for (byte s = 0; s < Count; s++)
+        {
+            if (Strips[s]->Held)
+            {
+                Serial.print(' ');
+                Serial.print(s + 1);
+            }
+        }
+        Serial.println();
+    }
+
+    private:
+
+    NeoPatterns *const *Strips;
+    byte Count;
+    const AssetBundle *Assets;
+    MqttQueue &Queue;
+    const char *ReplyTopic;
+    LightCue Pending[maxCueStrips];
+    bool Waiting[maxCueStrips];
+    pattern HeldPattern[maxCueStrips];
+    unsigned long HoldFor[maxCueStrips];
+    unsigned long HoldUntil[maxCueStrips];
+    CueBucket Buckets[cueTopics];
+
+    // Take a token from the topic's bucket, false when it is empty
+    bool allow(const char *topic)
+    {
+        uint32_t h = 2166136261UL;
+        for (const char *p = topic; p && *p; p++)
+        {
+            h = (h ^ (uint8_t)*p) * 16777619UL;
+        }
+        unsigned long now = millis();
+        CueBucket *bucket = nullptr;
+        CueBucket *oldest = &Buckets[0];
+        for (byte i = 0; i < cueTopics && !bucket; i++)
+        {
+            if (Buckets[i].inUse && Buckets[i].topicHash == h)
+            {
+                bucket = &Buckets[i];
+            }
+            else if (!Buckets[i].inUse || (oldest->inUse && now - Buckets[i].lastUsed > now - oldest->lastUsed))
+            {
+                oldest = &Buckets[i];
+            }
+        }
+        if (!bucket)
+        {
+            bucket = oldest;
+            bucket->topicHash = h;
+            bucket->tokens = cueBurst * 1000;
+            bucket->refilled = now;
+            bucket->inUse = true;
+            bucket->warned = false;
+        }
+        bucket->lastUsed = now;
+        uint32_t refill = min((unsigned long)(now - bucket->refilled), (unsigned long)(cueBurst * 1000 / cueRate)) * cueRate;
+        bucket->tokens = min(bucket->tokens + refill, cueBurst * 1000);
+        bucket->refilled = now;
+        if (bucket->tokens < 1000)
+        {
+            if (!bucket->warned)
+            {
+                Queue.publish(ReplyTopic, "light limited");
+                bucket->warned = true;
+            }
+            return false;
+        }
+        bucket->tokens -= 1000;
+        bucket->warned = false;
+        return true;
+    }
+
+    // Parse "<strip> <pattern> key=value ...", nullptr when it is well formed
+    const char *parse(CommandArgs &args, LightCue &cue, byte &mask)
+    {
+        unsigned long value;
+        if (args.is(0, "all"))
+        {
+            mask = 0;
+            for (byte s = 0; s < Count; s++)
+            {
+                if (!Strips[s]->View)
+                {
+                    mask |= 1 << s;
+                }
+            }
+        }
+        else if (number(args.arg(0), args.length(0), value) && value >= 1 && value <= Count)
+        {
+            mask = 1 << (value - 1);
+        }
+        else
+        {
+            return "strip";
+        }
+
+        cue.pattern = cuePatterns;
+        for (byte i = 0; i < cuePatterns; i++)
+        {
+            if (args.is(1, cueNames[i]))
+            {
+                cue.pattern = (cuePattern)i;
+            }
+        }
+        if (cue.pattern == cuePatterns)
+        {
+            return "pattern";
+        }
+        cue.color1 = 0xFFFFFF;
+        cue.color2 = 0;
+        cue.start = 0;
+        cue.len = 0;
+        cue.interval = 50;
+        cue.eye = 3;
+        cue.reps = 1;
+        cue.tail = 3;
+        cue.dir = forward;
+        cue.timed = false;
+        cue.startAt = 0;
+        cue.holdFor = 0;
+        cue.frames = nullptr;
+
+        for (byte i = 2; i < args.count(); i++)
+        {
+            const char *key = args.arg(i);
+            uint16_t length = args.length(i);
+            const char *equals = (const char *)memchr(key, '=', length);
+            if (!equals)
+            {
+                return "parameter";
+            }
+            uint16_t keyLength = equals - key;
+            const char *text = equals + 1;
+            uint16_t textLength = length - keyLength - 1;
+            if (isKey(key, keyLength, "color") || isKey(key, keyLength, "color2"))
+            {
+                uint32_t color;
+                if (!hexColor(text, textLength, color) && !paletteColor(text, textLength, color))
+                {
+                    return "color";
+                }
+                (keyLength == 5 ? cue.color1 : cue.color2) = color;
+            }
+            else if (isKey(key, keyLength, "asset"))
+            {
+                cue.frames = Assets ? Assets->frames(text, textLength, cue.frameWidth, cue.frameCount) : nullptr;
+                if (!cue.frames)
+                {
+                    return "asset";
+                }
+            }
+            else if (isKey(key, keyLength, "dir"))
+            {
+                if (textLength == 3 && strncasecmp(text, "fwd", 3) == 0)
+                {
+                    cue.dir = forward;
+                }
+                else if (textLength == 3 && strncasecmp(text, "rev", 3) == 0)
+                {
+                    cue.dir = reverse;
+                }
+                else
+                {
+                    return "dir";
+                }
+            }
+            else if (isKey(key, keyLength, "at"))
+            {
+                uint64_t at = 0;
+                for (uint16_t j = 0; j < textLength; j++)
+                {
+                    if (text[j] < '0' || text[j] > '9')
+                    {
+                        return "at";
+                    }
+                    at = at * 10 + (text[j] - '0');
+                }
+                if (textLength == 0 || !netClock.synced() || !netClock.localMillis(at, cue.startAt))
+                {
+                    return "at";
+                }
+                cue.timed = true;
+            }
+            else if (!number(text, textLength, value))
+            {
+                return "number";
+            }
+            else if (isKey(key, keyLength, "start"))
+            {
+                cue.start = min(value, 0xFFFFUL);
+            }
+            else if (isKey(key, keyLength, "len"))
+            {
+                if (value == 0)
+                {
+                    return "len";
+                }
+                cue.len = min(value, 0xFFFFUL);
+            }
+            else if (isKey(key, keyLength, "interval"))
+            {
+                if (value < (unsigned long)cueIntervalMin || value > (unsigned long)cueIntervalMax)
+                {
+                    return "interval";
+                }
+                cue.interval = value;
+            }
+            else if (isKey(key, keyLength, "eye"))
+            {
+                cue.eye = min(value, 0xFFFFUL);
+            }
+            else if (isKey(key, keyLength, "reps"))
+            {
+                if (value < 1 || value > cueRepsMax)
+                {
+                    return "reps";
+                }
+                cue.reps = value;
+            }
+            else if (isKey(key, keyLength, "tail"))
+            {
+                cue.tail = min(value, 0xFFFFUL);
+            }
+            else if (isKey(key, keyLength, "for"))
+            {
+                if (value > cueHoldMax)
+                {
+                    return "for";
+                }
+                cue.holdFor = value;
+            }
+            else
+            {
+                return "parameter";
+            }
+        }
+        if (cue.pattern == cueFrames && !cue.frames)
+        {
+            return "asset";
+        }
+        return nullptr;
+    }
+
+    // Fill in the segment for a strip and check that the cue fits it, nullptr when it does
+    const char *fit(LightCue &cue, NeoPatterns &strip)
+    {
+        int pixels = strip.numPixels();
+        if (cue.start >= pixels)
+        {
+            return "start";
+        }
+        if (cue.len == 0)
+        {
+            cue.len = pixels - cue.start;
+        }
+        if (cue.start + cue.len > pixels)
+        {
+            return "len";
+        }
+        if (cue.pattern == cueCylon && (cue.eye < 1 || cue.eye > cue.len))
+        {
+            return "eye";
+        }
+        if (cue.pattern == cueScanner && cue.tail > cue.len)
+        {
+            return "tail";
+        }
+        return nullptr;
+    }
+
+    bool due(LightCue &cue)
+    {
+        if (!cue.timed)
+        {
+            return true;
+        }
+        // Animations are set up early and wait for their first frame, a fill happens on time
+        bool animated = cue.pattern != cueOff && cue.pattern != cueSolid && cue.pattern != cueRelease;
+        return (long)(millis() - (cue.startAt - (animated ? cueLead : 0))) >= 0;
+    }
+
+    // Start the waiting cue of strip s
+    void begin(byte s)
+    {
+        NeoPatterns &strip = *Strips[s];
+        LightCue &cue = Pending[s];
+        Waiting[s] = false;
+        if (cue.pattern == cueRelease)
+        {
+            if (strip.Held)
+            {
+                release(s);
+            }
+            return;
+        }
+
+        // The newest cue wins: a view whose cue draws into this strip's pixels is stopped first
+        for (byte b = 0; b < Count; b++)
+        {
+            if (b != s && Strips[b]->View && Strips[b]->Held && overlaps(s, b))
+            {
+                Waiting[b] = false;
+                release(b);
+            }
+        }
+        strip.Held = false;
+        strip.Locked = false;
+        switch (cue.pattern)
+        {
+            case cueOff:
+                strip.ActivePattern = none;
+                strip.ColorSet(0, cue.start, cue.len);
+                break;
+            case cueSolid:
+                strip.ActivePattern = none;
+                strip.ColorSet(cue.color1, cue.start, cue.len);
+                break;
+            case cueFlash:
+                strip.Flash(cue.color1, cue.interval, cue.start, cue.len, cue.dir);
+                break;
+            case cueWipe:
+                strip.ColorWipe(cue.color1, cue.interval, cue.start, cue.len, cue.dir);
+                break;
+            case cueChase:
+                strip.TheaterChase(cue.color1, cue.color2, cue.interval, cue.start, cue.len, cue.dir);
+                break;
+            case cueRunning:
+                strip.RunningLights(cue.color1, cue.interval, cue.start, cue.len, cue.dir);
+                break;
+            case cueWave:
+                strip.ColorWave(cue.color1, cue.start, cue.len, cue.interval, cue.reps, cue.dir);
+                break;
+            case cueCylon:
+                strip.CylonEye(cue.color1, cue.interval, cue.start, cue.len, cue.eye, cue.reps, cue.dir);
+                break;
+            case cueScanner:
+                strip.Scanner(cue.color1, cue.color2, cue.interval, cue.start, cue.len, cue.tail, cue.start, cue.len, cue.tail, cue.dir);
+                break;
+            case cueFade:
+                strip.Fade(cue.color1, cue.color2, cue.interval, cue.start, cue.len, cue.dir);
+                break;
+            case cueAccel:
+                strip.AcceleratingSequence(cue.color1, cue.start, cue.len, cue.dir);
+                break;
+            case cueFrames:
+                strip.FrameSequence(cue.frames, cue.frameCount, cue.frameWidth, cue.interval, cue.start, cue.len, cue.dir);
+                break;
+            default:
+                break;
+        }
+        if (cue.timed && strip.ActivePattern != none)
+        {
+            strip.StartAt(cue.startAt);
+        }
+        holdBeneath(s);
+        strip.Held = true;
+        HeldPattern[s] = strip.ActivePattern;
+        HoldFor[s] = cue.holdFor;
+        HoldUntil[s] = (cue.timed ? cue.startAt : millis()) + cue.holdFor;
+        applied++;
+    }
+
+    // Blank strip s and hand it back, the puzzle redraws whatever its state needs
+    void release(byte s)
+    {
+        NeoPatterns &strip = *Strips[s];
+        strip.Held = false;
+        strip.Locked = false;
+        strip.ActivePattern = none;
+        strip.Color1 = 0;
+        strip.ColorSet(0, 0, strip.numPixels());
+        if (strip.View)
+        {
+            for (byte g = 0; g < strip.View->segments(); g++)
+            {
+                NeoPatterns *under = strip.View->segment(g).strip;
+                under->Held = false;
+                under->ActivePattern = none;
+            }
+        }
+    }
+
+    // Stop the strips under a view strip and hold them blank while its cue runs
+    void holdBeneath(byte s)
+    {
+        NeoPatterns &strip = *Strips[s];
+        if (!strip.View)
+        {
+            return;
+        }
+        for (byte g = 0; g < strip.View->segments(); g++)
+        {
+            NeoPatterns *under = strip.View->segment(g).strip;
+            under->ActivePattern = none;
+            under->Locked = false;
+            under->Held = true;
+            for (byte b = 0; b < Count; b++)
+            {
+                if (Strips[b] == under)
+                {
+                    Waiting[b] = false;
+                    HeldPattern[b] = none;
+                    HoldFor[b] = 0;
+                }
+            }
+        }
+    }
+
+    // The strips strip s draws into: the strips under it for a view, else itself
+    byte covers(byte s)
+    {
+        return Strips[s]->View ? Strips[s]->View->segments() : 1;
+    }
+
+    NeoPatterns *covered(byte s, byte g)
+    {
+        return Strips[s]->View ? Strips[s]->View->segment(g).strip : Strips[s];
+    }
+
+    // Whether strips a and b draw into a common strip
+    bool overlaps(byte a, byte b)
+    {
+        for (byte g = 0; g < covers(a); g++)
+        {
+            for (byte h = 0; h < covers(b); h++)
+            {
+                if (covered(a, g) == covered(b, h))
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    static bool isKey(const char *key, uint16_t length, const char *name)
+    {
+        return length == strlen(name) && strncasecmp(key, name, length) == 0;
+    }
+
+    // Decimal number of up to 9 digits
+    static bool number(const char *p, uint16_t length, unsigned long &value)
+    {
+        if (length == 0 || length > 9)
+        {
+            return false;
+        }
+        value = 0;
+        for (uint16_t i = 0; i < length; i++)
+        {
+            if (p[i] < '0' || p[i] > '9')
+            {
+                return false;
+            }
+            value = value * 10 + (p[i] - '0');
+        }
+        return true;
+    }
+
+    // RRGGBB, with or without a leading #
+    static bool hexColor(const char *p, uint16_t length, uint32_t &color)
+    {
+        if (length == 7 && *p == '#')
+        {
+            p++;
+            length--;
+        }
+        if (length != 6)
+        {
+            return false;
+        }
+        color = 0;
+        for (uint16_t i = 0; i < 6; i++)
+        {
+            char c = p[i];
+            uint8_t digit;
+            if (c >= '0' && c <= '9')
+            {
+                digit = c - '0';
+            }
+            else if (c >= 'a' && c <= 'f')
+            {
+                digit = c - 'a' + 10;
+            }
+            else if (c >= 'A' && c <= 'F')
+            {
+                digit = c - 'A' + 10;
+            }
+            else
+            {
+                return false;
+            }
+            color = (color << 4) | digit;
+        }
+        return true;
+    }
+
+    // <palette>:<index>, an entry of a palette in the asset bundle
+    bool paletteColor(const char *p, uint16_t length, uint32_t &color)
+    {
+        const char *colon = (const char *)memchr(p, ':', length);
+        unsigned long index;
+        uint16_t colors;
+        if (!Assets || !colon || !number(colon + 1, length - (colon - p) - 1, index))
+        {
+            return false;
+        }
+        const uint32_t *palette = Assets->palette(p, colon - p, colors);
+        if (!palette || index >= colors)
+        {
+            return false;
+        }
+        color = palette[index] & 0xFFFFFF;
+        return true;
+    }
+};
+
+#endif
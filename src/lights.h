@@ -4,10 +4,16 @@
 #include <Adafruit_NeoPixel.h>
 #include <algorithm> // Add this line to include the <algorithm> header
 #include <algorithm> // Add this line to include the <algorithm> header
+#include "binlog.h"
+#include "trace.h"
+#include "metrics.h"
+#include "heapaudit.h"
+#include "pixelarena.h"
+#include "pixelview.h"
 
 // Paterns to be used for light functions
 enum pattern {
-    none, runningLights, theaterChase, colorWipe, colorWave, cylonEye, scanner, fade, acceleratingSequence, flash
+    none, runningLights, theaterChase, colorWipe, colorWave, cylonEye, scanner, fade, acceleratingSequence, flash, frameSequence
 };
 
 // Pattern directions
@@ -15,6 +21,11 @@ enum direction {
     forward, reverse
 };
 
+// Frames pushed to the strips and how long each took, see metrics.h
+const uint32_t lightShowBounds[] = {250, 500, 1000, 2000, 5000};
+MetricCounter lightFrames("lights.frames");
+MetricHistogram lightShowMicros("lights.show_us", lightShowBounds, 5);
+
 // Class for LED patterns
 class NeoPatterns : public Adafruit_NeoPixel
 {
@@ -26,6 +37,9 @@ class NeoPatterns : public Adafruit_NeoPixel
 
     int Interval;     // milliseconds between updates
     unsigned long lastUpdate;   // last update of position
+    bool Locked;                // frames follow a fixed schedule from StartAt()
+    unsigned long NextFrame;    // millis() of the next frame while Locked
+    bool Held;                  // a remote light cue owns the strip, pattern changes are ignored (see lightcues.h)
 
     uint32_t Color1, Color2;    // what colors are in use
     uint16_t TotalSteps;        // total number of steps in the pattern
@@ -42,20 +56,154 @@ class NeoPatterns : public Adafruit_NeoPixel
         
 
     void (*OnComplete)();       // Callback on completion of pattern
+    bool ArenaPixels;           // pixels is a plane of the pixel arena, not a heap block
+    PixelView<NeoPatterns> *View;   // draws into a view across strips instead of pixels of its own
+    const uint8_t *FrameData;   // frames of a frame sequence, in the asset bundle (see assets.h)
+    uint16_t FrameWidth;        // pixels per frame
 
     // Constructor - calls base-class constructor to initialize the strip
     NeoPatterns(uint16_t pixels, uint16_t pin, uint16_t type, void (*callback)()) 
     :Adafruit_NeoPixel(pixels, pin, type)
     {
         OnComplete = callback;
+        Locked = false;
+        Held = false;
+        ArenaPixels = false;
+        View = nullptr;
+        FrameData = nullptr;
+    }
+
+    // Constructor for a strip whose pixels are a plane of the pixel arena (see pixelarena.h).
+    // The base class is built empty, so nothing is allocated.
+    NeoPatterns(const StripSpec &strip, uint8_t *buffer, void (*callback)())
+    :Adafruit_NeoPixel()
+    {
+        updateType(strip.type);
+        pixels = buffer;
+        numLEDs = strip.pixels;
+        numBytes = strip.pixels * stripBytesPerPixel(strip.type);
+        setPin(strip.pin);
+        OnComplete = callback;
+        Locked = false;
+        Held = false;
+        ArenaPixels = true;
+        View = nullptr;
+        FrameData = nullptr;
+    }
+
+    // Constructor for patterns drawn into a view over other strips (see pixelview.h). The
+    // pixels are the strips', this object only holds the pattern.
+    NeoPatterns(PixelView<NeoPatterns> &view, void (*callback)())
+    :Adafruit_NeoPixel()
+    {
+        OnComplete = callback;
+        Locked = false;
+        Held = false;
+        ArenaPixels = false;
+        View = &view;
+        FrameData = nullptr;
+    }
+
+    // The arena's planes are not the heap's to free
+    ~NeoPatterns()
+    {
+        if (ArenaPixels)
+        {
+            pixels = nullptr;
+        }
+    }
+
+    // Pixel access for the patterns, through the view when there is one
+    void setPixelColor(uint16_t n, uint32_t c)
+    {
+        if (View)
+        {
+            View->set(n, c);
+        }
+        else
+        {
+            Adafruit_NeoPixel::setPixelColor(n, c);
+        }
+    }
+
+    void setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b)
+    {
+        setPixelColor(n, Color(r, g, b));
+    }
+
+    uint32_t getPixelColor(uint16_t n) const
+    {
+        return View ? View->get(n) : Adafruit_NeoPixel::getPixelColor(n);
+    }
+
+    uint16_t numPixels() const
+    {
+        return View ? View->length() : Adafruit_NeoPixel::numPixels();
+    }
+
+    void fill(uint32_t c = 0, uint16_t first = 0, uint16_t count = 0)
+    {
+        if (View)
+        {
+            View->fill(c, first, count);
+        }
+        else
+        {
+            Adafruit_NeoPixel::fill(c, first, count);
+        }
+    }
+
+    void clear()
+    {
+        fill(0);
+    }
+
+    // Push the pixels out, traced: the strip takes 30 us per pixel with interrupts off. A view
+    // sends the strips under it.
+    void show()
+    {
+        if (View)
+        {
+            View->show();
+            return;
+        }
+        TRACE_SPAN("show");
+        HEAP_SCOPE(logLights);
+        unsigned long started = micros();
+        Adafruit_NeoPixel::show();
+        lightShowMicros.record(micros() - started);
+        lightFrames.add();
+    }
+
+    // Hold the pattern just set up until millis() reaches start, then draw its frames on a fixed
+    // schedule from there instead of from whenever Update() happens to run. Props given the same
+    // start on the shared clock (see netclock.h) stay in step for the whole effect.
+    void StartAt(unsigned long start)
+    {
+        Locked = true;
+        NextFrame = start;
     }
 
     // Update the pattern
     void Update()
     {
-        if((millis() - lastUpdate) > Interval) // time to update
+        bool due;
+        if (Locked)
+        {
+            long late = (long)(millis() - NextFrame);
+            due = late >= 0;
+            if (late > Interval)
+            {
+                NextFrame = millis();   // fell a frame behind, the schedule is lost
+            }
+        }
+        else
         {
-            lastUpdate = millis();
+            due = (millis() - lastUpdate) > Interval;
+        }
+        if(due) // time to update
+        {
+            lastUpdate = Locked ? NextFrame : millis();
             switch(ActivePattern)
             {
                 case runningLights:
@@ -85,9 +233,13 @@ class NeoPatterns : public Adafruit_NeoPixel
                 case flash:
                     FlashUpdate();
                     break;
+                case frameSequence:
+                    FrameSequenceUpdate();
+                    break;
                 default:
                     break;
             }
+            NextFrame = lastUpdate + Interval;
         }
     }
 
@@ -138,27 +290,39 @@ class NeoPatterns : public Adafruit_NeoPixel
     // Initialize for a Theater Chase
     void TheaterChase(uint32_t color1, uint32_t color2, uint8_t interval, direction dir = forward)
     {
+        TheaterChase(color1, color2, interval, 0, numPixels(), dir);
+    }
+
+    // Theater Chase on a segment of the strip
+    void TheaterChase(uint32_t color1, uint32_t color2, uint8_t interval, int start, int len, direction dir = forward)
+    {
+        if (Held)
+        {
+            return;
+        }
         ActivePattern = theaterChase;
         Interval = interval;
-        TotalSteps = numPixels();
+        TotalSteps = len;
         Color1 = color1;
         Color2 = color2;
         Index = 0;
         Direction = dir;
+        segmentStart = start;
+        segmentLen = len;
     }
 
     // Update the Theater Chase Pattern
     void TheaterChaseUpdate()
     {
-        for(int i=0; i<numPixels(); i++)
+        for(int i=0; i<segmentLen; i++)
         {
             if((i + Index) % 3 == 0)
             {
-                setPixelColor(i, Color1);
+                setPixelColor(segmentStart + i, Color1);
             }
             else
             {
-                setPixelColor(i, Color2);
+                setPixelColor(segmentStart + i, Color2);
             }
         }
         show();
@@ -167,6 +331,9 @@ class NeoPatterns : public Adafruit_NeoPixel
 
 // Initialize for a Flash pattern
 void Flash(uint32_t color, int interval, int start, int len, direction dir = forward) {
+    if (Held) {
+        return;
+    }
     ActivePattern = flash;
     Interval = interval;
     TotalSteps = len;  // Ensure this is correct for your expectations
@@ -175,7 +342,7 @@ void Flash(uint32_t color, int interval, int start, int len, direction dir = for
     Direction = dir;
     segmentStart = start;
     segmentLen = len;
-    Serial.println("Flash pattern initialized.");
+    LOG_DEBUG(logLights, "Flash pattern initialized.");
 }
 
 void FlashUpdate() {
@@ -191,10 +358,48 @@ void FlashUpdate() {
     Increment(); // Increment the index for toggling
 }
 
+    // Initialize to play count pre-rendered frames of width pixels, 3 bytes (r, g, b) each, onto
+    // a segment. The frames are read where they are, usually the mapped asset bundle, so they
+    // must stay there while the pattern runs.
+    void FrameSequence(const uint8_t *frames, uint16_t count, uint16_t width, int interval, int start, int len, direction dir = forward)
+    {
+        if (Held)
+        {
+            return;
+        }
+        ActivePattern = frameSequence;
+        FrameData = frames;
+        FrameWidth = width;
+        Interval = interval;
+        TotalSteps = count;
+        Index = dir == forward ? 0 : count - 1;
+        Direction = dir;
+        segmentStart = start;
+        segmentLen = len;
+    }
+
+    // Copy the current frame onto the segment, a frame narrower than the segment leaves the
+    // rest as it is
+    void FrameSequenceUpdate()
+    {
+        const uint8_t *frame = FrameData + (uint32_t)Index * FrameWidth * 3;
+        int pixels = min(segmentLen, (int)FrameWidth);
+        for (int i = 0; i < pixels; i++)
+        {
+            setPixelColor(segmentStart + i, frame[3 * i], frame[3 * i + 1], frame[3 * i + 2]);
+        }
+        show();
+        Increment();
+    }
+
 
     // Initialize for Running LightsLen, uint32_t color, int waveDelay, dir
     void RunningLights(uint32_t color, uint8_t WaveDelay, int start, int len, direction dir = forward) 
     {
+        if (Held)
+        {
+            return;
+        }
         ActivePattern = runningLights;
         Color1 = color;
         Interval = WaveDelay;
@@ -224,6 +429,10 @@ void FlashUpdate() {
     // Initialize for a ColorWipe
     void ColorWipe(uint32_t color, uint8_t interval, int start, int len, direction dir = forward)
     {
+        if (Held)
+        {
+            return;
+        }
         ActivePattern = colorWipe;
         Color1 = color;
         Interval = interval;
@@ -260,6 +469,10 @@ void FlashUpdate() {
     // Initialize for a wave effect (lights the pixels sequentially then turns them off, then reverses direction)
     void ColorWave(uint32_t color, int start, int len, int speed, int reps, direction dir = forward)
     {
+        if (Held)
+        {
+            return;
+        }
         ActivePattern = colorWave;
         Interval = speed;
         segmentLen = len;
@@ -316,6 +529,10 @@ void FlashUpdate() {
     // Initialize a cylon effect (with an eye)
     void CylonEye(uint32_t color, uint8_t interval, int start, int len, int eye, int reps, direction dir = forward)
     {
+        if (Held)
+        {
+            return;
+        }
         ActivePattern = cylonEye;
         Interval = interval;
         Color1 = color;
@@ -367,6 +584,10 @@ void FlashUpdate() {
     // Initialize for a scanner
     void Scanner(uint32_t color1, uint32_t color2, uint8_t interval, int startA, int lenA, int tailLengthA, int startB, int lenB, int tailLengthB, direction dir = forward)
     {
+        if (Held)
+        {
+            return;
+        }
         ActivePattern = scanner;
         Interval = interval;
         Color1 = color1;
@@ -436,6 +657,10 @@ void FlashUpdate() {
     // Initialize for a fade effect
     void Fade(uint32_t color1, uint32_t color2, uint8_t interval, int start, int len, direction dir = forward)
     {
+        if (Held)
+        {
+            return;
+        }
         ActivePattern = fade;
         Interval = interval;
         segmentLen = len;
@@ -456,12 +681,18 @@ void FlashUpdate() {
         uint8_t green = ((Green(Color1) * (TotalSteps - Index)) + (Green(Color2) * Index)) / TotalSteps;
         uint8_t blue = ((Blue(Color1) * (TotalSteps - Index)) + (Blue(Color2) * Index)) / TotalSteps;
         
-        ColorSet(Color(red, green, blue), segmentStart, segmentLen);
+        for (int i = segmentStart; i < segmentStart + segmentLen; i++)
+        {
+            setPixelColor(i, Color(red, green, blue));
+        }
         show();
         Increment();
     }
 
     void AcceleratingSequence(uint32_t color, int start, int len, direction dir = forward) {
+    if (Held) {
+        return;
+    }
     ActivePattern = acceleratingSequence;
     Color1 = color;
     Interval = 200; // Start with a slow speed, 1000 milliseconds interval
@@ -496,6 +727,10 @@ void FlashUpdate() {
     // Set all pixels to a color (synchronously)
     void ColorSet(uint32_t color, int start, int len)
     {
+        if (Held)
+        {
+            return;
+        }
         segmentStart = start;
         segmentLen = len;
         for (int i = segmentStart; i < segmentStart + segmentLen; i++)
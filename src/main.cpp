@@ -22,11 +22,35 @@
 //              AUG-31-2024       tony2feathers     Added main setup function and main loop, added libraries
 //              SEP-20-2024       tony2feathers     Changed to PN5180 RFID readers using ISO15693 protocol and added new lighting effects
 //              SEP-21-2024       tony2feathers     Bug fixes and refactored lighting effects and case switch statement
+//              OCT-17-2026       tony2feathers     Moved RFID polling into a reader bank with optional multiplexed chip selects
+//              OCT-17-2026       tony2feathers     Read beaker data from tag memory through a per-UID cache
+//              OCT-17-2026       tony2feathers     Moved the beaker and reset tags into a LittleFS tag database
+//              OCT-17-2026       tony2feathers     Added a simulated PN5180 for host-side polling benchmarks
+//              OCT-17-2026       tony2feathers     RFID tag traffic now uses a batched PN5180 SPI transport
+//              OCT-17-2026       tony2feathers     Non-blocking WiFi/MQTT connection manager with backoff
+//              OCT-17-2026       tony2feathers     MQTT messages dispatched through a hashed command registry
+//              OCT-17-2026       tony2feathers     Batched MessagePack telemetry of puzzle state and events
+//              OCT-17-2026       tony2feathers     Outbound MQTT messages go through a coalescing queue
+//              OCT-17-2026       tony2feathers     Events logged to flash while offline and replayed until acknowledged
+//              OCT-17-2026       tony2feathers     Retained state topics and a last will status topic for dashboards
+//              OCT-17-2026       tony2feathers     Added a ping command for round trip measurements
+//              OCT-17-2026       tony2feathers     Compressed delta OTA updates with a trial boot and rollback
+//              OCT-17-2026       tony2feathers     Loop diagnostics go through a deferred-format binary log
+//              OCT-17-2026       tony2feathers     SNTP shared clock, clock skew probe and solve at a shared start time
+//              OCT-17-2026       tony2feathers     Rate limited light cues over MQTT on any strip and segment
+//              OCT-17-2026       tony2feathers     MQTT moved onto an asynchronous client with lock-free queues to the loop
+//              OCT-17-2026       tony2feathers     Log levels per module, rate limited call sites and a drain task for the log
+//              OCT-17-2026       tony2feathers     Cycle counter trace spans around polling, show() and MQTT handling
+//              OCT-17-2026       tony2feathers     Metrics registry of counters, gauges and histograms published over MQTT
+//              OCT-17-2026       tony2feathers     Timer sampling profiler and a serial command console
+//              OCT-17-2026       tony2feathers     Heap allocation audit per subsystem, stack high-water marks and no allocation after setup
+//              OCT-17-2026       tony2feathers     Strip pixel buffers carved out of one static arena sized from the strip table
+//              OCT-17-2026       tony2feathers     Pixel views across strips, light cue strip 5 runs from the beakers into the purple pipe
+//              OCT-17-2026       tony2feathers     Palettes, frames and the tag table read in place from a memory mapped asset partition
 
 
 
 #include <Arduino.h>
-#include <PubSubClient.h>
 #include <WiFi.h>
 #include "WifiFunctions.h"
 #include <Adafruit_NeoPixel.h>
@@ -34,8 +58,30 @@
 #include "lights.h"
 #include <PN5180.h>
 #include <PN5180ISO15693.h>
-
-#define DEBUG
+#include "rfid.h"
+#include "tagcache.h"
+#include "tagdb.h"
+#include "telemetry.h"
+#include "eventlog.h"
+#include "ota.h"
+#include "binlog.h"
+#include "netclock.h"
+#include "lightcues.h"
+#include "assets.h"
+#include "trace.h"
+#include "metrics.h"
+#include "profiler.h"
+#include "heapaudit.h"
+
+// Uncomment to run up to 16 readers through the chip select multiplexers (see rfid.h). Only the
+// readers the tag database has a correct tag for are checked for a solve, so with 2 beakers
+// configured the other 14 readers only watch for the reset tag; add "correct <reader>" lines to
+// use more.
+//#define RFID_MUX
+// Uncomment to print inventory time (library vs batched SPI) and full-pass scan time against reader count during setup
+//#define RFID_BENCH
+// Uncomment to drive modelled PN5180 readers (pn5180_sim.h) instead of hardware
+//#define RFID_SIMULATED
 
 //Globals
 
@@ -45,6 +91,16 @@ PuzzleState puzzleState = Initializing;
 unsigned long solvedMillis = 0;
 unsigned long currentMillis = 0;
 
+// The red flash for missing or wrong beakers is held this long before the status is shown again
+// or the puzzle moves on, without stopping the loop
+unsigned long beakersWrongMillis = 0;
+const unsigned long beakersWrongHold = 2000;
+
+// A solve scheduled on the shared clock ("solve at <ms>"), as a millis() deadline
+bool solveScheduled = false;
+unsigned long solveAt = 0;
+const unsigned long solveLead = 100; // enter onSolve() this early so the first frame is on time
+
 // Constants
 const byte laserPin = 34;
 const byte beakerDoor = 32;
@@ -53,10 +109,25 @@ const byte lightStrip1 = 25; // Beaker Lights
 const byte lightStrip2 = 26; // Red Pipe Lights
 const byte lightStrip3 = 27;  // Purple lights for crystal compartment
 const byte lightStrip4 = 13; // Blue Pipe Lights
+#ifdef RFID_MUX
+// GPIO14 becomes the fourth mux select line, every other free output is a strapping pin.
+// GPIO39 is input only and has no internal pull-up, so fit a 10k pull-up to 3.3V
+const byte limitSwitch = 39; // Reed switch for the beaker door
+const byte limitSwitchMode = INPUT;
+#else
 const byte limitSwitch = 14; // Reed switch for the beaker door
+const byte limitSwitchMode = INPUT_PULLUP;
+#endif
+#ifdef RFID_MUX
+const byte numReaders = 16;
+#else
 const byte numReaders = 2;
+#endif
+// Bus time allowed for RFID polling per loop, readers not reached are polled on the next loop
+const unsigned long rfidScanBudget = 60000;
 
-uint8_t correctUid[][8] = {
+// Default tags, written to the tag database the first time the device boots without one
+uint8_t correctUid[numReaders][8] = {
   {0x3C, 0x33, 0x13, 0x66, 0x08, 0x01, 0x04, 0xE0}, // Red beaker
   {0x04, 0x3A, 0x13, 0x66, 0x08, 0x01, 0x04, 0xE0}  // Blue beaker
 };
@@ -74,12 +145,57 @@ bool beakersCorrect = false;
 bool alchemyPower = false;
 bool doorClosed = false;
 
+#ifdef RFID_MUX
+// A single driver reaches every reader, NSS and BUSY are routed through the multiplexers
+// addressed by the select pins and all RESET pins are tied to pin 22
+RfidReader nfc[] = {
+  RfidReader(21,5,22)
+};
+const byte rfidSelectPins[] = {16, 17, 4, 14};
+RfidBank rfid(nfc, numReaders, rfidSelectPins, sizeof(rfidSelectPins));
+#else
 // Each PN5180 reader requires unique NSS, BUSY, and RESET pins,
 // as defined in the constructor below
-PN5180ISO15693 nfc[] = {
-  PN5180ISO15693(21,5,22),
-  PN5180ISO15693(16,4,17)
+RfidReader nfc[] = {
+  RfidReader(21,5,22),
+  RfidReader(16,4,17)
 };
+RfidBank rfid(nfc, numReaders);
+#endif
+
+// Beaker data read from tag memory, cached per UID
+TagCache tagCache;
+
+// Correct beaker and reset tags, loaded from LittleFS
+TagDatabase tagDb;
+
+// Whether a reader takes part in the puzzle, readers no tag in the database solves do not
+bool readerUsed(int i)
+{
+  return tagDb.hasCorrect(i);
+}
+
+// State snapshots and events for the host, published in batches
+Telemetry telemetry(outbox, telemetryTopic, deviceID);
+
+// Events kept in flash until the host acknowledges them
+EventLog eventLog(outbox, eventTopic);
+
+// Firmware updates from the local update server
+OtaUpdater ota(outbox, hostTopic);
+
+// Puzzle health, published every metricsPeriod to the metrics topic (see metrics.h)
+const uint32_t loopBounds[] = {60000, 80000, 100000, 150000, 250000, 500000, 1000000};
+MetricCounter puzzleSolves("puzzle.solves");
+MetricCounter puzzleResets("puzzle.resets");
+MetricCounter puzzleGameOvers("puzzle.game_overs");
+MetricHistogram loopMicros("loop.us", loopBounds, 7);
+MetricGauge heapFree("heap.free");
+MetricGauge heapMinFree("heap.min_free");
+MetricGauge wifiRssi("net.rssi");
+unsigned long metricsPeriod = 10000;     // 0 when stopped
+const long metricsPeriodMax = 3600000;    // an hour
+const uint16_t metricsBufferSize = 1280;
 
 // Lights
 const int Strip1Length = 27;  // Beaker Lights
@@ -91,68 +207,131 @@ const int Strip3Start = 0;
 const int Strip4Length = 8;  // Pipe Lights (Right - Blue)
 const int Strip4Start = 0; 
 
-// Create instances of the lights
-NeoPatterns LS1(Strip1Length, lightStrip1, NEO_GRB + NEO_KHZ800, nullptr);
-NeoPatterns LS2(Strip2Length, lightStrip2, NEO_GRB + NEO_KHZ800, nullptr);
-NeoPatterns LS3(Strip3Length, lightStrip3, NEO_GRB + NEO_KHZ800, nullptr);
-NeoPatterns LS4(Strip4Length, lightStrip4, NEO_GRB + NEO_KHZ800, nullptr);
+// Strip table: the pixel arena is sized from it at compile time (see pixelarena.h)
+constexpr StripSpec strips[] = {
+  {Strip1Length, lightStrip1, NEO_GRB + NEO_KHZ800, 1},
+  {Strip2Length, lightStrip2, NEO_GRB + NEO_KHZ800, 1},
+  {Strip3Length, lightStrip3, NEO_GRB + NEO_KHZ800, 1},
+  {Strip4Length, lightStrip4, NEO_GRB + NEO_KHZ800, 1},
+};
+const byte stripCount = sizeof(strips) / sizeof(strips[0]);
+PixelArena<pixelArenaSize(strips, stripCount)> pixelArena(strips, stripCount);
+
+// Create instances of the lights, their pixels are in the arena
+NeoPatterns LS1(strips[0], pixelArena.plane(0), nullptr);
+NeoPatterns LS2(strips[1], pixelArena.plane(1), nullptr);
+NeoPatterns LS3(strips[2], pixelArena.plane(2), nullptr);
+NeoPatterns LS4(strips[3], pixelArena.plane(3), nullptr);
+
+// The beaker lights running on into the purple pipe as one line of pixels. Patterns on Flow draw
+// straight into LS1 and LS3 (see pixelview.h).
+const PixelSegment<NeoPatterns> flowSegments[] = {
+  {&LS1, Strip1Start, Strip1Length, 1, false},
+  {&LS3, Strip3Start, Strip3Length, 1, false},
+};
+PixelView<NeoPatterns> flowView(flowSegments, 2);
+NeoPatterns Flow(flowView, nullptr);
+
+// Palettes, frames and tables mapped from the assets partition, replaced with "assets load"
+FlashAssets assets(outbox, hostTopic);
+TimelinePlayer timeline(commands, "timeline");
+
+// Light cues from the game master ("light ..."), strips numbered from 1 in this order
+NeoPatterns *const cueStrips[] = {&LS1, &LS2, &LS3, &LS4, &Flow};
+LightCues lightCues(cueStrips, 5, outbox, hostTopic, &assets);
 
 
 //Function Prototypes
-void onSolve();
+void onSolve(unsigned long startAt = 0);
 void onReset();
 void gameOver();
 void showCurrentStatus();
+void registerCommands();
+void onSolveCommand(CommandArgs &args);
+void onResetCommand(CommandArgs &args);
+void onTagDbCommand(CommandArgs &args);
+void onCommandsCommand(CommandArgs &args);
+void onTelemetryCommand(CommandArgs &args);
+void telemetryUpdate();
+void reportEvent(telemetryEvent code, uint8_t index, uint32_t value, const uint8_t *uid = nullptr);
+void onAckCommand(CommandArgs &args);
+void onOtaCommand(CommandArgs &args);
+void onLogCommand(CommandArgs &args);
+void onClockCommand(CommandArgs &args);
+void onLightCommand(CommandArgs &args);
+void onTraceCommand(CommandArgs &args);
+void onMetricsCommand(CommandArgs &args);
+void metricsUpdate(bool now = false);
+void onProfileCommand(CommandArgs &args);
+void onHeapCommand(CommandArgs &args);
+void onAssetsCommand(CommandArgs &args);
+void heapUpdate();
+void serialConsole();
+void publishState();
 
 void setup() {
 
-  // Open a serial connection for debugging
+  // Open a serial connection for debugging and start the log drain task (see binlog.h)
   Serial.begin(115200);
+  binLog.begin(outbox, logTopic);
+  trace.begin(outbox, traceTopic);
+  profiler.begin(outbox, profileTopic);
   
-  Serial.println("Setup function begining");
+  LOG_INFO(logSystem, "Setup function begining");
 
   // Print out the file and the date at which it was last compiled
-  Serial.println(__FILE__ __DATE__);
+  LOG_INFO(logSystem, "%s", __FILE__ __DATE__);
 
-  // Connect to the WiFi network
+  // Start connecting to the WiFi network and the MQTT broker, networkUpdate() finishes the job
+  // from loop() so the puzzle runs even when the network is down
+  registerCommands();
   wifiSetup();
-  // Connect to the MQTT broker
   MQTTsetup();
+  netClock.begin(ntp_server);
   
   // Initialize the GPIO pins
   // Initialize the laser sensor
-  #ifdef DEBUG
-  Serial.println("Setting up laser sensor");
-  #endif
+  LOG_DEBUG(logPuzzle, "Setting up laser sensor");
   pinMode(laserPin, INPUT);
   delay(500);
 
   // Initialize the door locks & lock the crystal door (beaker door is unlocked by default, crystal door must remain low and only triggered high for a moment to release the lock)
-  Serial.println("Setting up door locks");
+  LOG_DEBUG(logPuzzle, "Setting up door locks");
   pinMode(beakerDoor, OUTPUT);
   pinMode(crystalDoor, OUTPUT);
-  Serial.println("Ensuring Beaker door is unlocked!");
+  LOG_DEBUG(logPuzzle, "Ensuring Beaker door is unlocked!");
   digitalWrite(beakerDoor, LOW);
   delay(500);
-  Serial.println("Ensuring Crystal door is not active!"); // Momentary high signal will unlock the door
+  LOG_DEBUG(logPuzzle, "Ensuring Crystal door is not active!"); // Momentary high signal will unlock the door
   digitalWrite(crystalDoor, LOW);
   
   // Initialize the limit switch
-  pinMode(limitSwitch, INPUT_PULLUP);
+  pinMode(limitSwitch, limitSwitchMode);
   
 
 
-  Serial.println("Setting up RFID readers");
-  for(int i=0; i<numReaders; i++){
-    Serial.print("Reader #");
-    Serial.println(i);
-    Serial.println(F("Initialising..."));
-    nfc[i].begin();
-    Serial.println(F("Resetting..."));
-    nfc[i].reset();
-    Serial.println(F("Enabling RF field..."));
-    nfc[i].setupRF();
+  // Mount the file system and load the tag database. A prop without one takes the tag table of
+  // the asset bundle, or the compiled-in tags when there is no bundle.
+  LOG_INFO(logRfid, "Loading tag database");
+  if (!LittleFS.begin(true)) {
+    LOG_ERROR(logSystem, "LittleFS mount failed!");
+  }
+  assets.begin();
+  uint32_t tagsLength;
+  const char *tags = assets.text("tags", assetTags, tagsLength);
+  if (tags && !LittleFS.exists(tagDbPath)) {
+    tagDb.replace(tags, tagsLength);
   }
+  tagDb.begin(correctUid, numReaders, resetUid);
+  eventLog.begin();
+  ota.begin();
+
+  LOG_INFO(logRfid, "Setting up RFID readers");
+  rfid.begin();
+  #ifdef RFID_BENCH
+  rfid.printTransportTimes(50);
+  rfid.printScanTimes(10);
+  #endif
 
   delay(500);
 
@@ -172,6 +351,7 @@ void setup() {
   LS4.begin();
   LS4.show();
   LS4.setBrightness(255);
+  pixelArena.printLayout();
 
   delay(50);
 
@@ -204,7 +384,7 @@ void setup() {
   LS3.show();
   LS4.show();
   delay(500);
-  Serial.println("Lights setup complete");  
+  LOG_INFO(logLights, "Lights setup complete");  
   
   // DEBUG block for RFID scanning using the serial monitor
   /*
@@ -256,11 +436,16 @@ void setup() {
   Serial.println("All tags scanned. Setup complete.");
   #endif*/
 
-  Serial.println("Setup function complete");
+  LOG_INFO(logSystem, "Setup function complete");
+
+  // From here on loop() should run without touching the heap (see heapaudit.h)
+  heapAudit.lock();
 
 }
 
 void loop() {
+  TRACE_SPAN("loop");
+  unsigned long loopStarted = micros();
   // Check the current state of the puzzle
   alchemyPower = (digitalRead(laserPin) == LOW);
   doorClosed = (digitalRead(limitSwitch) == LOW);
@@ -269,9 +454,9 @@ void loop() {
   { 
   case Initializing: // Should only be during setup and onReset
     {
-    Serial.println("Puzzle State: Initializing");
+    LOG_DEBUG(logPuzzle, "Puzzle State: Initializing");
     // Turn the lights off
-    Serial.println("Turning off lights");
+    LOG_DEBUG(logLights, "Turning off lights");
     if(LS1.ActivePattern!= none) {
     LS1.ColorSet(LS1.Color(0, 0, 0), Strip1Start, Strip1Length);
     LS1.show();
@@ -290,7 +475,7 @@ void loop() {
     }
 
     // Lock the crystal door and unlock the beaker door
-    Serial.println("Locking crystal door and unlocking beaker door");
+    LOG_INFO(logPuzzle, "Locking crystal door and unlocking beaker door");
     digitalWrite(beakerDoor, LOW);
     //digitalWrite(crystalDoor, LOW);
 
@@ -301,7 +486,7 @@ void loop() {
     }
   case Unpowered:
   {
-    Serial.println("Puzzle State: Unpowered");
+    LOG_DEBUG(logPuzzle, "Puzzle State: Unpowered");
 
     // Ensure all lights are turned off when unpowered
     if (LS1.ActivePattern != none)
@@ -327,12 +512,12 @@ void loop() {
     // Check if the laser is detected
     if(alchemyPower)
     {
-      Serial.println("Laser detected, Alchemy machine is now powered! Checking for beaker placement...");
+      LOG_INFO(logPuzzle, "Laser detected, Alchemy machine is now powered! Checking for beaker placement...");
       puzzleState = Powered;
     }
     else
     {
-      Serial.println("Laser not detected, Alchemy machine is not powered!");
+      LOG_DEBUG(logPuzzle, "Laser not detected, Alchemy machine is not powered!");
       puzzleState = Unpowered;
     }
     delay(100);
@@ -340,29 +525,36 @@ void loop() {
   }
   case Powered:
   {
-    Serial.println("Puzzle State: Powered");
+    LOG_DEBUG(logPuzzle, "Puzzle State: Powered");
     
-    beakersCorrect = true;
-    // Check the RFID readers
+    // Only readers with a correct tag take part, and at least one must
+    beakersCorrect = false;
+    for (int i = 0; i < numReaders && !beakersCorrect; i++)
+    {
+      beakersCorrect = readerUsed(i);
+    }
+    // Poll the RFID readers (or "get inventory" in ISO15693-speak) within the scan budget
+    rfid.poll(rfidScanBudget);
+    tagCache.update(rfid);
     for (int i = 0; i < numReaders; i++)
     {
-      // Variable to store the ID of any tag read by this reader
-      uint8_t thisUid[8];
-      // Try to read a tag ID (or "get inventory" in ISO15693-speak)
-      ISO15693ErrorCode rc = nfc[i].getInventory(thisUid);
+      // ID of any tag read by this reader
+      uint8_t *thisUid = rfid.uid[i];
 
       // If no tag is detected, set the UID to all zeros
-      if (rc != ISO15693_EC_OK)
+      if (rfid.result[i] != ISO15693_EC_OK)
       {
         if(memcmp(lastUid[i], noUid, 8) != 0)
         {
           // Tag was removed, clear last UID
           memset(lastUid[i], 0, 8); // Clear last UID to reflect no tag
-          Serial.print("Tag removed from reader #"); 
-          Serial.println(i);
+          LOG_INFO(logRfid, "Tag removed from reader #%d", i);
           showCurrentStatus(); // Show the cleared status
         }
-      beakersCorrect = false; // No tag detected, so beakers are incorrect
+      if (readerUsed(i))
+      {
+        beakersCorrect = false; // No tag detected, so beakers are incorrect
+      }
         continue; // move to the next reader
       }
 
@@ -374,13 +566,13 @@ void loop() {
       }
       
         // If this the detected tag matches the correct tag
-        if (memcmp(thisUid, correctUid[i], 8) != 0)
+        if (readerUsed(i) && !tagDb.isCorrect(i, thisUid))
         {
           beakersCorrect = false; // Incorrect tag detected
         }
 
         // If reset tag is detected, call reset function
-      if (memcmp(thisUid, resetUid, 8) == 0)
+      if (tagDb.isReset(thisUid))
       {
         onReset();
       }      
@@ -394,8 +586,15 @@ void loop() {
       {
         LS1.Flash(LS1.Color(255, 0, 0), 80, Strip1Start, Strip1Length, forward);
       }
-      showCurrentStatus();
-      delay(2000);
+      if (millis() - beakersWrongMillis >= beakersWrongHold)
+      {
+        showCurrentStatus();
+        beakersWrongMillis = millis();
+      }
+    }
+    else if (millis() - beakersWrongMillis < beakersWrongHold)
+    {
+      // Beakers just put right, keep the red flash up until the hold is over
     }
     else if (!doorClosed)
     {
@@ -442,7 +641,7 @@ void loop() {
   }
   case Solved:
     {
-    Serial.println("Puzzle State: Solved");
+    LOG_DEBUG(logPuzzle, "Puzzle State: Solved");
     //Check if game has been solved more than 30 minutes, if so turn off all lights.
     currentMillis = millis();
     if (currentMillis - solvedMillis > 1800000)
@@ -473,15 +672,11 @@ void loop() {
     }
     }
     // Check the RFID readers
+    rfid.poll(rfidScanBudget);
     for (int i = 0; i < numReaders; i++)
     {
-      // Variable to store the ID of any tag read by this reader
-      uint8_t thisUid[8];
-      // Try to read a tag ID (or "get inventory" in ISO15693-speak)
-      ISO15693ErrorCode rc = nfc[i].getInventory(thisUid);
-
       // If reset tag is detected, call reset function
-      if (memcmp(thisUid, resetUid, 8) == 0)
+      if (tagDb.isReset(rfid.uid[i]))
       {
         onReset();
       }
@@ -490,7 +685,7 @@ void loop() {
     }
   case GameOver:
     {
-    Serial.println("Puzzle State: Game Over...Awaiting Reset");
+    LOG_DEBUG(logPuzzle, "Puzzle State: Game Over...Awaiting Reset");
     // Turn all lights off if they are not already off
     if(LS1.ActivePattern != none)
     {
@@ -514,15 +709,11 @@ void loop() {
     }
 
     // Check the RFID readers
+    rfid.poll(rfidScanBudget);
     for (int i = 0; i < numReaders; i++)
     {
-      // Variable to store the ID of any tag read by this reader
-      uint8_t thisUid[8];
-      // Try to read a tag ID (or "get inventory" in ISO15693-speak)
-      ISO15693ErrorCode rc = nfc[i].getInventory(thisUid);
-
       // If reset tag is detected, call reset function
-      if (memcmp(thisUid, resetUid, 8) == 0)
+      if (tagDb.isReset(rfid.uid[i]))
       {
         onReset();
       }
@@ -532,25 +723,55 @@ void loop() {
   }
   }
   delay(50);      
-  client.loop();
+  if (solveScheduled && (long)(millis() - (solveAt - solveLead)) >= 0) {
+    solveScheduled = false;
+    onSolve(solveAt);
+  }
+  telemetryUpdate();
+  eventLog.update(networkState == netConnected);
+  ota.update(networkState == netConnected);
+  assets.update();
+  timeline.update();
+  publishState();
+  binLog.update();
+  trace.update();
+  metricsUpdate();
+  profiler.update();
+  heapUpdate();
+  serialConsole();
+  networkUpdate();
+  // Cues start here, between the last frame and the next
+  lightCues.update();
   LS1.Update();
   LS2.Update();
   LS3.Update();
   LS4.Update();
+  Flow.Update();
+  loopMicros.record(micros() - loopStarted);
 }
 
-void onSolve()
+// Run the solve sequence, starting the lights at startAt (a millis() value) when given so props
+// solving together light up together
+void onSolve(unsigned long startAt)
 {
-  Serial.println("Puzzle Solved!");
+  TRACE_SPAN("onSolve");
+  puzzleSolves.add();
+  LOG_INFO(logPuzzle, "Puzzle Solved!");
 
   // Start the light sequences for LS2 and LS4
   LS2.AcceleratingSequence(LS2.Color(255, 0, 0), Strip2Start, Strip2Length, forward);
   LS3.AcceleratingSequence(LS3.Color(128, 0, 128), Strip3Start, Strip3Length, forward);
   LS4.AcceleratingSequence(LS4.Color(0, 0, 255), Strip4Start, Strip4Length, reverse);
+  unsigned long startTime = millis();
+  if (startAt) {
+    LS2.StartAt(startAt);
+    LS3.StartAt(startAt);
+    LS4.StartAt(startAt);
+    startTime = startAt;
+  }
     
   // Run for 5 seconds (use millis() for non-blocking delay)
-  unsigned long startTime = millis();
-  while(millis() - startTime < 5000)
+  while((long)(millis() - startTime) < 5000)
   {
     LS2.Update();
     LS3.Update();
@@ -589,18 +810,25 @@ void onSolve()
 
   solvedMillis = millis();  
   puzzleState = Solved;
+  reportEvent(eventSolve, 0, 0);
 }
 
 void onReset()
 {
-  Serial.println("Puzzle Reset!");
+  TRACE_SPAN("onReset");
+  puzzleResets.add();
+  LOG_INFO(logPuzzle, "Puzzle Reset!");
+  reportEvent(eventReset, 0, 0);
   // Lock the crystal door and unlock the beaker door
   digitalWrite(crystalDoor, HIGH);
   delay(10);
   digitalWrite(crystalDoor, LOW);
   delay(10);
   digitalWrite(beakerDoor, LOW);
-  // Turn off all lights
+  // Forget the tags read so far so the reset tag is not acted on again
+  rfid.clear();
+  // Turn off all lights, cues included
+  lightCues.releaseAll();
   LS1.ActivePattern = none;
   LS2.ActivePattern = none;
   LS3.ActivePattern = none;
@@ -620,7 +848,8 @@ void onReset()
 
 void gameOver()
 {
-  Serial.println("Game Over!");
+  LOG_INFO(logPuzzle, "Game Over!");
+  puzzleGameOvers.add();
   // Lock the crystal door and unlock the beaker door
   //digitalWrite(crystalDoor, LOW);
   digitalWrite(beakerDoor, LOW);
@@ -641,14 +870,637 @@ void showCurrentStatus() {
         if(lastUid[i][j]<0x10) { Serial.print("0"); }
         Serial.print(lastUid[i][j], HEX);
       }
-      if(memcmp(lastUid[i], correctUid[i], 8) == 0) {
+      if(tagDb.isCorrect(i, lastUid[i])) {
         Serial.print(F(" - CORRECT"));
       }
       else {
         Serial.print(F(" - INCORRECT"));
       }
+      // Beaker contents from tag memory (version, ingredient, state)
+      const uint8_t *beaker = tagCache.data(i);
+      if(beaker) {
+        Serial.print(F(" v"));
+        Serial.print(beaker[0]);
+        Serial.print(F(" ingredient "));
+        Serial.print(beaker[1]);
+        Serial.print(F(" state "));
+        Serial.print(beaker[2]);
+      }
     }
     Serial.println("");
  }
+ Serial.print(F("Scan pass: "));
+ Serial.print(rfid.passMicros);
+ Serial.print(F(" us (max "));
+ Serial.print(rfid.maxPassMicros);
+ Serial.println(F(" us)"));
+ tagCache.printStats();
+ printNetworkStatus();
+ #ifndef MQTT_BLOCKING
+ client.printStats();
+ #endif
+ outbox.printStats();
+ eventLog.printStats();
+ ota.printStatus();
+ binLog.printStats();
+ netClock.printStatus();
+ lightCues.printStats();
+ trace.printStats();
+ profiler.printStats();
+ heapAudit.printStats();
+ printStacks();
+ pixelArena.printLayout();
+ assets.printStatus();
  Serial.println(F("---"));
-}
\ No newline at end of file
+}
+
+// Commands accepted on the device and room topics and the serial console. New commands only need a handler and a line here.
+void registerCommands()
+{
+  commands.add("solve", onSolveCommand);
+  commands.add("reset", onResetCommand);
+  commands.add("tagdb", onTagDbCommand);
+  commands.add("commands", onCommandsCommand);
+  commands.add("telemetry", onTelemetryCommand);
+  commands.add("ack", onAckCommand);
+  commands.addImmediate("ping", onPingCommand);
+  commands.add("ota", onOtaCommand);
+  commands.add("log", onLogCommand);
+  commands.addImmediate("clock", onClockCommand);
+  commands.add("light", onLightCommand);
+  commands.add("trace", onTraceCommand);
+  commands.add("metrics", onMetricsCommand);
+  commands.add("profile", onProfileCommand);
+  commands.add("heap", onHeapCommand);
+  commands.add("assets", onAssetsCommand);
+}
+
+// "solve" solves at once, "solve at <ms>" at that time on the shared clock (Unix epoch ms), so
+// the host can make several props solve together
+void onSolveCommand(CommandArgs &args)
+{
+  LOG_INFO(logPuzzle, "Solve received");
+  if (args.is(0, "at")) {
+    uint64_t at = args.toUInt64(1);
+    if (!netClock.synced() || !netClock.localMillis(at, solveAt)) {
+      LOG_WARN(logPuzzle, "Solve time is not on the shared clock!");
+      return;
+    }
+    solveScheduled = true;
+    return;
+  }
+  onSolve();
+}
+
+void onResetCommand(CommandArgs &args)
+{
+  LOG_INFO(logPuzzle, "Reset received");
+  onReset();
+}
+
+// Handle "tagdb ..." commands from MQTT
+//    tagdb reload                          reload the database file
+//    tagdb print                           print the database as a "tagdb set" command
+//    tagdb set <line>;<line>;...           replace the database
+//    tagdb add <uid> correct <reader>      add or replace a tag
+//    tagdb bench <entries>                 measure lookup time
+//    tagdb assets                          replace the database with the asset bundle's tag table
+void onTagDbCommand(CommandArgs &args)
+{
+  if (args.is(0, "reload")) {
+    tagDb.reload();
+  }
+  else if (args.is(0, "print")) {
+    tagDb.print();
+  }
+  else if (args.is(0, "assets")) {
+    uint32_t length;
+    const char *tags = assets.text("tags", assetTags, length);
+    if (!tags || !tagDb.replace(tags, length)) {
+      LOG_WARN(logRfid, "No tag table in the asset bundle!");
+    }
+  }
+  else if (args.is(0, "set")) {
+    if (!tagDb.replace(args.rest(1), args.restLength(1))) {
+      LOG_WARN(logRfid, "Tag database could not be replaced!");
+    }
+  }
+  else if (args.is(0, "add")) {
+    if (!tagDb.append(args.rest(1), args.restLength(1))) {
+      LOG_WARN(logRfid, "Tag could not be added!");
+    }
+  }
+  else if (args.is(0, "bench")) {
+    tagDb.benchmark(args.toInt(1, 2000));
+  }
+  else {
+    LOG_WARN(logRfid, "Unknown tag database command!");
+  }
+}
+
+// Handle "commands ..." from MQTT
+//    commands stats                        calls and handler time per command
+//    commands bench <rounds>               hashed lookup against a strcmp chain
+void onCommandsCommand(CommandArgs &args)
+{
+  if (args.is(0, "bench")) {
+    long rounds = args.toInt(1, 10000);
+    CommandRegistry::benchmark(rounds > 0 ? rounds : 10000);
+  }
+  else {
+    commands.printStats();
+  }
+}
+
+// Handle "telemetry ..." from MQTT
+//    telemetry stats                       bytes/s and CPU time per encoding
+//    telemetry format msgpack|json         switch the encoding, to compare the two
+//    telemetry rate <sample ms> <publish ms>  each 1 ms to an hour, sample is at least 10 ms
+//    telemetry flush                       publish the pending batch now
+void onTelemetryCommand(CommandArgs &args)
+{
+  if (args.is(0, "format")) {
+    telemetry.setFormat(args.is(1, "json") ? formatJson : formatMsgPack);
+  }
+  else if (args.is(0, "rate")) {
+    long sample = args.toInt(1, telemetrySampleDefault);
+    long publish = args.toInt(2, telemetryPublishDefault);
+    if (sample <= 0 || publish <= 0 || sample > telemetryRateMax || publish > telemetryRateMax) {
+      outbox.publish(hostTopic, "telemetry error rate");
+    }
+    else {
+      telemetry.setRate(sample, publish);
+    }
+  }
+  else if (args.is(0, "flush")) {
+    telemetry.flush();
+  }
+  else {
+    telemetry.printStats();
+  }
+}
+
+// Send an event with the next telemetry batch and through the event log, which keeps it until
+// the host acknowledges it
+void reportEvent(telemetryEvent code, uint8_t index, uint32_t value, const uint8_t *uid)
+{
+  telemetry.event(code, index, value, uid);
+  eventLog.append(code, index, value, uid);
+}
+
+// Handle "ack <seq>" from the host: every event up to seq has arrived
+void onAckCommand(CommandArgs &args)
+{
+  long seq = args.toInt(0, 0);
+  if (seq > 0) {
+    eventLog.ack(seq);
+  }
+}
+
+// Handle "ota ..." from MQTT, results are reported on the host topic
+//    ota <url> [force]                     install the update the server has for this image
+//    ota confirm                           keep a new image before its trial run is over
+//    ota rollback                          boot the previous image
+//    ota status                            print partitions and the last update
+// Updates are refused while a game is in progress unless forced.
+void onOtaCommand(CommandArgs &args)
+{
+  if (args.is(0, "confirm")) {
+    ota.confirm();
+  }
+  else if (args.is(0, "rollback")) {
+    if (!ota.rollback()) {
+      LOG_WARN(logOta, "No image to roll back to!");
+    }
+  }
+  else if (args.is(0, "status") || args.count() == 0) {
+    ota.printStatus();
+  }
+  else if ((puzzleState == Powered || puzzleState == Solved) && !args.is(1, "force")) {
+    LOG_WARN(logOta, "Game in progress, update refused!");
+    outbox.publish(hostTopic, "ota failed game in progress");
+  }
+  else if (!ota.start(args.arg(0), args.length(0))) {
+    LOG_WARN(logOta, "Update already running!");
+  }
+}
+
+// Handle "log ..." from MQTT
+//    log text                              format on the device and print to Serial (default)
+//    log serial                            binary batches on Serial, for tools/binlog_decode.py
+//    log mqtt                              binary batches on the log topic
+//    log off                               discard
+//    log level <module|all> <level>        none, error, warn, info, debug or trace
+//    log levels                            level of each module
+//    log stats                             records, drops and cost per record
+void onLogCommand(CommandArgs &args)
+{
+  if (args.is(0, "level")) {
+    byte module = numLogModules;
+    byte level = numLogLevels;
+    for (byte m = 0; m < numLogModules; m++) {
+      if (args.is(1, logModuleNames[m])) {
+        module = m;
+      }
+    }
+    for (byte l = 0; l < numLogLevels; l++) {
+      if (args.is(2, logLevelNames[l])) {
+        level = l;
+      }
+    }
+    if ((module == numLogModules && !args.is(1, "all")) || level == numLogLevels) {
+      outbox.publish(hostTopic, "log error level");
+      return;
+    }
+    binLog.setLevel(module, (logLevel)level);
+    binLog.printLevels();
+    return;
+  }
+  if (args.is(0, "levels")) {
+    binLog.printLevels();
+    return;
+  }
+  if (args.is(0, "text")) {
+    binLog.setSink(sinkText);
+  }
+  else if (args.is(0, "serial")) {
+    binLog.setSink(sinkSerial);
+  }
+  else if (args.is(0, "mqtt")) {
+    binLog.setSink(sinkMqtt);
+  }
+  else if (args.is(0, "off")) {
+    binLog.setSink(sinkOff);
+  }
+  else {
+    binLog.printStats();
+  }
+}
+
+// Handle "clock <seq> <host time>" from tools/clock_skew.cpp. The reply carries the shared clock
+// when the message was handled and when the reply was queued, in microseconds. It is an
+// immediate command, answered as soon as it arrives rather than on the next pass of the loop.
+void onClockCommand(CommandArgs &args)
+{
+  unsigned long long received = netClock.nowMicros();
+  char reply[96];
+  int len = snprintf(reply, sizeof(reply), "clock %.*s %.*s %llu %llu", (int)args.length(0), args.arg(0),
+    (int)args.length(1), args.arg(1), received, (unsigned long long)netClock.nowMicros());
+  mqttReply(hostTopic, reply, len);
+}
+
+// Handle "light ..." from MQTT, see lightcues.h
+//    light <1-5|all> <pattern> [key=value ...]   start a cue, holding the strip (5 is the flow view)
+//    light <1-5|all> release                     hand the strip back to the puzzle
+//    light stats                                 cues applied, replaced, rate limited and rejected
+void onLightCommand(CommandArgs &args)
+{
+  lightCues.command(args);
+}
+
+// Handle "trace ..." from MQTT, see trace.h
+//    trace dump                            publish the trace ring to the trace topic
+//    trace dump serial                     print it to Serial instead (blocks while it prints)
+//    trace on / trace off                  start or stop recording
+//    trace stats                           events recorded and overwritten
+void onTraceCommand(CommandArgs &args)
+{
+  if (args.is(0, "dump") && args.is(1, "serial")) {
+    trace.print();
+  }
+  else if (args.is(0, "dump")) {
+    if (!trace.dump()) {
+      outbox.publish(hostTopic, "trace busy");
+    }
+  }
+  else if (args.is(0, "on")) {
+    trace.enabled = true;
+  }
+  else if (args.is(0, "off")) {
+    trace.enabled = false;
+  }
+  else {
+    trace.printStats();
+  }
+}
+
+// Handle "metrics ..." from MQTT, see metrics.h
+//    metrics                               print every metric to Serial
+//    metrics publish                       publish them now
+//    metrics rate <ms>                     publishing period, 1 ms to an hour
+//    metrics rate off                      stop publishing
+void onMetricsCommand(CommandArgs &args)
+{
+  if (args.is(0, "publish")) {
+    metricsUpdate(true);
+  }
+  else if (args.is(0, "rate")) {
+    long period = args.toInt(1, 0);
+    if (args.is(1, "off")) {
+      metricsPeriod = 0;
+    }
+    else if (period <= 0 || period > metricsPeriodMax) {
+      outbox.publish(hostTopic, "metrics error rate");
+    }
+    else {
+      metricsPeriod = period;
+    }
+  }
+  else {
+    printMetrics();
+  }
+}
+
+// Handle "profile ..." from MQTT or the serial console, see profiler.h
+//    profile <seconds> [hz] [stacks]       sample loop()'s core, then publish the result, or
+//                                          print it when started from the serial console
+//    profile stop                          stop early, the samples so far are kept
+//    profile dump                          publish the last result to the profile topic again
+//    profile dump serial                   print it to Serial
+//    profile stats                         samples taken and dropped
+void onProfileCommand(CommandArgs &args)
+{
+  if (args.is(0, "stop")) {
+    profiler.stop();
+  }
+  else if (args.is(0, "dump") && args.is(1, "serial")) {
+    profiler.print();
+  }
+  else if (args.is(0, "dump")) {
+    if (!profiler.dump()) {
+      outbox.publish(hostTopic, "profile busy");
+    }
+  }
+  else if (args.toInt(0, 0) > 0) {
+    if (!profiler.start(args.toInt(0, 0), args.toInt(1, profileDefaultHz), args.is(1, "stacks") || args.is(2, "stacks"), args.topic() == nullptr)) {
+      outbox.publish(hostTopic, "profile busy");
+    }
+  }
+  else {
+    profiler.printStats();
+  }
+}
+
+// Handle "heap ..." from MQTT or the serial console, see heapaudit.h
+//    heap                                  allocations per subsystem, sites that allocated after
+//                                          setup and the stack left on each task
+//    heap strict on|off                    abort on an allocation after setup
+//    heap lock / heap unlock               start or stop treating loop() allocations as violations
+void onHeapCommand(CommandArgs &args)
+{
+  if (args.is(0, "strict")) {
+    heapAudit.strict = args.is(1, "on");
+  }
+  else if (args.is(0, "lock")) {
+    heapAudit.lock();
+  }
+  else if (args.is(0, "unlock")) {
+    heapAudit.unlock();
+  }
+  else {
+    heapAuditSample();
+    heapAudit.printStats();
+    printStacks();
+  }
+}
+
+// Handle "assets ..." from MQTT or the serial console, see assets.h. Results of a load are
+// reported on the host topic.
+//    assets                                the bundle and what is in it
+//    assets load <url> [force]             download a new bundle into the assets partition
+//    assets reload                         map the partition again after writing it with esptool
+//    assets bench [reads]                  time reads from the mapped bundle against RAM
+//    assets play <timeline> / assets stop  run the commands of a timeline at their times
+// Loads are refused while a game is in progress unless forced. Cues playing frames and the
+// timeline stop before the bundle goes.
+void onAssetsCommand(CommandArgs &args)
+{
+  if (args.is(0, "load")) {
+    if ((puzzleState == Powered || puzzleState == Solved) && !args.is(2, "force")) {
+      LOG_WARN(logOta, "Game in progress, assets not loaded!");
+      outbox.publish(hostTopic, "assets failed game in progress");
+      return;
+    }
+    timeline.stop();
+    lightCues.dropAssets();
+    if (!assets.load(args.arg(1), args.length(1))) {
+      LOG_WARN(logOta, "Assets already loading!");
+    }
+  }
+  else if (args.is(0, "reload")) {
+    timeline.stop();
+    lightCues.dropAssets();
+    assets.reload();
+    assets.printStatus();
+  }
+  else if (args.is(0, "play")) {
+    const AssetEntry *entry = assets.find(args.arg(1), args.length(1), assetTimeline);
+    if (!entry) {
+      LOG_WARN(logLights, "No such timeline!");
+      return;
+    }
+    timeline.play((const char *)assets.data(entry), entry->size);
+  }
+  else if (args.is(0, "stop")) {
+    timeline.stop();
+  }
+  else if (args.is(0, "bench")) {
+    long reads = args.toInt(1, 10000);
+    assets.benchmark(reads > 0 ? reads : 10000);
+  }
+  else {
+    assets.printStatus();
+    assets.printList();
+  }
+}
+
+// Report each new call site that allocated after setup once, in the log and as an event
+void heapUpdate()
+{
+  HeapSite *site;
+  while ((site = heapAudit.unreported())) {
+    LOG_WARN(logSystem, "Allocated %u bytes after setup from 0x%08x (%s)", (unsigned)site->size, (unsigned)site->caller, logModuleNames[site->module]);
+    reportEvent(eventHeap, site->module, site->size);
+  }
+}
+
+// Run commands typed on the serial console, one per line, as if they came over MQTT
+void serialConsole()
+{
+  static char line[128];
+  static byte length = 0;
+  while (Serial.available()) {
+    char c = Serial.read();
+    if (c == '\r' || c == '\n') {
+      if (length && !commands.dispatch((const uint8_t *)line, length)) {
+        LOG_WARN(logSystem, "Unknown command");
+      }
+      length = 0;
+    }
+    else if (length < sizeof(line)) {
+      line[length++] = c;
+    }
+  }
+}
+
+// Sample the gauges and publish every metric as MessagePack once per period, or now
+void metricsUpdate(bool now)
+{
+  static unsigned long lastPublish = 0;
+  if (!now && (metricsPeriod == 0 || millis() - lastPublish < metricsPeriod)) {
+    return;
+  }
+  lastPublish = millis();
+  heapFree.set(ESP.getFreeHeap());
+  heapMinFree.set(ESP.getMinFreeHeap());
+  wifiRssi.set(networkState == netConnected ? WiFi.RSSI() : 0);
+  heapAuditSample();
+  uint8_t buffer[metricsBufferSize];
+  MsgPackWriter out(buffer, sizeof(buffer));
+  encodeMetrics(out, deviceID, millis() / 1000);
+  if (!out.overflow()) {
+    outbox.publish(metricsTopic, buffer, out.length());
+  }
+}
+
+// Report changes as events and sample the puzzle state, the telemetry publisher batches both
+void telemetryUpdate()
+{
+  static PuzzleState lastState = Initializing;
+  static bool lastPower = false;
+  static bool lastDoor = false;
+  static uint8_t reportedUid[numReaders][8];
+
+  if (puzzleState != lastState) {
+    TRACE_INSTANT("state", puzzleState);
+    reportEvent(eventState, 0, puzzleState);
+    lastState = puzzleState;
+  }
+  if (alchemyPower != lastPower) {
+    reportEvent(eventLaser, 0, alchemyPower);
+    lastPower = alchemyPower;
+  }
+  if (doorClosed != lastDoor) {
+    reportEvent(eventDoor, 0, doorClosed);
+    lastDoor = doorClosed;
+  }
+  for (byte i = 0; i < numReaders; i++) {
+    if (memcmp(reportedUid[i], lastUid[i], 8) != 0) {
+      reportEvent(eventTag, i, 0, lastUid[i]);
+      memcpy(reportedUid[i], lastUid[i], 8);
+    }
+  }
+
+  if (telemetry.snapshotDue()) {
+    TelemetrySnapshot snapshot;
+    snapshot.millis = millis();
+    snapshot.state = puzzleState;
+    snapshot.inputs = (alchemyPower ? inputLaser : 0) | (doorClosed ? inputDoorClosed : 0) | (beakersCorrect ? inputBeakersCorrect : 0);
+    snapshot.numReaders = numReaders;
+    snapshot.uids = lastUid;
+    telemetry.snapshot(snapshot);
+  }
+  telemetry.update();
+}
+
+// Queue a retained state topic. due is cleared once the topic is queued, so a topic the
+// outbound queue had no room for is tried again. A newer payload replaces one still waiting in
+// the outbound queue.
+void publishRetained(const char *topic, const char *payload, bool &due)
+{
+  if (outbox.publish(topic, payload, keyState, true)) {
+    due = false;
+  }
+}
+
+const byte stateStripCount = sizeof(cueStrips) / sizeof(cueStrips[0]);
+
+// Raw fields behind the retained state topics, compared on every loop so a payload is only
+// formatted when something in it changed
+struct PublishedState {
+  byte puzzle;
+  bool beakerLocked;
+  bool doorClosed;
+  bool beakersCorrect;
+  unsigned long tagLoads;       // a reload can change which tags are correct
+  uint8_t uids[numReaders][8];
+  pattern patterns[stateStripCount];
+  uint32_t colors[stateStripCount];
+};
+
+// Keep the retained state topics up to date
+void publishState()
+{
+  static const char *stateNames[] = {"Initializing", "Unpowered", "Powered", "Solved", "GameOver"};
+  static const char *patternNames[] = {"none", "runningLights", "theaterChase", "colorWipe", "colorWave", "cylonEye", "scanner", "fade", "acceleratingSequence", "flash", "frameSequence"};
+  const byte patternCount = sizeof(patternNames) / sizeof(patternNames[0]);
+  static PublishedState last;
+  static bool stateDue, doorsDue, beakersDue, lightsDue;
+  char payload[256 + numReaders * 48];
+  int len;
+
+  if (republishState) {
+    stateDue = doorsDue = beakersDue = lightsDue = true;
+    republishState = false;
+  }
+
+  if (puzzleState != last.puzzle) {
+    last.puzzle = puzzleState;
+    stateDue = true;
+  }
+  if (stateDue) {
+    publishRetained(stateTopic, stateNames[puzzleState], stateDue);
+  }
+
+  bool beakerLocked = digitalRead(beakerDoor) == HIGH;
+  if (beakerLocked != last.beakerLocked || doorClosed != last.doorClosed) {
+    last.beakerLocked = beakerLocked;
+    last.doorClosed = doorClosed;
+    doorsDue = true;
+  }
+  if (doorsDue) {
+    snprintf(payload, sizeof(payload), "{\"beakerLocked\":%s,\"doorClosed\":%s}",
+      beakerLocked ? "true" : "false", doorClosed ? "true" : "false");
+    publishRetained(doorsTopic, payload, doorsDue);
+  }
+
+  if (beakersCorrect != last.beakersCorrect || tagDb.loads != last.tagLoads || memcmp(lastUid, last.uids, sizeof(lastUid)) != 0) {
+    last.beakersCorrect = beakersCorrect;
+    last.tagLoads = tagDb.loads;
+    memcpy(last.uids, lastUid, sizeof(lastUid));
+    beakersDue = true;
+  }
+  if (beakersDue) {
+    len = snprintf(payload, sizeof(payload), "{\"correct\":%s,\"readers\":[", beakersCorrect ? "true" : "false");
+    for (byte i = 0; i < numReaders; i++) {
+      if (memcmp(lastUid[i], noUid, 8) == 0) {
+        len += snprintf(&payload[len], sizeof(payload) - len, "%snull", i ? "," : "");
+        continue;
+      }
+      len += snprintf(&payload[len], sizeof(payload) - len, "%s{\"uid\":\"", i ? "," : "");
+      for (byte j = 0; j < 8; j++) {
+        len += snprintf(&payload[len], sizeof(payload) - len, "%02X", lastUid[i][j]);
+      }
+      len += snprintf(&payload[len], sizeof(payload) - len, "\",\"correct\":%s}", tagDb.isCorrect(i, lastUid[i]) ? "true" : "false");
+    }
+    snprintf(&payload[len], sizeof(payload) - len, "]}");
+    publishRetained(beakersTopic, payload, beakersDue);
+  }
+
+  for (byte i = 0; i < stateStripCount; i++) {
+    if (cueStrips[i]->ActivePattern != last.patterns[i] || cueStrips[i]->Color1 != last.colors[i]) {
+      last.patterns[i] = cueStrips[i]->ActivePattern;
+      last.colors[i] = cueStrips[i]->Color1;
+      lightsDue = true;
+    }
+  }
+  if (lightsDue) {
+    len = snprintf(payload, sizeof(payload), "[");
+    for (byte i = 0; i < stateStripCount; i++) {
+      len += snprintf(&payload[len], sizeof(payload) - len, "%s{\"pattern\":\"%s\",\"color\":\"%06lX\"}",
+        i ? "," : "", cueStrips[i]->ActivePattern < patternCount ? patternNames[cueStrips[i]->ActivePattern] : "unknown", (unsigned long)(cueStrips[i]->Color1 & 0xFFFFFF));
+    }
+    snprintf(&payload[len], sizeof(payload) - len, "]");
+    publishRetained(lightsTopic, payload, lightsDue);
+  }
+}
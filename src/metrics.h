@@ -0,0 +1,236 @@
+#ifndef Metrics_h
+#define Metrics_h
+
+#include "native_hal.h"
+#include <atomic>
+
+// Counters, gauges and histograms for trending prop health across the fleet
+//
+//      MetricCounter tagReads("rfid.reads");               tagReads.add();
+//      MetricGauge freeHeap("heap.free");                  freeHeap.set(ESP.getFreeHeap());
+//      MetricHistogram loopTime("loop.us", loopBounds, 7); loopTime.record(micros() - started);
+//
+// A metric is a global defined next to the code it measures. Its constructor links it into
+// the registry, so there is no table to keep in step and no allocation. Values are atomics,
+// updated with one relaxed read-modify-write, so any task on either core (or an interrupt) can
+// count without a lock. Counters only grow from boot; the host works out rates and sees a
+// reboot as the uptime going back.
+//
+// encode() writes every metric with a telemetry writer (telemetry.h), as MessagePack:
+//      {"id": device, "up": seconds, "m": {name: value, ...}}
+// counters and gauges are numbers, a histogram is [sum, [bounds...], [counts...]] with one
+// more count than bounds for the values above the last bound.
+
+const byte metricMaxBuckets = 8;            // bounds per histogram
+
+enum metricKind {metricCounter, metricGauge, metricHistogram};
+
+class Metric;
+
+// Registry: the metrics in the order they were defined. Zero initialised, so it is ready
+// before any metric constructor runs.
+struct MetricRegistry
+{
+    Metric *first;
+    Metric *last;
+    byte count;
+};
+
+MetricRegistry metrics;
+
+// Base of every metric, links it into the registry
+class Metric
+{
+    public:
+
+    // Member Variables:
+    const char *name;
+    metricKind kind;
+    Metric *next;
+
+    Metric(const char *metricName, metricKind metricType)
+    {
+        name = metricName;
+        kind = metricType;
+        next = nullptr;
+        if (metrics.last)
+        {
+            metrics.last->next = this;
+        }
+        else
+        {
+            metrics.first = this;
+        }
+        metrics.last = this;
+        metrics.count++;
+    }
+};
+
+// Number of times something happened since boot
+class MetricCounter : public Metric
+{
+    public:
+
+    MetricCounter(const char *name) : Metric(name, metricCounter)
+    {
+        Value.store(0);
+    }
+
+    void add(uint32_t n = 1) { Value.fetch_add(n, std::memory_order_relaxed); }
+    uint32_t value() { return Value.load(std::memory_order_relaxed); }
+
+    private:
+
+    std::atomic<uint32_t> Value;
+};
+
+// Level of something right now
+class MetricGauge : public Metric
+{
+    public:
+
+    MetricGauge(const char *name) : Metric(name, metricGauge)
+    {
+        Value.store(0);
+    }
+
+    void set(int32_t v) { Value.store(v, std::memory_order_relaxed); }
+    void add(int32_t n) { Value.fetch_add(n, std::memory_order_relaxed); }
+    int32_t value() { return Value.load(std::memory_order_relaxed); }
+
+    private:
+
+    std::atomic<int32_t> Value;
+};
+
+// Distribution of a value over fixed buckets, each counting the values up to its bound
+class MetricHistogram : public Metric
+{
+    public:
+
+    MetricHistogram(const char *name, const uint32_t *bounds, byte count) : Metric(name, metricHistogram)
+    {
+        Bounds = bounds;
+        Count = min(count, metricMaxBuckets);
+        for (byte b = 0; b <= metricMaxBuckets; b++)
+        {
+            Buckets[b].store(0);
+        }
+        Sum.store(0);
+    }
+
+    void record(uint32_t v)
+    {
+        byte b = 0;
+        while (b < Count && v > Bounds[b])
+        {
+            b++;
+        }
+        Buckets[b].fetch_add(1, std::memory_order_relaxed);
+        Sum.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    byte bounds() { return Count; }
+    uint32_t bound(byte b) { return Bounds[b]; }
+    uint32_t bucket(byte b) { return Buckets[b].load(std::memory_order_relaxed); }
+    uint32_t sum() { return Sum.load(std::memory_order_relaxed); }
+
+    uint32_t total()
+    {
+        uint32_t n = 0;
+        for (byte b = 0; b <= Count; b++)
+        {
+            n += bucket(b);
+        }
+        return n;
+    }
+
+    private:
+
+    const uint32_t *Bounds;
+    byte Count;
+    std::atomic<uint32_t> Buckets[metricMaxBuckets + 1];
+    std::atomic<uint32_t> Sum;      // wraps, the host takes differences
+};
+
+// Write every metric, see the top of this file
+template <typename Writer>
+void encodeMetrics(Writer &out, const char *device, uint32_t uptime)
+{
+    out.beginMap(3);
+    out.key("id");
+    out.string(device);
+    out.key("up");
+    out.number(uptime);
+    out.key("m");
+    out.beginMap(metrics.count);
+    for (Metric *m = metrics.first; m; m = m->next)
+    {
+        out.key(m->name);
+        if (m->kind == metricCounter)
+        {
+            out.number(((MetricCounter *)m)->value());
+        }
+        else if (m->kind == metricGauge)
+        {
+            out.integer(((MetricGauge *)m)->value());
+        }
+        else
+        {
+            MetricHistogram *h = (MetricHistogram *)m;
+            out.beginArray(3);
+            out.number(h->sum());
+            out.beginArray(h->bounds());
+            for (byte b = 0; b < h->bounds(); b++)
+            {
+                out.number(h->bound(b));
+            }
+            out.endArray();
+            out.beginArray(h->bounds() + 1);
+            for (byte b = 0; b <= h->bounds(); b++)
+            {
+                out.number(h->bucket(b));
+            }
+            out.endArray();
+            out.endArray();
+        }
+    }
+    out.endMap();
+    out.endMap();
+}
+
+// Print every metric to Serial
+void printMetrics()
+{
+    for (Metric *m = metrics.first; m; m = m->next)
+    {
+        Serial.print(m->name);
+        Serial.print(F(": "));
+        if (m->kind == metricCounter)
+        {
+            Serial.println(((MetricCounter *)m)->value());
+        }
+        else if (m->kind == metricGauge)
+        {
+            Serial.println((long)((MetricGauge *)m)->value());
+        }
+        else
+        {
+            MetricHistogram *h = (MetricHistogram *)m;
+            uint32_t n = h->total();
+            Serial.print(n);
+            Serial.print(F(" values, mean "));
+            Serial.print(n ? h->sum() / n : 0);
+            for (byte b = 0; b <= h->bounds(); b++)
+            {
+                Serial.print(b < h->bounds() ? F(", <=") : F(", >"));
+                Serial.print(h->bound(b < h->bounds() ? b : b - 1));
+                Serial.print(F(": "));
+                Serial.print(h->bucket(b));
+            }
+            Serial.println();
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,429 @@
+#ifndef MqttLink_h
+#define MqttLink_h
+
+#include <Arduino.h>
+
+// Transport under the connection manager, outbound queue and command registry. Both offer the
+// PubSubClient calls the firmware uses, so the rest of the code does not care which one is built.
+//
+//      MqttLink (default): AsyncMqttClient, nothing blocks loop()
+//      PubSubClient (MQTT_BLOCKING defined): the original blocking client, kept so round trips
+//      can be compared against it (tools/fleet_load.cpp)
+
+#ifdef MQTT_BLOCKING
+
+#include <PubSubClient.h>
+typedef PubSubClient MqttClient;
+
+#else
+
+#include <AsyncMqttClient.h>
+#include "spscqueue.h"
+
+const uint16_t mqttInboundSize = 4096;      // bytes of commands waiting for loop()
+const uint16_t mqttOutboundSize = 4096;     // bytes of messages waiting for the network task
+const uint16_t mqttReplySize = 1024;        // bytes of replies from immediate commands
+const uint32_t mqttTaskStack = 4096;
+const int mqttTaskPriority = 2;             // above loop(), below the TCP task
+const int mqttTaskCore = 0;                 // with the WiFi stack, loop() runs on core 1
+const uint32_t mqttTaskIdleMillis = 50;     // longest sleep between checks of the queues
+const uint32_t mqttTaskRetryMillis = 5;     // wait when the TCP send buffer is full
+
+typedef void (*MqttCallback)(char *topic, uint8_t *payload, unsigned int length);
+
+// Handler for commands answered on the network side, true when it took the message
+typedef bool (*MqttImmediate)(char *topic, uint8_t *payload, unsigned int length);
+
+// Kinds of outbound record
+enum mqttOp {mqttOpPublish, mqttOpRetained, mqttOpSubscribe};
+
+// Class running MQTT off the puzzle loop
+//
+// AsyncMqttClient does its socket work in the TCP task and reports through callbacks, so
+// connecting and receiving never block. Three lock-free queues (spscqueue.h) carry messages
+// between the tasks, each with a single writer and a single reader:
+//
+//      TCP task  -> loop()         commands, dispatched from loop()
+//      loop()    -> network task   publishes and subscriptions, in order
+//      TCP task  -> network task   replies from immediate commands
+//
+// The network task makes every call into AsyncMqttClient itself. Immediate commands ("ping",
+// "clock") are answered from the TCP task as they arrive instead of waiting for the next pass
+// of loop(), so they must not touch puzzle state. A message loop() does not collect in time is
+// dropped and counted rather than holding up the TCP task.
+//
+// Nothing outbound outlives the session it was queued for. Publishes are refused while the
+// connection is down, and whatever is still queued when it drops is thrown away, so a reconnect
+// starts with the retained state the firmware republishes instead of minutes-old messages.
+class MqttLink
+{
+    public:
+
+    // Member Variables:
+    unsigned long received;         // messages handed to loop()
+    unsigned long immediate;        // messages answered on the network side
+    unsigned long dropped;          // messages lost because loop() fell behind, or too large
+    unsigned long waitMicros;       // total time from arrival to dispatch in loop()
+    unsigned long maxWaitMicros;
+    unsigned long sent;             // messages handed to the TCP connection
+    unsigned long full;             // publishes refused because the outbound queue was full
+    unsigned long stale;            // messages thrown away because the connection dropped
+
+    MqttLink()
+    {
+        received = 0;
+        immediate = 0;
+        dropped = 0;
+        waitMicros = 0;
+        maxWaitMicros = 0;
+        sent = 0;
+        full = 0;
+        stale = 0;
+        Callback = nullptr;
+        Immediate = nullptr;
+        MaxMessage = 256;
+        Task = nullptr;
+        Connected.store(false);
+        ReplyTask.store(nullptr);
+        ConnectRequested.store(false);
+        DisconnectRequested.store(false);
+        Reason = -1;
+        Assembling = nullptr;
+        Discarding = false;
+    }
+
+    MqttLink &setServer(const char *host, uint16_t port)
+    {
+        Mqtt.setServer(host, port);
+        return *this;
+    }
+
+    MqttLink &setCallback(MqttCallback callback)
+    {
+        Callback = callback;
+        return *this;
+    }
+
+    MqttLink &setImmediate(MqttImmediate handler)
+    {
+        Immediate = handler;
+        return *this;
+    }
+
+    // Largest message accepted, as PubSubClient's buffer size
+    bool setBufferSize(uint16_t size)
+    {
+        MaxMessage = size;
+        return true;
+    }
+
+    // Start connecting, connected() turns true when the broker accepts. The strings must outlive
+    // the connection (normally constants).
+    bool connect(const char *id, const char *willTopic, uint8_t willQos, bool willRetain, const char *willMessage)
+    {
+        if (!Task && !begin())
+        {
+            return false;
+        }
+        Id = id;
+        WillTopic = willTopic;
+        WillQos = willQos;
+        WillRetain = willRetain;
+        WillMessage = willMessage;
+        ConnectRequested.store(true, std::memory_order_release);
+        xTaskNotifyGive(Task);
+        return true;
+    }
+
+    bool connected()
+    {
+        return Connected.load(std::memory_order_acquire);
+    }
+
+    // Reason for the last disconnection (AsyncMqttClientDisconnectReason), -1 before any
+    int state() { return Reason; }
+
+    void disconnect()
+    {
+        if (Task)
+        {
+            DisconnectRequested.store(true, std::memory_order_release);
+            xTaskNotifyGive(Task);
+        }
+    }
+
+    // Queue a message for the network task, false when the connection is down or the queue is
+    // full. Called from loop().
+    bool publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained = false)
+    {
+        if (!connected())
+        {
+            return false;
+        }
+        if (!post(Outbound, retained ? mqttOpRetained : mqttOpPublish, topic, payload, length))
+        {
+            full++;
+            return false;
+        }
+        return true;
+    }
+
+    bool publish(const char *topic, const char *payload, bool retained = false)
+    {
+        return publish(topic, (const uint8_t *)payload, strlen(payload), retained);
+    }
+
+    bool subscribe(const char *topic)
+    {
+        return connected() && post(Outbound, mqttOpSubscribe, topic, nullptr, 0);
+    }
+
+    // Queue a reply from an immediate command. On the TCP task it goes on the reply queue.
+    // The same command run by loop() (the serial console, a message that came in pieces, a
+    // timeline) publishes through the outbound queue instead, so each queue keeps one writer.
+    bool reply(const char *topic, const uint8_t *payload, unsigned int length)
+    {
+        if (xTaskGetCurrentTaskHandle() != ReplyTask.load())
+        {
+            return publish(topic, payload, length);
+        }
+        return connected() && post(Replies, mqttOpPublish, topic, payload, length);
+    }
+
+    // Dispatch the commands that have arrived, false when the connection is down. Called from
+    // loop() only.
+    bool loop()
+    {
+        uint16_t length;
+        const uint8_t *record;
+        while ((record = Inbound.peek(length)) != nullptr)
+        {
+            unsigned long arrived;
+            memcpy(&arrived, record, sizeof(arrived));
+            uint8_t topicLength = record[sizeof(arrived)];
+            char *topic = (char *)record + sizeof(arrived) + 1;
+            uint8_t *payload = (uint8_t *)topic + topicLength;
+            unsigned long wait = micros() - arrived;
+            waitMicros += wait;
+            maxWaitMicros = max(maxWaitMicros, wait);
+            received++;
+            if (Callback)
+            {
+                Callback(topic, payload, length - (payload - record));
+            }
+            Inbound.release();
+        }
+        return connected();
+    }
+
+    void printStats()
+    {
+        Serial.print(F("MQTT link: "));
+        Serial.print(received);
+        Serial.print(F(" commands (wait "));
+        Serial.print(received ? waitMicros / received : 0);
+        Serial.print(F(" us average, "));
+        Serial.print(maxWaitMicros);
+        Serial.print(F(" us max), "));
+        Serial.print(immediate);
+        Serial.print(F(" immediate, "));
+        Serial.print(dropped);
+        Serial.print(F(" dropped, "));
+        Serial.print(sent);
+        Serial.print(F(" sent, "));
+        Serial.print(full);
+        Serial.print(F(" refused, "));
+        Serial.print(stale);
+        Serial.println(F(" stale"));
+    }
+
+    private:
+
+    AsyncMqttClient Mqtt;
+    MqttCallback Callback;
+    MqttImmediate Immediate;
+    uint16_t MaxMessage;
+    TaskHandle_t Task;
+    SpscQueue<mqttInboundSize> Inbound;
+    SpscQueue<mqttOutboundSize> Outbound;
+    SpscQueue<mqttReplySize> Replies;
+    std::atomic<bool> Connected;
+    std::atomic<TaskHandle_t> ReplyTask;    // the TCP task, once a message has arrived
+    std::atomic<bool> ConnectRequested;
+    std::atomic<bool> DisconnectRequested;
+    volatile int Reason;
+    const char *Id;
+    const char *WillTopic;
+    uint8_t WillQos;
+    bool WillRetain;
+    const char *WillMessage;
+    uint8_t *Assembling;            // payload of a message arriving in pieces, in Inbound
+    bool Discarding;                // the message arriving in pieces did not fit
+
+    // Hook up the client callbacks and start the network task
+    bool begin()
+    {
+        Mqtt.onConnect([this](bool sessionPresent) {
+            Connected.store(true, std::memory_order_release);
+            xTaskNotifyGive(Task);
+        });
+        Mqtt.onDisconnect([this](AsyncMqttClientDisconnectReason reason) {
+            Reason = (int)reason;
+            Connected.store(false, std::memory_order_release);
+            xTaskNotifyGive(Task);
+        });
+        Mqtt.onMessage([this](char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t length, size_t index, size_t total) {
+            arrive(topic, (uint8_t *)payload, length, index, total);
+        });
+        return xTaskCreatePinnedToCore(task, "mqtt", mqttTaskStack, this, mqttTaskPriority, &Task, mqttTaskCore) == pdPASS;
+    }
+
+    // A piece of an incoming message, in the TCP task. Large payloads come in several pieces.
+    void arrive(char *topic, uint8_t *payload, size_t length, size_t index, size_t total)
+    {
+        if (index == 0)
+        {
+            ReplyTask.store(xTaskGetCurrentTaskHandle());
+            if (length == total && Immediate && Immediate(topic, payload, length))
+            {
+                immediate++;
+                xTaskNotifyGive(Task);
+                return;
+            }
+            size_t topicLength = strlen(topic) + 1;
+            unsigned long now = micros();
+            uint8_t *record = nullptr;
+            if (topicLength <= 0xFF && total <= MaxMessage)
+            {
+                record = Inbound.reserve(sizeof(now) + 1 + topicLength + total);
+            }
+            Discarding = record == nullptr;
+            if (Discarding)
+            {
+                dropped++;
+                return;
+            }
+            memcpy(record, &now, sizeof(now));
+            record[sizeof(now)] = topicLength;
+            memcpy(record + sizeof(now) + 1, topic, topicLength);
+            Assembling = record + sizeof(now) + 1 + topicLength;
+        }
+        if (Discarding)
+        {
+            return;
+        }
+        memcpy(Assembling + index, payload, length);
+        if (index + length >= total)
+        {
+            Inbound.commit();
+        }
+    }
+
+    // Add a record to one of the outbound queues and wake the network task
+    template <uint16_t Size>
+    bool post(SpscQueue<Size> &queue, uint8_t op, const char *topic, const uint8_t *payload, uint16_t length)
+    {
+        uint8_t *record = queue.reserve(1 + sizeof(topic) + length);
+        if (!record)
+        {
+            return false;
+        }
+        record[0] = op;
+        memcpy(record + 1, &topic, sizeof(topic));
+        if (length)
+        {
+            memcpy(record + 1 + sizeof(topic), payload, length);
+        }
+        queue.commit();
+        if (Task)
+        {
+            xTaskNotifyGive(Task);
+        }
+        return true;
+    }
+
+    // Hand queued records to the client, false when its send buffer filled up
+    template <uint16_t Size>
+    bool send(SpscQueue<Size> &queue)
+    {
+        uint16_t length;
+        const uint8_t *record;
+        while ((record = queue.peek(length)) != nullptr)
+        {
+            const char *topic;
+            memcpy(&topic, record + 1, sizeof(topic));
+            const char *payload = (const char *)record + 1 + sizeof(topic);
+            size_t payloadLength = length - 1 - sizeof(topic);
+            uint16_t accepted;
+            if (record[0] == mqttOpSubscribe)
+            {
+                accepted = Mqtt.subscribe(topic, 0);
+            }
+            else
+            {
+                accepted = Mqtt.publish(topic, 0, record[0] == mqttOpRetained, payload, payloadLength);
+                sent += accepted != 0;
+            }
+            if (!accepted)
+            {
+                return false;
+            }
+            queue.release();
+        }
+        return true;
+    }
+
+    // Throw away every queued record, the session they were meant for is gone
+    template <uint16_t Size>
+    void discard(SpscQueue<Size> &queue)
+    {
+        uint16_t length;
+        while (queue.peek(length) != nullptr)
+        {
+            queue.release();
+            stale++;
+        }
+    }
+
+    static void task(void *link)
+    {
+        ((MqttLink *)link)->run();
+    }
+
+    // The network task: connection requests, then replies ahead of loop()'s messages. While the
+    // connection is down anything queued before it dropped is discarded.
+    void run()
+    {
+        uint32_t wait = mqttTaskIdleMillis;
+        while (true)
+        {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait));
+            if (DisconnectRequested.exchange(false, std::memory_order_acquire))
+            {
+                Mqtt.disconnect(true);
+            }
+            if (ConnectRequested.exchange(false, std::memory_order_acquire))
+            {
+                Mqtt.setClientId(Id);
+                Mqtt.setWill(WillTopic, WillQos, WillRetain, WillMessage);
+                Mqtt.connect();
+            }
+            wait = mqttTaskIdleMillis;
+            if (!connected())
+            {
+                discard(Replies);
+                discard(Outbound);
+            }
+            else if (!send(Replies) || !send(Outbound))
+            {
+                wait = mqttTaskRetryMillis;
+            }
+        }
+    }
+};
+
+typedef MqttLink MqttClient;
+
+#endif
+
+#endif
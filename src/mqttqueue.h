@@ -0,0 +1,214 @@
+#ifndef MqttQueue_h
+#define MqttQueue_h
+
+#include <Arduino.h>
+#include "mqttlink.h"
+
+const byte mqttQueueSlots = 16;             // messages waiting at most
+const uint16_t mqttQueueArenaSize = 2048;   // payload bytes waiting at most
+const uint16_t noCoalesce = 0;              // key of messages that are never merged
+
+// One queued message, its payload lives in the arena
+struct MqttQueueSlot
+{
+    const char *topic;          // must outlive the message (normally a constant)
+    uint16_t key;               // messages with the same key replace each other
+    uint16_t offset;            // payload position in the arena
+    uint16_t length;
+    uint16_t capacity;          // arena bytes reserved, a later payload up to this size is copied in place
+    unsigned long queuedAt;     // micros() when the key was first queued
+    bool retained;              // broker keeps the message for new subscribers
+    bool live;                  // false once replaced by a newer message for its key
+};
+
+// Class queueing outbound MQTT messages so publishing never holds up the puzzle loop
+//
+// Messages are copied into a ring of slots with their payloads in a byte arena, and drained
+// in a time budget after client.loop(). A message queued with the key of one still waiting
+// replaces it, so a burst of updates to the same state costs one publish of the latest value.
+// When the queue is full new messages are dropped and counted. Messages still waiting when the
+// broker accepts a new connection are thrown away (clear()) and the state is republished.
+class MqttQueue
+{
+    public:
+
+    // Member Variables:
+    unsigned long queued;           // messages accepted
+    unsigned long coalesced;        // messages that replaced a waiting message
+    unsigned long dropped;          // messages refused because the queue was full
+    unsigned long stale;            // messages thrown away because the connection dropped
+    unsigned long sent;             // messages published
+    unsigned long failures;         // publish calls that failed (message kept for the next drain)
+    unsigned long latencyMicros;    // total time from queueing to publishing
+    unsigned long maxLatencyMicros;
+    byte maxDepth;
+
+    MqttQueue(MqttClient &client)
+    : Client(client)
+    {
+        Head = 0;
+        Count = 0;
+        Tail = 0;
+        queued = 0;
+        coalesced = 0;
+        dropped = 0;
+        stale = 0;
+        sent = 0;
+        failures = 0;
+        latencyMicros = 0;
+        maxLatencyMicros = 0;
+        maxDepth = 0;
+    }
+
+    // Queue a message, false when it was dropped
+    bool publish(const char *topic, const uint8_t *payload, uint16_t length, uint16_t key = noCoalesce, bool retained = false)
+    {
+        MqttQueueSlot *waiting = (key != noCoalesce) ? find(topic, key) : nullptr;
+        if (waiting && length <= waiting->capacity)
+        {
+            memcpy(&Arena[waiting->offset], payload, length);
+            waiting->length = length;
+            coalesced++;
+            return true;
+        }
+
+        int offset = allocate(length);
+        if (Count >= mqttQueueSlots || offset < 0)
+        {
+            dropped++;
+            return false;
+        }
+        if (waiting)
+        {
+            waiting->live = false;  // too big to copy in place, the new copy goes to the back
+            coalesced++;
+        }
+        memcpy(&Arena[offset], payload, length);
+        MqttQueueSlot &slot = Slots[(Head + Count) % mqttQueueSlots];
+        slot.topic = topic;
+        slot.key = key;
+        slot.offset = offset;
+        slot.length = length;
+        slot.capacity = max(length, (uint16_t)1);
+        slot.queuedAt = micros();
+        slot.retained = retained;
+        slot.live = true;
+        Tail = offset + slot.capacity;
+        Count++;
+        maxDepth = max(maxDepth, Count);
+        queued++;
+        return true;
+    }
+
+    bool publish(const char *topic, const char *text, uint16_t key = noCoalesce, bool retained = false)
+    {
+        return publish(topic, (const uint8_t *)text, strlen(text), key, retained);
+    }
+
+    // Publish waiting messages until the queue is empty or the budget is spent. Stops at the
+    // first failed publish and leaves that message at the head.
+    void drain(unsigned long budgetMicros)
+    {
+        unsigned long started = micros();
+        while (Count > 0 && micros() - started < budgetMicros)
+        {
+            MqttQueueSlot &slot = Slots[Head];
+            if (slot.live)
+            {
+                if (!Client.publish(slot.topic, &Arena[slot.offset], slot.length, slot.retained))
+                {
+                    failures++;
+                    return;
+                }
+                unsigned long latency = micros() - slot.queuedAt;
+                latencyMicros += latency;
+                maxLatencyMicros = max(maxLatencyMicros, latency);
+                sent++;
+            }
+            Head = (Head + 1) % mqttQueueSlots;
+            Count--;
+        }
+    }
+
+    // Throw away every waiting message
+    void clear()
+    {
+        for (byte i = 0; i < Count; i++)
+        {
+            stale += Slots[(Head + i) % mqttQueueSlots].live;
+        }
+        Head = 0;
+        Count = 0;
+        Tail = 0;
+    }
+
+    // Messages waiting, including replaced ones not yet skipped
+    byte depth() { return Count; }
+
+    void printStats()
+    {
+        Serial.print(F("MQTT queue: depth "));
+        Serial.print(Count);
+        Serial.print(F(" (max "));
+        Serial.print(maxDepth);
+        Serial.print(F("), "));
+        Serial.print(sent);
+        Serial.print(F(" sent, "));
+        Serial.print(coalesced);
+        Serial.print(F(" coalesced, "));
+        Serial.print(dropped);
+        Serial.print(F(" dropped, "));
+        Serial.print(stale);
+        Serial.print(F(" stale, latency "));
+        Serial.print(sent ? latencyMicros / sent : 0);
+        Serial.print(F(" us (max "));
+        Serial.print(maxLatencyMicros);
+        Serial.println(F(" us)"));
+    }
+
+    private:
+
+    MqttClient &Client;
+    MqttQueueSlot Slots[mqttQueueSlots];
+    byte Head;              // oldest message
+    byte Count;
+    uint16_t Tail;          // end of the newest payload in the arena
+    uint8_t Arena[mqttQueueArenaSize];
+
+    MqttQueueSlot *find(const char *topic, uint16_t key)
+    {
+        for (byte i = 0; i < Count; i++)
+        {
+            MqttQueueSlot &slot = Slots[(Head + i) % mqttQueueSlots];
+            if (slot.live && slot.key == key && slot.topic == topic)
+            {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    // Reserve arena space behind the newest payload, wrapping to the start when the end is
+    // too short. Payloads are freed in queue order, so the arena is a ring like the slots.
+    int allocate(uint16_t length)
+    {
+        length = max(length, (uint16_t)1);
+        if (Count == 0)
+        {
+            Tail = 0;
+            return length <= mqttQueueArenaSize ? 0 : -1;
+        }
+        uint16_t headOffset = Slots[Head].offset;
+        if (Tail > headOffset)
+        {
+            if (length <= mqttQueueArenaSize - Tail)
+            {
+                return Tail;
+            }
+            return length < headOffset ? 0 : -1;
+        }
+        return length < headOffset - Tail ? Tail : -1;
+    }
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef NativeHal_h
+#define NativeHal_h
+
+// Minimal stand-in for the Arduino core so device-independent modules (RFID bank, simulated
+// readers) can be built and benchmarked on a Linux host. Time is virtual: delay() and the
+// simulated hardware advance simMicros instead of sleeping, so benchmarks run faster than real
+// time and give the same answer on every run.
+//
+// With NATIVE_REALTIME defined the clock is the host's monotonic clock and delay() sleeps, for
+// tools that talk to real network peers (see tools/host for the WiFi and MQTT shims).
+
+#ifndef ARDUINO
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#ifdef NATIVE_REALTIME
+#include <time.h>
+#include <unistd.h>
+#endif
+
+using std::min;
+using std::max;
+
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define DEC 10
+#define HEX 16
+#define F(string) (string)
+
+#ifdef NATIVE_REALTIME
+
+// Host monotonic time in microseconds
+unsigned long long hostMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+unsigned long micros()
+{
+    return (unsigned long)hostMicros();
+}
+
+unsigned long millis()
+{
+    return (unsigned long)(hostMicros() / 1000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    usleep(us);
+}
+
+void delay(unsigned long ms)
+{
+    usleep(ms * 1000);
+}
+
+#else
+
+// Virtual time since boot in microseconds
+unsigned long long simMicros = 0;
+
+unsigned long micros()
+{
+    return (unsigned long)simMicros;
+}
+
+unsigned long millis()
+{
+    return (unsigned long)(simMicros / 1000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    simMicros += us;
+}
+
+void delay(unsigned long ms)
+{
+    simMicros += (unsigned long long)ms * 1000;
+}
+
+#endif
+
+long random(long hi)
+{
+    return hi > 0 ? rand() % hi : 0;
+}
+
+long random(long lo, long hi)
+{
+    return lo + random(hi - lo);
+}
+
+// GPIO has no effect on the host
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) { return LOW; }
+
+// Serial output goes to stdout, or nowhere while quiet
+class NativeSerial
+{
+    public:
+
+    bool quiet = false;
+
+    void begin(unsigned long) {}
+    void print(const char *s) { if (!quiet) fputs(s, stdout); }
+    void print(char c) { if (!quiet) fputc(c, stdout); }
+    void print(double d, int digits = 2) { if (!quiet) printf("%.*f", digits, d); }
+    void print(int n, int base = DEC) { print((long)n, base); }
+    void print(unsigned int n, int base = DEC) { print((unsigned long)n, base); }
+    void print(long n, int base = DEC) { if (!quiet) printf(base == HEX ? "%lX" : "%ld", n); }
+    void print(unsigned long n, int base = DEC) { if (!quiet) printf(base == HEX ? "%lX" : "%lu", n); }
+    void write(const uint8_t *data, size_t len) { if (!quiet) fwrite(data, 1, len, stdout); }
+    int availableForWrite() { return 4096; }
+    void println() { if (!quiet) fputc('\n', stdout); }
+    template <typename T> void println(T value) { print(value); println(); }
+    template <typename T> void println(T value, int base) { print(value, base); println(); }
+};
+
+NativeSerial Serial;
+
+#else
+
+#include <Arduino.h>
+
+#endif
+
+// Spend modelled hardware time: advance the virtual clock on the host, really wait on a device
+inline void simAdvance(unsigned long us)
+{
+    delayMicroseconds(us);
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef NetClock_h
+#define NetClock_h
+
+#include <Arduino.h>
+#include <esp_sntp.h>
+#include <sys/time.h>
+
+// Shared clock for props that have to act together
+//
+// Every prop keeps the system clock in step with the same SNTP server on the local network
+// (normally the broker host). SNTP runs in smooth mode: after the first sync, which sets the
+// clock, corrections are slewed with adjtime() so the clock never jumps under a running effect.
+// Effects agree on a start time on this clock and convert it to a millis() deadline just before
+// they start, see NeoPatterns::StartAt(). tools/clock_skew.cpp measures how far apart the props'
+// clocks really are with the "clock" command.
+
+const uint32_t netClockSyncInterval = 60000;        // SNTP poll period, ms (15 s at least)
+const uint64_t netClockMaxLead = 3600000ULL;        // start times further ahead are refused, ms
+
+// Class wrapping the SNTP client and the shared clock
+class NetClock
+{
+    public:
+
+    // Member Variables:
+    volatile unsigned long syncs;           // SNTP replies applied
+    volatile unsigned long lastSyncMillis;  // millis() of the last one
+
+    NetClock()
+    {
+        syncs = 0;
+        lastSyncMillis = 0;
+    }
+
+    // Start polling the time server, WiFi must be initialised
+    void begin(const char *server)
+    {
+        sntp_setoperatingmode(SNTP_OPMODE_POLL);
+        sntp_setservername(0, server);
+        sntp_set_sync_mode(SNTP_SYNC_MODE_SMOOTH);
+        sntp_set_sync_interval(netClockSyncInterval);
+        sntp_set_time_sync_notification_cb(onSync);
+        sntp_init();
+    }
+
+    bool synced() { return syncs > 0; }
+
+    // Microseconds since the Unix epoch on the shared clock
+    uint64_t nowMicros()
+    {
+        struct timeval now;
+        gettimeofday(&now, nullptr);
+        return (uint64_t)now.tv_sec * 1000000ULL + now.tv_usec;
+    }
+
+    uint64_t nowMillis() { return nowMicros() / 1000; }
+
+    // The millis() value at which the shared clock reads sharedMillis, false when that is in the
+    // past or too far ahead to be a sensible start time
+    bool localMillis(uint64_t sharedMillis, unsigned long &local)
+    {
+        uint64_t now = nowMillis();
+        if (sharedMillis < now || sharedMillis - now > netClockMaxLead)
+        {
+            return false;
+        }
+        local = millis() + (unsigned long)(sharedMillis - now);
+        return true;
+    }
+
+    // Correction still being slewed in, microseconds
+    long adjusting()
+    {
+        struct timeval delta;
+        if (adjtime(nullptr, &delta) != 0)
+        {
+            return 0;
+        }
+        return delta.tv_sec * 1000000L + delta.tv_usec;
+    }
+
+    void printStatus()
+    {
+        Serial.print(F("Clock: "));
+        if (!synced())
+        {
+            Serial.println(F("not synced"));
+            return;
+        }
+        Serial.print(syncs);
+        Serial.print(F(" syncs, last "));
+        Serial.print((millis() - lastSyncMillis) / 1000);
+        Serial.print(F(" s ago, slewing "));
+        Serial.print(adjusting());
+        Serial.println(F(" us"));
+    }
+
+    private:
+
+    static void onSync(struct timeval *tv);
+};
+
+NetClock netClock;
+
+// Called from the SNTP task whenever a reply has been applied
+void NetClock::onSync(struct timeval *tv)
+{
+    netClock.syncs++;
+    netClock.lastSyncMillis = millis();
+}
+
+#endif
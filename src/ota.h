@@ -0,0 +1,464 @@
+#ifndef Ota_h
+#define Ota_h
+
+#include <Arduino.h>
+#include <HTTPClient.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_image_format.h>
+#include <mbedtls/sha256.h>
+#include "esp32/rom/miniz.h"
+#include "deltapatch.h"
+#include "mqttqueue.h"
+#include "binlog.h"
+#include "heapaudit.h"
+
+// Over the air updates from a local update server (tools/ota_delta.py serve)
+//
+// The device hashes the image it is running and asks the server for <url>?from=<sha256>. The
+// server answers with a compressed delta against that image when it has it, or a compressed
+// full image otherwise. The download is inflated with the ROM copy of miniz and patched straight
+// into the idle OTA partition, so nothing is buffered beyond a page.
+//
+// A new image boots on trial: it is kept once it has run for otaConfirmMillis and reached the
+// broker, and rolled back if it does not get there within otaTrialTimeout. If it crashes before
+// that the bootloader rolls back on the next reset.
+
+const uint16_t otaReadSize = 1024;              // network bytes read at a time
+const uint16_t otaUrlSize = 160;
+const unsigned long otaStallTimeout = 10000;    // give up when no data arrives for this long
+const unsigned long otaConfirmMillis = 60000;
+const unsigned long otaTrialTimeout = 300000;
+const unsigned long otaRebootDelay = 2000;      // time for the result to reach the host
+const uint32_t otaTaskStack = 8192;
+
+enum otaState {otaIdle, otaRunning, otaDone, otaFailed};
+
+// Keep a freshly installed image pending until OtaUpdater decides, instead of the core marking
+// it valid as soon as it boots
+extern "C" bool verifyRollbackLater()
+{
+    return true;
+}
+
+// Class downloading and installing updates in a task of its own, so the puzzle keeps running
+class OtaUpdater : public DeltaPatcher
+{
+    public:
+
+    // Member Variables:
+    volatile otaState state;
+    bool full;                      // last update was a full image
+    uint32_t downloaded;            // compressed bytes received
+    uint32_t imageBytes;            // bytes written to the update partition
+    unsigned long hashMillis;       // hashing the running image
+    unsigned long totalMillis;      // from the command to the new image being ready
+
+    OtaUpdater(MqttQueue &outbox, const char *topic)
+    : Outbox(outbox)
+    {
+        Topic = topic;
+        state = otaIdle;
+        full = false;
+        downloaded = 0;
+        imageBytes = 0;
+        hashMillis = 0;
+        totalMillis = 0;
+        Trial = false;
+        Reported = true;
+        RebootAt = 0;
+        Handle = 0;
+        Inflator = nullptr;
+        Dict = nullptr;
+    }
+
+    // Check whether this boot is the trial run of a new image
+    void begin()
+    {
+        esp_ota_img_states_t imageState;
+        const esp_partition_t *running = esp_ota_get_running_partition();
+        if (esp_ota_get_state_partition(running, &imageState) == ESP_OK && imageState == ESP_OTA_IMG_PENDING_VERIFY)
+        {
+            Trial = true;
+            TrialStarted = millis();
+            LOG_INFO(logOta, "New image on trial in %s", running->label);
+            Outbox.publish(Topic, "ota trial");
+        }
+    }
+
+    // Start an update, false when one is already running
+    bool start(const char *url, uint16_t length)
+    {
+        if (state == otaRunning || length == 0 || length >= otaUrlSize)
+        {
+            return false;
+        }
+        memcpy(Url, url, length);
+        Url[length] = '\0';
+        state = otaRunning;
+        Reported = false;
+        if (xTaskCreate(task, "ota", otaTaskStack, this, 1, nullptr) != pdPASS)
+        {
+            error = "no task";
+            state = otaFailed;
+        }
+        return true;
+    }
+
+    // Report results, reboot into a new image and settle a trial run. Called from loop().
+    void update(bool online)
+    {
+        if (!Reported && state != otaRunning)
+        {
+            char message[96];
+            if (state == otaDone)
+            {
+                snprintf(message, sizeof(message), "ota done %s %lu %lu %lu %lu",
+                    full ? "full" : "delta", (unsigned long)downloaded, (unsigned long)imageBytes, hashMillis, totalMillis);
+                RebootAt = millis() + otaRebootDelay;
+            }
+            else
+            {
+                snprintf(message, sizeof(message), "ota failed %s", error ? error : "");
+            }
+            LOG_INFO(logOta, "%s", message);
+            Outbox.publish(Topic, message);
+            Reported = true;
+        }
+        if (RebootAt && (long)(millis() - RebootAt) >= 0)
+        {
+            // Straight to Serial, the log would not drain before the restart
+            Serial.println(F("OTA: rebooting into the new image"));
+            esp_restart();
+        }
+        if (Trial)
+        {
+            if (online && millis() - TrialStarted >= otaConfirmMillis)
+            {
+                confirm();
+            }
+            else if (millis() - TrialStarted >= otaTrialTimeout)
+            {
+                Serial.println(F("OTA: new image never reached the broker, rolling back"));
+                esp_ota_mark_app_invalid_rollback_and_reboot();
+            }
+        }
+    }
+
+    // Keep the running image
+    void confirm()
+    {
+        if (Trial && esp_ota_mark_app_valid_cancel_rollback() == ESP_OK)
+        {
+            Trial = false;
+            LOG_INFO(logOta, "New image confirmed");
+            Outbox.publish(Topic, "ota confirmed");
+        }
+    }
+
+    // Boot the previous image, false when there is none
+    bool rollback()
+    {
+        if (state == otaRunning || !esp_ota_check_rollback_is_possible())
+        {
+            return false;
+        }
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+        return true;
+    }
+
+    void printStatus()
+    {
+        const esp_partition_t *running = esp_ota_get_running_partition();
+        const esp_partition_t *next = esp_ota_get_next_update_partition(nullptr);
+        Serial.print(F("OTA: running "));
+        Serial.print(running->label);
+        Serial.print(Trial ? F(" (trial)") : F(""));
+        Serial.print(F(", next "));
+        Serial.print(next ? next->label : "-");
+        if (state == otaRunning)
+        {
+            Serial.print(F(", updating: "));
+            Serial.print(downloaded);
+            Serial.print(F(" bytes in, "));
+            Serial.print(written);
+            Serial.print(F(" bytes written"));
+        }
+        else if (state == otaDone || state == otaFailed)
+        {
+            Serial.print(state == otaDone ? F(", last update ") : F(", last update failed: "));
+            Serial.print(state == otaDone ? (full ? "full " : "delta ") : error);
+            Serial.print(F(" "));
+            Serial.print(downloaded);
+            Serial.print(F(" bytes in "));
+            Serial.print(totalMillis);
+            Serial.print(F(" ms"));
+        }
+        Serial.println();
+    }
+
+    protected:
+
+    bool readSource(uint32_t offset, uint8_t *buffer, size_t len)
+    {
+        return esp_partition_read(Running, offset, buffer, len) == ESP_OK;
+    }
+
+    bool writeTarget(const uint8_t *buffer, size_t len)
+    {
+        mbedtls_sha256_update_ret(&Sha, buffer, len);
+        return esp_ota_write(Handle, buffer, len) == ESP_OK;
+    }
+
+    private:
+
+    MqttQueue &Outbox;
+    const char *Topic;
+    char Url[otaUrlSize];
+    bool Trial;                     // running a new image that is not confirmed yet
+    unsigned long TrialStarted;
+    bool Reported;                  // result of the last update sent to the host
+    unsigned long RebootAt;
+    const esp_partition_t *Running;
+    const esp_partition_t *Target;
+    esp_ota_handle_t Handle;
+    mbedtls_sha256_context Sha;
+    tinfl_decompressor *Inflator;
+    uint8_t *Dict;                  // inflate output, wraps around
+    size_t DictPos;
+    bool Inflated;                  // end of the compressed stream seen
+    uint8_t In[otaReadSize];
+
+    static void task(void *updater)
+    {
+        ((OtaUpdater *)updater)->run();
+        heapTaskExit();
+    }
+
+    void run()
+    {
+        unsigned long started = millis();
+        error = nullptr;
+        full = false;
+        downloaded = 0;
+        imageBytes = 0;
+        written = 0;
+        Handle = 0;
+        Running = esp_ota_get_running_partition();
+        Target = esp_ota_get_next_update_partition(nullptr);
+        Inflator = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+        Dict = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+        bool ok = Target && Inflator && Dict;
+        if (!ok)
+        {
+            fail(Target ? "out of memory" : "no update partition");
+        }
+
+        // The server picks a delta by the hash of the running image
+        uint8_t sourceSha[32];
+        uint32_t sourceSize = 0;
+        if (ok)
+        {
+            ok = hashRunningImage(sourceSize, sourceSha);
+            hashMillis = millis() - started;
+        }
+        HTTPClient http;
+        if (ok)
+        {
+            char url[otaUrlSize + 72];
+            int n = snprintf(url, sizeof(url), "%s%sfrom=", Url, strchr(Url, '?') ? "&" : "?");
+            for (byte i = 0; i < 32; i++)
+            {
+                n += snprintf(url + n, sizeof(url) - n, "%02x", sourceSha[i]);
+            }
+            http.begin(url);
+            int code = http.GET();
+            if (code != HTTP_CODE_OK)
+            {
+                ok = fail("http error");
+            }
+        }
+        if (ok)
+        {
+            ok = download(http.getStreamPtr(), http.getSize(), sourceSize, sourceSha);
+        }
+        http.end();
+
+        if (Handle)
+        {
+            if (ok)
+            {
+                ok = (esp_ota_end(Handle) == ESP_OK) || fail("image not valid");
+            }
+            else
+            {
+                esp_ota_abort(Handle);
+            }
+        }
+        if (ok)
+        {
+            ok = (esp_ota_set_boot_partition(Target) == ESP_OK) || fail("boot partition not set");
+        }
+        free(Inflator);
+        free(Dict);
+        Inflator = nullptr;
+        Dict = nullptr;
+        totalMillis = millis() - started;
+        state = ok ? otaDone : otaFailed;
+    }
+
+    // SHA-256 of the image in the running partition, as the .bin file the server holds
+    bool hashRunningImage(uint32_t &size, uint8_t *sha)
+    {
+        esp_image_metadata_t image;
+        const esp_partition_pos_t position = {Running->address, Running->size};
+        if (esp_image_verify(ESP_IMAGE_VERIFY_SILENT, &position, &image) != ESP_OK)
+        {
+            return fail("running image not readable");
+        }
+        size = image.image_len;
+        mbedtls_sha256_context sha256;
+        mbedtls_sha256_init(&sha256);
+        mbedtls_sha256_starts_ret(&sha256, 0);
+        for (uint32_t offset = 0; offset < size; offset += otaReadSize)
+        {
+            uint32_t n = min((uint32_t)otaReadSize, size - offset);
+            if (esp_partition_read(Running, offset, In, n) != ESP_OK)
+            {
+                mbedtls_sha256_free(&sha256);
+                return fail("running image not readable");
+            }
+            mbedtls_sha256_update_ret(&sha256, In, n);
+        }
+        mbedtls_sha256_finish_ret(&sha256, sha);
+        mbedtls_sha256_free(&sha256);
+        return true;
+    }
+
+    // Read the header, then inflate and patch the rest of the download as it arrives
+    bool download(WiFiClient *stream, int contentLength, uint32_t sourceSize, const uint8_t *sourceSha)
+    {
+        OtaHeader header;
+        size_t headerBytes = 0;
+        bool ok = true;
+        Inflated = false;
+        DictPos = 0;
+        tinfl_init(Inflator);
+        mbedtls_sha256_init(&Sha);
+        mbedtls_sha256_starts_ret(&Sha, 0);
+        unsigned long lastData = millis();
+        while (ok && !Inflated && (contentLength < 0 || (int)downloaded < contentLength))
+        {
+            size_t available = stream->available();
+            if (available == 0)
+            {
+                if (!stream->connected() || millis() - lastData > otaStallTimeout)
+                {
+                    ok = fail("download stalled");
+                    break;
+                }
+                vTaskDelay(1);
+                continue;
+            }
+            size_t n = stream->read(In, min(available, (size_t)otaReadSize));
+            lastData = millis();
+            downloaded += n;
+            const uint8_t *data = In;
+            if (headerBytes < sizeof(header))
+            {
+                size_t take = min(n, sizeof(header) - headerBytes);
+                memcpy((uint8_t *)&header + headerBytes, data, take);
+                headerBytes += take;
+                data += take;
+                n -= take;
+                if (headerBytes == sizeof(header))
+                {
+                    ok = startImage(header, sourceSize, sourceSha);
+                }
+            }
+            if (ok && n > 0)
+            {
+                ok = inflate(data, n);
+            }
+        }
+        if (ok && !Inflated)
+        {
+            ok = fail("download cut short");
+        }
+        ok = ok && finish();
+        uint8_t sha[32];
+        mbedtls_sha256_finish_ret(&Sha, sha);
+        mbedtls_sha256_free(&Sha);
+        if (ok && memcmp(sha, header.targetSha, sizeof(sha)) != 0)
+        {
+            ok = fail("image hash mismatch");
+        }
+        imageBytes = written;
+        return ok;
+    }
+
+    bool startImage(const OtaHeader &header, uint32_t sourceSize, const uint8_t *sourceSha)
+    {
+        if (header.magic != otaMagic || header.version != otaVersion)
+        {
+            return fail("not an update image");
+        }
+        full = header.flags & otaFlagFull;
+        if (!full && (header.sourceSize != sourceSize || memcmp(header.sourceSha, sourceSha, 32) != 0))
+        {
+            return fail("delta is for another image");
+        }
+        if (header.targetSize > Target->size)
+        {
+            return fail("image too large");
+        }
+        reset(full ? 0 : sourceSize, header.targetSize);
+        // Sequential writes erase each sector as it is reached instead of the whole partition
+        // up front, which would stall the puzzle loop for seconds
+#ifdef OTA_WITH_SEQUENTIAL_WRITES
+        size_t imageSize = OTA_WITH_SEQUENTIAL_WRITES;
+#else
+        size_t imageSize = header.targetSize;
+#endif
+        if (esp_ota_begin(Target, imageSize, &Handle) != ESP_OK)
+        {
+            Handle = 0;
+            return fail("update partition not ready");
+        }
+        return true;
+    }
+
+    // Inflate a piece of the body and patch what comes out
+    bool inflate(const uint8_t *data, size_t length)
+    {
+        while (true)
+        {
+            size_t inBytes = length;
+            size_t outBytes = TINFL_LZ_DICT_SIZE - DictPos;
+            tinfl_status status = tinfl_decompress(Inflator, data, &inBytes, Dict, Dict + DictPos, &outBytes,
+                TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+            data += inBytes;
+            length -= inBytes;
+            if (outBytes > 0 && !feed(Dict + DictPos, outBytes))
+            {
+                return false;
+            }
+            DictPos = (DictPos + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+            if (status == TINFL_STATUS_DONE)
+            {
+                Inflated = true;
+                return true;
+            }
+            if (status < TINFL_STATUS_DONE)
+            {
+                return fail("bad compressed data");
+            }
+            if (status == TINFL_STATUS_NEEDS_MORE_INPUT && length == 0)
+            {
+                return true;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef PixelArena_h
+#define PixelArena_h
+
+#include "native_hal.h"
+
+// One static block of RAM for the pixel buffers of every strip
+//
+//      constexpr StripSpec strips[] = {{27, 25, NEO_GRB + NEO_KHZ800, 1}, ...};
+//      PixelArena<pixelArenaSize(strips, 4)> pixelArena(strips, 4);
+//      NeoPatterns LS1(strips[0], pixelArena.plane(0), nullptr);
+//
+// Adafruit_NeoPixel normally mallocs each strip's buffer in its constructor, before the heap
+// has settled, and holds it for good. Here the strip table sizes one array at compile time:
+// every strip gets planes buffers of pixels * bytes per pixel each, rounded up to
+// pixelArenaAlignment so each buffer can be copied a word at a time. Plane 0 is the buffer
+// show() sends; any others are the strip's to use (a back buffer, a layer to mix in).
+//
+// The arena lives in .bss, so the buffers start dark like the ones Adafruit_NeoPixel clears.
+// A strip given an arena plane must keep its length: updateLength() would free the plane.
+
+const byte pixelArenaAlignment = 4;
+
+// A strip as the arena sees it
+struct StripSpec
+{
+    uint16_t pixels;
+    int16_t pin;
+    uint16_t type;              // NEO_* color order and speed
+    uint8_t planes;             // buffers of the whole strip, plane 0 is the one shown
+};
+
+// 4 bytes per pixel when the type has a white offset of its own, as Adafruit_NeoPixel decides
+constexpr uint8_t stripBytesPerPixel(uint16_t type)
+{
+    return ((type >> 6) & 3) == ((type >> 4) & 3) ? 3 : 4;
+}
+
+constexpr uint32_t pixelArenaRound(uint32_t bytes)
+{
+    return (bytes + pixelArenaAlignment - 1) & ~(uint32_t)(pixelArenaAlignment - 1);
+}
+
+// Bytes of one plane of a strip, rounded to the arena alignment
+constexpr uint32_t stripPlaneBytes(const StripSpec &strip)
+{
+    return pixelArenaRound((uint32_t)strip.pixels * stripBytesPerPixel(strip.type));
+}
+
+// Bytes of the arena for count strips of a table
+constexpr uint32_t pixelArenaSize(const StripSpec *strips, byte count)
+{
+    return count == 0 ? 0 : stripPlaneBytes(strips[0]) * strips[0].planes + pixelArenaSize(strips + 1, count - 1);
+}
+
+// Class holding the pixel buffers of a strip table, see the top of this file
+template <uint32_t Size>
+class PixelArena
+{
+    public:
+
+    // Define the arena before its strips, they ask for their planes as they are built
+    PixelArena(const StripSpec *strips, byte count)
+    {
+        Strips = strips;
+        Count = count;
+    }
+
+    // Start of a plane of a strip
+    uint8_t *plane(byte strip, byte plane = 0)
+    {
+        return Bytes + offset(strip, plane);
+    }
+
+    // Offset of a plane of a strip from the start of the arena
+    uint32_t offset(byte strip, byte plane = 0)
+    {
+        uint32_t at = 0;
+        for (byte s = 0; s < strip; s++)
+        {
+            at += stripPlaneBytes(Strips[s]) * Strips[s].planes;
+        }
+        return at + stripPlaneBytes(Strips[strip]) * plane;
+    }
+
+    uint32_t size() { return Size; }
+
+    // Print where each strip's planes are
+    void printLayout()
+    {
+        char line[96];
+        snprintf(line, sizeof(line), "Pixel arena: %lu bytes at %p, %u strips", (unsigned long)Size, (void *)Bytes, Count);
+        Serial.println(line);
+        for (byte s = 0; s < Count; s++)
+        {
+            const StripSpec &strip = Strips[s];
+            snprintf(line, sizeof(line), "  strip %u: %u pixels x %u bytes x %u planes, +%lu, %lu bytes per plane",
+                s + 1, strip.pixels, stripBytesPerPixel(strip.type), strip.planes, (unsigned long)offset(s),
+                (unsigned long)stripPlaneBytes(strip));
+            Serial.println(line);
+        }
+    }
+
+    private:
+
+    alignas(pixelArenaAlignment) uint8_t Bytes[Size];
+    const StripSpec *Strips;
+    byte Count;
+};
+
+#endif
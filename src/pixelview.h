@@ -0,0 +1,118 @@
+#ifndef PixelView_h
+#define PixelView_h
+
+#include "native_hal.h"
+
+// One line of pixels made of runs on several strips
+//
+//      const PixelSegment<NeoPatterns> flowSegments[] = {{&LS1, 0, 27, 1, false}, {&LS3, 0, 22, 1, false}};
+//      PixelView<NeoPatterns> flow(flowSegments, 2);
+//      NeoPatterns Flow(flow, nullptr);            // its patterns run from the beakers on into the pipe
+//
+// A view owns no pixels. Pixel i of the view is looked up in its segments and written straight
+// into that strip's buffer (a plane of the pixel arena, see pixelarena.h), so an effect that
+// crosses strips is drawn once and nothing is copied between them. show() sends each strip
+// under the view once. A segment may skip pixels (stride) or run from the far end (reversed).
+
+// A run of pixels on one strip
+template <typename Strip>
+struct PixelSegment
+{
+    Strip *strip;
+    uint16_t offset;            // first strip pixel of the run
+    uint16_t length;            // pixels in the view
+    uint8_t stride;             // strip pixels from one view pixel to the next, at least 1
+    bool reversed;              // view pixel 0 is the last pixel of the run
+};
+
+// Class mapping view pixels onto strip pixels, see the top of this file
+template <typename Strip>
+class PixelView
+{
+    public:
+
+    PixelView(const PixelSegment<Strip> *segments, byte count)
+    {
+        Segments = segments;
+        Count = count;
+        Length = 0;
+        for (byte s = 0; s < count; s++)
+        {
+            Length += segments[s].length;
+        }
+    }
+
+    uint16_t length() const { return Length; }
+    byte segments() const { return Count; }
+    const PixelSegment<Strip> &segment(byte s) const { return Segments[s]; }
+
+    void set(uint16_t i, uint32_t color)
+    {
+        Strip *strip;
+        uint16_t pixel;
+        if (locate(i, strip, pixel))
+        {
+            strip->setPixelColor(pixel, color);
+        }
+    }
+
+    uint32_t get(uint16_t i) const
+    {
+        Strip *strip;
+        uint16_t pixel;
+        return locate(i, strip, pixel) ? strip->getPixelColor(pixel) : 0;
+    }
+
+    // Set count pixels from first, to the end of the view when count is 0
+    void fill(uint32_t color, uint16_t first = 0, uint16_t count = 0)
+    {
+        uint16_t end = count ? min((uint16_t)(first + count), Length) : Length;
+        for (uint16_t i = first; i < end; i++)
+        {
+            set(i, color);
+        }
+    }
+
+    // Send every strip under the view, each once
+    void show()
+    {
+        for (byte s = 0; s < Count; s++)
+        {
+            bool shown = false;
+            for (byte t = 0; t < s && !shown; t++)
+            {
+                shown = Segments[t].strip == Segments[s].strip;
+            }
+            if (!shown)
+            {
+                Segments[s].strip->show();
+            }
+        }
+    }
+
+    private:
+
+    const PixelSegment<Strip> *Segments;
+    byte Count;
+    uint16_t Length;
+
+    // Strip and strip pixel of view pixel i
+    bool locate(uint16_t i, Strip *&strip, uint16_t &pixel) const
+    {
+        for (byte s = 0; s < Count; s++)
+        {
+            const PixelSegment<Strip> &segment = Segments[s];
+            if (i < segment.length)
+            {
+                uint16_t step = segment.reversed ? segment.length - 1 - i : i;
+                strip = segment.strip;
+                pixel = segment.offset + step * segment.stride;
+                return true;
+            }
+            i -= segment.length;
+        }
+        return false;
+    }
+};
+
+#endif
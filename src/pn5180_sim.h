@@ -0,0 +1,374 @@
+#ifndef PN5180Sim_h
+#define PN5180Sim_h
+
+#include "native_hal.h"
+
+#ifdef ARDUINO
+#include <PN5180ISO15693.h>
+#else
+// ISO15693 results and PN5180 register names, as the PN5180 library defines them
+enum ISO15693ErrorCode {
+    EC_NO_CARD = -1,
+    ISO15693_EC_OK = 0,
+    ISO15693_EC_NOT_SUPPORTED = 0x01,
+    ISO15693_EC_NOT_RECOGNIZED = 0x02,
+    ISO15693_EC_UNKNOWN_ERROR = 0x0f,
+    ISO15693_EC_BLOCK_NOT_AVAILABLE = 0x10,
+    ISO15693_EC_CUSTOM_CMD_ERROR = 0xA0
+};
+#define RX_STATUS           (0x13)
+#define RX_IRQ_STAT         (1<<0)
+#define TX_IRQ_STAT         (1<<1)
+#define IDLE_IRQ_STAT       (1<<2)
+#define RX_SOF_DET_IRQ_STAT (1<<14)
+#endif
+
+// Timing of the modelled reader in microseconds
+struct PN5180Timing
+{
+    unsigned long frameDelay;       // fixed waits the PN5180 library puts around every SPI frame
+    unsigned long handshake;        // NSS toggling and BUSY polling per frame on the batched transport
+    unsigned long busy;             // BUSY held high while the PN5180 executes an instruction
+    unsigned long spiBytePerMHz;    // one SPI byte at 1 MHz, divided by the bus clock
+    unsigned long spiClockMHz;      // SPI clock
+    unsigned long inventoryWait;    // fixed wait between inventory request and response check
+    unsigned long tagResponse;      // tag turnaround time t1
+    unsigned long rfByte;           // one byte over the air at 26.48 kbit/s
+    unsigned long reset;            // reset pulse and boot until the IDLE interrupt
+    unsigned long rfOn;             // loading the ISO15693 RF configuration and raising the field
+};
+
+// Timing on a 7 MHz bus. The PN5180 library v1.5 adds 2 ms + 1 ms of delay() around each NSS
+// cycle and a 10 ms fixed wait after an inventory request.
+const PN5180Timing pn5180Timing = {3000, 10, 40, 8, 7, 10000, 320, 302, 25000, 12000};
+
+const byte simMaxTags = 8;          // scripted tag placements per reader
+const byte simTagMemory = 64;       // bytes of user memory per simulated tag
+const byte simBlockSize = 4;
+const unsigned long simSofWindow = 1500;    // as iso15693SofWindow in pn5180_transport.h
+const unsigned long simPollInterval = 200;  // wait between status polls on the batched transport
+
+// A tag placed on the reader for a window of (virtual) time
+struct SimTag
+{
+    uint8_t uid[8];
+    uint8_t memory[simTagMemory];
+    unsigned long from;     // millis() when the tag arrives
+    unsigned long until;    // millis() when it is taken away
+};
+
+// Class modelling one PN5180 running ISO15693, with the calls RfidBank uses
+//
+// Both ways of talking to the reader are modelled: the batched transport (getInventory, iso15693)
+// and the library's sequence (getInventoryLibrary). Each SPI frame is charged its transfer time,
+// BUSY time and either the library's fixed delays or the transport's handshake. RF exchanges are
+// charged the request and response airtime, and tags come and go according to a script, so
+// polling strategies can be compared for detection latency and throughput.
+class PN5180Sim
+{
+    public:
+
+    // Member Variables:
+    PN5180Timing Timing;
+    unsigned long spiFrames;        // NSS cycles on the bus
+    unsigned long SpiMicros;        // time spent on SPI frames
+    unsigned long rfMicros;         // time spent waiting on RF exchanges
+    unsigned long inventories;      // inventories issued
+
+    // Constructor - pins are accepted so the sim drops in for PN5180ISO15693
+    PN5180Sim(uint8_t, uint8_t, uint8_t)
+    {
+        Timing = pn5180Timing;
+        NumTags = 0;
+        spiFrames = 0;
+        SpiMicros = 0;
+        rfMicros = 0;
+        inventories = 0;
+        Batched = false;
+        Pending = false;
+        ResponseLen = 0;
+    }
+
+    // Script a tag onto this reader between fromMillis and untilMillis
+    void addTag(const uint8_t *uid, unsigned long fromMillis, unsigned long untilMillis, const uint8_t *memory = nullptr)
+    {
+        if (NumTags >= simMaxTags)
+        {
+            return;
+        }
+        SimTag &tag = Tags[NumTags++];
+        memcpy(tag.uid, uid, 8);
+        memset(tag.memory, 0, simTagMemory);
+        if (memory)
+        {
+            memcpy(tag.memory, memory, simTagMemory);
+        }
+        tag.from = fromMillis;
+        tag.until = untilMillis;
+    }
+
+    // Tag on the reader right now, nullptr when the field is empty
+    SimTag *presentTag()
+    {
+        unsigned long now = millis();
+        for (byte i = 0; i < NumTags; i++)
+        {
+            if (now >= Tags[i].from && now < Tags[i].until)
+            {
+                return &Tags[i];
+            }
+        }
+        return nullptr;
+    }
+
+    void begin() {}
+
+    void reset()
+    {
+        simAdvance(Timing.reset);
+    }
+
+    bool setupRF()
+    {
+        frame(4);
+        frame(4);
+        simAdvance(Timing.rfOn);
+        return true;
+    }
+
+    unsigned long spiMicros()
+    {
+        return SpiMicros;
+    }
+
+    // The model charges both sequences to the same bus time
+    unsigned long librarySpiMicros()
+    {
+        return spiMicros();
+    }
+
+    // Inventory over the batched transport
+    ISO15693ErrorCode getInventory(uint8_t *uid)
+    {
+        const uint8_t inventory[] = { 0x26, 0x01, 0x00 };
+        uint8_t *response;
+        uint16_t responseLen;
+        inventories++;
+        ISO15693ErrorCode rc = iso15693(inventory, sizeof(inventory), &response, &responseLen);
+        if (rc == ISO15693_EC_OK)
+        {
+            memcpy(uid, &response[2], 8);
+        }
+        return rc;
+    }
+
+    // Request and response with the batched transport's frames: one WRITE_REGISTER_MULTIPLE,
+    // SEND_DATA, READ_REGISTER_MULTIPLE status polls and READ_DATA
+    ISO15693ErrorCode iso15693(const uint8_t *cmd, uint8_t cmdLen, uint8_t **response, uint16_t *responseLen)
+    {
+        Batched = true;
+        frame(1 + 3 * 6);
+        frame(2 + cmdLen);
+        Pending = false;
+        SimTag *tag = presentTag();
+        unsigned long sent = micros();
+        unsigned long airtime = (cmdLen + 2) * Timing.rfByte;
+        if (tag && respond(tag, cmd, cmdLen))
+        {
+            SofAt = sent + airtime + Timing.tagResponse;
+            RxDoneAt = SofAt + (ResponseLen + 2) * Timing.rfByte;
+            Pending = true;
+        }
+        wait(airtime);
+
+        while (true)
+        {
+            readFrame(3, 8);
+            unsigned long elapsed = micros() - sent;
+            if (Pending && micros() >= RxDoneAt)
+            {
+                break;
+            }
+            if (!(Pending && micros() >= SofAt) && elapsed > airtime + simSofWindow)
+            {
+                Batched = false;
+                return EC_NO_CARD;
+            }
+            wait(simPollInterval);
+        }
+
+        readFrame(2, ResponseLen);
+        Batched = false;
+        Pending = false;
+        *response = Response;
+        *responseLen = ResponseLen;
+        if (Response[0] & 0x01)
+        {
+            return (ISO15693ErrorCode)Response[1];
+        }
+        return ISO15693_EC_OK;
+    }
+
+    // Inventory with the same sequence of SPI frames and waits as the PN5180 library
+    ISO15693ErrorCode getInventoryLibrary(uint8_t *uid)
+    {
+        uint8_t inventory[] = { 0x26, 0x01, 0x00 };
+        inventories++;
+        sendData(inventory, sizeof(inventory));
+        wait(Timing.inventoryWait);
+        if ((getIRQStatus() & RX_SOF_DET_IRQ_STAT) == 0)
+        {
+            return EC_NO_CARD;
+        }
+        uint32_t rxStatus;
+        readRegister(RX_STATUS, &rxStatus);
+        uint8_t *response = readData(rxStatus & 0x1ff);
+        getIRQStatus();
+        clearIRQStatus(RX_SOF_DET_IRQ_STAT | IDLE_IRQ_STAT | TX_IRQ_STAT | RX_IRQ_STAT);
+        memcpy(uid, &response[2], 8);
+        return ISO15693_EC_OK;
+    }
+
+    private:
+
+    SimTag Tags[simMaxTags];
+    byte NumTags;
+    bool Batched;                   // frames are going over the batched transport
+    bool Pending;                   // a tag is answering the last request
+    unsigned long SofAt;            // micros() when the response starts
+    unsigned long RxDoneAt;         // micros() when the response is complete
+    uint8_t Response[2 + simTagMemory];
+    uint16_t ResponseLen;
+
+    // The library's low-level calls, as getInventoryLibrary uses them
+
+    // Idle, transceive and state check register frames, then the SEND_DATA frame. The tag
+    // present at this moment decides the response.
+    bool sendData(uint8_t *data, int len, uint8_t validBits = 0)
+    {
+        (void)validBits;
+        frame(6);
+        frame(6);
+        readFrame(2, 4);
+        frame(len + 2);
+
+        Pending = false;
+        SimTag *tag = presentTag();
+        if (tag == nullptr || !respond(tag, data, len))
+        {
+            return true;    // nobody answers, the receive interrupt never fires
+        }
+        unsigned long sent = micros() + (len + 2) * Timing.rfByte;
+        SofAt = sent + Timing.tagResponse;
+        RxDoneAt = SofAt + (ResponseLen + 2) * Timing.rfByte;
+        Pending = true;
+        return true;
+    }
+
+    uint32_t getIRQStatus()
+    {
+        readFrame(2, 4);
+        uint32_t irq = 0;
+        if (Pending && micros() >= SofAt)
+        {
+            irq |= RX_SOF_DET_IRQ_STAT;
+        }
+        if (Pending && micros() >= RxDoneAt)
+        {
+            irq |= RX_IRQ_STAT;
+        }
+        return irq;
+    }
+
+    bool readRegister(uint8_t reg, uint32_t *value)
+    {
+        readFrame(2, 4);
+        *value = (reg == RX_STATUS && Pending) ? ResponseLen : 0;
+        return true;
+    }
+
+    uint8_t *readData(int len, uint8_t *buffer = nullptr)
+    {
+        readFrame(2, len);
+        if (buffer)
+        {
+            memcpy(buffer, Response, min(len, (int)sizeof(Response)));
+            return buffer;
+        }
+        return Response;
+    }
+
+    bool clearIRQStatus(uint32_t)
+    {
+        frame(6);
+        Pending = false;
+        return true;
+    }
+
+    // Charge one NSS cycle carrying bytes
+    void frame(int bytes)
+    {
+        unsigned long us = (Batched ? Timing.handshake : Timing.frameDelay) + Timing.busy + bytes * Timing.spiBytePerMHz / Timing.spiClockMHz;
+        spiFrames++;
+        SpiMicros += us;
+        simAdvance(us);
+    }
+
+    // Instruction frame followed by a second NSS cycle reading the answer
+    void readFrame(int sent, int received)
+    {
+        frame(sent);
+        frame(received);
+    }
+
+    void wait(unsigned long us)
+    {
+        rfMicros += us;
+        simAdvance(us);
+    }
+
+    // Build the tag's answer to an ISO15693 request, false if the request is not for this tag
+    bool respond(SimTag *tag, const uint8_t *request, int len)
+    {
+        if (len < 2)
+        {
+            return false;
+        }
+        uint8_t command = request[1];
+        if (command == 0x01)
+        {
+            // Inventory: flags, DSFID, UID
+            Response[0] = 0x00;
+            Response[1] = 0x00;
+            memcpy(&Response[2], tag->uid, 8);
+            ResponseLen = 10;
+            return true;
+        }
+        if (len < 11 || memcmp(&request[2], tag->uid, 8) != 0)
+        {
+            return false;   // addressed to another tag
+        }
+        if (command == 0x20 || command == 0x23)
+        {
+            uint8_t first = request[10];
+            uint8_t count = (command == 0x23 && len > 11) ? request[11] + 1 : 1;
+            if ((first + count) * simBlockSize > simTagMemory)
+            {
+                Response[0] = 0x01;
+                Response[1] = ISO15693_EC_BLOCK_NOT_AVAILABLE;
+                ResponseLen = 2;
+                return true;
+            }
+            Response[0] = 0x00;
+            memcpy(&Response[1], &tag->memory[first * simBlockSize], count * simBlockSize);
+            ResponseLen = 1 + count * simBlockSize;
+            return true;
+        }
+        Response[0] = 0x01;
+        Response[1] = ISO15693_EC_NOT_SUPPORTED;
+        ResponseLen = 2;
+        return true;
+    }
+};
+
+#endif
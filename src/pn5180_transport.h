@@ -0,0 +1,320 @@
+#ifndef PN5180Transport_h
+#define PN5180Transport_h
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <PN5180.h>
+#include <PN5180ISO15693.h>
+
+// PN5180 host interface instructions
+const uint8_t pn5180WriteRegisterMultiple = 0x03;
+const uint8_t pn5180ReadRegisterMultiple = 0x05;
+const uint8_t pn5180SendData = 0x09;
+const uint8_t pn5180ReadData = 0x0A;
+
+// Actions of a WRITE_REGISTER_MULTIPLE element
+const uint8_t pn5180Write = 0x01;
+const uint8_t pn5180OrMask = 0x02;
+const uint8_t pn5180AndMask = 0x03;
+
+const unsigned long pn5180BusyTimeout = 50000;  // microseconds before a BUSY handshake is abandoned
+const unsigned long iso15693ByteMicros = 302;   // one byte over the air at 26.48 kbit/s
+const unsigned long iso15693SofWindow = 1500;   // microseconds after the request in which a tag starts answering
+const unsigned long iso15693ResponseTimeout = 20000;    // microseconds to wait for a complete response
+const uint16_t pn5180MaxResponse = 80;          // largest response collected (inventory or block read)
+
+// One element of a WRITE_REGISTER_MULTIPLE instruction
+struct PN5180RegisterWrite
+{
+    uint8_t address;
+    uint8_t action;
+    uint32_t value;
+};
+
+// Class speaking the PN5180 host interface directly on the SPI bus
+//
+// The PN5180 needs one NSS cycle per instruction and BUSY low before the next, so instructions
+// cannot share a transfer. What can be batched is batched: each frame goes out as a single SPI
+// transfer, register updates travel together in WRITE_REGISTER_MULTIPLE, status registers come back
+// together from READ_REGISTER_MULTIPLE, and the IRQ clear rides along with the next request. BUSY is
+// polled instead of the library's fixed waits, and a missing tag is noticed as soon as its start of
+// frame is overdue.
+class PN5180Transport
+{
+    public:
+
+    // Member Variables:
+    unsigned long frames;       // NSS cycles on the bus
+    unsigned long spiMicros;    // time spent inside SPI frames (including BUSY handshakes)
+
+    PN5180Transport(uint8_t nss, uint8_t busy)
+    : Settings(7000000, MSBFIRST, SPI_MODE0)
+    {
+        Nss = nss;
+        Busy = busy;
+        frames = 0;
+        spiMicros = 0;
+    }
+
+    // One instruction: send tx in a single transfer, then (if rxLen) read the answer in a second
+    // NSS cycle. Each cycle waits for BUSY to rise and fall rather than for fixed delays.
+    bool exchange(const uint8_t *tx, uint16_t txLen, uint8_t *rx = nullptr, uint16_t rxLen = 0)
+    {
+        unsigned long started = micros();
+        bool ok = waitBusy(LOW);
+        SPI.beginTransaction(Settings);
+        ok = ok && cycle(tx, nullptr, txLen);
+        if (ok && rxLen)
+        {
+            ok = cycle(nullptr, rx, rxLen);
+        }
+        SPI.endTransaction();
+        spiMicros += micros() - started;
+        return ok;
+    }
+
+    // Apply several register writes and masks in one WRITE_REGISTER_MULTIPLE frame
+    bool writeRegisters(const PN5180RegisterWrite *writes, byte n)
+    {
+        uint8_t tx[1 + 6 * 4];
+        uint8_t len = 0;
+        tx[len++] = pn5180WriteRegisterMultiple;
+        for (byte i = 0; i < n && i < 4; i++)
+        {
+            tx[len++] = writes[i].address;
+            tx[len++] = writes[i].action;
+            for (byte b = 0; b < 4; b++)
+            {
+                tx[len++] = (writes[i].value >> (8 * b)) & 0xFF;
+            }
+        }
+        return exchange(tx, len);
+    }
+
+    // Read several registers in one READ_REGISTER_MULTIPLE frame
+    bool readRegisters(const uint8_t *addresses, byte n, uint32_t *values)
+    {
+        uint8_t tx[1 + 4];
+        uint8_t rx[4 * 4];
+        n = min(n, (byte)4);
+        tx[0] = pn5180ReadRegisterMultiple;
+        memcpy(&tx[1], addresses, n);
+        if (!exchange(tx, 1 + n, rx, 4 * n))
+        {
+            return false;
+        }
+        for (byte i = 0; i < n; i++)
+        {
+            values[i] = rx[4 * i] | (rx[4 * i + 1] << 8) | ((uint32_t)rx[4 * i + 2] << 16) | ((uint32_t)rx[4 * i + 3] << 24);
+        }
+        return true;
+    }
+
+    // Send an ISO15693 request and collect the response
+    ISO15693ErrorCode iso15693(const uint8_t *cmd, uint8_t cmdLen, uint8_t **response, uint16_t *responseLen)
+    {
+        // Clear the last exchange's interrupts, then Idle and Transceive, in one frame
+        const PN5180RegisterWrite start[] = {
+            {IRQ_CLEAR, pn5180Write, 0x000FFFFF},
+            {SYSTEM_CONFIG, pn5180AndMask, 0xFFFFFFF8},
+            {SYSTEM_CONFIG, pn5180OrMask, 0x00000003}
+        };
+        if (!writeRegisters(start, 3))
+        {
+            return ISO15693_EC_UNKNOWN_ERROR;
+        }
+
+        uint8_t tx[2 + 16];
+        cmdLen = min(cmdLen, (uint8_t)16);
+        tx[0] = pn5180SendData;
+        tx[1] = 0x00;   // all bits of the last byte are valid
+        memcpy(&tx[2], cmd, cmdLen);
+        if (!exchange(tx, 2 + cmdLen))
+        {
+            return ISO15693_EC_UNKNOWN_ERROR;
+        }
+
+        // Nothing can arrive before the request is on the air, so sleep through it
+        unsigned long sent = micros();
+        unsigned long airtime = (cmdLen + 2) * iso15693ByteMicros;
+        delayMicroseconds(airtime);
+
+        const uint8_t status[] = {IRQ_STATUS, RX_STATUS};
+        uint32_t values[2];
+        while (true)
+        {
+            if (!readRegisters(status, 2, values))
+            {
+                return ISO15693_EC_UNKNOWN_ERROR;
+            }
+            unsigned long elapsed = micros() - sent;
+            if (values[0] & RX_IRQ_STAT)
+            {
+                break;
+            }
+            if (!(values[0] & RX_SOF_DET_IRQ_STAT) && elapsed > airtime + iso15693SofWindow)
+            {
+                return EC_NO_CARD;  // no tag started answering
+            }
+            if (elapsed > iso15693ResponseTimeout)
+            {
+                return EC_NO_CARD;
+            }
+            delayMicroseconds(200);
+        }
+
+        *responseLen = min((uint16_t)(values[1] & 0x000001ff), pn5180MaxResponse);
+        if (*responseLen == 0)
+        {
+            return ISO15693_EC_UNKNOWN_ERROR;
+        }
+        const uint8_t readData[] = {pn5180ReadData, 0x00};
+        if (!exchange(readData, sizeof(readData), Response, *responseLen))
+        {
+            return ISO15693_EC_UNKNOWN_ERROR;
+        }
+        *response = Response;
+
+        // Error flag set, the tag reports an error code in the next byte
+        if (Response[0] & 0x01)
+        {
+            uint8_t errorCode = Response[1];
+            return (errorCode >= 0xA0) ? ISO15693_EC_CUSTOM_CMD_ERROR : (ISO15693ErrorCode)errorCode;
+        }
+        return ISO15693_EC_OK;
+    }
+
+    // Single slot inventory, as the library's getInventory
+    ISO15693ErrorCode getInventory(uint8_t *uid)
+    {
+        const uint8_t inventory[] = { 0x26, 0x01, 0x00 };
+        uint8_t *response;
+        uint16_t responseLen;
+        ISO15693ErrorCode rc = iso15693(inventory, sizeof(inventory), &response, &responseLen);
+        if (rc != ISO15693_EC_OK)
+        {
+            return rc;
+        }
+        if (responseLen < 10)
+        {
+            return ISO15693_EC_UNKNOWN_ERROR;
+        }
+        memcpy(uid, &response[2], 8);   // skip flags and DSFID
+        return ISO15693_EC_OK;
+    }
+
+    private:
+
+    uint8_t Nss;
+    uint8_t Busy;
+    SPISettings Settings;
+    uint8_t Response[pn5180MaxResponse];
+
+    bool waitBusy(int level)
+    {
+        unsigned long started = micros();
+        while (digitalRead(Busy) != level)
+        {
+            if (micros() - started > pn5180BusyTimeout)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // One NSS cycle: a single transfer, BUSY rises, NSS released, BUSY falls
+    bool cycle(const uint8_t *tx, uint8_t *rx, uint16_t len)
+    {
+        frames++;
+        digitalWrite(Nss, LOW);
+        SPI.transferBytes(tx, rx, len);  // a null tx clocks out 0xFF
+        bool ok = waitBusy(HIGH);
+        digitalWrite(Nss, HIGH);
+        return ok && waitBusy(LOW);
+    }
+};
+
+// PN5180 reader using the library for setup and the batched transport for tag traffic
+class PN5180Batched : public PN5180ISO15693
+{
+    public:
+
+    PN5180Transport Transport;
+
+    PN5180Batched(uint8_t nss, uint8_t busy, uint8_t reset)
+    : PN5180ISO15693(nss, busy, reset), Transport(nss, busy)
+    {
+        LibrarySpiMicros = 0;
+    }
+
+    ISO15693ErrorCode getInventory(uint8_t *uid)
+    {
+        return Transport.getInventory(uid);
+    }
+
+    // The library's inventory, kept for comparison. This is the call sequence of the library's
+    // getInventory(), made here so each call can be timed: everything but its fixed 10 ms wait for
+    // the tag is SPI frames and BUSY handshakes, and goes into librarySpiMicros().
+    ISO15693ErrorCode getInventoryLibrary(uint8_t *uid)
+    {
+        uint8_t inventory[] = {0x26, 0x01, 0x00};
+        memset(uid, 0, 8);
+        unsigned long started = micros();
+        sendData(inventory, sizeof(inventory));
+        LibrarySpiMicros += micros() - started;
+        delay(10);
+
+        started = micros();
+        ISO15693ErrorCode rc = EC_NO_CARD;
+        if (getIRQStatus() & RX_SOF_DET_IRQ_STAT)
+        {
+            uint32_t rxStatus;
+            readRegister(RX_STATUS, &rxStatus);
+            uint8_t *response = readData(rxStatus & 0x1ff);
+            if (response == nullptr)
+            {
+                rc = ISO15693_EC_UNKNOWN_ERROR;
+            }
+            else if ((getIRQStatus() & RX_SOF_DET_IRQ_STAT) == 0)
+            {
+                clearIRQStatus(TX_IRQ_STAT | IDLE_IRQ_STAT);
+            }
+            else if (response[0] & 0x01)
+            {
+                rc = (response[1] >= 0xA0) ? ISO15693_EC_CUSTOM_CMD_ERROR : (ISO15693ErrorCode)response[1];
+            }
+            else
+            {
+                clearIRQStatus(RX_SOF_DET_IRQ_STAT | IDLE_IRQ_STAT | TX_IRQ_STAT | RX_IRQ_STAT);
+                memcpy(uid, &response[2], 8);
+                rc = ISO15693_EC_OK;
+            }
+        }
+        LibrarySpiMicros += micros() - started;
+        return rc;
+    }
+
+    ISO15693ErrorCode iso15693(const uint8_t *cmd, uint8_t cmdLen, uint8_t **response, uint16_t *responseLen)
+    {
+        return Transport.iso15693(cmd, cmdLen, response, responseLen);
+    }
+
+    // SPI time spent by the transport
+    unsigned long spiMicros()
+    {
+        return Transport.spiMicros;
+    }
+
+    // SPI time spent by the library's calls in getInventoryLibrary()
+    unsigned long librarySpiMicros()
+    {
+        return LibrarySpiMicros;
+    }
+
+    private:
+
+    unsigned long LibrarySpiMicros;
+};
+
+#endif
@@ -0,0 +1,503 @@
+#ifndef Profiler_h
+#define Profiler_h
+
+#include "native_hal.h"
+
+// Statistical profiler: where does the CPU running loop() spend its time?
+//
+//      profile 10              sample for 10 s at profileDefaultHz, then publish the result
+//      profile 10 2000 stacks  at 2 kHz, with a three deep backtrace per sample
+//
+// A hardware timer interrupts the core that started it (core 1, where loop() runs) and the
+// handler reads the program counter the interrupted task will resume at from the exception
+// frame FreeRTOS saved on entry. Samples are counted in fixed open addressed tables, one for
+// PCs and, when asked for, one for backtraces (the PC and up to three return addresses), so
+// sampling never allocates and costs a few microseconds. A sample that finds its table full
+// is counted as dropped. Samples that land in another interrupt handler are only counted.
+//
+// When the time is up the tables are published as text lines to the profile topic, a few per
+// loop() pass, or printed to Serial when the profile was started from the serial console.
+//
+//      #PF begin <hz> <samples> <dropped> <in interrupts>
+//      #PF task <samples> <name>
+//      #PF pc <samples> <address>
+//      #PF stack <samples> <address> <return address>...
+//      #PF end
+//
+// tools/prof_report.py looks the addresses up in the firmware ELF and prints a flat profile
+// and the callers and callees of each function. Building with NO_PROFILER leaves it out.
+
+const uint16_t profilePcSlots = 512;            // distinct PCs, power of two
+const uint16_t profileStackSlots = 256;         // distinct backtraces, power of two
+const byte profileStackDepth = 4;               // the PC and up to three return addresses
+const byte profileProbes = 8;                   // slots tried before a sample is dropped
+const byte profileTasks = 8;                    // distinct tasks counted
+const uint32_t profileDefaultHz = 1000;
+const uint32_t profileMaxHz = 10000;
+const uint16_t profileMaxSeconds = 600;
+const byte profileTimer = 3;                    // hardware timer 0-3, the others are free
+const uint16_t profileMessageSize = 512;        // bytes per published dump message
+
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+struct ProfilePc
+{
+    uint32_t pc;
+    uint32_t count;
+};
+
+struct ProfileStack
+{
+    uint32_t pc[profileStackDepth];
+    uint32_t count;
+};
+
+// Sample counts by PC and by backtrace. add() runs in the timer interrupt, so it lives in IRAM
+// and only touches the tables.
+class ProfileHistogram
+{
+    public:
+
+    // Member Variables:
+    volatile uint32_t samples;
+    volatile uint32_t dropped;          // PC table full
+    volatile uint32_t stacksDropped;    // backtrace table full
+
+    ProfileHistogram()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        memset(Pcs, 0, sizeof(Pcs));
+        memset(Stacks, 0, sizeof(Stacks));
+        samples = 0;
+        dropped = 0;
+        stacksDropped = 0;
+    }
+
+    // Count one sample, pcs[0] is where it landed and the rest its return addresses
+    void IRAM_ATTR add(const uint32_t *pcs, byte depth)
+    {
+        samples++;
+        if (!addPc(pcs[0]))
+        {
+            dropped++;
+        }
+        if (depth > 1 && !addStack(pcs, depth))
+        {
+            stacksDropped++;
+        }
+    }
+
+    // Dump lines are numbered over both tables, empty slots give no line
+    uint16_t lines() { return profilePcSlots + profileStackSlots; }
+
+    // Format line i of the dump into out, its length or 0 for an empty slot
+    uint16_t format(uint16_t i, char *out, uint16_t size)
+    {
+        int n = 0;
+        if (i < profilePcSlots)
+        {
+            if (Pcs[i].count)
+            {
+                n = snprintf(out, size, "#PF pc %lu %08lx", (unsigned long)Pcs[i].count, (unsigned long)Pcs[i].pc);
+            }
+        }
+        else if (Stacks[i - profilePcSlots].count)
+        {
+            const ProfileStack &stack = Stacks[i - profilePcSlots];
+            n = snprintf(out, size, "#PF stack %lu", (unsigned long)stack.count);
+            for (byte d = 0; d < profileStackDepth && stack.pc[d] && n < size; d++)
+            {
+                n += snprintf(out + n, size - n, " %08lx", (unsigned long)stack.pc[d]);
+            }
+        }
+        return min(n, (int)size - 1);
+    }
+
+    private:
+
+    ProfilePc Pcs[profilePcSlots];
+    ProfileStack Stacks[profileStackSlots];
+
+    static uint32_t IRAM_ATTR hash(uint32_t key)
+    {
+        return (key * 2654435761u) >> 16;
+    }
+
+    bool IRAM_ATTR addPc(uint32_t pc)
+    {
+        uint32_t h = hash(pc);
+        for (byte probe = 0; probe < profileProbes; probe++)
+        {
+            ProfilePc &slot = Pcs[(h + probe) & (profilePcSlots - 1)];
+            if (slot.pc == pc || slot.count == 0)
+            {
+                slot.pc = pc;
+                slot.count++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool IRAM_ATTR addStack(const uint32_t *pcs, byte depth)
+    {
+        uint32_t key = 0;
+        for (byte d = 0; d < depth; d++)
+        {
+            key = key * 31 + pcs[d];
+        }
+        uint32_t h = hash(key);
+        for (byte probe = 0; probe < profileProbes; probe++)
+        {
+            ProfileStack &slot = Stacks[(h + probe) & (profileStackSlots - 1)];
+            if (slot.count == 0)
+            {
+                for (byte d = 0; d < profileStackDepth; d++)
+                {
+                    slot.pc[d] = d < depth ? pcs[d] : 0;
+                }
+                slot.count = 1;
+                return true;
+            }
+            bool same = true;
+            for (byte d = 0; d < profileStackDepth && same; d++)
+            {
+                same = slot.pc[d] == (d < depth ? pcs[d] : 0);
+            }
+            if (same)
+            {
+                slot.count++;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+#if defined(ARDUINO_ARCH_ESP32) && !defined(NO_PROFILER)
+
+#include <freertos/xtensa_context.h>
+#include <esp_debug_helpers.h>
+#include "mqttqueue.h"
+
+// FreeRTOS internals the sampler reads: the running task of each core, whose control block
+// starts with the stack pointer saved on interrupt entry, and the interrupt nesting depth
+extern "C" void *volatile pxCurrentTCB[];
+extern "C" volatile unsigned port_interruptNesting[];
+
+void profileTick();
+
+// Class holding the sampling timer and the sample tables
+class Profiler
+{
+    public:
+
+    // Member Variables:
+    volatile uint32_t interrupted;      // samples that landed in another interrupt handler
+
+    Profiler()
+    {
+        interrupted = 0;
+        Timer = nullptr;
+        Hz = 0;
+        Seconds = 0;
+        Started = 0;
+        Stacks = false;
+        ToSerial = false;
+        Ready = false;
+        Dumping = false;
+        DumpHeader = false;
+        DumpNext = 0;
+        Outbox = nullptr;
+        Topic = nullptr;
+        memset(Tasks, 0, sizeof(Tasks));
+        memset(TaskCounts, 0, sizeof(TaskCounts));
+    }
+
+    void begin(MqttQueue &outbox, const char *topic)
+    {
+        Outbox = &outbox;
+        Topic = topic;
+    }
+
+    bool running() { return Timer != nullptr; }
+
+    // Sample the calling core hz times a second for seconds, then publish the tables (or print
+    // them when toSerial). Call from loop() so the samples come from its core.
+    bool start(uint16_t seconds, uint32_t hz, bool stacks, bool toSerial)
+    {
+        if (running() || Dumping || seconds == 0 || hz == 0)
+        {
+            return false;
+        }
+        Histogram.clear();
+        interrupted = 0;
+        memset(Tasks, 0, sizeof(Tasks));
+        memset(TaskCounts, 0, sizeof(TaskCounts));
+        Hz = min(hz, profileMaxHz);
+        Seconds = min(seconds, profileMaxSeconds);
+        Stacks = stacks;
+        ToSerial = toSerial;
+        Ready = false;
+        Started = millis();
+        // 80 MHz APB clock / 80: the timer counts microseconds
+        Timer = timerBegin(profileTimer, 80, true);
+        if (!Timer)
+        {
+            return false;
+        }
+        timerAttachInterrupt(Timer, profileTick, true);
+        timerAlarmWrite(Timer, 1000000 / Hz, true);
+        timerAlarmEnable(Timer);
+        return true;
+    }
+
+    void stop()
+    {
+        if (!running())
+        {
+            return;
+        }
+        timerAlarmDisable(Timer);
+        timerDetachInterrupt(Timer);
+        timerEnd(Timer);
+        Timer = nullptr;
+        Ready = true;
+    }
+
+    // Start publishing the last profile, one message per loop() pass
+    bool dump()
+    {
+        if (!Ready || Dumping || !Outbox)
+        {
+            return false;
+        }
+        Dumping = true;
+        DumpHeader = true;
+        DumpNext = 0;
+        return true;
+    }
+
+    // Print the last profile to Serial, blocking
+    bool print()
+    {
+        if (!Ready)
+        {
+            return false;
+        }
+        char line[96];
+        header(line, sizeof(line));
+        Serial.println(line);
+        for (uint16_t i = 0; i < dumpLines(); i++)
+        {
+            if (format(i, line, sizeof(line)))
+            {
+                Serial.println(line);
+            }
+        }
+        Serial.println(F("#PF end"));
+        return true;
+    }
+
+    // Stop when the time is up and publish the next part of a dump. Called from loop().
+    void update()
+    {
+        if (running() && millis() - Started >= Seconds * 1000UL)
+        {
+            stop();
+            if (ToSerial)
+            {
+                print();
+            }
+            else
+            {
+                dump();
+            }
+        }
+        if (!Dumping)
+        {
+            return;
+        }
+        char message[profileMessageSize];
+        uint16_t n = 0;
+        char line[96];
+        if (DumpHeader)
+        {
+            n += header(message, sizeof(message));
+            message[n++] = '\n';
+        }
+        uint16_t next = DumpNext;
+        while (next < dumpLines())
+        {
+            uint16_t length = format(next, line, sizeof(line));
+            if (n + length + 1 > sizeof(message))
+            {
+                break;
+            }
+            if (length)
+            {
+                memcpy(message + n, line, length);
+                n += length;
+                message[n++] = '\n';
+            }
+            next++;
+        }
+        bool last = next == dumpLines() && n + 8 <= sizeof(message);
+        if (last)
+        {
+            memcpy(message + n, "#PF end\n", 8);
+            n += 8;
+        }
+        if (!Outbox->publish(Topic, (const uint8_t *)message, n))
+        {
+            return;
+        }
+        DumpHeader = false;
+        DumpNext = next;
+        if (last)
+        {
+            Dumping = false;
+        }
+    }
+
+    // Take one sample of the interrupted task, from the timer interrupt
+    void IRAM_ATTR tick()
+    {
+        byte core = xPortGetCoreID();
+        if (port_interruptNesting[core] > 1)
+        {
+            // The frame in the task's control block is from before the other handler ran
+            interrupted++;
+            Histogram.samples++;
+            return;
+        }
+        void *task = pxCurrentTCB[core];
+        XtExcFrame *frame = *(XtExcFrame **)task;
+        uint32_t pcs[profileStackDepth];
+        pcs[0] = frame->pc;
+        byte depth = 1;
+        if (Stacks)
+        {
+            // The register windows of the task were spilled to its stack on interrupt entry
+            esp_backtrace_frame_t walk = {(uint32_t)frame->pc, (uint32_t)frame->a1, (uint32_t)frame->a0};
+            while (depth < profileStackDepth && esp_backtrace_get_next_frame(&walk))
+            {
+                pcs[depth++] = codeAddress(walk.pc);
+            }
+        }
+        Histogram.add(pcs, depth);
+        countTask(task);
+    }
+
+    void printStats()
+    {
+        Serial.print(F("Profiler: "));
+        Serial.print(Histogram.samples);
+        Serial.print(F(" samples, "));
+        Serial.print(Histogram.dropped);
+        Serial.print(F(" dropped, "));
+        Serial.print(interrupted);
+        Serial.print(F(" in interrupts, "));
+        Serial.println(running() ? F("sampling") : (Dumping ? F("dumping") : (Ready ? F("ready") : F("idle"))));
+    }
+
+    private:
+
+    ProfileHistogram Histogram;
+    void *Tasks[profileTasks];
+    uint32_t TaskCounts[profileTasks];
+    hw_timer_t *Timer;
+    uint32_t Hz;
+    uint16_t Seconds;
+    unsigned long Started;
+    bool Stacks;
+    bool ToSerial;
+    bool Ready;                     // a finished profile is in the tables
+    bool Dumping;
+    bool DumpHeader;
+    uint16_t DumpNext;
+    MqttQueue *Outbox;
+    const char *Topic;
+
+    // A return address carries the caller's window size in its top two bits
+    static uint32_t IRAM_ATTR codeAddress(uint32_t pc)
+    {
+        return (pc & 0x3FFFFFFF) | 0x40000000;
+    }
+
+    void IRAM_ATTR countTask(void *task)
+    {
+        for (byte t = 0; t < profileTasks; t++)
+        {
+            if (Tasks[t] == task || Tasks[t] == nullptr)
+            {
+                Tasks[t] = task;
+                TaskCounts[t]++;
+                return;
+            }
+        }
+    }
+
+    uint16_t dumpLines() { return profileTasks + Histogram.lines(); }
+
+    uint16_t header(char *out, uint16_t size)
+    {
+        return snprintf(out, size, "#PF begin %lu %lu %lu %lu", (unsigned long)Hz,
+            (unsigned long)Histogram.samples, (unsigned long)Histogram.dropped, (unsigned long)interrupted);
+    }
+
+    uint16_t format(uint16_t i, char *out, uint16_t size)
+    {
+        if (i >= profileTasks)
+        {
+            return Histogram.format(i - profileTasks, out, size);
+        }
+        if (!Tasks[i])
+        {
+            return 0;
+        }
+        int n = snprintf(out, size, "#PF task %lu %s", (unsigned long)TaskCounts[i], pcTaskGetName((TaskHandle_t)Tasks[i]));
+        return min(n, (int)size - 1);
+    }
+};
+
+Profiler profiler;
+
+void IRAM_ATTR profileTick()
+{
+    profiler.tick();
+}
+
+#else
+
+// Stands in for the profiler when it is compiled out
+class Profiler
+{
+    public:
+
+    template <typename Queue>
+    void begin(Queue &outbox, const char *topic) {}
+    bool running() { return false; }
+    bool start(uint16_t seconds, uint32_t hz, bool stacks, bool toSerial) { return false; }
+    void stop() {}
+    bool dump() { return false; }
+    bool print() { return false; }
+    void update() {}
+
+    void printStats()
+    {
+        Serial.println(F("Profiler: compiled out"));
+    }
+};
+
+Profiler profiler;
+
+#endif
+
+#endif
@@ -0,0 +1,296 @@
+#ifndef RfidFunctions_h
+#define RfidFunctions_h
+
+#include "native_hal.h"
+#include "trace.h"
+#include "metrics.h"
+#include "heapaudit.h"
+
+// Readers talk to tags through the batched SPI transport (see pn5180_transport.h). With
+// RFID_SIMULATED defined the bank drives modelled readers instead (see pn5180_sim.h), which also
+// lets it build on a host for polling benchmarks.
+#ifdef RFID_SIMULATED
+#include "pn5180_sim.h"
+typedef PN5180Sim RfidReader;
+#else
+#include "pn5180_transport.h"
+typedef PN5180Batched RfidReader;
+#endif
+
+// Largest bank that a pair of 16 channel multiplexers can address
+const byte maxReaders = 16;
+
+// ISO15693 request flags and commands used for tag memory reads
+const uint8_t iso15693AddressedFlags = 0x22;    // high data rate, addressed to one UID
+const uint8_t iso15693ReadSingleBlock = 0x20;
+const uint8_t iso15693ReadMultipleBlocks = 0x23;
+const uint8_t maxBlockRead = 64;                // bytes per block read, inside the transport's response buffer
+
+// Reader health, published with the other metrics (see metrics.h)
+const uint32_t rfidInventoryBounds[] = {2000, 5000, 10000, 20000, 50000};
+MetricCounter rfidInventories("rfid.inventories");
+MetricCounter rfidTagReads("rfid.tags");            // inventories that found a tag
+MetricCounter rfidFailures("rfid.failures");        // inventories that failed, other than no tag
+MetricHistogram rfidInventoryMicros("rfid.inventory_us", rfidInventoryBounds, 5);
+
+// Class for a bank of PN5180 readers sharing one SPI bus
+//
+// Direct wiring: every reader has its own NSS, BUSY and RESET pins and its own driver object.
+// Multiplexed wiring (select pins given): one driver object serves every reader. Its NSS and BUSY
+// lines are routed to the addressed reader through a pair of 74HC4067 multiplexers driven by the
+// select pins, and all RESET inputs are tied to the driver's RESET pin. Unselected NSS lines need a
+// 10k pull-up to 3V3 so those readers ignore the bus.
+class RfidBank
+{
+    public:
+
+    // Member Variables:
+    uint8_t uid[maxReaders][8];             // UID last read by each reader (all zeros when no tag)
+    ISO15693ErrorCode result[maxReaders];   // result of the last inventory on each reader
+
+    unsigned long pollMicros[maxReaders];   // duration of the last inventory on each reader
+    unsigned long passMicros;               // bus time of the last complete pass over the bank
+    unsigned long maxPassMicros;            // longest complete pass since boot
+    unsigned long passCount;                // complete passes since boot
+
+    // Constructor - readers holds one driver per reader, or a single shared driver when multiplexed
+    RfidBank(RfidReader *readers, byte count, const byte *selectPins = nullptr, byte numSelectPins = 0)
+    {
+        Readers = readers;
+        Count = min(count, maxReaders);
+        SelectPins = selectPins;
+        NumSelectPins = numSelectPins;
+        Cursor = 0;
+        passBusMicros = 0;
+        passMicros = 0;
+        maxPassMicros = 0;
+        passCount = 0;
+        clear();
+    }
+
+    // Number of readers in the bank
+    byte size()
+    {
+        return Count;
+    }
+
+    // Initialise every reader and enable its RF field
+    void begin()
+    {
+        for (byte s = 0; s < NumSelectPins; s++)
+        {
+            pinMode(SelectPins[s], OUTPUT);
+        }
+
+        if (multiplexed())
+        {
+            Serial.println(F("Initialising shared reader bus..."));
+            select(0);
+            Readers[0].begin();
+            // The RESET line is shared, so every reader restarts together
+            Serial.println(F("Resetting all readers..."));
+            Readers[0].reset();
+        }
+
+        for (byte i = 0; i < Count; i++)
+        {
+            Serial.print("Reader #");
+            Serial.println(i);
+            if (!multiplexed())
+            {
+                Serial.println(F("Initialising..."));
+                Readers[i].begin();
+                Serial.println(F("Resetting..."));
+                Readers[i].reset();
+            }
+            Serial.println(F("Enabling RF field..."));
+            reader(i).setupRF();
+        }
+    }
+
+    // Forget every result, e.g. after a reset so a stale reset tag is not acted on twice
+    void clear()
+    {
+        for (byte i = 0; i < maxReaders; i++)
+        {
+            memset(uid[i], 0, 8);
+            result[i] = EC_NO_CARD;
+            pollMicros[i] = 0;
+        }
+    }
+
+    // Poll readers round robin until the time budget is spent (at least one reader per call).
+    // A call never runs past the end of the bank, so it returns true when a pass completes.
+    bool poll(unsigned long budgetMicros)
+    {
+        TRACE_SPAN("rfid.poll");
+        HEAP_SCOPE(logRfid);
+        unsigned long started = micros();
+        do
+        {
+            pollReader(Cursor);
+            passBusMicros += pollMicros[Cursor];
+            if (++Cursor >= Count)
+            {
+                Cursor = 0;
+                passMicros = passBusMicros;
+                maxPassMicros = max(maxPassMicros, passMicros);
+                passBusMicros = 0;
+                passCount++;
+                return true;
+            }
+        } while (micros() - started < budgetMicros);
+        return false;
+    }
+
+    // Read the UID on a single reader
+    void pollReader(byte i)
+    {
+        TRACE_SPAN("rfid.inventory");
+        unsigned long started = micros();
+        result[i] = reader(i).getInventory(uid[i]);
+        pollMicros[i] = micros() - started;
+        rfidInventories.add();
+        rfidInventoryMicros.record(pollMicros[i]);
+        if (result[i] == ISO15693_EC_OK)
+        {
+            rfidTagReads.add();
+        }
+        else
+        {
+            if (result[i] != EC_NO_CARD)
+            {
+                rfidFailures.add();
+            }
+            memset(uid[i], 0, 8);
+        }
+    }
+
+    // Read count blocks of tag memory, starting at block first, from the tag with this UID on reader i.
+    // A single block uses READ SINGLE BLOCK, anything longer one READ MULTIPLE BLOCKS exchange.
+    ISO15693ErrorCode readBlocks(byte i, const uint8_t *tagUid, uint8_t first, uint8_t count, uint8_t blockSize, uint8_t *data)
+    {
+        uint16_t dataLen = count * blockSize;
+        if (count == 0 || dataLen > maxBlockRead)
+        {
+            return ISO15693_EC_NOT_SUPPORTED;
+        }
+
+        uint8_t cmd[12];
+        uint8_t cmdLen = 0;
+        cmd[cmdLen++] = iso15693AddressedFlags;
+        cmd[cmdLen++] = (count == 1) ? iso15693ReadSingleBlock : iso15693ReadMultipleBlocks;
+        memcpy(&cmd[cmdLen], tagUid, 8);
+        cmdLen += 8;
+        cmd[cmdLen++] = first;
+        if (count > 1)
+        {
+            cmd[cmdLen++] = count - 1;  // the request carries the number of extra blocks
+        }
+
+        uint8_t *response;
+        uint16_t responseLen;
+        ISO15693ErrorCode rc = reader(i).iso15693(cmd, cmdLen, &response, &responseLen);
+        if (rc != ISO15693_EC_OK)
+        {
+            return rc;
+        }
+        if (responseLen < dataLen + 1)
+        {
+            return ISO15693_EC_UNKNOWN_ERROR;
+        }
+        memcpy(data, &response[1], dataLen);   // skip the response flags
+        return ISO15693_EC_OK;
+    }
+
+    // Measure full-pass time against reader count (first 1, 2 ... N readers)
+    void printScanTimes(byte passes)
+    {
+        Serial.println(F("Readers  Pass (us)  Per reader (us)"));
+        for (byte n = 1; n <= Count; n++)
+        {
+            unsigned long total = 0;
+            for (byte p = 0; p < passes; p++)
+            {
+                for (byte i = 0; i < n; i++)
+                {
+                    pollReader(i);
+                    total += pollMicros[i];
+                }
+            }
+            Serial.print(n);
+            Serial.print("        ");
+            Serial.print(total / passes);
+            Serial.print("      ");
+            Serial.println(total / passes / n);
+        }
+        clear();
+    }
+
+    // Compare SPI and total time per inventory on reader 0, library sequence against batched transport
+    void printTransportTimes(uint16_t count)
+    {
+        uint8_t tagUid[8];
+        RfidReader &nfc = reader(0);
+        Serial.println(F("Inventory   Total (us)  SPI (us)"));
+        for (byte batched = 0; batched < 2; batched++)
+        {
+            unsigned long spiBefore = batched ? nfc.spiMicros() : nfc.librarySpiMicros();
+            unsigned long started = micros();
+            for (uint16_t n = 0; n < count; n++)
+            {
+                if (batched)
+                {
+                    nfc.getInventory(tagUid);
+                }
+                else
+                {
+                    nfc.getInventoryLibrary(tagUid);
+                }
+            }
+            unsigned long total = (micros() - started) / count;
+            unsigned long spi = ((batched ? nfc.spiMicros() : nfc.librarySpiMicros()) - spiBefore) / count;
+            Serial.print(batched ? F("Batched     ") : F("Library     "));
+            Serial.print(total);
+            Serial.print(F("        "));
+            Serial.println(spi);
+        }
+    }
+
+    private:
+
+    RfidReader *Readers;
+    byte Count;
+    const byte *SelectPins;
+    byte NumSelectPins;
+    byte Cursor;                    // next reader to poll
+    unsigned long passBusMicros;    // bus time accumulated by the pass in progress
+
+    bool multiplexed()
+    {
+        return NumSelectPins > 0;
+    }
+
+    // Address reader i on the multiplexers. The driver only changes readers between
+    // transactions, when it has already released NSS, so chip selects never glitch.
+    void select(byte i)
+    {
+        for (byte s = 0; s < NumSelectPins; s++)
+        {
+            digitalWrite(SelectPins[s], (i >> s) & 1);
+        }
+    }
+
+    // Select reader i and return the driver that talks to it
+    RfidReader &reader(byte i)
+    {
+        if (multiplexed())
+        {
+            select(i);
+            return Readers[0];
+        }
+        return Readers[i];
+    }
+};
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef SpscQueue_h
+#define SpscQueue_h
+
+#include <Arduino.h>
+#include <atomic>
+
+// Lock-free queue of variable-length records between exactly one producer task and one
+// consumer task
+//
+// Records are stored whole in a byte ring, each behind a 16-bit length, so the consumer gets
+// them as one contiguous block it can hand on without copying. A record that does not fit
+// before the end of the ring leaves a wrap marker and starts again at the front. The producer
+// only ever moves Head and the consumer only ever moves Tail. Each publishes its index with a
+// release store and reads the other's with an acquire load, so a record is complete in memory
+// before the consumer can see it, and its space is free before the producer reuses it.
+//
+//      producer: p = reserve(n); fill p[0..n); commit();
+//      consumer: p = peek(n); use p[0..n); release();
+
+const uint16_t spscWrap = 0xFFFF;       // length field of a wrap marker
+
+template <uint16_t Size>
+class SpscQueue
+{
+    public:
+
+    SpscQueue()
+    {
+        Head.store(0);
+        Tail.store(0);
+        Reserved = 0;
+        Reading = 0;
+    }
+
+    // Producer: room for a record of length bytes, nullptr when the queue is too full
+    uint8_t *reserve(uint16_t length)
+    {
+        uint16_t need = length + 2;
+        uint16_t head = Head.load(std::memory_order_relaxed);
+        uint16_t tail = Tail.load(std::memory_order_acquire);
+        if (need >= Size)
+        {
+            return nullptr;
+        }
+        if (head >= tail)
+        {
+            // Free space runs to the end of the ring and then up to the tail. The head must
+            // never catch up with the tail, which would read as empty.
+            if (head + need < Size || (head + need == Size && tail != 0))
+            {
+                Reserved = head;
+            }
+            else if (need < tail)
+            {
+                Reserved = 0;
+            }
+            else
+            {
+                return nullptr;
+            }
+        }
+        else if (head + need < tail)
+        {
+            Reserved = head;
+        }
+        else
+        {
+            return nullptr;
+        }
+        ReservedLength = length;
+        return &Buffer[Reserved + 2];
+    }
+
+    // Producer: publish the record filled in after reserve()
+    void commit()
+    {
+        uint16_t head = Head.load(std::memory_order_relaxed);
+        if (Reserved != head && Size - head >= 2)
+        {
+            putLength(head, spscWrap);
+        }
+        putLength(Reserved, ReservedLength);
+        uint16_t next = Reserved + ReservedLength + 2;
+        Head.store(next == Size ? 0 : next, std::memory_order_release);
+    }
+
+    // Producer: publish the record, cut down to length bytes (no more than were reserved)
+    void commit(uint16_t length)
+    {
+        ReservedLength = min(length, ReservedLength);
+        commit();
+    }
+
+    // Producer: reserve, copy and commit in one go, false when the queue is too full
+    bool push(const uint8_t *data, uint16_t length)
+    {
+        uint8_t *p = reserve(length);
+        if (!p)
+        {
+            return false;
+        }
+        memcpy(p, data, length);
+        commit();
+        return true;
+    }
+
+    // Consumer: the oldest record and its length, nullptr when the queue is empty
+    const uint8_t *peek(uint16_t &length)
+    {
+        uint16_t head = Head.load(std::memory_order_acquire);
+        uint16_t tail = Tail.load(std::memory_order_relaxed);
+        if (tail == head)
+        {
+            return nullptr;
+        }
+        if (Size - tail < 2 || getLength(tail) == spscWrap)
+        {
+            tail = 0;
+            if (tail == head)
+            {
+                return nullptr;
+            }
+        }
+        length = getLength(tail);
+        Reading = tail;
+        return &Buffer[tail + 2];
+    }
+
+    // Consumer: drop the record returned by peek()
+    void release()
+    {
+        uint16_t next = Reading + getLength(Reading) + 2;
+        Tail.store(next == Size ? 0 : next, std::memory_order_release);
+    }
+
+    bool empty()
+    {
+        return Head.load(std::memory_order_acquire) == Tail.load(std::memory_order_acquire);
+    }
+
+    // Bytes in use, wrap markers and length fields included. Exact for either side, the other
+    // side can only make it smaller (producer) or larger (consumer).
+    uint16_t used()
+    {
+        uint16_t head = Head.load(std::memory_order_acquire);
+        uint16_t tail = Tail.load(std::memory_order_acquire);
+        return head >= tail ? head - tail : Size - tail + head;
+    }
+
+    private:
+
+    uint8_t Buffer[Size];
+    std::atomic<uint16_t> Head;     // next write position, moved by the producer
+    std::atomic<uint16_t> Tail;     // oldest record, moved by the consumer
+    uint16_t Reserved;              // producer's record being filled
+    uint16_t ReservedLength;
+    uint16_t Reading;               // consumer's record being used
+
+    void putLength(uint16_t at, uint16_t length)
+    {
+        Buffer[at] = length & 0xFF;
+        Buffer[at + 1] = length >> 8;
+    }
+
+    uint16_t getLength(uint16_t at)
+    {
+        return Buffer[at] | (Buffer[at + 1] << 8);
+    }
+};
+
+#endif
@@ -0,0 +1,217 @@
+#ifndef TagCache_h
+#define TagCache_h
+
+#include <Arduino.h>
+#include "rfid.h"
+
+// Beaker data held in the first blocks of tag user memory
+//   byte 0: version, bumped by whoever rewrites the tag
+//   byte 1: ingredient
+//   byte 2: state
+//   rest:   reserved
+const uint8_t beakerBlockSize = 4;      // ICODE SLIX block size in bytes
+const uint8_t beakerBlocks = 4;         // blocks holding beaker data
+const uint8_t beakerDataSize = beakerBlockSize * beakerBlocks;
+const uint8_t tagCacheSize = maxReaders + 8;   // distinct tags remembered, more than can rest on the bank
+
+// Cached beaker data for one tag
+struct TagCacheEntry
+{
+    uint8_t uid[8];
+    uint8_t data[beakerDataSize];
+    unsigned long lastUsed;     // millis() of the last lookup, for eviction
+    bool valid;
+};
+
+// Class caching beaker data per UID so unchanged tags are not read again over RF
+//
+// A tag that stays on its reader costs no RF traffic at all. A known tag that comes back is
+// revalidated with a single block read of its version byte, and only a new or rewritten tag
+// is read in full with one multi-block read.
+class TagCache
+{
+    public:
+
+    // Member Variables:
+    unsigned long hits;             // lookups served without RF traffic
+    unsigned long revalidations;    // lookups served after a version check
+    unsigned long misses;           // lookups that needed a full read
+    unsigned long failures;         // reads that failed, retried on the next lookup
+    unsigned long rfMicros;         // RF time spent on block reads
+    unsigned long fullReadMicros;   // RF time of all full reads, to estimate the time saved
+
+    TagCache()
+    {
+        hits = 0;
+        revalidations = 0;
+        misses = 0;
+        failures = 0;
+        rfMicros = 0;
+        fullReadMicros = 0;
+        for (byte i = 0; i < tagCacheSize; i++)
+        {
+            Entries[i].valid = false;
+        }
+        for (byte i = 0; i < maxReaders; i++)
+        {
+            OnReader[i] = nullptr;
+        }
+    }
+
+    // Refresh the cache against the latest results of the bank
+    void update(RfidBank &bank)
+    {
+        for (byte i = 0; i < bank.size(); i++)
+        {
+            if (bank.result[i] != ISO15693_EC_OK)
+            {
+                OnReader[i] = nullptr;  // tag left, revalidate it if it comes back
+                continue;
+            }
+            lookup(bank, i, bank.uid[i]);
+        }
+    }
+
+    // Beaker data of the tag on reader i, or nullptr when there is none (or it could not be read)
+    const uint8_t *data(byte i)
+    {
+        return OnReader[i] ? OnReader[i]->data : nullptr;
+    }
+
+    // Estimated RF time saved against a full read on every lookup
+    unsigned long savedMicros()
+    {
+        if (misses == 0)
+        {
+            return 0;
+        }
+        unsigned long fullRead = fullReadMicros / misses;
+        unsigned long lookups = hits + revalidations + misses;
+        return (lookups * fullRead > rfMicros) ? lookups * fullRead - rfMicros : 0;
+    }
+
+    // Print hit rate and RF time
+    void printStats()
+    {
+        unsigned long lookups = hits + revalidations + misses;
+        Serial.print(F("Tag cache: "));
+        Serial.print(hits);
+        Serial.print(F(" hits, "));
+        Serial.print(revalidations);
+        Serial.print(F(" version checks, "));
+        Serial.print(misses);
+        Serial.print(F(" full reads ("));
+        Serial.print(lookups ? (hits + revalidations) * 100 / lookups : 0);
+        Serial.print(F("% hit rate), RF "));
+        Serial.print(rfMicros);
+        Serial.print(F(" us, saved "));
+        Serial.print(savedMicros());
+        Serial.println(F(" us"));
+    }
+
+    private:
+
+    TagCacheEntry Entries[tagCacheSize];
+    TagCacheEntry *OnReader[maxReaders];    // entry of the tag currently resting on each reader
+
+    void lookup(RfidBank &bank, byte reader, const uint8_t *uid)
+    {
+        TagCacheEntry *entry = OnReader[reader];
+        if (entry && memcmp(entry->uid, uid, 8) == 0)
+        {
+            entry->lastUsed = millis();
+            hits++;
+            return;
+        }
+
+        entry = find(uid);
+        if (entry)
+        {
+            // Known tag put back, its version byte tells whether it was rewritten meanwhile
+            uint8_t block[beakerBlockSize];
+            unsigned long started = micros();
+            ISO15693ErrorCode rc = bank.readBlocks(reader, uid, 0, 1, beakerBlockSize, block);
+            rfMicros += micros() - started;
+            if (rc != ISO15693_EC_OK)
+            {
+                failures++;
+                OnReader[reader] = nullptr;
+                return;
+            }
+            if (block[0] == entry->data[0])
+            {
+                entry->lastUsed = millis();
+                OnReader[reader] = entry;
+                revalidations++;
+                return;
+            }
+        }
+        else
+        {
+            entry = evict();
+        }
+
+        unsigned long started = micros();
+        ISO15693ErrorCode rc = bank.readBlocks(reader, uid, 0, beakerBlocks, beakerBlockSize, entry->data);
+        unsigned long elapsed = micros() - started;
+        rfMicros += elapsed;
+        if (rc != ISO15693_EC_OK)
+        {
+            failures++;
+            entry->valid = false;
+            OnReader[reader] = nullptr;
+            return;
+        }
+        fullReadMicros += elapsed;
+        memcpy(entry->uid, uid, 8);
+        entry->lastUsed = millis();
+        entry->valid = true;
+        OnReader[reader] = entry;
+        misses++;
+    }
+
+    TagCacheEntry *find(const uint8_t *uid)
+    {
+        for (byte i = 0; i < tagCacheSize; i++)
+        {
+            if (Entries[i].valid && memcmp(Entries[i].uid, uid, 8) == 0)
+            {
+                return &Entries[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // Free slot, or the least recently used tag that is not resting on a reader
+    TagCacheEntry *evict()
+    {
+        TagCacheEntry *oldest = nullptr;
+        for (byte i = 0; i < tagCacheSize; i++)
+        {
+            TagCacheEntry *entry = &Entries[i];
+            if (!entry->valid)
+            {
+                return entry;
+            }
+            if (!inUse(entry) && (oldest == nullptr || entry->lastUsed < oldest->lastUsed))
+            {
+                oldest = entry;
+            }
+        }
+        return oldest ? oldest : &Entries[0];
+    }
+
+    bool inUse(TagCacheEntry *entry)
+    {
+        for (byte i = 0; i < maxReaders; i++)
+        {
+            if (OnReader[i] == entry)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+#endif
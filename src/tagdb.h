@@ -0,0 +1,475 @@
+#ifndef TagDatabase_h
+#define TagDatabase_h
+
+#include <Arduino.h>
+#include <FS.h>
+#include <LittleFS.h>
+#include "binlog.h"
+
+// Tag database file in LittleFS, one tag per line:
+//   <16 hex digit UID> correct <reader>    beaker that solves the given reader
+//   <16 hex digit UID> reset               tag that resets the puzzle on any reader
+// Blank lines and lines starting with # are ignored. Lines may also be separated with ';' so a
+// whole table fits in a single MQTT message.
+const char *tagDbPath = "/tags.txt";
+const char *tagDbTempPath = "/tags.tmp";
+const byte tagDbLineLength = 48;
+const uint32_t tagDbMaxSlots = 32768;                   // largest hash index
+const uint16_t tagDbMaxTags = tagDbMaxSlots * 3 / 4;    // the index is kept at most 3/4 full
+
+// Tag roles
+enum tagRole {
+    tagNone, tagCorrect, tagReset
+};
+
+// One slot of the hash index (role tagNone marks an empty slot)
+struct TagEntry
+{
+    uint8_t uid[8];
+    uint8_t role;
+    uint8_t reader;
+};
+
+// Open addressing hash index over the tag entries
+struct TagTable
+{
+    TagEntry *slots;
+    uint16_t mask;      // capacity - 1, capacity is a power of two
+    uint16_t count;
+    uint32_t readers;   // readers 0-31 that some tag solves
+};
+
+// Class holding the tag database as an in-RAM hash index
+//
+// A reload builds a complete new index beside the active one and swaps the active pointer in a
+// single store, so a scan sees either the old table or the new one, never a partial table.
+class TagDatabase
+{
+    public:
+
+    // Member Variables:
+    unsigned long loads;    // tables swapped in, lookups may answer differently after each
+
+    TagDatabase()
+    {
+        Active = nullptr;
+        loads = 0;
+    }
+
+    // Load the database, seeding the file from the compiled-in tags if it does not exist yet
+    bool begin(const uint8_t (*correct)[8], byte numCorrect, const uint8_t *reset)
+    {
+        if (!LittleFS.exists(tagDbPath))
+        {
+            LOG_INFO(logRfid, "No tag database, writing the default tags");
+            File file = LittleFS.open(tagDbPath, "w");
+            if (!file)
+            {
+                return false;
+            }
+            char line[tagDbLineLength];
+            const uint8_t blank[8] = {0};
+            for (byte i = 0; i < numCorrect; i++)
+            {
+                if (memcmp(correct[i], blank, 8) == 0)
+                {
+                    continue;   // no default for this reader
+                }
+                formatLine(line, correct[i], tagCorrect, i);
+                file.print(line);
+            }
+            formatLine(line, reset, tagReset, 0);
+            file.print(line);
+            file.close();
+        }
+        return reload();
+    }
+
+    // Rebuild the index from the database file
+    bool reload()
+    {
+        File file = LittleFS.open(tagDbPath, "r");
+        if (!file)
+        {
+            LOG_WARN(logRfid, "Tag database could not be opened");
+            return false;
+        }
+
+        // First pass sizes the table, second pass fills it
+        uint16_t lines = 0;
+        char line[tagDbLineLength];
+        TagEntry entry;
+        while (file.available())
+        {
+            size_t len = file.readBytesUntil('\n', line, sizeof(line) - 1);
+            if (parseLine(line, len, entry))
+            {
+                lines++;
+            }
+        }
+
+        TagTable *table = create(lines);
+        if (table == nullptr)
+        {
+            file.close();
+            return false;
+        }
+        file.seek(0);
+        while (file.available())
+        {
+            size_t len = file.readBytesUntil('\n', line, sizeof(line) - 1);
+            if (parseLine(line, len, entry))
+            {
+                insert(table, entry);
+            }
+        }
+        file.close();
+        swap(table);
+        return true;
+    }
+
+    // Replace the database file with new contents and reload it. The file is written beside the
+    // old one and renamed over it, so a power cut never leaves a half written database.
+    bool replace(const char *text, size_t len)
+    {
+        File file = LittleFS.open(tagDbTempPath, "w");
+        if (!file)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < len; i++)
+        {
+            file.write(text[i] == ';' ? '\n' : text[i]);
+        }
+        file.close();
+        // LittleFS replaces an existing target in the same step as the rename
+        if (!LittleFS.rename(tagDbTempPath, tagDbPath))
+        {
+            return false;
+        }
+        return reload();
+    }
+
+    // Append lines to the database file and reload it
+    bool append(const char *text, size_t len)
+    {
+        File file = LittleFS.open(tagDbPath, "a");
+        if (!file)
+        {
+            return false;
+        }
+        file.write('\n');
+        for (size_t i = 0; i < len; i++)
+        {
+            file.write(text[i] == ';' ? '\n' : text[i]);
+        }
+        file.close();
+        return reload();
+    }
+
+    // Find a tag, nullptr when it is not in the database
+    const TagEntry *lookup(const uint8_t *uid)
+    {
+        return find(Active, uid);
+    }
+
+    // Whether this tag solves the given reader
+    bool isCorrect(byte reader, const uint8_t *uid)
+    {
+        const TagEntry *entry = lookup(uid);
+        return entry && entry->role == tagCorrect && entry->reader == reader;
+    }
+
+    // Whether some tag solves the given reader. Readers without one take no part in the
+    // puzzle, so a bank of 16 multiplexed readers can be used with fewer beakers.
+    bool hasCorrect(byte reader)
+    {
+        return Active && reader < 32 && (Active->readers & (1UL << reader));
+    }
+
+    // Whether this tag resets the puzzle
+    bool isReset(const uint8_t *uid)
+    {
+        const TagEntry *entry = lookup(uid);
+        return entry && entry->role == tagReset;
+    }
+
+    // Number of tags in the active table
+    uint16_t size()
+    {
+        return Active ? Active->count : 0;
+    }
+
+    // Print the database file as one "tagdb set" command, to keep a copy or move it to another prop
+    void print()
+    {
+        File file = LittleFS.open(tagDbPath, "r");
+        if (!file)
+        {
+            Serial.println(F("Tag database could not be opened"));
+            return;
+        }
+        Serial.print(F("tagdb set "));
+        bool first = true;
+        char line[tagDbLineLength];
+        TagEntry entry;
+        while (file.available())
+        {
+            size_t len = file.readBytesUntil('\n', line, sizeof(line) - 1);
+            if (parseLine(line, len, entry))
+            {
+                formatLine(line, entry.uid, (tagRole)entry.role, entry.reader);
+                line[strlen(line) - 1] = '\0';     // drop the newline
+                if (!first)
+                {
+                    Serial.print(';');
+                }
+                Serial.print(line);
+                first = false;
+            }
+        }
+        Serial.println();
+        file.close();
+    }
+
+    // Measure lookup time on a scratch table of n random tags (hits and misses), 1 to tagDbMaxTags
+    void benchmark(long n)
+    {
+        if (n <= 0 || n > tagDbMaxTags)
+        {
+            Serial.print(F("Benchmark size must be 1 to "));
+            Serial.println(tagDbMaxTags);
+            return;
+        }
+        TagTable *table = create(n);
+        if (table == nullptr)
+        {
+            Serial.println(F("Not enough memory for the benchmark table"));
+            return;
+        }
+        TagEntry entry;
+        entry.role = tagCorrect;
+        entry.reader = 0;
+        for (long i = 0; i < n; i++)
+        {
+            randomUid(entry.uid, i);
+            insert(table, entry);
+        }
+
+        uint8_t uid[8];
+        uint16_t found = 0;
+        unsigned long started = micros();
+        for (long i = 0; i < n; i++)
+        {
+            randomUid(uid, i);
+            found += find(table, uid) != nullptr;
+        }
+        unsigned long hitMicros = micros() - started;
+
+        started = micros();
+        for (long i = 0; i < n; i++)
+        {
+            randomUid(uid, n + i);
+            found += find(table, uid) != nullptr;
+        }
+        unsigned long missMicros = micros() - started;
+
+        Serial.print(F("Tag lookup with "));
+        Serial.print(n);
+        Serial.print(F(" entries in "));
+        Serial.print(table->mask + 1);
+        Serial.print(F(" slots: hit "));
+        Serial.print(hitMicros * 1000 / n);
+        Serial.print(F(" ns, miss "));
+        Serial.print(missMicros * 1000 / n);
+        Serial.print(F(" ns ("));
+        Serial.print(found);
+        Serial.println(F(" found)"));
+        destroy(table);
+    }
+
+    private:
+
+    TagTable *Active;
+
+    // Parse one database line, false for blank lines, comments and malformed lines
+    static bool parseLine(char *line, size_t len, TagEntry &entry)
+    {
+        line[len] = '\0';
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+        {
+            p++;
+        }
+        if (*p == '\0' || *p == '\r' || *p == '#')
+        {
+            return false;
+        }
+        for (byte i = 0; i < 8; i++)
+        {
+            int hi = hexValue(p[i * 2]);
+            int lo = hexValue(p[i * 2 + 1]);
+            if (hi < 0 || lo < 0)
+            {
+                return false;
+            }
+            entry.uid[i] = (hi << 4) | lo;
+        }
+        p += 16;
+        while (*p == ' ' || *p == '\t')
+        {
+            p++;
+        }
+        if (strncasecmp(p, "correct", 7) == 0)
+        {
+            entry.role = tagCorrect;
+            entry.reader = atoi(p + 7);
+            return true;
+        }
+        if (strncasecmp(p, "reset", 5) == 0)
+        {
+            entry.role = tagReset;
+            entry.reader = 0;
+            return true;
+        }
+        return false;
+    }
+
+    static void formatLine(char *line, const uint8_t *uid, tagRole role, byte reader)
+    {
+        for (byte i = 0; i < 8; i++)
+        {
+            sprintf(&line[i * 2], "%02X", uid[i]);
+        }
+        if (role == tagCorrect)
+        {
+            sprintf(&line[16], " correct %d\n", reader);
+        }
+        else
+        {
+            sprintf(&line[16], " reset\n");
+        }
+    }
+
+    static int hexValue(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    // FNV-1a over the UID bytes
+    static uint32_t hash(const uint8_t *uid)
+    {
+        uint32_t h = 2166136261UL;
+        for (byte i = 0; i < 8; i++)
+        {
+            h = (h ^ uid[i]) * 16777619UL;
+        }
+        return h;
+    }
+
+    // Empty table sized to stay at most three quarters full
+    static TagTable *create(uint16_t count)
+    {
+        uint32_t capacity = 16;
+        while (capacity * 3 < (uint32_t)count * 4)
+        {
+            capacity <<= 1;
+        }
+        if (capacity > tagDbMaxSlots)
+        {
+            return nullptr;
+        }
+        TagTable *table = (TagTable *)malloc(sizeof(TagTable));
+        if (table == nullptr)
+        {
+            return nullptr;
+        }
+        table->slots = (TagEntry *)calloc(capacity, sizeof(TagEntry));
+        if (table->slots == nullptr)
+        {
+            free(table);
+            return nullptr;
+        }
+        table->mask = capacity - 1;
+        table->count = 0;
+        table->readers = 0;
+        return table;
+    }
+
+    static void destroy(TagTable *table)
+    {
+        if (table)
+        {
+            free(table->slots);
+            free(table);
+        }
+    }
+
+    // Insert or replace an entry (linear probing)
+    static void insert(TagTable *table, const TagEntry &entry)
+    {
+        uint16_t i = hash(entry.uid) & table->mask;
+        while (table->slots[i].role != tagNone && memcmp(table->slots[i].uid, entry.uid, 8) != 0)
+        {
+            i = (i + 1) & table->mask;
+        }
+        if (table->slots[i].role == tagNone)
+        {
+            table->count++;
+        }
+        table->slots[i] = entry;
+    }
+
+    static const TagEntry *find(const TagTable *table, const uint8_t *uid)
+    {
+        if (table == nullptr)
+        {
+            return nullptr;
+        }
+        uint16_t i = hash(uid) & table->mask;
+        while (table->slots[i].role != tagNone)
+        {
+            if (memcmp(table->slots[i].uid, uid, 8) == 0)
+            {
+                return &table->slots[i];
+            }
+            i = (i + 1) & table->mask;
+        }
+        return nullptr;
+    }
+
+    // Publish a fully built table, then release the old one
+    void swap(TagTable *table)
+    {
+        for (uint32_t i = 0; i <= table->mask; i++)
+        {
+            if (table->slots[i].role == tagCorrect && table->slots[i].reader < 32)
+            {
+                table->readers |= 1UL << table->slots[i].reader;
+            }
+        }
+        TagTable *old = Active;
+        Active = table;
+        loads++;
+        destroy(old);
+        Serial.print(F("Tag database loaded, "));
+        Serial.print(table->count);
+        Serial.println(F(" tags"));
+    }
+
+    // Deterministic pseudo random UID for the benchmark
+    static void randomUid(uint8_t *uid, uint32_t seed)
+    {
+        uint32_t h = hash((const uint8_t *)"benchtag") ^ seed;
+        for (byte i = 0; i < 8; i++)
+        {
+            h = h * 1664525UL + 1013904223UL;
+            uid[i] = h >> 24;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,715 @@
+#ifndef Telemetry_h
+#define Telemetry_h
+
+#include <Arduino.h>
+#include "mqttqueue.h"
+
+const uint16_t telemetryBufferSize = 960;       // batch size, leaves room in the MQTT buffer for topic and header
+const unsigned long telemetrySampleDefault = 1000;     // milliseconds between state snapshots
+const unsigned long telemetryPublishDefault = 5000;    // milliseconds between batches
+const long telemetryRateMax = 3600000;                  // longest sample or publish period, an hour
+
+// Telemetry encodings
+enum telemetryFormat {
+    formatMsgPack, formatJson, numTelemetryFormats
+};
+
+// Telemetry event codes
+enum telemetryEvent {
+    eventState,     // value: new PuzzleState
+    eventLaser,     // value: 1 when the laser is detected
+    eventDoor,      // value: 1 when the beaker door is closed
+    eventTag,       // index: reader, uid: tag placed (nil when removed)
+    eventSolve,
+    eventReset,
+    eventHeap       // index: subsystem, value: bytes, a new call site allocating after setup
+};
+
+// Inputs bitmask in a snapshot
+const uint8_t inputLaser = 0x01;
+const uint8_t inputDoorClosed = 0x02;
+const uint8_t inputBeakersCorrect = 0x04;
+
+// State of the puzzle at one moment
+struct TelemetrySnapshot
+{
+    unsigned long millis;
+    uint8_t state;                  // PuzzleState
+    uint8_t inputs;                 // input* bits
+    byte numReaders;
+    const uint8_t (*uids)[8];       // tag on each reader, all zeros when empty
+};
+
+// Position in a writer, to take back a record that did not fit
+struct TelemetryMark
+{
+    uint16_t length;
+    bool comma;
+    byte depth;
+};
+
+// MessagePack encoder into a fixed buffer. Writes past the end are dropped and flagged.
+class MsgPackWriter
+{
+    public:
+
+    MsgPackWriter(uint8_t *buffer, uint16_t capacity)
+    {
+        Buffer = buffer;
+        Capacity = capacity;
+        reset();
+    }
+
+    void reset()
+    {
+        Length = 0;
+        Overflow = false;
+    }
+
+    uint16_t length() { return Length; }
+    bool overflow() { return Overflow; }
+
+    TelemetryMark mark()
+    {
+        TelemetryMark m = {Length, false, 0};
+        return m;
+    }
+
+    void rewind(const TelemetryMark &m)
+    {
+        Length = m.length;
+        Overflow = false;
+    }
+
+    void beginMap(byte n) { header(0x80, 0xDE, n); }
+    void endMap() {}
+    void beginArray(byte n) { header(0x90, 0xDC, n); }
+    void endArray() {}
+
+    // Array whose length is only known at the end, always written as array 16
+    uint16_t beginOpenArray()
+    {
+        uint16_t at = Length;
+        put(0xDC);
+        put(0);
+        put(0);
+        return at;
+    }
+
+    void endOpenArray(uint16_t at, uint16_t count)
+    {
+        if (at + 2 < Capacity)
+        {
+            Buffer[at + 1] = count >> 8;
+            Buffer[at + 2] = count & 0xFF;
+        }
+    }
+
+    void key(const char *k) { string(k); }
+
+    void string(const char *s)
+    {
+        size_t len = strlen(s);
+        if (len < 32)
+        {
+            put(0xA0 | len);
+        }
+        else
+        {
+            put(0xD9);
+            put(len);
+        }
+        put((const uint8_t *)s, len);
+    }
+
+    void number(uint32_t v)
+    {
+        if (v < 0x80)
+        {
+            put(v);
+        }
+        else if (v <= 0xFF)
+        {
+            put(0xCC);
+            put(v);
+        }
+        else if (v <= 0xFFFF)
+        {
+            put(0xCD);
+            put(v >> 8);
+            put(v & 0xFF);
+        }
+        else
+        {
+            put(0xCE);
+            put(v >> 24);
+            put((v >> 16) & 0xFF);
+            put((v >> 8) & 0xFF);
+            put(v & 0xFF);
+        }
+    }
+
+    void integer(int32_t v)
+    {
+        if (v >= 0)
+        {
+            number(v);
+        }
+        else if (v >= -32)
+        {
+            put(0xE0 | (v + 32));
+        }
+        else if (v >= -128)
+        {
+            put(0xD0);
+            put(v & 0xFF);
+        }
+        else if (v >= -32768)
+        {
+            put(0xD1);
+            put((v >> 8) & 0xFF);
+            put(v & 0xFF);
+        }
+        else
+        {
+            put(0xD2);
+            put((v >> 24) & 0xFF);
+            put((v >> 16) & 0xFF);
+            put((v >> 8) & 0xFF);
+            put(v & 0xFF);
+        }
+    }
+
+    void boolean(bool b) { put(b ? 0xC3 : 0xC2); }
+    void nil() { put(0xC0); }
+
+    void bytes(const uint8_t *data, byte len)
+    {
+        put(0xC4);
+        put(len);
+        put(data, len);
+    }
+
+    void endBatch() {}
+
+    private:
+
+    uint8_t *Buffer;
+    uint16_t Capacity;
+    uint16_t Length;
+    bool Overflow;
+
+    // Fixed size header for up to 15 entries, 16 bit count above
+    void header(uint8_t fix, uint8_t wide, byte n)
+    {
+        if (n < 16)
+        {
+            put(fix | n);
+        }
+        else
+        {
+            put(wide);
+            put(0);
+            put(n);
+        }
+    }
+
+    void put(uint8_t b)
+    {
+        if (Length < Capacity)
+        {
+            Buffer[Length++] = b;
+        }
+        else
+        {
+            Overflow = true;
+        }
+    }
+
+    void put(const uint8_t *data, size_t len)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            put(data[i]);
+        }
+    }
+};
+
+// JSON encoder with the same calls as MsgPackWriter, so both encodings can be compared on the
+// same data. Binary values become hex strings.
+class JsonWriter
+{
+    public:
+
+    JsonWriter(uint8_t *buffer, uint16_t capacity)
+    {
+        Buffer = buffer;
+        Capacity = capacity;
+        reset();
+    }
+
+    void reset()
+    {
+        Length = 0;
+        Overflow = false;
+        Comma = false;
+        Depth = 0;
+    }
+
+    uint16_t length() { return Length; }
+    bool overflow() { return Overflow; }
+
+    TelemetryMark mark()
+    {
+        TelemetryMark m = {Length, Comma, Depth};
+        return m;
+    }
+
+    void rewind(const TelemetryMark &m)
+    {
+        Length = m.length;
+        Comma = m.comma;
+        Depth = m.depth;
+        Overflow = false;
+    }
+
+    void beginMap(byte) { open('{'); }
+    void endMap() { close('}'); }
+    void beginArray(byte) { open('['); }
+    void endArray() { close(']'); }
+
+    uint16_t beginOpenArray()
+    {
+        open('[');
+        return 0;
+    }
+
+    void endOpenArray(uint16_t, uint16_t) { close(']'); }
+
+    void key(const char *k)
+    {
+        string(k);
+        put(':');
+        Comma = false;
+    }
+
+    void string(const char *s)
+    {
+        separate();
+        put('"');
+        put(s, strlen(s));
+        put('"');
+    }
+
+    void number(uint32_t v)
+    {
+        separate();
+        char digits[11];
+        put(digits, sprintf(digits, "%lu", (unsigned long)v));
+    }
+
+    void integer(int32_t v)
+    {
+        separate();
+        char digits[12];
+        put(digits, sprintf(digits, "%ld", (long)v));
+    }
+
+    void boolean(bool b)
+    {
+        separate();
+        put(b ? "true" : "false", b ? 4 : 5);
+    }
+
+    void nil()
+    {
+        separate();
+        put("null", 4);
+    }
+
+    void bytes(const uint8_t *data, byte len)
+    {
+        separate();
+        put('"');
+        for (byte i = 0; i < len; i++)
+        {
+            put("0123456789ABCDEF"[data[i] >> 4]);
+            put("0123456789ABCDEF"[data[i] & 0x0F]);
+        }
+        put('"');
+    }
+
+    // Close any containers left open by the envelope
+    void endBatch()
+    {
+        while (Depth > 0)
+        {
+            close(Closers[Depth - 1]);
+        }
+    }
+
+    private:
+
+    uint8_t *Buffer;
+    uint16_t Capacity;
+    uint16_t Length;
+    bool Overflow;
+    bool Comma;         // a value was written, the next one needs a separator
+    byte Depth;
+    char Closers[8];
+
+    void separate()
+    {
+        if (Comma)
+        {
+            put(',');
+        }
+        Comma = true;
+    }
+
+    void open(char c)
+    {
+        separate();
+        put(c);
+        Comma = false;
+        if (Depth < sizeof(Closers))
+        {
+            Closers[Depth++] = (c == '{') ? '}' : ']';
+        }
+    }
+
+    void close(char c)
+    {
+        put(c);
+        Comma = true;
+        if (Depth > 0)
+        {
+            Depth--;
+        }
+    }
+
+    void put(char c)
+    {
+        if (Length < Capacity)
+        {
+            Buffer[Length++] = c;
+        }
+        else
+        {
+            Overflow = true;
+        }
+    }
+
+    void put(const char *s, size_t len)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            put(s[i]);
+        }
+    }
+};
+
+// Cost of one encoding
+struct TelemetryStats
+{
+    unsigned long batches;          // batches published
+    unsigned long records;          // snapshots and events published
+    unsigned long bytes;            // payload bytes published
+    unsigned long dropped;          // batches the outbound queue had no room for
+    unsigned long encodeMicros;     // time spent encoding records
+    unsigned long publishMicros;    // time spent handing batches to the outbound queue
+    unsigned long activeMillis;     // time this encoding was selected, excluding the current stretch
+};
+
+// Class publishing state snapshots and events to the host in batches
+//
+// Records are encoded into the batch as they happen, so a batch is ready to publish without a
+// second pass. A batch goes out when the publish interval ends or when the next record would not
+// fit. The encoding can be switched at run time so MessagePack and JSON can be compared on the
+// same traffic: bytes per second and CPU time are kept per encoding.
+//
+// Batch layout (same shape in both encodings):
+//   {"dev": deviceID, "seq": n, "rec": [record, ...]}
+//   snapshot: {"t": millis, "st": state, "in": inputs, "tags": [uid or nil, ...]}
+//   event:    {"t": millis, "ev": code, "i": index, "v": value or uid}
+class Telemetry
+{
+    public:
+
+    // Member Variables:
+    TelemetryStats stats[numTelemetryFormats];
+    unsigned long sampleMillis;     // milliseconds between snapshots
+    unsigned long publishMillis;    // milliseconds between batches
+
+    Telemetry(MqttQueue &outbox, const char *topic, const char *device)
+    : Outbox(outbox), Pack(Buffer, telemetryBufferSize), Json(Buffer, telemetryBufferSize)
+    {
+        Topic = topic;
+        Device = device;
+        Format = formatMsgPack;
+        sampleMillis = telemetrySampleDefault;
+        publishMillis = telemetryPublishDefault;
+        memset(stats, 0, sizeof(stats));
+        Sequence = 0;
+        LastSample = 0;
+        LastPublish = 0;
+        FormatSince = 0;
+        Records = 0;
+    }
+
+    void setRate(unsigned long sample, unsigned long publish)
+    {
+        sampleMillis = max(sample, 10UL);
+        publishMillis = max(publish, sampleMillis);
+    }
+
+    // Switch encodings, the pending batch is published in the old one first
+    void setFormat(telemetryFormat format)
+    {
+        if (format == Format)
+        {
+            return;
+        }
+        flush();
+        stats[Format].activeMillis += millis() - FormatSince;
+        FormatSince = millis();
+        Format = format;
+    }
+
+    telemetryFormat format() { return Format; }
+
+    // Whether the next snapshot should be taken
+    bool snapshotDue()
+    {
+        return millis() - LastSample >= sampleMillis;
+    }
+
+    void snapshot(const TelemetrySnapshot &s)
+    {
+        LastSample = millis();
+        if (Format == formatMsgPack)
+        {
+            add(Pack, s);
+        }
+        else
+        {
+            add(Json, s);
+        }
+    }
+
+    void event(telemetryEvent code, uint8_t index, uint32_t value, const uint8_t *uid = nullptr)
+    {
+        TelemetryEventRecord e = {millis(), (uint8_t)code, index, value, uid};
+        if (Format == formatMsgPack)
+        {
+            add(Pack, e);
+        }
+        else
+        {
+            add(Json, e);
+        }
+    }
+
+    // Publish the batch once the interval is over
+    void update()
+    {
+        if (millis() - LastPublish >= publishMillis)
+        {
+            flush();
+        }
+    }
+
+    // Publish whatever is pending
+    void flush()
+    {
+        LastPublish = millis();
+        if (Records == 0)
+        {
+            return;
+        }
+        uint16_t length;
+        if (Format == formatMsgPack)
+        {
+            length = finish(Pack);
+        }
+        else
+        {
+            length = finish(Json);
+        }
+        TelemetryStats &st = stats[Format];
+        unsigned long started = micros();
+        bool sent = Outbox.publish(Topic, Buffer, length);
+        st.publishMicros += micros() - started;
+        if (sent)
+        {
+            st.batches++;
+            st.records += Records;
+            st.bytes += length;
+        }
+        else
+        {
+            st.dropped++;
+        }
+        Records = 0;
+    }
+
+    // Print bytes per second and CPU time for each encoding used so far
+    void printStats()
+    {
+        static const char *names[numTelemetryFormats] = {"MessagePack", "JSON"};
+        for (byte f = 0; f < numTelemetryFormats; f++)
+        {
+            TelemetryStats &st = stats[f];
+            unsigned long active = st.activeMillis + (f == Format ? millis() - FormatSince : 0);
+            if (st.records == 0)
+            {
+                continue;
+            }
+            Serial.print(F("Telemetry "));
+            Serial.print(names[f]);
+            Serial.print(F(": "));
+            Serial.print(st.batches);
+            Serial.print(F(" batches, "));
+            Serial.print(st.bytes / st.records);
+            Serial.print(F(" bytes/record, "));
+            Serial.print(active ? (unsigned long)(st.bytes * 1000ULL / active) : 0UL);
+            Serial.print(F(" bytes/s, encode "));
+            Serial.print(st.encodeMicros / st.records);
+            Serial.print(F(" us/record, publish "));
+            Serial.print(st.batches ? st.publishMicros / st.batches : 0);
+            Serial.print(F(" us/batch, "));
+            Serial.print(st.dropped);
+            Serial.println(F(" dropped"));
+        }
+    }
+
+    private:
+
+    struct TelemetryEventRecord
+    {
+        unsigned long millis;
+        uint8_t code;
+        uint8_t index;
+        uint32_t value;
+        const uint8_t *uid;
+    };
+
+    MqttQueue &Outbox;
+    const char *Topic;
+    const char *Device;
+    telemetryFormat Format;
+    uint8_t Buffer[telemetryBufferSize];
+    MsgPackWriter Pack;
+    JsonWriter Json;
+    uint16_t RecordsAt;         // where the record array starts, to patch its length
+    uint16_t Records;           // records in the pending batch
+    unsigned long Sequence;
+    unsigned long LastSample;
+    unsigned long LastPublish;
+    unsigned long FormatSince;
+
+    // Envelope up to the opening of the record array
+    template <class Writer> void start(Writer &w)
+    {
+        w.reset();
+        w.beginMap(3);
+        w.key("dev");
+        w.string(Device);
+        w.key("seq");
+        w.number(Sequence++);
+        w.key("rec");
+        RecordsAt = w.beginOpenArray();
+    }
+
+    template <class Writer> uint16_t finish(Writer &w)
+    {
+        w.endOpenArray(RecordsAt, Records);
+        w.endBatch();
+        return w.length();
+    }
+
+    // Append one record, publishing the batch first if the record does not fit
+    template <class Writer, class Record> void add(Writer &w, const Record &r)
+    {
+        unsigned long started = micros();
+        if (Records == 0)
+        {
+            start(w);
+        }
+        TelemetryMark m = w.mark();
+        encode(w, r);
+        if (w.overflow() || w.length() > telemetryBufferSize - 8)
+        {
+            w.rewind(m);
+            stats[Format].encodeMicros += micros() - started;
+            flush();
+            started = micros();
+            start(w);
+            m = w.mark();
+            encode(w, r);
+            if (w.overflow())
+            {
+                w.rewind(m);    // larger than a whole batch, never sent
+                stats[Format].encodeMicros += micros() - started;
+                return;
+            }
+        }
+        Records++;
+        stats[Format].encodeMicros += micros() - started;
+    }
+
+    template <class Writer> void encode(Writer &w, const TelemetrySnapshot &s)
+    {
+        w.beginMap(4);
+        w.key("t");
+        w.number(s.millis);
+        w.key("st");
+        w.number(s.state);
+        w.key("in");
+        w.number(s.inputs);
+        w.key("tags");
+        w.beginArray(s.numReaders);
+        for (byte i = 0; i < s.numReaders; i++)
+        {
+            encodeUid(w, s.uids[i]);
+        }
+        w.endArray();
+        w.endMap();
+    }
+
+    template <class Writer> void encode(Writer &w, const TelemetryEventRecord &e)
+    {
+        w.beginMap(4);
+        w.key("t");
+        w.number(e.millis);
+        w.key("ev");
+        w.number(e.code);
+        w.key("i");
+        w.number(e.index);
+        w.key("v");
+        if (e.code == eventTag)
+        {
+            encodeUid(w, e.uid);
+        }
+        else
+        {
+            w.number(e.value);
+        }
+        w.endMap();
+    }
+
+    template <class Writer> void encodeUid(Writer &w, const uint8_t *uid)
+    {
+        static const uint8_t empty[8] = {0};
+        if (uid == nullptr || memcmp(uid, empty, 8) == 0)
+        {
+            w.nil();
+        }
+        else
+        {
+            w.bytes(uid, 8);
+        }
+    }
+};
+
+#endif
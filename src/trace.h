@@ -0,0 +1,286 @@
+#ifndef Trace_h
+#define Trace_h
+
+#include "native_hal.h"
+
+// Scoped trace points in a RAM flight recorder
+//
+//      TRACE_SPAN("rfid.poll");            begin here, end when the enclosing scope exits
+//      TRACE_INSTANT("state", puzzleState);
+//
+// An event is the CPU cycle counter (4 ns at 240 MHz), the name (a string literal), a number,
+// the core and the task, written into a fixed ring of traceEvents slots. Writers claim a slot
+// with one atomic increment, so any task on either core may trace and none of them waits; the
+// oldest events are overwritten. A trace point costs well under a microsecond.
+//
+// Each core has its own cycle counter and it wraps every 17.9 s, so a core that has not logged
+// a sync event for traceSyncMicros logs one first, pairing its counter with micros().
+// tools/trace2chrome.py times every event from the nearest sync event of its core.
+//
+// "trace dump" freezes the ring and publishes it as text lines to the trace topic, a few per
+// loop() pass; "trace dump serial" prints them to Serial at once.
+//
+//      #TR begin <cpu MHz> <events> <overwritten>
+//      #TR <core> <B|E|I|S> <cycles> <number> <task> <name>    S: number is micros()
+//      #TR end
+//
+// Trace points may only go in tasks that never exit, the dump looks up task names by handle.
+// Building with NO_TRACE compiles every trace point out.
+
+const uint16_t traceEvents = 1024;              // power of two
+const uint32_t traceSyncMicros = 1000000;
+const uint16_t traceMessageSize = 512;          // bytes per published dump message
+
+enum traceType {traceBegin, traceEnd, traceInstant, traceSync};
+
+#if defined(ARDUINO_ARCH_ESP32) && !defined(NO_TRACE)
+
+#include <atomic>
+#include "mqttqueue.h"
+
+struct TraceEvent
+{
+    uint32_t cycles;
+    const char *name;
+    uint32_t value;
+    TaskHandle_t task;
+    uint8_t type;
+    uint8_t core;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+#define TRACE_INSTANT(name, value) trace.record(traceInstant, name, value)
+
+// Class holding the trace ring
+class Tracer
+{
+    public:
+
+    // Member Variables:
+    volatile bool enabled;          // recording, cleared while a dump is in progress
+
+    Tracer()
+    {
+        enabled = true;
+        Next.store(0);
+        Dumping = false;
+        DumpNext = 0;
+        DumpEnd = 0;
+        Outbox = nullptr;
+        Topic = nullptr;
+        for (byte c = 0; c < 2; c++)
+        {
+            LastSync[c] = 0;
+            Synced[c] = false;
+        }
+    }
+
+    void begin(MqttQueue &outbox, const char *topic)
+    {
+        Outbox = &outbox;
+        Topic = topic;
+    }
+
+    void record(traceType type, const char *name, uint32_t value)
+    {
+        if (!enabled)
+        {
+            return;
+        }
+        uint32_t cycles = ESP.getCycleCount();
+        byte core = xPortGetCoreID();
+        uint32_t now = micros();
+        if (!Synced[core] || now - LastSync[core] >= traceSyncMicros)
+        {
+            Synced[core] = true;
+            LastSync[core] = now;
+            write(traceSync, cycles, "sync", now, core);
+        }
+        write(type, cycles, name, value, core);
+    }
+
+    // Freeze the ring and start publishing it, one message per loop() pass
+    bool dump()
+    {
+        if (Dumping || !Outbox)
+        {
+            return false;
+        }
+        enabled = false;
+        Dumping = true;
+        DumpEnd = Next.load(std::memory_order_acquire);
+        DumpNext = DumpEnd > traceEvents ? DumpEnd - traceEvents : 0;
+        DumpHeader = true;
+        return true;
+    }
+
+    // Print the whole ring to Serial, blocking
+    void print()
+    {
+        bool was = enabled;
+        enabled = false;
+        uint32_t end = Next.load(std::memory_order_acquire);
+        char line[96];
+        header(line, sizeof(line), end);
+        Serial.println(line);
+        for (uint32_t i = end > traceEvents ? end - traceEvents : 0; i < end; i++)
+        {
+            format(line, sizeof(line), Ring[i % traceEvents]);
+            Serial.println(line);
+        }
+        Serial.println(F("#TR end"));
+        enabled = was;
+    }
+
+    // Publish the next part of a dump. Called from loop().
+    void update()
+    {
+        if (!Dumping)
+        {
+            return;
+        }
+        char message[traceMessageSize];
+        uint16_t n = 0;
+        char line[96];
+        if (DumpHeader)
+        {
+            n += header(message, sizeof(message), DumpEnd);
+            message[n++] = '\n';
+        }
+        uint32_t next = DumpNext;
+        while (next < DumpEnd)
+        {
+            uint16_t length = format(line, sizeof(line), Ring[next % traceEvents]);
+            if (n + length + 1 > sizeof(message))
+            {
+                break;
+            }
+            memcpy(message + n, line, length);
+            n += length;
+            message[n++] = '\n';
+            next++;
+        }
+        bool last = next == DumpEnd && n + 8 <= sizeof(message);
+        if (last)
+        {
+            memcpy(message + n, "#TR end\n", 8);
+            n += 8;
+        }
+        if (!Outbox->publish(Topic, (const uint8_t *)message, n))
+        {
+            return;
+        }
+        DumpHeader = false;
+        DumpNext = next;
+        if (last)
+        {
+            Dumping = false;
+            enabled = true;
+        }
+    }
+
+    void printStats()
+    {
+        uint32_t total = Next.load(std::memory_order_relaxed);
+        Serial.print(F("Trace: "));
+        Serial.print(total);
+        Serial.print(F(" events, "));
+        Serial.print(total > traceEvents ? total - traceEvents : 0);
+        Serial.print(F(" overwritten, "));
+        Serial.print(Dumping ? F("dumping") : (enabled ? F("recording") : F("off")));
+        Serial.println();
+    }
+
+    private:
+
+    TraceEvent Ring[traceEvents];
+    std::atomic<uint32_t> Next;     // events claimed so far
+    uint32_t LastSync[2];           // micros() of the last sync event on each core
+    bool Synced[2];
+    MqttQueue *Outbox;
+    const char *Topic;
+    bool Dumping;
+    bool DumpHeader;
+    uint32_t DumpNext;
+    uint32_t DumpEnd;
+
+    void write(traceType type, uint32_t cycles, const char *name, uint32_t value, byte core)
+    {
+        TraceEvent &event = Ring[Next.fetch_add(1, std::memory_order_relaxed) % traceEvents];
+        event.cycles = cycles;
+        event.name = name;
+        event.value = value;
+        event.task = xTaskGetCurrentTaskHandle();
+        event.type = type;
+        event.core = core;
+    }
+
+    uint16_t header(char *out, uint16_t size, uint32_t end)
+    {
+        return snprintf(out, size, "#TR begin %lu %lu %lu", (unsigned long)getCpuFrequencyMhz(),
+            (unsigned long)min(end, (uint32_t)traceEvents), (unsigned long)(end > traceEvents ? end - traceEvents : 0));
+    }
+
+    uint16_t format(char *out, uint16_t size, const TraceEvent &event)
+    {
+        int n = snprintf(out, size, "#TR %u %c %lu %lu %s %s", event.core, "BEIS"[event.type & 3],
+            (unsigned long)event.cycles, (unsigned long)event.value,
+            event.task ? pcTaskGetName(event.task) : "-", event.name);
+        return min(n, (int)size - 1);
+    }
+};
+
+Tracer trace;
+
+// Trace span for the enclosing scope, see TRACE_SPAN
+class TraceSpan
+{
+    public:
+
+    TraceSpan(const char *name)
+    {
+        Name = name;
+        trace.record(traceBegin, name, 0);
+    }
+
+    ~TraceSpan()
+    {
+        trace.record(traceEnd, Name, 0);
+    }
+
+    private:
+
+    const char *Name;
+};
+
+#else
+
+#define TRACE_SPAN(name) do {} while (0)
+#define TRACE_INSTANT(name, value) do {} while (0)
+
+// Stands in for the trace ring when tracing is compiled out
+class Tracer
+{
+    public:
+
+    bool enabled = false;
+
+    template <typename Queue>
+    void begin(Queue &outbox, const char *topic) {}
+    bool dump() { return false; }
+    void print() {}
+    void update() {}
+
+    void printStats()
+    {
+        Serial.println(F("Trace: compiled out"));
+    }
+};
+
+Tracer trace;
+
+#endif
+
+#endif
@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+#
+# File: binlog_decode.py (renders the firmware's binary log, see src/binlog.h)
+#
+# Description:
+#
+#      Log records hold the flash address of their format string and the raw arguments. This
+#      reads the format strings out of the firmware ELF and prints each record with its device
+#      time. Build the ELF and flash it together, the addresses change with every build.
+#
+#          Serial ("log serial"): other lines pass through unchanged
+#              pio device monitor | tools/binlog_decode.py .pio/build/nodemcu-32s/firmware.elf
+#              tools/binlog_decode.py firmware.elf capture.txt
+#          MQTT ("log mqtt"), needs paho-mqtt:
+#              tools/binlog_decode.py firmware.elf --mqtt 10.1.10.10 --topic ToHost/NameOfMachine/log
+#
+
+import argparse
+import base64
+import re
+import struct
+import sys
+
+SHF_ALLOC = 0x2
+SHT_NOBITS = 8
+LEVELS = "-EWIDT"
+MODULES = ["system", "puzzle", "rfid", "net", "lights", "ota"]
+CONVERSION = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(hh|h|ll|l|z)?([diouxXcsfeEgGp%])")
+
+
+class Elf:
+    """Allocated sections of an ELF file, enough to read strings by address"""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[:4] != b"\x7fELF":
+            raise ValueError("%s is not an ELF file" % path)
+        is64 = self.data[4] == 2
+        endian = "<" if self.data[5] == 1 else ">"
+        if is64:
+            shoff, = struct.unpack_from(endian + "Q", self.data, 0x28)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x3A)
+            layout = endian + "IIQQQQ"
+        else:
+            shoff, = struct.unpack_from(endian + "I", self.data, 0x20)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x2E)
+            layout = endian + "IIIIII"
+        self.sections = []
+        for i in range(shnum):
+            _, kind, flags, addr, offset, size = struct.unpack_from(layout, self.data, shoff + i * shentsize)
+            if flags & SHF_ALLOC and kind != SHT_NOBITS and size:
+                self.sections.append((addr, size, offset))
+
+    def string(self, address):
+        for addr, size, offset in self.sections:
+            if addr <= address < addr + size:
+                start = offset + address - addr
+                end = self.data.index(b"\0", start, offset + size)
+                return self.data[start:end].decode("latin-1")
+        return None
+
+
+class Decoder:
+    def __init__(self, elf):
+        self.elf = elf
+        self.formats = {}
+        self.sequence = None
+        self.dropped = 0
+        self.last_micros = None
+        self.epoch = 0
+
+    def format(self, address):
+        if address not in self.formats:
+            self.formats[address] = self.elf.string(address)
+        return self.formats[address]
+
+    def render(self, fmt, args):
+        p = 0
+        out = []
+        last = 0
+        for m in CONVERSION.finditer(fmt):
+            out.append(fmt[last:m.start()])
+            last = m.end()
+            flags, size, conversion = m.groups()
+            if conversion == "%":
+                out.append("%")
+                continue
+            if conversion == "s":
+                n = args[p] if p < len(args) else 0
+                value = args[p + 1:p + 1 + n].decode("latin-1")
+                p += 1 + n
+            elif size == "ll":
+                value, = struct.unpack_from("<q" if conversion in "di" else "<Q", args.ljust(p + 8, b"\0"), p)
+                p += 8
+            else:
+                word = args[p:p + 4].ljust(4, b"\0")
+                p += 4
+                if conversion in "feEgG":
+                    value, = struct.unpack("<f", word)
+                elif conversion in "di":
+                    value, = struct.unpack("<i", word)
+                else:
+                    value, = struct.unpack("<I", word)
+            if conversion == "p":
+                out.append("0x%08x" % value)
+            elif conversion == "c":
+                out.append(("%" + flags + "c") % chr(value & 0xFF))
+            else:
+                out.append(("%" + flags + conversion.replace("u", "d")) % value)
+        out.append(fmt[last:])
+        return "".join(out)
+
+    def batch(self, data):
+        lines = []
+        if len(data) < 8 or data[0] not in (1, 2):
+            return ["[bad log batch]"]
+        header = 9 if data[0] == 1 else 10   # version 2 added the level and module byte
+        sequence, dropped = struct.unpack_from("<HI", data, 2)
+        if self.sequence is not None and sequence != (self.sequence + 1) & 0xFFFF:
+            lines.append("[%d log batches missing]" % ((sequence - self.sequence - 1) & 0xFFFF))
+        if dropped > self.dropped:
+            lines.append("[%d log records dropped on the device]" % (dropped - self.dropped))
+        self.sequence, self.dropped = sequence, dropped
+        p = 8
+        while p < len(data):
+            length = data[p]
+            if length < header or p + length > len(data):
+                lines.append("[bad log record]")
+                break
+            micros, address = struct.unpack_from("<II", data, p + header - 8)
+            if self.last_micros is not None and micros < self.last_micros:
+                self.epoch += 1 << 32   # micros() wrapped after 71 minutes
+            self.last_micros = micros
+            fmt = self.format(address)
+            text = self.render(fmt, data[p + header:p + length]) if fmt is not None else "[unknown format 0x%08x]" % address
+            if header == 10:
+                tag = data[p + 1]
+                module = MODULES[tag & 0x0F] if (tag & 0x0F) < len(MODULES) else "?"
+                text = "%s %s: %s" % (LEVELS[min(tag >> 4, len(LEVELS) - 1)], module, text)
+            lines.append("[%12.6f] %s" % ((self.epoch + micros) / 1e6, text))
+            p += length
+        return lines
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Render the firmware's binary log")
+    parser.add_argument("elf")
+    parser.add_argument("capture", nargs="?", help="serial capture, standard input when left out")
+    parser.add_argument("--mqtt", metavar="BROKER")
+    parser.add_argument("--topic", default="ToHost/NameOfMachine/log")
+    args = parser.parse_args()
+    decoder = Decoder(Elf(args.elf))
+
+    if args.mqtt:
+        import paho.mqtt.client as mqtt
+
+        def on_message(client, userdata, message):
+            for line in decoder.batch(message.payload):
+                print(line)
+            sys.stdout.flush()
+
+        client = mqtt.Client()
+        client.on_message = on_message
+        client.connect(args.mqtt)
+        client.subscribe(args.topic)
+        client.loop_forever()
+        return
+
+    source = open(args.capture, errors="replace") if args.capture else sys.stdin
+    for line in source:
+        line = line.rstrip("\r\n")
+        if line.startswith("#BL "):
+            try:
+                lines = decoder.batch(base64.b64decode(line[4:]))
+            except ValueError:
+                lines = ["[bad log line]"]
+            for text in lines:
+                print(text)
+        else:
+            print(line)
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,183 @@
+//+------------------------------------------------------------------------
+//
+// File: clock_skew.cpp (host-side measurement of the props' shared clocks)
+//
+// Description:
+//
+//      Measures how far each prop's shared clock (src/netclock.h) is from this host's clock, and
+//      so how far apart the props are, the skew that limits how closely their effects line up.
+//      Each round sends "clock <seq> <host us>" to every prop and takes the reply
+//      "clock <seq> <host us> <prop us at receive> <prop us at reply>" as an NTP exchange:
+//
+//          offset = ((receive - sent) + (reply - arrived)) / 2
+//          delay  = (arrived - sent) - (reply - receive)
+//
+//      A prop answers "clock" on its network task as the message arrives, and the time it spends
+//      on the reply is taken out of the delay, so what is left is the two trips through the broker
+//      and Wi-Fi. Those are rarely equal (broker queueing, Wi-Fi power save), so the offset is only
+//      known to within half the delay. The exchange with the smallest delay is kept for each prop.
+//      Run it on a machine synced to the same time server (ideally the server itself):
+//
+//          g++ -std=gnu++11 -O2 -pthread -Itools/host -Isrc tools/clock_skew.cpp -o clock_skew
+//          ./clock_skew [-b broker] [-r rounds] Prop1 Prop2 ...
+//
+//      Then "solve at <ms>" sent to the props with the same time makes them solve together.
+//
+
+#define NATIVE_REALTIME
+#include "native_hal.h"
+#include "PubSubClient.h"
+
+#include <time.h>
+#include <vector>
+#include <string>
+
+const unsigned long roundMillis = 500;      // time between rounds, and to wait for late replies
+const uint16_t skewBufferSize = 512;
+
+struct PropClock
+{
+    std::string name;
+    int replies;
+    bool measured;
+    double offset;          // prop clock minus host clock, microseconds
+    double delay;           // round trip without the prop's own time, microseconds
+};
+
+WiFiClient skewSocket;
+PubSubClient skewClient(skewSocket);
+std::vector<PropClock> props;
+
+// Microseconds since the Unix epoch on this host
+unsigned long long hostRealMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (unsigned long long)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+void onReply(char *thisTopic, uint8_t *payload, unsigned int length)
+{
+    unsigned long long arrived = hostRealMicros();
+    char text[128];
+    length = min(length, (unsigned int)sizeof(text) - 1);
+    memcpy(text, payload, length);
+    text[length] = '\0';
+    unsigned long seq;
+    unsigned long long sent, receive, reply;
+    if (sscanf(text, "clock %lu %llu %llu %llu", &seq, &sent, &receive, &reply) != 4 || seq >= props.size())
+    {
+        return;
+    }
+    PropClock &prop = props[seq];
+    double offset = (((double)receive - sent) + ((double)reply - arrived)) / 2;
+    double delay = ((double)arrived - sent) - ((double)reply - receive);
+    prop.replies++;
+    if (!prop.measured || delay < prop.delay)
+    {
+        prop.measured = true;
+        prop.offset = offset;
+        prop.delay = delay;
+    }
+}
+
+void pump(unsigned long ms)
+{
+    unsigned long started = millis();
+    do
+    {
+        if (!skewClient.loop())
+        {
+            fprintf(stderr, "Lost the broker\n");
+            exit(1);
+        }
+        usleep(200);
+    } while (millis() - started < ms);
+}
+
+int main(int argc, char **argv)
+{
+    const char *broker = "localhost";
+    int rounds = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:r:")) != -1)
+    {
+        if (opt == 'b')
+        {
+            broker = optarg;
+        }
+        else if (opt == 'r')
+        {
+            rounds = atoi(optarg);
+        }
+    }
+    for (int i = optind; i < argc; i++)
+    {
+        PropClock prop = {argv[i], 0, false, 0, 0};
+        props.push_back(prop);
+    }
+    if (props.empty())
+    {
+        fprintf(stderr, "usage: clock_skew [-b broker] [-r rounds] Prop1 Prop2 ...\n");
+        return 2;
+    }
+
+    skewClient.setServer(broker, 1883);
+    skewClient.setBufferSize(skewBufferSize);
+    skewClient.setCallback(onReply);
+    if (!skewClient.connect("clock-skew"))
+    {
+        fprintf(stderr, "Could not connect to the broker at %s\n", broker);
+        return 1;
+    }
+    for (size_t i = 0; i < props.size(); i++)
+    {
+        std::string hostTopic = "ToHost/" + props[i].name;
+        skewClient.subscribe(hostTopic.c_str());
+    }
+
+    // The sequence number is the prop's index, replies are matched to props by it
+    for (int round = 0; round < rounds; round++)
+    {
+        for (size_t i = 0; i < props.size(); i++)
+        {
+            std::string deviceTopic = "ToDevice/" + props[i].name;
+            char message[64];
+            snprintf(message, sizeof(message), "clock %u %llu", (unsigned)i, hostRealMicros());
+            skewClient.publish(deviceTopic.c_str(), message);
+        }
+        pump(roundMillis);
+    }
+
+    printf("%-20s %8s %12s %10s\n", "prop", "replies", "offset ms", "+/- ms");
+    double low = 0, high = 0, lowError = 0, highError = 0;
+    int measured = 0;
+    for (size_t i = 0; i < props.size(); i++)
+    {
+        PropClock &prop = props[i];
+        if (!prop.measured)
+        {
+            printf("%-20s %8d %12s %10s\n", prop.name.c_str(), 0, "-", "-");
+            continue;
+        }
+        double error = prop.delay / 2;
+        printf("%-20s %8d %12.3f %10.3f\n", prop.name.c_str(), prop.replies, prop.offset / 1000, error / 1000);
+        if (measured == 0 || prop.offset < low)
+        {
+            low = prop.offset;
+            lowError = error;
+        }
+        if (measured == 0 || prop.offset > high)
+        {
+            high = prop.offset;
+            highError = error;
+        }
+        measured++;
+    }
+    if (measured > 1)
+    {
+        printf("\nSkew between props: %.3f ms (+/- %.3f ms)\n", (high - low) / 1000, (lowError + highError) / 1000);
+    }
+    skewClient.disconnect();
+    return 0;
+}
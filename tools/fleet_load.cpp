@@ -0,0 +1,301 @@
+//+------------------------------------------------------------------------
+//
+// File: fleet_load.cpp (host-side fleet load test against an MQTT broker)
+//
+// Description:
+//
+//      Runs a fleet of simulated AlchemyMachine props against a real broker and measures how
+//      it holds up as the fleet grows. Each prop is a child process running the firmware's
+//      connection manager, command registry, outbound queue and telemetry publisher
+//      (WifiFunctions.h, commands.h, mqttqueue.h, telemetry.h) on the native HAL, with the
+//      host WiFi, MQTT and task shims in tools/host. Props play a scripted game so they
+//      publish telemetry like real ones. The driver itself uses the PubSubClient shim.
+//
+//      The driver pings every prop once a second ("ping <seq>" on ToDevice/PropNNN, answered
+//      with "pong <seq>" on ToHost/PropNNN) and subscribes to ToHost/#. For each fleet size it
+//      reports the command round trip (ping sent to pong received) and the message and byte
+//      rate the broker delivered.
+//
+//      Build and run on Linux against a local Mosquitto:
+//          g++ -std=gnu++11 -O2 -pthread -Itools/host -Isrc tools/fleet_load.cpp -o fleet_load
+//          ./fleet_load [broker] [fleet sizes] [seconds per size]
+//          ./fleet_load localhost 10,50,100,200,400 20
+//
+//      Props use the asynchronous MQTT link (src/mqttlink.h). Build a second copy with
+//      -DMQTT_BLOCKING for props on the blocking PubSubClient, and compare the round trips.
+//
+//      Hundreds of props need a higher open file limit on the broker (ulimit -n) and
+//      "max_connections -1" in mosquitto.conf.
+//
+
+#define NATIVE_REALTIME
+#include "native_hal.h"
+#include "WifiFunctions.h"
+#include "PubSubClient.h"
+#include "telemetry.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <vector>
+
+const unsigned long propLoopMicros = 50000;     // one pass of a prop's loop()
+const unsigned long propSampleMillis = 250;     // telemetry snapshot interval of each prop
+const unsigned long propPublishMillis = 1000;   // telemetry batch interval of each prop
+const unsigned long readyTimeout = 60000;       // milliseconds for the whole fleet to answer
+const unsigned long pongGrace = 2000;           // milliseconds to wait for late pongs
+const uint16_t driverBufferSize = 2048;
+
+//************SIMULATED PROP************
+
+char propId[16];
+char propTopic[32];
+char propHostTopic[32];
+char propTelemetryTopic[48];
+char propStatusTopic[32];
+
+// A prop's life: connect, then play the puzzle on a loop until the driver kills it
+void runProp(int n, const char *broker)
+{
+    Serial.quiet = true;
+    srand(n + 1);
+    snprintf(propId, sizeof(propId), "Prop%03d", n);
+    snprintf(propTopic, sizeof(propTopic), "ToDevice/%s", propId);
+    snprintf(propHostTopic, sizeof(propHostTopic), "ToHost/%s", propId);
+    snprintf(propTelemetryTopic, sizeof(propTelemetryTopic), "ToHost/%s/telemetry", propId);
+    snprintf(propStatusTopic, sizeof(propStatusTopic), "%s/status", propId);
+    deviceID = propId;
+    topic = propTopic;
+    hostTopic = propHostTopic;
+    telemetryTopic = propTelemetryTopic;
+    statusTopic = propStatusTopic;
+    mqtt_server = broker;
+
+    Telemetry telemetry(outbox, telemetryTopic, deviceID);
+    telemetry.setRate(propSampleMillis, propPublishMillis);
+    commands.addImmediate("ping", onPingCommand);
+
+    // Spread the connection storm over a second
+    usleep((n % 100) * 10000);
+    wifiSetup();
+    MQTTsetup();
+
+    uint8_t uids[2][8] = {{0}};
+    const uint8_t beaker[8] = {0x3C, 0x33, 0x13, 0x66, 0x08, 0x01, 0x04, 0xE0};
+    uint8_t state = 1;
+    unsigned long nextChange = millis() + random(2000, 8000);
+    while (true)
+    {
+        if ((long)(millis() - nextChange) >= 0)
+        {
+            // Someone moved a beaker, and now and then the puzzle changes state
+            byte reader = random(2);
+            bool placed = uids[reader][7] == 0;
+            memcpy(uids[reader], placed ? beaker : (const uint8_t *)"\0\0\0\0\0\0\0\0", 8);
+            telemetry.event(eventTag, reader, 0, uids[reader]);
+            if (random(4) == 0)
+            {
+                state = 1 + random(4);
+                telemetry.event(eventState, 0, state);
+            }
+            nextChange = millis() + random(2000, 8000);
+        }
+        if (telemetry.snapshotDue())
+        {
+            TelemetrySnapshot snapshot = {millis(), state, inputLaser, 2, uids};
+            telemetry.snapshot(snapshot);
+        }
+        telemetry.update();
+        networkUpdate();
+        usleep(propLoopMicros);
+    }
+}
+
+//************DRIVER************
+
+WiFiClient driverSocket;
+PubSubClient driver(driverSocket);
+
+std::vector<unsigned long long> pingSentAt;     // host micros per ping sequence number
+std::vector<double> roundTrips;                 // milliseconds
+std::vector<bool> propReady;
+int readyCount = 0;
+unsigned long delivered = 0;
+unsigned long deliveredBytes = 0;
+
+void onDriverMessage(char *thisTopic, uint8_t *payload, unsigned int length)
+{
+    delivered++;
+    deliveredBytes += length;
+    if (length < 6 || memcmp(payload, "pong ", 5) != 0)
+    {
+        return;
+    }
+    unsigned long long now = hostMicros();
+    char text[24];
+    memcpy(text, payload + 5, min(length - 5, (unsigned int)sizeof(text) - 1));
+    text[min(length - 5, (unsigned int)sizeof(text) - 1)] = '\0';
+    if (text[0] == 'r')
+    {
+        // Readiness probe "r<prop>"
+        int n = atoi(text + 1);
+        if (n >= 0 && n < (int)propReady.size() && !propReady[n])
+        {
+            propReady[n] = true;
+            readyCount++;
+        }
+        return;
+    }
+    unsigned long seq = strtoul(text, nullptr, 10);
+    if (seq < pingSentAt.size() && pingSentAt[seq])
+    {
+        roundTrips.push_back((now - pingSentAt[seq]) / 1000.0);
+        pingSentAt[seq] = 0;    // count a duplicate only once
+    }
+}
+
+void ping(int n, const char *token)
+{
+    char propTopic[32];
+    char message[32];
+    snprintf(propTopic, sizeof(propTopic), "ToDevice/Prop%03d", n);
+    snprintf(message, sizeof(message), "ping %s", token);
+    driver.publish(propTopic, message);
+}
+
+double percentile(std::vector<double> &values, double p)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    size_t i = std::min(values.size() - 1, (size_t)(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+}
+
+// Service the driver connection for a while
+void pump(unsigned long ms)
+{
+    unsigned long started = millis();
+    do
+    {
+        if (!driver.loop())
+        {
+            fprintf(stderr, "Driver lost the broker\n");
+            exit(1);
+        }
+        usleep(200);
+    } while (millis() - started < ms);
+}
+
+void runFleet(int size, const char *broker, unsigned long seconds)
+{
+    fflush(stdout);
+    std::vector<pid_t> props;
+    for (int n = 0; n < size; n++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            driverSocket.stop();
+            runProp(n, broker);
+            _exit(0);
+        }
+        props.push_back(pid);
+    }
+
+    // Wait until every prop answers
+    propReady.assign(size, false);
+    readyCount = 0;
+    unsigned long started = millis();
+    while (readyCount < size && millis() - started < readyTimeout)
+    {
+        for (int n = 0; n < size; n++)
+        {
+            if (!propReady[n])
+            {
+                char token[16];
+                snprintf(token, sizeof(token), "r%d", n);
+                ping(n, token);
+            }
+        }
+        pump(500);
+    }
+    unsigned long readyMillis = millis() - started;
+
+    // Ping every prop once a second, spread evenly over the second
+    pingSentAt.assign(seconds * size, 0);
+    roundTrips.clear();
+    delivered = 0;
+    deliveredBytes = 0;
+    unsigned long long begin = hostMicros();
+    unsigned long long interval = 1000000ULL / size;
+    for (unsigned long seq = 0; seq < pingSentAt.size(); seq++)
+    {
+        unsigned long long due = begin + seq * interval;
+        while (hostMicros() < due)
+        {
+            pump(0);
+        }
+        char token[24];
+        snprintf(token, sizeof(token), "%lu", seq);
+        pingSentAt[seq] = hostMicros();
+        ping(seq % size, token);
+    }
+    pump(pongGrace);
+    double elapsed = (hostMicros() - begin) / 1000000.0;
+
+    for (size_t i = 0; i < props.size(); i++)
+    {
+        kill(props[i], SIGKILL);
+    }
+    for (size_t i = 0; i < props.size(); i++)
+    {
+        waitpid(props[i], nullptr, 0);
+    }
+
+    unsigned long sent = pingSentAt.size();
+    unsigned long lost = sent - roundTrips.size();
+    printf("%6d %6d %9.1f %8lu %6lu %8.1f %8.1f %8.1f %8.1f %10.0f %10.1f\n",
+        size, readyCount, readyMillis / 1000.0, sent, lost,
+        percentile(roundTrips, 0.5), percentile(roundTrips, 0.95), percentile(roundTrips, 0.99), percentile(roundTrips, 1.0),
+        delivered / elapsed, deliveredBytes / elapsed / 1024);
+}
+
+int main(int argc, char **argv)
+{
+    const char *broker = argc > 1 ? argv[1] : "localhost";
+    const char *sizes = argc > 2 ? argv[2] : "10,50,100,200";
+    unsigned long seconds = argc > 3 ? strtoul(argv[3], nullptr, 10) : 10;
+
+    driver.setServer(broker, 1883);
+    driver.setBufferSize(driverBufferSize);
+    driver.setCallback(onDriverMessage);
+    if (!driver.connect("fleet-load") || !driver.subscribe("ToHost/#"))
+    {
+        fprintf(stderr, "Could not connect to the broker at %s\n", broker);
+        return 1;
+    }
+
+    printf("Fleet load against %s, %lu s per size, props publish telemetry every %lu ms\n\n", broker, seconds, propPublishMillis);
+    printf("  props  ready  ready s    pings   lost   p50 ms   p95 ms   p99 ms   max ms  deliv msg/s  deliv KB/s\n");
+    for (const char *p = sizes; *p; )
+    {
+        int size = atoi(p);
+        if (size > 0)
+        {
+            runFleet(size, broker, seconds);
+        }
+        while (*p && *p != ',')
+        {
+            p++;
+        }
+        if (*p == ',')
+        {
+            p++;
+        }
+    }
+    driver.disconnect();
+    return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef HostArduino_h
+#define HostArduino_h
+
+// Firmware headers include <Arduino.h>, on the host that is the native HAL
+#include "native_hal.h"
+
+// Tools talking to real peers also get tasks, for the asynchronous MQTT link
+#ifdef NATIVE_REALTIME
+#include "freertos_host.h"
+#endif
+
+#endif
@@ -0,0 +1,380 @@
+#ifndef HostAsyncMqttClient_h
+#define HostAsyncMqttClient_h
+
+#include "native_hal.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Host stand-in for AsyncMqttClient with the calls src/mqttlink.h makes. A thread of its own
+// plays the part of the TCP task: it connects, reads packets and runs the callbacks. publish()
+// and subscribe() write to the socket from the caller's thread under a lock. MQTT 3.1.1 at
+// QoS0, payloads are delivered whole (index 0, length == total).
+
+enum class AsyncMqttClientDisconnectReason : uint8_t
+{
+    TCP_DISCONNECTED = 0,
+    MQTT_UNACCEPTABLE_PROTOCOL_VERSION = 1,
+    MQTT_IDENTIFIER_REJECTED = 2,
+    MQTT_SERVER_UNAVAILABLE = 3,
+    MQTT_MALFORMED_CREDENTIALS = 4,
+    MQTT_NOT_AUTHORIZED = 5,
+};
+
+struct AsyncMqttClientMessageProperties
+{
+    uint8_t qos;
+    bool dup;
+    bool retain;
+};
+
+class AsyncMqttClient
+{
+    public:
+
+    typedef std::function<void(bool sessionPresent)> ConnectHandler;
+    typedef std::function<void(AsyncMqttClientDisconnectReason reason)> DisconnectHandler;
+    typedef std::function<void(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)> MessageHandler;
+
+    AsyncMqttClient()
+    {
+        Host = "localhost";
+        Port = 1883;
+        Id = "host";
+        WillTopic = nullptr;
+        WillMessage = nullptr;
+        WillQos = 0;
+        WillRetain = false;
+        KeepAlive = 15;
+        Socket = -1;
+        NextId = 1;
+        LastOut = 0;
+        Connected.store(false);
+        Running.store(false);
+    }
+
+    ~AsyncMqttClient()
+    {
+        disconnect(true);
+    }
+
+    AsyncMqttClient &setServer(const char *host, uint16_t port)
+    {
+        Host = host;
+        Port = port;
+        return *this;
+    }
+
+    AsyncMqttClient &setClientId(const char *id)
+    {
+        Id = id;
+        return *this;
+    }
+
+    AsyncMqttClient &setKeepAlive(uint16_t seconds)
+    {
+        KeepAlive = seconds;
+        return *this;
+    }
+
+    AsyncMqttClient &setWill(const char *topic, uint8_t qos, bool retain, const char *payload = nullptr, size_t length = 0)
+    {
+        WillTopic = topic;
+        WillQos = qos;
+        WillRetain = retain;
+        WillMessage = payload;
+        return *this;
+    }
+
+    AsyncMqttClient &onConnect(ConnectHandler handler)
+    {
+        OnConnect = handler;
+        return *this;
+    }
+
+    AsyncMqttClient &onDisconnect(DisconnectHandler handler)
+    {
+        OnDisconnect = handler;
+        return *this;
+    }
+
+    AsyncMqttClient &onMessage(MessageHandler handler)
+    {
+        OnMessage = handler;
+        return *this;
+    }
+
+    bool connected() const { return Connected.load(); }
+
+    // Start connecting in the background
+    void connect()
+    {
+        if (Running.load())
+        {
+            return;
+        }
+        if (Reader.joinable())
+        {
+            Reader.join();
+        }
+        Running.store(true);
+        Reader = std::thread(&AsyncMqttClient::session, this);
+    }
+
+    void disconnect(bool force = false)
+    {
+        if (Socket >= 0)
+        {
+            if (Connected.load() && !force)
+            {
+                const uint8_t packet[] = {0xE0, 0x00};
+                write(packet, sizeof(packet));
+            }
+            shutdown(Socket, SHUT_RDWR);
+        }
+        if (Reader.joinable() && Reader.get_id() != std::this_thread::get_id())
+        {
+            Reader.join();
+        }
+    }
+
+    uint16_t publish(const char *topic, uint8_t qos, bool retain, const char *payload = nullptr, size_t length = 0, bool dup = false, uint16_t messageId = 0)
+    {
+        if (!Connected.load())
+        {
+            return 0;
+        }
+        std::vector<uint8_t> body;
+        putString(body, topic);
+        body.insert(body.end(), payload, payload + length);
+        return send(0x30 | (retain ? 0x01 : 0), body) ? 1 : 0;
+    }
+
+    uint16_t subscribe(const char *topic, uint8_t qos)
+    {
+        if (!Connected.load())
+        {
+            return 0;
+        }
+        uint16_t id = NextId++;
+        std::vector<uint8_t> body;
+        body.push_back(id >> 8);
+        body.push_back(id & 0xFF);
+        putString(body, topic);
+        body.push_back(qos);
+        return send(0x82, body) ? id : 0;
+    }
+
+    private:
+
+    const char *Host;
+    uint16_t Port;
+    const char *Id;
+    const char *WillTopic;
+    const char *WillMessage;
+    uint8_t WillQos;
+    bool WillRetain;
+    uint16_t KeepAlive;
+    int Socket;
+    uint16_t NextId;
+    std::atomic<bool> Connected;
+    std::atomic<bool> Running;
+    std::thread Reader;
+    std::mutex WriteLock;
+    unsigned long LastOut;
+    ConnectHandler OnConnect;
+    DisconnectHandler OnDisconnect;
+    MessageHandler OnMessage;
+
+    static void putString(std::vector<uint8_t> &out, const char *s)
+    {
+        size_t len = strlen(s);
+        out.push_back(len >> 8);
+        out.push_back(len & 0xFF);
+        out.insert(out.end(), s, s + len);
+    }
+
+    bool write(const uint8_t *data, size_t length)
+    {
+        std::lock_guard<std::mutex> guard(WriteLock);
+        while (length > 0)
+        {
+            ssize_t n = ::send(Socket, data, length, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                return false;
+            }
+            data += n;
+            length -= n;
+        }
+        LastOut = millis();
+        return true;
+    }
+
+    bool send(uint8_t type, const std::vector<uint8_t> &body)
+    {
+        std::vector<uint8_t> packet;
+        packet.push_back(type);
+        size_t remaining = body.size();
+        do
+        {
+            uint8_t digit = remaining & 0x7F;
+            remaining >>= 7;
+            packet.push_back(digit | (remaining ? 0x80 : 0));
+        } while (remaining);
+        packet.insert(packet.end(), body.begin(), body.end());
+        return write(packet.data(), packet.size());
+    }
+
+    bool open()
+    {
+        struct addrinfo hints = {}, *found;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        char port[8];
+        snprintf(port, sizeof(port), "%u", Port);
+        if (getaddrinfo(Host, port, &hints, &found) != 0)
+        {
+            return false;
+        }
+        Socket = socket(AF_INET, SOCK_STREAM, 0);
+        bool ok = Socket >= 0 && ::connect(Socket, found->ai_addr, found->ai_addrlen) == 0;
+        freeaddrinfo(found);
+        if (!ok)
+        {
+            return false;
+        }
+        int one = 1;
+        setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::vector<uint8_t> body = {0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02, (uint8_t)(KeepAlive >> 8), (uint8_t)(KeepAlive & 0xFF)};
+        if (WillTopic)
+        {
+            body[7] |= 0x04 | (WillQos << 3) | (WillRetain ? 0x20 : 0);
+        }
+        putString(body, Id);
+        if (WillTopic)
+        {
+            putString(body, WillTopic);
+            putString(body, WillMessage ? WillMessage : "");
+        }
+        return send(0x10, body);
+    }
+
+    // The "TCP task": one connection from CONNECT to close
+    void session()
+    {
+        AsyncMqttClientDisconnectReason reason = AsyncMqttClientDisconnectReason::TCP_DISCONNECTED;
+        std::vector<uint8_t> in;
+        if (open())
+        {
+            uint8_t chunk[2048];
+            while (true)
+            {
+                struct pollfd waiting = {Socket, POLLIN, 0};
+                int ready = poll(&waiting, 1, 100);
+                if (Connected.load() && millis() - LastOut > KeepAlive * 1000UL)
+                {
+                    const uint8_t ping[] = {0xC0, 0x00};
+                    write(ping, sizeof(ping));
+                }
+                if (ready == 0)
+                {
+                    continue;
+                }
+                ssize_t n = recv(Socket, chunk, sizeof(chunk), 0);
+                if (n <= 0)
+                {
+                    break;
+                }
+                in.insert(in.end(), chunk, chunk + n);
+                if (!packets(in, reason))
+                {
+                    break;
+                }
+            }
+        }
+        if (Socket >= 0)
+        {
+            close(Socket);
+            Socket = -1;
+        }
+        bool was = Connected.exchange(false);
+        Running.store(false);
+        if (was || reason != AsyncMqttClientDisconnectReason::TCP_DISCONNECTED)
+        {
+            if (OnDisconnect)
+            {
+                OnDisconnect(reason);
+            }
+        }
+    }
+
+    // Handle the complete packets at the front of in, false when the connection must end
+    bool packets(std::vector<uint8_t> &in, AsyncMqttClientDisconnectReason &reason)
+    {
+        while (true)
+        {
+            size_t headerLen = 1;
+            size_t remaining = 0;
+            uint8_t shift = 0;
+            while (true)
+            {
+                if (headerLen >= in.size())
+                {
+                    return true;
+                }
+                uint8_t digit = in[headerLen++];
+                remaining |= (size_t)(digit & 0x7F) << shift;
+                shift += 7;
+                if (!(digit & 0x80))
+                {
+                    break;
+                }
+            }
+            if (in.size() < headerLen + remaining)
+            {
+                return true;
+            }
+            uint8_t type = in[0] & 0xF0;
+            uint8_t *p = in.data() + headerLen;
+            if (type == 0x20)
+            {
+                if (remaining < 2 || p[1] != 0)
+                {
+                    reason = (AsyncMqttClientDisconnectReason)(remaining < 2 ? 3 : p[1]);
+                    return false;
+                }
+                Connected.store(true);
+                if (OnConnect)
+                {
+                    OnConnect(false);
+                }
+            }
+            else if (type == 0x30)
+            {
+                size_t topicLen = (p[0] << 8) | p[1];
+                size_t offset = 2 + topicLen + ((in[0] & 0x06) ? 2 : 0);
+                std::string topic((const char *)p + 2, topicLen);
+                AsyncMqttClientMessageProperties properties = {(uint8_t)((in[0] >> 1) & 0x03), (in[0] & 0x08) != 0, (in[0] & 0x01) != 0};
+                size_t length = remaining - offset;
+                if (OnMessage)
+                {
+                    OnMessage(&topic[0], (char *)p + offset, properties, length, 0, length);
+                }
+            }
+            in.erase(in.begin(), in.begin() + headerLen + remaining);
+        }
+    }
+};
+
+#endif
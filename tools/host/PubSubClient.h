@@ -0,0 +1,377 @@
+#ifndef HostPubSubClient_h
+#define HostPubSubClient_h
+
+#include "native_hal.h"
+#include "WiFi.h"
+
+// Host stand-in for the PubSubClient library with the calls the firmware uses. It speaks
+// MQTT 3.1.1 at QoS0 over a WiFiClient. Unlike the library, loop() never blocks: it parses
+// whatever complete packets have arrived and returns.
+
+#define MQTT_CONNECTED 0
+#define MQTT_CONNECTION_TIMEOUT -4
+#define MQTT_CONNECTION_LOST -3
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+
+const uint8_t mqttConnect = 0x10;
+const uint8_t mqttConnack = 0x20;
+const uint8_t mqttPublish = 0x30;
+const uint8_t mqttSubscribe = 0x82;
+const uint8_t mqttPingreq = 0xC0;
+const uint8_t mqttPingresp = 0xD0;
+const uint8_t mqttDisconnect = 0xE0;
+
+typedef void (*MqttCallback)(char *topic, uint8_t *payload, unsigned int length);
+
+class PubSubClient
+{
+    public:
+
+    PubSubClient(WiFiClient &client)
+    : Client(client)
+    {
+        Host = "localhost";
+        Port = 1883;
+        Callback = nullptr;
+        BufferSize = 0;
+        Received = 0;
+        SocketTimeout = 15;
+        KeepAlive = 15;
+        State = MQTT_DISCONNECTED;
+        NextId = 1;
+        setBufferSize(256);
+    }
+
+    PubSubClient &setServer(const char *host, uint16_t port)
+    {
+        Host = host;
+        Port = port;
+        return *this;
+    }
+
+    PubSubClient &setCallback(MqttCallback callback)
+    {
+        Callback = callback;
+        return *this;
+    }
+
+    bool setBufferSize(uint16_t size)
+    {
+        uint8_t *buffer = (uint8_t *)realloc(Buffer, size);
+        uint8_t *in = (uint8_t *)realloc(In, size);
+        uint8_t *topic = (uint8_t *)realloc(Topic, size);
+        Buffer = buffer ? buffer : Buffer;
+        In = in ? in : In;
+        Topic = topic ? topic : Topic;
+        if (buffer == nullptr || in == nullptr || topic == nullptr)
+        {
+            return false;
+        }
+        BufferSize = size;
+        return true;
+    }
+
+    uint16_t getBufferSize() { return BufferSize; }
+
+    PubSubClient &setSocketTimeout(uint16_t seconds)
+    {
+        SocketTimeout = seconds;
+        return *this;
+    }
+
+    PubSubClient &setKeepAlive(uint16_t seconds)
+    {
+        KeepAlive = seconds;
+        return *this;
+    }
+
+    bool connect(const char *id)
+    {
+        return connect(id, nullptr, 0, false, nullptr);
+    }
+
+    bool connect(const char *id, const char *willTopic, uint8_t willQos, bool willRetain, const char *willMessage)
+    {
+        if (!Client.connect(Host, Port))
+        {
+            State = MQTT_CONNECT_FAILED;
+            return false;
+        }
+        uint8_t flags = 0x02;   // clean session
+        if (willTopic)
+        {
+            flags |= 0x04 | (willQos << 3) | (willRetain ? 0x20 : 0);
+        }
+        uint16_t len = 0;
+        uint8_t *p = Buffer + 5;    // room for the fixed header
+        const uint8_t header[] = {0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, flags, (uint8_t)(KeepAlive >> 8), (uint8_t)(KeepAlive & 0xFF)};
+        memcpy(p, header, sizeof(header));
+        len += sizeof(header);
+        len += putString(p + len, id);
+        if (willTopic)
+        {
+            len += putString(p + len, willTopic);
+            len += putString(p + len, willMessage);
+        }
+        if (!send(mqttConnect, len))
+        {
+            return false;
+        }
+
+        // Wait for CONNACK, the only blocking part of this client
+        Received = 0;
+        unsigned long started = millis();
+        while (millis() - started < SocketTimeout * 1000UL)
+        {
+            if (!fill())
+            {
+                break;
+            }
+            uint16_t packetLen, headerLen;
+            if (complete(packetLen, headerLen))
+            {
+                bool accepted = (In[0] & 0xF0) == mqttConnack && packetLen >= 4 && In[headerLen + 1] == 0;
+                consume(packetLen);
+                State = accepted ? MQTT_CONNECTED : MQTT_CONNECT_FAILED;
+                if (!accepted)
+                {
+                    Client.stop();
+                }
+                LastIn = LastOut = millis();
+                return accepted;
+            }
+            usleep(1000);
+        }
+        Client.stop();
+        State = MQTT_CONNECTION_TIMEOUT;
+        return false;
+    }
+
+    bool publish(const char *topic, const char *payload)
+    {
+        return publish(topic, (const uint8_t *)payload, strlen(payload), false);
+    }
+
+    bool publish(const char *topic, const char *payload, bool retained)
+    {
+        return publish(topic, (const uint8_t *)payload, strlen(payload), retained);
+    }
+
+    bool publish(const char *topic, const uint8_t *payload, unsigned int length)
+    {
+        return publish(topic, payload, length, false);
+    }
+
+    bool publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained)
+    {
+        if (!connected() || 5 + 2 + strlen(topic) + length > BufferSize)
+        {
+            return false;
+        }
+        uint8_t *p = Buffer + 5;
+        uint16_t len = putString(p, topic);
+        memcpy(p + len, payload, length);
+        len += length;
+        return send(mqttPublish | (retained ? 0x01 : 0), len);
+    }
+
+    bool subscribe(const char *topic, uint8_t qos = 0)
+    {
+        if (!connected())
+        {
+            return false;
+        }
+        uint8_t *p = Buffer + 5;
+        p[0] = NextId >> 8;
+        p[1] = NextId & 0xFF;
+        NextId++;
+        uint16_t len = 2 + putString(p + 2, topic);
+        p[len++] = qos;
+        return send(mqttSubscribe, len);
+    }
+
+    // Handle the packets that have arrived and keep the connection alive
+    bool loop()
+    {
+        if (!connected())
+        {
+            return false;
+        }
+        unsigned long now = millis();
+        if (now - LastIn > KeepAlive * 1500UL)
+        {
+            lost();
+            return false;
+        }
+        if (now - LastOut > KeepAlive * 1000UL)
+        {
+            send(mqttPingreq, 0);
+        }
+        if (!fill())
+        {
+            lost();
+            return false;
+        }
+        uint16_t packetLen, headerLen;
+        while (complete(packetLen, headerLen))
+        {
+            LastIn = now;
+            if ((In[0] & 0xF0) == mqttPublish)
+            {
+                deliver(headerLen, packetLen);
+            }
+            consume(packetLen);
+        }
+        return connected();
+    }
+
+    bool connected()
+    {
+        return State == MQTT_CONNECTED && Client.connected();
+    }
+
+    int state() { return State; }
+
+    void disconnect()
+    {
+        send(mqttDisconnect, 0);
+        Client.stop();
+        State = MQTT_DISCONNECTED;
+    }
+
+    private:
+
+    WiFiClient &Client;
+    const char *Host;
+    uint16_t Port;
+    MqttCallback Callback;
+    uint8_t *Buffer = nullptr;      // outgoing packets are built here
+    uint8_t *In = nullptr;          // incoming data collects here until a packet is complete
+    uint8_t *Topic = nullptr;       // null-terminated topic handed to the callback
+    uint16_t BufferSize;
+    uint16_t Received;              // bytes of incoming data in In
+    uint16_t SocketTimeout;
+    uint16_t KeepAlive;
+    uint16_t NextId;
+    int State;
+    unsigned long LastIn;
+    unsigned long LastOut;
+
+    static uint16_t putString(uint8_t *p, const char *s)
+    {
+        uint16_t len = strlen(s);
+        p[0] = len >> 8;
+        p[1] = len & 0xFF;
+        memcpy(p + 2, s, len);
+        return len + 2;
+    }
+
+    // Send the packet built at Buffer + 5, with its fixed header in front
+    bool send(uint8_t type, uint16_t len)
+    {
+        uint8_t header[5];
+        byte headerLen = 0;
+        header[headerLen++] = type;
+        uint16_t remaining = len;
+        do
+        {
+            uint8_t digit = remaining & 0x7F;
+            remaining >>= 7;
+            header[headerLen++] = digit | (remaining ? 0x80 : 0);
+        } while (remaining);
+        uint8_t *start = Buffer + 5 - headerLen;
+        if (len)
+        {
+            memcpy(start, header, headerLen);
+        }
+        else
+        {
+            start = header;
+        }
+        bool ok = Client.write(start, headerLen + len) == (size_t)(headerLen + len);
+        LastOut = millis();
+        if (!ok)
+        {
+            lost();
+        }
+        return ok;
+    }
+
+    // Read what has arrived into the receive area, false when the connection closed
+    bool fill()
+    {
+        if (Received >= BufferSize)
+        {
+            return true;
+        }
+        int n = Client.read(In + Received, BufferSize - Received);
+        if (n < 0)
+        {
+            return false;
+        }
+        Received += n;
+        return true;
+    }
+
+    // Whether a whole packet is waiting at the start of the receive area
+    bool complete(uint16_t &packetLen, uint16_t &headerLen)
+    {
+        uint32_t remaining = 0;
+        uint8_t shift = 0;
+        headerLen = 1;
+        while (true)
+        {
+            if (headerLen >= Received)
+            {
+                return false;
+            }
+            uint8_t digit = In[headerLen++];
+            remaining |= (uint32_t)(digit & 0x7F) << shift;
+            shift += 7;
+            if (!(digit & 0x80))
+            {
+                break;
+            }
+        }
+        packetLen = headerLen + remaining;
+        if (packetLen > BufferSize)
+        {
+            lost();     // larger than the buffer, as the library does
+            return false;
+        }
+        return packetLen <= Received;
+    }
+
+    void consume(uint16_t packetLen)
+    {
+        memmove(In, In + packetLen, Received - packetLen);
+        Received -= packetLen;
+    }
+
+    void deliver(uint16_t headerLen, uint16_t packetLen)
+    {
+        const uint8_t *p = In + headerLen;
+        uint16_t topicLen = (p[0] << 8) | p[1];
+        uint16_t offset = 2 + topicLen;
+        if ((In[0] & 0x06) != 0)
+        {
+            offset += 2;    // packet identifier of a QoS1/2 message
+        }
+        memcpy(Topic, p + 2, topicLen);
+        Topic[topicLen] = '\0';
+        if (Callback)
+        {
+            Callback((char *)Topic, (uint8_t *)p + offset, packetLen - headerLen - offset);
+        }
+    }
+
+    void lost()
+    {
+        Client.stop();
+        State = MQTT_CONNECTION_LOST;
+        Received = 0;
+    }
+};
+
+#endif
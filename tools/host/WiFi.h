@@ -0,0 +1,148 @@
+#ifndef HostWiFi_h
+#define HostWiFi_h
+
+#include "native_hal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Host stand-in for the ESP32 WiFi library: the network is always up, and WiFiClient is a
+// plain TCP socket.
+
+enum wl_status_t {
+    WL_IDLE_STATUS = 0, WL_CONNECTED = 3, WL_DISCONNECTED = 6
+};
+
+enum wifi_mode_t {
+    WIFI_OFF, WIFI_STA
+};
+
+struct IPAddress
+{
+    uint8_t octets[4];
+
+    uint8_t operator[](int i) const { return octets[i]; }
+};
+
+class HostWiFi
+{
+    public:
+
+    void mode(wifi_mode_t) {}
+    void setAutoReconnect(bool) {}
+    void begin(const char *, const char *) { Status = WL_CONNECTED; }
+    void disconnect() { Status = WL_DISCONNECTED; }
+    wl_status_t status() { return Status; }
+    IPAddress localIP() { return {{127, 0, 0, 1}}; }
+
+    private:
+
+    wl_status_t Status = WL_IDLE_STATUS;
+};
+
+HostWiFi WiFi;
+
+class WiFiClient
+{
+    public:
+
+    WiFiClient()
+    {
+        Socket = -1;
+    }
+
+    // Blocking connect, then the socket is switched to non-blocking reads
+    bool connect(const char *host, uint16_t port)
+    {
+        stop();
+        char service[8];
+        snprintf(service, sizeof(service), "%u", port);
+        struct addrinfo hints, *found;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, service, &hints, &found) != 0)
+        {
+            return false;
+        }
+        Socket = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+        bool ok = Socket >= 0 && ::connect(Socket, found->ai_addr, found->ai_addrlen) == 0;
+        freeaddrinfo(found);
+        if (!ok)
+        {
+            stop();
+            return false;
+        }
+        int one = 1;
+        setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(Socket, F_SETFL, fcntl(Socket, F_GETFL) | O_NONBLOCK);
+        return true;
+    }
+
+    bool connected()
+    {
+        return Socket >= 0;
+    }
+
+    // Write everything, waiting for the socket when its buffer is full
+    size_t write(const uint8_t *data, size_t len)
+    {
+        size_t done = 0;
+        while (Socket >= 0 && done < len)
+        {
+            ssize_t n = send(Socket, data + done, len - done, MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                done += n;
+            }
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                usleep(100);
+            }
+            else
+            {
+                stop();
+            }
+        }
+        return done;
+    }
+
+    // Read what has arrived, -1 once the peer has closed the connection
+    int read(uint8_t *buffer, size_t len)
+    {
+        if (Socket < 0)
+        {
+            return -1;
+        }
+        ssize_t n = recv(Socket, buffer, len, 0);
+        if (n > 0)
+        {
+            return n;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 0;
+        }
+        stop();
+        return -1;
+    }
+
+    void stop()
+    {
+        if (Socket >= 0)
+        {
+            close(Socket);
+        }
+        Socket = -1;
+    }
+
+    private:
+
+    int Socket;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef HostFreeRTOS_h
+#define HostFreeRTOS_h
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Host stand-in for the FreeRTOS calls the network code makes: a task is a detached thread and
+// its notification value a counter guarded by a condition variable. Priorities and cores are
+// ignored. Build with -pthread.
+
+typedef int BaseType_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define pdPASS 1
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdMS_TO_TICKS(ms) (ms)
+
+struct HostTask
+{
+    std::mutex lock;
+    std::condition_variable wake;
+    uint32_t notified = 0;
+};
+
+typedef HostTask *TaskHandle_t;
+
+thread_local HostTask *hostCurrentTask = nullptr;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack, void *arg, int priority, TaskHandle_t *handle, int core)
+{
+    HostTask *task = new HostTask();
+    if (handle)
+    {
+        *handle = task;
+    }
+    std::thread([task, function, arg]() {
+        hostCurrentTask = task;
+        function(arg);
+    }).detach();
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack, void *arg, int priority, TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(function, name, stack, arg, priority, handle, 0);
+}
+
+// The calling task, each thread not started through xTaskCreate counting as one of its own
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+    thread_local HostTask own;
+    return hostCurrentTask ? hostCurrentTask : &own;
+}
+
+void xTaskNotifyGive(TaskHandle_t task)
+{
+    std::lock_guard<std::mutex> guard(task->lock);
+    task->notified++;
+    task->wake.notify_one();
+}
+
+// Wait up to ms for a notification of the calling task, its count before taking
+uint32_t ulTaskNotifyTake(BaseType_t clear, uint32_t ms)
+{
+    HostTask *task = hostCurrentTask;
+    std::unique_lock<std::mutex> guard(task->lock);
+    task->wake.wait_for(guard, std::chrono::milliseconds(ms), [task]() { return task->notified > 0; });
+    uint32_t count = task->notified;
+    if (count)
+    {
+        task->notified = clear ? 0 : count - 1;
+    }
+    return count;
+}
+
+void vTaskDelay(uint32_t ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+#endif
@@ -0,0 +1,251 @@
+#!/usr/bin/env python3
+#
+# File: mkassets.py (builds the asset bundle for the assets partition, see src/assets.h)
+#
+# Description:
+#
+#      Packs palettes, lookup tables, timelines, pre-rendered frames and the tag table into one
+#      bundle for the assets partition in partitions.csv, and puts it on a prop without
+#      rebuilding the firmware.
+#
+#          mkassets.py build assets/manifest.txt assets.bin --version 3
+#          mkassets.py list assets.bin                     check a bundle and list what is in it
+#          mkassets.py flash assets.bin [--port /dev/ttyUSB0]
+#          mkassets.py serve assets.bin [--port 8071]      then "assets load http://<host>:8071/"
+#
+#      flash writes the bundle over USB with esptool at the offset partitions.csv gives the
+#      partition (follow with "assets reload", or reset the prop). serve answers every GET with
+#      the bundle for "assets load" over MQTT, and logs each transfer.
+#
+#      A manifest has one asset per line, paths relative to the manifest:
+#          <type> <name> <source> [width=<pixels>]
+#          palette  potion  palettes/potion.txt     hex colors, RRGGBB
+#          lut      gamma   gamma:2.6               256 numbers in a text file, or gamma:<exponent>
+#          frames   comet   comet:ff6000:49         raw r,g,b bytes (.rgb, needs width=), or
+#                                                   comet:<RRGGBB>:<pixels>, one frame per pixel
+#          timeline solve   timelines/solve.txt     text, as is
+#          tags     tags    ../data/tags.txt        tag database lines (src/tagdb.h), as is
+#          raw      notes   notes.bin               bytes, as is
+#
+
+import argparse
+import os
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import time
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+MAGIC = 0x54455341          # "ASET"
+FORMAT = 1
+HEADER = struct.Struct("<IHHIII12x")
+ENTRY = struct.Struct("<16sHHIII")
+NAME_SIZE = 16
+LUT_SIZE = 256
+TYPES = ["raw", "palette", "lut", "timeline", "frames", "tags"]
+PARTITIONS = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "partitions.csv")
+
+
+def partition(label="assets"):
+    """Offset and size of a partition in partitions.csv"""
+    with open(PARTITIONS) as f:
+        for line in f:
+            fields = [field.strip() for field in line.split("#")[0].split(",")]
+            if len(fields) >= 5 and fields[0] == label:
+                return int(fields[3], 0), int(fields[4], 0)
+    sys.exit("no %s partition in %s" % (label, PARTITIONS))
+
+
+def hex_colors(text):
+    colors = []
+    for line in text.splitlines():
+        for word in line.split("#", 1)[0].split():
+            if not re.fullmatch(r"[0-9a-fA-F]{6}", word):
+                raise ValueError("bad color %r" % word)
+            colors.append(int(word, 16))
+    return colors
+
+
+def comet(color, pixels, tail=6):
+    """A head of color running along the pixels with a fading tail, one frame per position"""
+    rgb = [(color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF]
+    frames = bytearray()
+    for head in range(pixels):
+        for i in range(pixels):
+            behind = head - i
+            level = 1.0 / (1 << behind) if 0 <= behind < tail else 0.0
+            frames += bytes(int(c * level) for c in rgb)
+    return bytes(frames)
+
+
+def load_asset(kind, source, base, options):
+    """Data and parameter of one manifest line"""
+    if kind == "palette":
+        with open(os.path.join(base, source)) as f:
+            colors = hex_colors(f.read())
+        return struct.pack("<%dI" % len(colors), *colors), 0
+    if kind == "lut":
+        if source.startswith("gamma:"):
+            g = float(source[6:])
+            values = [int(round(255.0 * (i / 255.0) ** g)) for i in range(LUT_SIZE)]
+        else:
+            with open(os.path.join(base, source)) as f:
+                values = [int(v, 0) for v in f.read().split()]
+        if len(values) != LUT_SIZE or not all(0 <= v <= 255 for v in values):
+            raise ValueError("a lut is %d values of 0-255" % LUT_SIZE)
+        return bytes(values), 0
+    if kind == "frames":
+        if source.startswith("comet:"):
+            _, color, pixels = source.split(":")
+            return comet(int(color, 16), int(pixels)), int(pixels)
+        width = int(options.get("width", 0))
+        with open(os.path.join(base, source), "rb") as f:
+            data = f.read()
+        if width <= 0 or len(data) % (3 * width):
+            raise ValueError("frames need width=<pixels> and whole frames of 3 bytes per pixel")
+        return data, width
+    with open(os.path.join(base, source), "rb") as f:
+        return f.read(), 0
+
+
+def build(manifest, version):
+    base = os.path.dirname(os.path.abspath(manifest))
+    assets = []
+    with open(manifest) as f:
+        for number, line in enumerate(f, 1):
+            words = line.split("#", 1)[0].split()
+            if not words:
+                continue
+            if len(words) < 3 or words[0] not in TYPES:
+                sys.exit("%s:%d: expected <type> <name> <source>" % (manifest, number))
+            kind, name, source = words[:3]
+            options = dict(word.split("=", 1) for word in words[3:] if "=" in word)
+            if len(name.encode()) >= NAME_SIZE or any(name == a[1] and words[0] == TYPES[a[0]] for a in assets):
+                sys.exit("%s:%d: names are unique per type and up to %d characters" % (manifest, number, NAME_SIZE - 1))
+            try:
+                data, param = load_asset(kind, source, base, options)
+            except (OSError, ValueError) as error:
+                sys.exit("%s:%d: %s" % (manifest, number, error))
+            assets.append((TYPES.index(kind), name, data, param))
+
+    offset = HEADER.size + ENTRY.size * len(assets)
+    table = bytearray()
+    body = bytearray()
+    for kind, name, data, param in assets:
+        at = offset + len(body)
+        table += ENTRY.pack(name.encode(), kind, 0, at, len(data), param)
+        body += data + bytes(-len(data) % 4)
+    rest = bytes(table + body)
+    size = HEADER.size + len(rest)
+    return HEADER.pack(MAGIC, FORMAT, len(assets), version, size, zlib.crc32(rest)) + rest
+
+
+def parse(bundle):
+    """Version and (type, name, offset, size, param) of each asset, after the checks the prop makes"""
+    if len(bundle) < HEADER.size:
+        raise ValueError("too short")
+    magic, fmt, count, version, size, crc = HEADER.unpack_from(bundle)
+    if magic != MAGIC or fmt != FORMAT:
+        raise ValueError("not a bundle of format %d" % FORMAT)
+    if size > len(bundle) or size < HEADER.size + count * ENTRY.size:
+        raise ValueError("bad size")
+    if zlib.crc32(bundle[HEADER.size:size]) != crc:
+        raise ValueError("bad crc")
+    entries = []
+    for i in range(count):
+        name, kind, _, offset, length, param = ENTRY.unpack_from(bundle, HEADER.size + i * ENTRY.size)
+        if offset % 4 or offset + length > size:
+            raise ValueError("bad entry %d" % i)
+        entries.append((kind, name.rstrip(b"\0").decode(), offset, length, param))
+    return version, size, entries
+
+
+def describe(bundle):
+    version, size, entries = parse(bundle)
+    _, room = partition()
+    lines = ["version %d, %d assets, %d bytes (%d%% of the partition)" % (version, len(entries), size, 100 * size // room)]
+    for kind, name, offset, length, param in entries:
+        kind = TYPES[kind] if kind < len(TYPES) else "?"
+        extra = ""
+        if kind == "frames" and param:
+            extra = "  %d frames of %d pixels" % (length // (3 * param), param)
+        elif kind == "palette":
+            extra = "  %d colors" % (length // 4)
+        lines.append("  %-8s %-15s %7d bytes at +%d%s" % (kind, name, length, offset, extra))
+    return "\n".join(lines)
+
+
+def flash(path, port):
+    offset, size = partition()
+    if os.path.getsize(path) > size:
+        sys.exit("bundle is larger than the assets partition")
+    tool = shutil.which("esptool.py") or shutil.which("esptool")
+    command = [tool] if tool else [sys.executable, "-m", "esptool"]
+    command += ["--chip", "esp32"] + (["--port", port] if port else []) + ["write_flash", "0x%x" % offset, path]
+    print(" ".join(command))
+    sys.exit(subprocess.call(command))
+
+
+def serve(path, port):
+    with open(path, "rb") as f:
+        bundle = f.read()
+    print(describe(bundle))
+
+    class Handler(BaseHTTPRequestHandler):
+        def do_GET(self):
+            started = time.time()
+            self.send_response(200)
+            self.send_header("Content-Type", "application/octet-stream")
+            self.send_header("Content-Length", str(len(bundle)))
+            self.end_headers()
+            self.wfile.write(bundle)
+            print("%s %d bytes in %.2f s" % (self.client_address[0], len(bundle), time.time() - started))
+
+        def log_message(self, format, *args):
+            pass
+
+    print("serving %s on port %d" % (path, port))
+    ThreadingHTTPServer(("", port), Handler).serve_forever()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build and install the asset bundle")
+    commands = parser.add_subparsers(dest="command", required=True)
+    p = commands.add_parser("build")
+    p.add_argument("manifest")
+    p.add_argument("out")
+    p.add_argument("--version", type=int, default=int(time.time()), help="bundle version, the build time by default")
+    p = commands.add_parser("list")
+    p.add_argument("bundle")
+    p = commands.add_parser("flash")
+    p.add_argument("bundle")
+    p.add_argument("--port")
+    p = commands.add_parser("serve")
+    p.add_argument("bundle")
+    p.add_argument("--port", type=int, default=8071)
+    args = parser.parse_args()
+
+    if args.command == "build":
+        bundle = build(args.manifest, args.version)
+        if len(bundle) > partition()[1]:
+            sys.exit("bundle of %d bytes is larger than the assets partition" % len(bundle))
+        with open(args.out, "wb") as f:
+            f.write(bundle)
+        print(describe(bundle))
+    elif args.command == "list":
+        with open(args.bundle, "rb") as f:
+            try:
+                print(describe(f.read()))
+            except ValueError as error:
+                sys.exit("%s: %s" % (args.bundle, error))
+    elif args.command == "flash":
+        flash(args.bundle, args.port)
+    else:
+        serve(args.bundle, args.port)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,266 @@
+#!/usr/bin/env python3
+#
+# File: ota_delta.py (update images and a stand-in update server for OTA)
+#
+# Description:
+#
+#      Builds the compressed update images src/ota.h installs (format in src/deltapatch.h) and
+#      serves them to props on the local network.
+#
+#          ota_delta.py diff old.bin new.bin out.delta    delta of new against old
+#          ota_delta.py full new.bin out.delta            full image, same format
+#          ota_delta.py apply old.bin in.delta out.bin    rebuild an image and check its hash
+#          ota_delta.py bench old.bin new.bin [--rate KB/s ...]
+#          ota_delta.py serve images/ --target new.bin [--port 8070] [--rate KB/s]
+#
+#      Keep the .bin of every build that went onto a prop in the served directory. A prop asks
+#      for /delta?from=<sha256 of its image> and gets a delta when a .bin with that hash is
+#      there, otherwise the full image; /full always sends the full image. Each transfer is
+#      logged with its size and time, and the prop reports its own download and install time
+#      as "ota done ..." on its host topic, so delta and full updates can be compared.
+#
+#      The delta is a simplified bsdiff: matches found through a hash of 16-byte blocks are
+#      extended while at least half the bytes agree, and stored as byte differences against
+#      the old image, which are mostly zero and compress well.
+#
+
+import argparse
+import hashlib
+import os
+import struct
+import sys
+import threading
+import time
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+MAGIC = 0x544C4441          # "ADLT"
+VERSION = 1
+FLAG_FULL = 0x01
+OP_END, OP_ADD, OP_INSERT = 0, 1, 2
+HEADER = struct.Struct("<IBBHII32s32s")
+
+BLOCK = 16                  # bytes hashed to find a match
+STRIDE = 4                  # old image offsets indexed
+MIN_MATCH = 24              # shorter matches are sent as inserts
+GIVE_UP = 64                # stop extending after this many bytes without improvement
+
+
+def header(flags, old, new):
+    return HEADER.pack(MAGIC, VERSION, flags, 0, len(old), len(new),
+                       hashlib.sha256(old).digest(), hashlib.sha256(new).digest())
+
+
+def make_full(new):
+    ops = bytearray()
+    ops += struct.pack("<BI", OP_INSERT, len(new)) + new
+    ops.append(OP_END)
+    return header(FLAG_FULL, b"", new) + zlib.compress(bytes(ops), 9)
+
+
+def make_delta(old, new):
+    index = {}
+    for off in range(0, len(old) - BLOCK + 1, STRIDE):
+        index.setdefault(old[off:off + BLOCK], off)
+
+    ops = bytearray()
+
+    def insert(start, end):
+        if end > start:
+            ops.extend(struct.pack("<BI", OP_INSERT, end - start))
+            ops.extend(new[start:end])
+
+    literal = 0     # start of the bytes not covered yet
+    i = 0
+    while i <= len(new) - BLOCK:
+        off = index.get(new[i:i + BLOCK])
+        if off is None:
+            i += 1
+            continue
+
+        # Extend back over exact bytes, then forward while the match keeps scoring
+        back = 0
+        while i - back > literal and off - back > 0 and new[i - back - 1] == old[off - back - 1]:
+            back += 1
+        start_new, start_old = i - back, off - back
+        same = best_same = length = k = 0
+        limit = min(len(new) - start_new, len(old) - start_old)
+        while k < limit:
+            if new[start_new + k] == old[start_old + k]:
+                same += 1
+            k += 1
+            if same * 2 - k > best_same * 2 - length:
+                best_same, length = same, k
+            elif k - length > GIVE_UP:
+                break
+        if length < MIN_MATCH:
+            i += 1
+            continue
+
+        insert(literal, start_new)
+        diff = bytes((new[start_new + j] - old[start_old + j]) & 0xFF for j in range(length))
+        ops.extend(struct.pack("<BII", OP_ADD, start_old, length))
+        ops.extend(diff)
+        i = literal = start_new + length
+    insert(literal, len(new))
+    ops.append(OP_END)
+    return header(0, old, new) + zlib.compress(bytes(ops), 9)
+
+
+def apply(old, delta):
+    magic, version, flags, _, source_size, target_size, source_sha, target_sha = HEADER.unpack_from(delta)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not an update image")
+    if not flags & FLAG_FULL and (source_size != len(old) or hashlib.sha256(old).digest() != source_sha):
+        raise ValueError("delta is for another image")
+    ops = zlib.decompress(delta[HEADER.size:])
+    out = bytearray()
+    p = 0
+    while ops[p] != OP_END:
+        if ops[p] == OP_ADD:
+            off, n = struct.unpack_from("<II", ops, p + 1)
+            p += 9
+            out.extend((old[off + j] + ops[p + j]) & 0xFF for j in range(n))
+        elif ops[p] == OP_INSERT:
+            n, = struct.unpack_from("<I", ops, p + 1)
+            p += 5
+            out.extend(ops[p:p + n])
+        else:
+            raise ValueError("bad operation")
+        p += n
+    if len(out) != target_size or hashlib.sha256(out).digest() != target_sha:
+        raise ValueError("image hash mismatch")
+    return bytes(out)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def write(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def bench(args):
+    old, new = read(args.old), read(args.new)
+    started = time.time()
+    delta = make_delta(old, new)
+    diff_seconds = time.time() - started
+    full = make_full(new)
+    apply(old, delta)
+    print("image %d bytes, full image %d bytes compressed, delta %d bytes (%.1f%% of full), diff took %.1f s"
+          % (len(new), len(full), len(delta), 100.0 * len(delta) / len(full), diff_seconds))
+    print("\n  rate KB/s   full s   delta s")
+    for rate in args.rate or [50, 200, 1000]:
+        print("%11g %8.1f %9.1f" % (rate, len(full) / 1024.0 / rate, len(delta) / 1024.0 / rate))
+
+
+class UpdateHandler(BaseHTTPRequestHandler):
+    # Set by serve()
+    target = b""
+    directory = "."
+    rate = 0
+    cache = {}
+    lock = threading.Lock()
+
+    def image(self, kind, source):
+        with self.lock:
+            key = (kind, source)
+            if key not in self.cache:
+                base = None
+                if kind == "delta" and source:
+                    for name in sorted(os.listdir(self.directory)):
+                        if name.endswith(".bin"):
+                            data = read(os.path.join(self.directory, name))
+                            if hashlib.sha256(data).hexdigest() == source:
+                                base = data
+                                break
+                if base is None:
+                    self.cache[key] = ("full", make_full(self.target))
+                elif base == self.target:
+                    self.cache[key] = (None, None)
+                else:
+                    self.cache[key] = ("delta", make_delta(base, self.target))
+            return self.cache[key]
+
+    def do_GET(self):
+        url = urlparse(self.path)
+        source = parse_qs(url.query).get("from", [""])[0].lower()
+        if url.path not in ("/delta", "/full"):
+            self.send_error(404)
+            return
+        kind, body = self.image(url.path[1:], source)
+        if body is None:
+            self.send_error(409, "already up to date")
+            return
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        started = time.time()
+        chunk = 4096
+        for p in range(0, len(body), chunk):
+            self.wfile.write(body[p:p + chunk])
+            if self.rate:
+                # Pace the transfer to emulate a slower network
+                due = started + (p + chunk) / 1024.0 / self.rate
+                time.sleep(max(0, due - time.time()))
+        seconds = time.time() - started
+        print("%s %s %s %d bytes in %.2f s (%.1f KB/s)" % (time.strftime("%H:%M:%S"), self.client_address[0],
+              kind, len(body), seconds, len(body) / 1024.0 / max(seconds, 1e-6)))
+        sys.stdout.flush()
+
+    def log_message(self, format, *args):
+        pass
+
+
+def serve(args):
+    UpdateHandler.target = read(args.target)
+    UpdateHandler.directory = args.directory
+    UpdateHandler.rate = args.rate
+    print("Serving %s (sha256 %s) on port %d" % (args.target, hashlib.sha256(UpdateHandler.target).hexdigest(), args.port))
+    ThreadingHTTPServer(("", args.port), UpdateHandler).serve_forever()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="OTA update images and update server")
+    sub = parser.add_subparsers(dest="command", required=True)
+    p = sub.add_parser("diff")
+    p.add_argument("old")
+    p.add_argument("new")
+    p.add_argument("out")
+    p = sub.add_parser("full")
+    p.add_argument("new")
+    p.add_argument("out")
+    p = sub.add_parser("apply")
+    p.add_argument("old")
+    p.add_argument("delta")
+    p.add_argument("out")
+    p = sub.add_parser("bench")
+    p.add_argument("old")
+    p.add_argument("new")
+    p.add_argument("--rate", type=float, action="append", help="network rate in KB/s, repeatable")
+    p = sub.add_parser("serve")
+    p.add_argument("directory")
+    p.add_argument("--target", required=True)
+    p.add_argument("--port", type=int, default=8070)
+    p.add_argument("--rate", type=float, default=0, help="limit each transfer to this many KB/s")
+    args = parser.parse_args()
+
+    if args.command == "diff":
+        write(args.out, make_delta(read(args.old), read(args.new)))
+    elif args.command == "full":
+        write(args.out, make_full(read(args.new)))
+    elif args.command == "apply":
+        write(args.out, apply(read(args.old), read(args.delta)))
+    elif args.command == "bench":
+        bench(args)
+    else:
+        serve(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,257 @@
+#!/usr/bin/env python3
+#
+# File: prof_report.py (symbolises a sampling profile, see src/profiler.h)
+#
+# Description:
+#
+#      Reads the "#PF ..." lines of a profile and looks the sampled addresses up in the
+#      firmware ELF, then prints the samples per task, a flat profile (the samples that landed
+#      in each function, and with "stacks" the samples it was on the backtrace for) and for
+#      the busiest functions the callers and callees seen in the backtraces. Build the ELF and
+#      flash it together, the addresses change with every build.
+#
+#          Serial ("profile 10" typed on the console): other lines are ignored
+#              pio device monitor | tee capture.txt
+#              tools/prof_report.py .pio/build/nodemcu-32s/firmware.elf capture.txt
+#          MQTT ("profile 10 1000 stacks"), needs paho-mqtt, exits after the first complete profile:
+#              tools/prof_report.py firmware.elf --mqtt 10.1.10.10 --topic ToHost/NameOfMachine/profile
+#
+#      Names come from the ELF symbol table, demangled with c++filt when it is on the path.
+#      --addr2line xtensa-esp32-elf-addr2line adds the hottest source lines, --folded writes
+#      the backtraces in the folded format flamegraph.pl reads.
+#
+
+import argparse
+import bisect
+import shutil
+import struct
+import subprocess
+import sys
+
+SHT_SYMTAB = 2
+STT_FUNC = 2
+
+
+class Symbols:
+    """Function symbols of an ELF file, looked up by address"""
+
+    def __init__(self, path):
+        self.path = path
+        with open(path, "rb") as f:
+            data = f.read()
+        if data[:4] != b"\x7fELF":
+            raise ValueError("%s is not an ELF file" % path)
+        is64 = data[4] == 2
+        endian = "<" if data[5] == 1 else ">"
+        if is64:
+            shoff, = struct.unpack_from(endian + "Q", data, 0x28)
+            shentsize, shnum = struct.unpack_from(endian + "HH", data, 0x3A)
+            layout = endian + "IIQQQQIIQQ"
+        else:
+            shoff, = struct.unpack_from(endian + "I", data, 0x20)
+            shentsize, shnum = struct.unpack_from(endian + "HH", data, 0x2E)
+            layout = endian + "IIIIIIIIII"
+        sections = [struct.unpack_from(layout, data, shoff + i * shentsize) for i in range(shnum)]
+        functions = {}
+        for _, kind, _, _, offset, size, link, _, _, entsize in sections:
+            if kind != SHT_SYMTAB:
+                continue
+            strings = sections[link][4]
+            for at in range(offset, offset + size, entsize):
+                if is64:
+                    name, info, _, _, value, length = struct.unpack_from(endian + "IBBHQQ", data, at)
+                else:
+                    name, value, length, info, _, _ = struct.unpack_from(endian + "IIIBBH", data, at)
+                if info & 0xF != STT_FUNC or value == 0:
+                    continue
+                end = data.index(b"\0", strings + name)
+                functions.setdefault(value, (length, data[strings + name:end].decode("latin-1")))
+        self.starts = sorted(functions)
+        self.functions = [functions[start] for start in self.starts]
+
+    def name(self, address):
+        i = bisect.bisect_right(self.starts, address) - 1
+        if i < 0:
+            return "0x%08x" % address
+        length, name = self.functions[i]
+        if length and address >= self.starts[i] + length:
+            return "0x%08x" % address
+        return name
+
+
+def demangle(names):
+    """Readable names for the mangled C++ ones, unchanged without c++filt"""
+    names = sorted(set(names))
+    tool = shutil.which("c++filt") or shutil.which("xtensa-esp32-elf-c++filt")
+    if not tool or not names:
+        return {name: name for name in names}
+    out = subprocess.run([tool], input="\n".join(names), capture_output=True, text=True).stdout.splitlines()
+    return dict(zip(names, out)) if len(out) == len(names) else {name: name for name in names}
+
+
+class Profile:
+    def __init__(self, fields):
+        self.hz, self.samples, self.dropped, self.interrupted = (int(f) for f in fields[:4])
+        self.tasks = []         # (samples, name)
+        self.pcs = []           # (samples, address)
+        self.stacks = []        # (samples, [address, return address, ...])
+        self.complete = False
+
+    def add(self, fields):
+        if fields[0] == "task" and len(fields) >= 3:
+            self.tasks.append((int(fields[1]), " ".join(fields[2:])))
+        elif fields[0] == "pc" and len(fields) == 3:
+            self.pcs.append((int(fields[1]), int(fields[2], 16)))
+        elif fields[0] == "stack" and len(fields) >= 3:
+            self.stacks.append((int(fields[1]), [int(f, 16) for f in fields[2:]]))
+
+
+class Reader:
+    """Collects profiles from "#PF" lines, the last complete one wins"""
+
+    def __init__(self):
+        self.profile = None
+        self.done = None
+
+    def line(self, line):
+        if not line.startswith("#PF "):
+            return
+        fields = line[4:].split()
+        if not fields:
+            return
+        if fields[0] == "begin" and len(fields) >= 5:
+            self.profile = Profile(fields[1:])
+        elif fields[0] == "end":
+            if self.profile is not None:
+                self.profile.complete = True
+                self.done = self.profile
+                self.profile = None
+        elif self.profile is not None:
+            self.profile.add(fields)
+
+
+def functions_of(profile, symbols):
+    """Function names of each backtrace, return addresses looked up a byte back so a call at
+    the very end of a function is not put in the next one"""
+    stacks = []
+    for count, addresses in profile.stacks:
+        names = [symbols.name(addresses[0])] + [symbols.name(a - 1) for a in addresses[1:]]
+        stacks.append((count, names))
+    return stacks
+
+
+def report(profile, symbols, top, addr2line):
+    out = []
+    seconds = profile.samples / float(profile.hz) if profile.hz else 0
+    out.append("%d samples at %d Hz (%.1f s), %d dropped, %d in interrupts" %
+               (profile.samples, profile.hz, seconds, profile.dropped, profile.interrupted))
+    total = float(sum(count for count, _ in profile.pcs)) or 1.0
+
+    if profile.tasks:
+        out.append("")
+        out.append("%8s %7s  %s" % ("samples", "%", "task"))
+        for count, name in sorted(profile.tasks, reverse=True):
+            out.append("%8d %6.1f%%  %s" % (count, 100.0 * count / total, name))
+
+    flat = {}
+    for count, address in profile.pcs:
+        name = symbols.name(address)
+        flat[name] = flat.get(name, 0) + count
+    stacks = functions_of(profile, symbols)
+    inclusive = {}
+    callers = {}
+    callees = {}
+    for count, names in stacks:
+        for name in set(names):
+            inclusive[name] = inclusive.get(name, 0) + count
+        for callee, caller in zip(names, names[1:]):
+            callers.setdefault(callee, {})
+            callers[callee][caller] = callers[callee].get(caller, 0) + count
+            callees.setdefault(caller, {})
+            callees[caller][callee] = callees[caller].get(callee, 0) + count
+    stacked = float(sum(count for count, _ in stacks)) or 1.0
+    readable = demangle(list(flat) + list(inclusive))
+
+    out.append("")
+    out.append("Flat profile" + (", total from %d backtraces" % stacked if stacks else ""))
+    out.append("%8s %7s %7s  %s" % ("self", "%", "total %", "function"))
+    for name, count in sorted(flat.items(), key=lambda item: -item[1])[:top]:
+        whole = "%6.1f%%" % (100.0 * inclusive[name] / stacked) if name in inclusive else "      -"
+        out.append("%8d %6.1f%% %s  %s" % (count, 100.0 * count / total, whole, readable[name]))
+
+    if stacks:
+        out.append("")
+        out.append("Call graph, callers above and callees below each function (samples)")
+        for name, count in sorted(inclusive.items(), key=lambda item: -item[1])[:top]:
+            out.append("")
+            for caller, n in sorted(callers.get(name, {}).items(), key=lambda item: -item[1]):
+                out.append("%16d      %s" % (n, readable.get(caller, caller)))
+            out.append("%8d %6.1f%%  %s" % (flat.get(name, 0), 100.0 * count / stacked, readable[name]))
+            for callee, n in sorted(callees.get(name, {}).items(), key=lambda item: -item[1]):
+                out.append("%16d      %s" % (n, readable.get(callee, callee)))
+
+    if addr2line:
+        hottest = sorted(profile.pcs, reverse=True)[:top]
+        lookup = subprocess.run([addr2line, "-e", symbols.path, "-f", "-C", "-i"] + ["0x%x" % a for _, a in hottest],
+                                capture_output=True, text=True).stdout.splitlines()
+        # Inlined frames give extra pairs, only the innermost line of each address is kept
+        lines = lookup[1::2] if len(lookup) == 2 * len(hottest) else []
+        out.append("")
+        out.append("Hottest lines")
+        for (count, address), place in zip(hottest, lines):
+            out.append("%8d %6.1f%%  %08x  %s" % (count, 100.0 * count / total, address, place))
+    return "\n".join(out)
+
+
+def folded(profile, symbols):
+    readable = {}
+    lines = []
+    for count, names in functions_of(profile, symbols):
+        readable.update(demangle([n for n in names if n not in readable]))
+        lines.append("%s %d" % (";".join(readable[n].replace(";", ":") for n in reversed(names)), count))
+    return "\n".join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Symbolise a sampling profile against the firmware ELF")
+    parser.add_argument("elf")
+    parser.add_argument("capture", nargs="?", help="serial capture, standard input when left out")
+    parser.add_argument("--mqtt", metavar="BROKER")
+    parser.add_argument("--topic", default="ToHost/NameOfMachine/profile")
+    parser.add_argument("--top", type=int, default=25, help="functions in each table")
+    parser.add_argument("--addr2line", metavar="TOOL", help="addr2line of the firmware toolchain, for source lines")
+    parser.add_argument("--folded", metavar="FILE", help="also write the backtraces for flamegraph.pl")
+    args = parser.parse_args()
+    symbols = Symbols(args.elf)
+    reader = Reader()
+
+    if args.mqtt:
+        import paho.mqtt.client as mqtt
+
+        def on_message(client, userdata, message):
+            for line in message.payload.decode("latin-1").splitlines():
+                reader.line(line)
+            if reader.done:
+                client.disconnect()
+
+        client = mqtt.Client()
+        client.on_message = on_message
+        client.connect(args.mqtt)
+        client.subscribe(args.topic)
+        client.loop_forever()
+    else:
+        source = open(args.capture, errors="replace") if args.capture else sys.stdin
+        for line in source:
+            reader.line(line.rstrip("\r\n"))
+
+    profile = reader.done or reader.profile
+    if profile is None:
+        sys.exit("no profile found")
+    print(report(profile, symbols, args.top, args.addr2line))
+    if args.folded:
+        with open(args.folded, "w") as out:
+            out.write(folded(profile, symbols) + "\n")
+
+
+if __name__ == "__main__":
+    main()
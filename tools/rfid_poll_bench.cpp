@@ -0,0 +1,193 @@
+//+------------------------------------------------------------------------
+//
+// File: rfid_poll_bench.cpp (host-side RFID polling benchmark)
+//
+// Description:
+//
+//      Runs the firmware's RfidBank against simulated PN5180 readers (src/pn5180_sim.h) on a
+//      virtual clock, with beakers placed and removed at scripted times, and reports tag
+//      detection latency, inventory throughput and the longest loop() stall for several
+//      polling budgets and bank sizes. It also compares SPI and total time per inventory for
+//      the PN5180 library's sequence and the batched transport.
+//
+//      Build and run on Linux:
+//          g++ -std=gnu++11 -O2 -Isrc tools/rfid_poll_bench.cpp -o rfid_poll_bench
+//          ./rfid_poll_bench
+//
+
+#define RFID_SIMULATED
+#include "rfid.h"
+
+#include <vector>
+
+const unsigned long simDuration = 600000;   // milliseconds of play per run
+const unsigned long loopWork = 100;         // milliseconds loop() spends on everything but RFID
+
+// A scripted beaker placement and when the bank first reported it
+struct Placement
+{
+    byte reader;
+    uint8_t uid[8];
+    unsigned long from;
+    unsigned long until;
+    unsigned long detected;     // 0 until detected
+};
+
+// Deterministic pseudo random numbers so every run scripts the same tags
+uint32_t benchSeed = 12345;
+unsigned long benchRandom(unsigned long lo, unsigned long hi)
+{
+    benchSeed = benchSeed * 1664525UL + 1013904223UL;
+    return lo + (benchSeed >> 8) % (hi - lo);
+}
+
+void runScenario(byte numReaders, unsigned long budgetMicros, const char *name)
+{
+    simMicros = 0;
+    benchSeed = 12345;
+
+    std::vector<RfidReader> readers;
+    for (byte i = 0; i < numReaders; i++)
+    {
+        readers.push_back(RfidReader(0, 0, 0));
+    }
+
+    // Each reader sees beakers resting 5-60 s with 2-20 s gaps
+    std::vector<Placement> placements;
+    for (byte i = 0; i < numReaders; i++)
+    {
+        unsigned long t = benchRandom(1000, 20000);
+        uint32_t serial = 0;
+        while (t < simDuration)
+        {
+            Placement p;
+            p.reader = i;
+            memset(p.uid, 0, 8);
+            p.uid[0] = i;
+            p.uid[1] = ++serial;
+            p.uid[7] = 0xE0;
+            p.from = t;
+            p.until = t + benchRandom(5000, 60000);
+            p.detected = 0;
+            readers[i].addTag(p.uid, p.from, p.until);
+            placements.push_back(p);
+            t = p.until + benchRandom(2000, 20000);
+            if (serial == simMaxTags)
+            {
+                break;
+            }
+        }
+    }
+
+    RfidBank bank(readers.data(), numReaders);
+    unsigned long longestPoll = 0;
+    unsigned long loops = 0;
+    while (millis() < simDuration)
+    {
+        unsigned long started = micros();
+        bank.poll(budgetMicros);
+        longestPoll = max(longestPoll, micros() - started);
+        loops++;
+
+        for (size_t p = 0; p < placements.size(); p++)
+        {
+            Placement &placement = placements[p];
+            if (placement.detected == 0 && bank.result[placement.reader] == ISO15693_EC_OK &&
+                memcmp(bank.uid[placement.reader], placement.uid, 8) == 0)
+            {
+                placement.detected = millis();
+            }
+        }
+        delay(loopWork);
+    }
+
+    std::vector<unsigned long> latency;
+    unsigned long missed = 0;
+    for (size_t p = 0; p < placements.size(); p++)
+    {
+        if (placements[p].from >= simDuration)
+        {
+            continue;
+        }
+        if (placements[p].detected)
+        {
+            latency.push_back(placements[p].detected - placements[p].from);
+        }
+        else
+        {
+            missed++;
+        }
+    }
+    std::sort(latency.begin(), latency.end());
+    unsigned long total = 0;
+    for (size_t i = 0; i < latency.size(); i++)
+    {
+        total += latency[i];
+    }
+
+    unsigned long inventories = 0;
+    for (byte i = 0; i < numReaders; i++)
+    {
+        inventories += readers[i].inventories;
+    }
+
+    printf("%7u  %-12s %8lu %8lu %8lu %6lu %10.1f %10lu\n", numReaders, name,
+        latency.empty() ? 0 : total / latency.size(),
+        latency.empty() ? 0 : latency[latency.size() * 95 / 100],
+        latency.empty() ? 0 : latency.back(),
+        missed,
+        inventories * 1000.0 / simDuration,
+        longestPoll / 1000);
+}
+
+// SPI frames, SPI time and total time per inventory with and without a tag in the field
+void compareTransports()
+{
+    const uint8_t tagUid[8] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0xE0};
+    const unsigned long count = 100;
+    printf("Transport  Tag   Frames  SPI(us)  Total(us)\n");
+    for (byte tag = 0; tag < 2; tag++)
+    {
+        for (byte batched = 0; batched < 2; batched++)
+        {
+            simMicros = 0;
+            RfidReader reader(0, 0, 0);
+            if (tag)
+            {
+                reader.addTag(tagUid, 0, 0xFFFFFFFFUL);
+            }
+            uint8_t uid[8];
+            for (unsigned long n = 0; n < count; n++)
+            {
+                if (batched)
+                {
+                    reader.getInventory(uid);
+                }
+                else
+                {
+                    reader.getInventoryLibrary(uid);
+                }
+            }
+            printf("%-10s %-5s %6lu %8lu %10lu\n", batched ? "batched" : "library", tag ? "yes" : "no",
+                reader.spiFrames / count, reader.spiMicros() / count, (unsigned long)(simMicros / count));
+        }
+    }
+    printf("\n");
+}
+
+int main()
+{
+    compareTransports();
+
+    printf("Simulated %lu s of play, %lu ms of other work per loop\n\n", simDuration / 1000, loopWork);
+    printf("Readers  Budget       Mean(ms)  P95(ms)  Max(ms) Missed  Inv/s      Stall(ms)\n");
+    const byte sizes[] = {2, 8, 16};
+    for (byte s = 0; s < sizeof(sizes); s++)
+    {
+        runScenario(sizes[s], 0, "1 reader");
+        runScenario(sizes[s], 30000, "30 ms");
+        runScenario(sizes[s], 60000, "60 ms");
+        runScenario(sizes[s], 0xFFFFFFFFUL, "full pass");
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+#
+# File: trace2chrome.py (turns a trace dump into Chrome trace JSON, see src/trace.h)
+#
+# Description:
+#
+#      Reads the "#TR ..." lines of a trace dump and writes them in the Chrome trace event
+#      format, which chrome://tracing and https://ui.perfetto.dev open. Each task is a track,
+#      spans nest as they ran and instant events are marks on their task's track. A summary of
+#      the spans (count, mean and longest) goes to standard error.
+#
+#          Serial ("trace dump serial"): other lines are ignored
+#              pio device monitor | tee capture.txt
+#              tools/trace2chrome.py capture.txt -o trace.json
+#          MQTT ("trace dump"), needs paho-mqtt, exits after the first complete dump:
+#              tools/trace2chrome.py --mqtt 10.1.10.10 --topic ToHost/NameOfMachine/trace -o trace.json
+#
+#      Events carry the cycle counter of their core. Each is timed from the nearest sync event
+#      of the same core, which pairs that counter with micros().
+#
+
+import argparse
+import json
+import sys
+
+
+def signed32(value):
+    value &= 0xFFFFFFFF
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+class Dump:
+    def __init__(self, mhz):
+        self.mhz = mhz
+        self.events = []        # (core, type, cycles, value, task, name) in ring order
+        self.complete = False
+
+    def add(self, fields):
+        core, kind, cycles, value, task = fields[:5]
+        name = " ".join(fields[5:])
+        self.events.append((int(core), kind, int(cycles), int(value), task, name))
+
+    def times(self):
+        """Microseconds of every event, None for events of a core without a sync event"""
+        syncs = {}
+        for i, (core, kind, cycles, value, _, _) in enumerate(self.events):
+            if kind == "S":
+                syncs.setdefault(core, []).append((i, cycles, value))
+        # micros() wraps every 71 minutes, keep the sync times increasing
+        base = None
+        for core in syncs:
+            for n, (i, cycles, micros) in enumerate(syncs[core]):
+                if base is None:
+                    base = micros
+                syncs[core][n] = (i, cycles, base + signed32(micros - base))
+        times = []
+        for i, (core, kind, cycles, _, _, _) in enumerate(self.events):
+            points = syncs.get(core)
+            if not points:
+                times.append(None)
+                continue
+            # Nearest sync at or before the event in the ring, else the first after it
+            sync = points[0]
+            for point in points:
+                if point[0] > i:
+                    break
+                sync = point
+            times.append(sync[2] + signed32(cycles - sync[1]) / self.mhz)
+        return times
+
+    def chrome(self):
+        times = self.times()
+        known = [t for t in times if t is not None]
+        start = min(known) if known else 0
+        tasks = {}
+        by_task = {}
+        for event, t in zip(self.events, times):
+            core, kind, cycles, value, task, name = event
+            if kind == "S" or t is None:
+                continue
+            if task not in tasks:
+                tasks[task] = len(tasks) + 1
+            by_task.setdefault(task, []).append((t - start, kind, value, name, core))
+
+        out = []
+        spans = {}
+        for task, tid in tasks.items():
+            out.append({"ph": "M", "name": "thread_name", "pid": 1, "tid": tid, "args": {"name": task}})
+            open_spans = []
+            last = 0
+            for ts, kind, value, name, core in sorted(by_task[task], key=lambda e: e[0]):
+                last = ts
+                if kind == "B":
+                    open_spans.append((name, ts))
+                    out.append({"ph": "B", "name": name, "ts": ts, "pid": 1, "tid": tid, "args": {"core": core}})
+                elif kind == "E":
+                    # An end whose begin was overwritten in the ring is dropped
+                    if not any(n == name for n, _ in open_spans):
+                        continue
+                    while open_spans:
+                        n, began = open_spans.pop()
+                        out.append({"ph": "E", "name": n, "ts": ts, "pid": 1, "tid": tid})
+                        spans.setdefault(n, []).append(ts - began)
+                        if n == name:
+                            break
+                else:
+                    out.append({"ph": "i", "s": "t", "name": name, "ts": ts, "pid": 1, "tid": tid,
+                                "args": {"value": value, "core": core}})
+            # Spans still running when the ring was frozen end with the dump
+            for n, began in reversed(open_spans):
+                out.append({"ph": "E", "name": n, "ts": last, "pid": 1, "tid": tid})
+        out.insert(0, {"ph": "M", "name": "process_name", "pid": 1, "args": {"name": "AlchemyMachine"}})
+        return {"traceEvents": out, "displayTimeUnit": "ns"}, spans
+
+
+def summary(spans):
+    lines = ["%-20s %8s %12s %12s" % ("span", "count", "mean us", "max us")]
+    for name, durations in sorted(spans.items(), key=lambda item: -max(item[1])):
+        lines.append("%-20s %8d %12.1f %12.1f" % (name, len(durations), sum(durations) / len(durations), max(durations)))
+    return "\n".join(lines)
+
+
+class Reader:
+    """Collects dumps from "#TR" lines, the last complete one wins"""
+
+    def __init__(self):
+        self.dump = None
+        self.done = None
+
+    def line(self, line):
+        if not line.startswith("#TR "):
+            return
+        fields = line[4:].split()
+        if not fields:
+            return
+        if fields[0] == "begin":
+            self.dump = Dump(float(fields[1]))
+        elif fields[0] == "end":
+            if self.dump is not None:
+                self.dump.complete = True
+                self.done = self.dump
+                self.dump = None
+        elif self.dump is not None and len(fields) >= 6:
+            self.dump.add(fields)
+
+
+def write(dump, path):
+    trace, spans = dump.chrome()
+    with (open(path, "w") if path != "-" else sys.stdout) as out:
+        json.dump(trace, out)
+    sys.stderr.write("%d events\n%s\n" % (len(dump.events), summary(spans)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert a trace dump to Chrome trace JSON")
+    parser.add_argument("capture", nargs="?", help="serial capture, standard input when left out")
+    parser.add_argument("-o", "--output", default="-", help="JSON file, standard output by default")
+    parser.add_argument("--mqtt", metavar="BROKER")
+    parser.add_argument("--topic", default="ToHost/NameOfMachine/trace")
+    args = parser.parse_args()
+    reader = Reader()
+
+    if args.mqtt:
+        import paho.mqtt.client as mqtt
+
+        def on_message(client, userdata, message):
+            for line in message.payload.decode("latin-1").splitlines():
+                reader.line(line)
+            if reader.done:
+                client.disconnect()
+
+        client = mqtt.Client()
+        client.on_message = on_message
+        client.connect(args.mqtt)
+        client.subscribe(args.topic)
+        client.loop_forever()
+    else:
+        source = open(args.capture, errors="replace") if args.capture else sys.stdin
+        for line in source:
+            reader.line(line.rstrip("\r\n"))
+
+    dump = reader.done or reader.dump
+    if dump is None:
+        sys.exit("no trace dump found")
+    write(dump, args.output)
+
+
+if __name__ == "__main__":
+    main()